@@ -1,5 +1,7 @@
 #include "learngl.hpp"
-#include <cassert>
+#include "draw_queue.hpp"
+#include "shader_reload.hpp"
+#include "texture_loader.hpp"
 #include <cstdlib>
 
 int main(void)
@@ -8,9 +10,10 @@ int main(void)
         if (window == NULL)
                 return -1;
 
-        uint32_t vertex = create_shader("./shader.vert", GL_VERTEX_SHADER);
-        uint32_t fragment = create_shader("./shader.frag", GL_FRAGMENT_SHADER);
-        uint32_t shader_prog = create_shader_program(vertex, fragment);
+        shader_watcher watcher;
+        reload_program shader_prog;
+        reload_program_init(shader_prog, watcher, "./shader.vert", "./shader.frag");
+        shader_watcher_start(watcher);
 
         float vertices[] = {
                 -0.5f, -0.5f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
@@ -31,32 +34,52 @@ int main(void)
         init_vert_attr(1, 3, 8, 3);
         init_vert_attr(2, 2, 8, 6);
 
-        uint32_t texture1;
-        glGenTextures(1, &texture1);
-        glBindTexture(GL_TEXTURE_2D, texture1);
+        texture_loader loader;
+        texture_loader_start(loader);
+        uint32_t texture1 = texture_loader_request(loader, "container.jpg");
 
-        // set the texture wrapping/filtering options (on the currently bound
-        // texture object)
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        draw_queue queue;
+        init_draw_queue(queue, 1);
+        const draw_range quad = {GL_TRIANGLES, GL_UNSIGNED_INT, 6, 0, 0};
+        while (!glfwWindowShouldClose(window)) {
+                reload_program_poll(shader_prog, watcher);
 
-        int32_t result = load_texture_image("container.jpg", GL_RGB);
-        assert(result == 0);
+                {
+                        PROFILE_SCOPE("texture upload");
+                        texture_loader_pump(loader, 2.0);
+                }
 
-        glUseProgram(shader_prog);
-        while (!glfwWindowShouldClose(window)) {
-                glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-                glClear(GL_COLOR_BUFFER_BIT);
+                {
+                        PROFILE_SCOPE("draw");
+                        PROFILE_GPU_SCOPE("draw");
+                        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+                        glClear(GL_COLOR_BUFFER_BIT);
 
-                glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+                        draw_queue_reset(queue);
+                        draw_queue_push(queue,
+                                        draw_queue_state(queue,
+                                                         DRAW_PASS_OPAQUE,
+                                                         shader_prog.program.id,
+                                                         GL_TEXTURE_2D,
+                                                         &texture1,
+                                                         1,
+                                                         VAO),
+                                        0.0f,
+                                        quad);
+                        draw_queue_submit(queue);
+                }
 
-                glfwSwapBuffers(window);
-                glfwPollEvents();
+                swap_buffers(window);
+                {
+                        PROFILE_SCOPE("input");
+                        glfwPollEvents();
+                }
         }
 
-        glfwTerminate();
+        destroy_draw_queue(queue);
+        shader_watcher_stop(watcher);
+        texture_loader_stop(loader);
+        terminate_gl();
 
         return EXIT_SUCCESS;
 }
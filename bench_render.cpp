@@ -0,0 +1,993 @@
+#include "learngl.hpp"
+#include "coordsystems_scene.hpp"
+#include "frame_capture.hpp"
+#include "soft_raster.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include <time.h>
+
+/*
+ * Reproducible rendering benchmark of the coordsystems scene. Always runs
+ * headless (see headless.h), so llvmpipe is enough, and sweeps cube count,
+ * texture size and draw strategy, with --materials textures sets to tell
+ * apart (copies of the same two textures, so the image doesn't change),
+ * as separate textures or, with --texture-arrays, as layers of two
+ * arrays. Animation time advances a fixed step per frame rather than
+ * following the clock, and the last frame is always at BENCH_FINAL_TIME,
+ * so the final frame of a given cube count and texture size is the same
+ * image whichever strategy drew it, however fast it ran and however many
+ * frames were asked for.
+ *
+ * Per configuration it records frames/sec, wall and CPU ms/frame, peak
+ * RSS and GL binds issued/elided per frame to a JSON file, and reads the
+ * final frame back. That frame is compared against the golden image
+ * golden/cubes<N>_tex<M>.ppm, which the repository holds for the default
+ * sweep. Any mismatch fails the run, so a speedup can't hide a broken
+ * render, and so does a missing golden image; the strategies are then
+ * still held to what the first one drew. --update-golden (re)writes the
+ * golden images instead.
+ *
+ * With --capture FORMAT (png, y4m or hash) every GL frame is also captured
+ * through frame_capture.hpp into capture/. Each GL configuration is then
+ * run once without capturing first, and what capturing adds to the frame
+ * time is reported against that, next to the render thread's time in
+ * frame_capture_read. On a driver that rasterizes on the CPU, such as
+ * llvmpipe, that time includes waiting for the frame to be drawn, which
+ * glReadPixels must do.
+ *
+ * The "soft" strategy draws the same frames on the CPU with soft_raster.hpp
+ * (one soft_draw_arrays per cube, rasterized on the benchmark's job system)
+ * and is held to the same reference; GL-only options such as
+ * --texture-arrays don't apply to it. With it, the anki quad is also drawn
+ * both ways and compared, to cover the vertex colour kernel.
+ */
+
+#define BENCH_WIDTH 800
+#define BENCH_HEIGHT 600
+#define BENCH_TIME_STEP (1.0 / 60.0)
+// animation time of the last frame, the one read back
+#define BENCH_FINAL_TIME 2.0
+// channel difference that counts a pixel as changed, and the fraction of
+// changed pixels tolerated (rasterisation rules leave some freedom)
+#define GOLDEN_CHANNEL_TOLERANCE 8
+#define GOLDEN_PIXEL_TOLERANCE 0.001
+
+struct bench_options {
+        std::vector<size_t> counts = {10, 1000, 10000};
+        std::vector<size_t> texture_sizes = {64, 512};
+        std::vector<draw_strategy> strategies = {DRAW_PER_OBJECT,
+                                                 DRAW_INSTANCED,
+                                                 DRAW_MULTI_INDIRECT,
+                                                 DRAW_QUEUE};
+        // the software rasterizer, after the GL strategies
+        bool soft = true;
+        uint32_t materials = 1;
+        bool texture_arrays = false;
+        uint32_t warmup = 10;
+        uint32_t frames = 120;
+        uint32_t threads = 0;
+        const char *json_path = "bench_render.json";
+        const char *golden_dir = "golden";
+        bool update_golden = false;
+        // capture GL frames in this format, unless NULL
+        const char *capture = NULL;
+};
+
+struct bench_result {
+        size_t count;
+        size_t texture_size;
+        draw_strategy strategy;
+        // drawn by soft_raster.hpp rather than strategy
+        bool soft;
+        bool skipped;
+        double fps;
+        double wall_ms;
+        double cpu_ms;
+        double process_cpu_ms;
+        double visible;
+        long peak_rss_kb;
+        // GL binds per frame through the state cache (gl_state.h)
+        double binds_issued;
+        double binds_elided;
+        // GL draw calls per frame, where the draw queue says
+        double draw_calls;
+        // render thread ms per frame capturing, and frames dropped or
+        // waited for; 0 unless capturing
+        double capture_ms;
+        // capturing, wall_ms of the same configuration without it
+        double uncaptured_ms;
+        uint64_t capture_dropped;
+        uint64_t capture_stalls;
+        // "match", "mismatch", "missing" (no golden image) or "updated"
+        const char *image;
+        double image_diff;
+};
+
+static const char*
+result_strategy_name(const bench_result& result)
+{
+        return result.soft ? "soft" : draw_strategy_name(result.strategy);
+}
+
+// animation time of frame, counting the warmup frames
+static double
+bench_frame_time(const bench_options& options, uint32_t frame)
+{
+        uint32_t last = options.warmup + options.frames - 1;
+        return BENCH_FINAL_TIME - (last - frame) * BENCH_TIME_STEP;
+}
+
+static double
+clock_ms(clockid_t clock)
+{
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+
+        return 1e3 * ts.tv_sec + 1e-6 * ts.tv_nsec;
+}
+
+/*
+ * Peak RSS is a high-water mark for the whole process, so it is reset
+ * before each configuration (Linux 4.0+); where that isn't allowed the
+ * numbers are peaks since start.
+ */
+static void
+reset_peak_rss(void)
+{
+        FILE *file = fopen("/proc/self/clear_refs", "w");
+        if (file == NULL)
+                return;
+        fputs("5", file);
+        fclose(file);
+}
+
+static long
+peak_rss_kb(void)
+{
+        FILE *file = fopen("/proc/self/status", "r");
+        if (file != NULL) {
+                char line[256];
+                long kb = -1;
+                while (fgets(line, sizeof(line), file) != NULL)
+                        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                                break;
+                fclose(file);
+                if (kb >= 0)
+                        return kb;
+        }
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_maxrss;
+}
+
+/*
+ * Deterministic stand-ins for container.jpg and awesomeface.png, so the
+ * sweep can pick their size: a bordered checkerboard, and a disc that is
+ * transparent outside.
+ */
+static cook_image
+gen_bench_image(size_t size, bool disc)
+{
+        cook_image image;
+        image.width = size;
+        image.height = size;
+        image.channels = 4;
+        std::vector<uint8_t>& pixels = image.pixels;
+        pixels.resize(size * size * 4);
+        for (size_t y = 0; y < size; ++y) {
+                for (size_t x = 0; x < size; ++x) {
+                        uint8_t *p = &pixels[4 * (y * size + x)];
+                        float u = (x + 0.5f) / size;
+                        float v = (y + 0.5f) / size;
+                        if (disc) {
+                                float du = u - 0.5f;
+                                float dv = v - 0.5f;
+                                bool inside = du * du + dv * dv < 0.16f;
+                                p[0] = 255;
+                                p[1] = (uint8_t)(200.0f * v);
+                                p[2] = 32;
+                                p[3] = inside ? 255 : 0;
+                        } else {
+                                bool border = (u < 0.06f) || (u > 0.94f) ||
+                                              (v < 0.06f) || (v > 0.94f);
+                                bool check = ((int32_t)(8 * u) + (int32_t)(8 * v)) & 1;
+                                p[0] = border ? 90 : (check ? 190 : 140);
+                                p[1] = border ? 90 : (check ? 120 : 80);
+                                p[2] = border ? 100 : 40;
+                                p[3] = 255;
+                        }
+                }
+        }
+
+        return image;
+}
+
+static uint32_t
+gen_bench_texture(const cook_image& image)
+{
+        uint32_t texture;
+        glGenTextures(1, &texture);
+        state_bind_texture(0, GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,
+                     GL_RGBA8,
+                     image.width,
+                     image.height,
+                     0,
+                     GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     image.pixels.data());
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+        return texture;
+}
+
+// RGBA rows, bottom row first, as tightly packed RGB rows, top row first
+static std::vector<uint8_t>
+rgba_to_rgb(const std::vector<uint8_t>& rgba)
+{
+        std::vector<uint8_t> rgb(BENCH_WIDTH * BENCH_HEIGHT * 3);
+        for (size_t y = 0; y < BENCH_HEIGHT; ++y) {
+                const uint8_t *src = &rgba[(BENCH_HEIGHT - 1 - y) * BENCH_WIDTH * 4];
+                uint8_t *dst = &rgb[y * BENCH_WIDTH * 3];
+                for (size_t x = 0; x < BENCH_WIDTH; ++x)
+                        memcpy(&dst[3 * x], &src[4 * x], 3);
+        }
+
+        return rgb;
+}
+
+// the final frame as tightly packed RGB rows, top row first
+static std::vector<uint8_t>
+read_frame(void)
+{
+        std::vector<uint8_t> rgba(BENCH_WIDTH * BENCH_HEIGHT * 4);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, screen_framebuffer());
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, BENCH_WIDTH, BENCH_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+
+        return rgba_to_rgb(rgba);
+}
+
+// the same from the software rasterizer
+static std::vector<uint8_t>
+read_soft_frame(void)
+{
+        std::vector<uint8_t> rgba(BENCH_WIDTH * BENCH_HEIGHT * 4);
+        soft_read_pixels(rgba.data());
+
+        return rgba_to_rgb(rgba);
+}
+
+static bool
+write_ppm(const std::string& path, const std::vector<uint8_t>& rgb)
+{
+        FILE *file = fopen(path.c_str(), "wb");
+        if (file == NULL)
+                return false;
+        fprintf(file, "P6\n%d %d\n255\n", BENCH_WIDTH, BENCH_HEIGHT);
+        bool ok = fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+
+        return (fclose(file) == 0) && ok;
+}
+
+// empty if missing or not a BENCH_WIDTH x BENCH_HEIGHT binary PPM
+static std::vector<uint8_t>
+read_ppm(const std::string& path)
+{
+        std::vector<uint8_t> rgb;
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == NULL)
+                return rgb;
+
+        int32_t width;
+        int32_t height;
+        int32_t max;
+        if ((fscanf(file, "P6 %d %d %d", &width, &height, &max) == 3) &&
+            (width == BENCH_WIDTH) && (height == BENCH_HEIGHT) && (max == 255) &&
+            (fgetc(file) != EOF)) {
+                rgb.resize(BENCH_WIDTH * BENCH_HEIGHT * 3);
+                if (fread(rgb.data(), 1, rgb.size(), file) != rgb.size())
+                        rgb.clear();
+        }
+        fclose(file);
+
+        return rgb;
+}
+
+// fraction of pixels with a channel off by more than GOLDEN_CHANNEL_TOLERANCE
+static double
+image_diff(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b)
+{
+        size_t changed = 0;
+        for (size_t i = 0; i < a.size(); i += 3) {
+                for (size_t c = 0; c < 3; ++c) {
+                        if (std::abs(a[i + c] - b[i + c]) > GOLDEN_CHANNEL_TOLERANCE) {
+                                ++changed;
+                                break;
+                        }
+                }
+        }
+
+        return (double)changed / (a.size() / 3);
+}
+
+/*
+ * Renders warmup + frames frames of count cubes with size x size textures
+ * drawn by strategy, timing the last frames, and returns the final frame
+ * in rgb.
+ */
+static bench_result
+run_config(job_system& jobs,
+           GLFWwindow *window,
+           const bench_options& options,
+           size_t count,
+           size_t texture_size,
+           draw_strategy strategy,
+           std::vector<uint8_t>& rgb)
+{
+        bench_result result = {};
+        result.count = count;
+        result.texture_size = texture_size;
+        result.strategy = strategy;
+        if (!draw_strategy_supported(strategy)) {
+                result.skipped = true;
+                return result;
+        }
+        reset_peak_rss();
+
+        std::vector<glm::vec3> positions =
+                gen_cube_positions(cube_fixed_positions,
+                                   sizeof(cube_fixed_positions)/sizeof(cube_fixed_positions[0]),
+                                   count);
+        bvh tree;
+        bvh_build(tree, cube_bounds(positions).data(), positions.size());
+        cube_field field = gen_cube_field(positions, tree.order, options.materials);
+        std::vector<glm::mat4> models(positions.size());
+        std::vector<cull_range> visible;
+
+        bool arrays = options.texture_arrays;
+        cube_mesh mesh = init_cube_mesh(strategy, models.size(), NULL, arrays);
+        shader_program program = create_program_cached(draw_strategy_vs(strategy),
+                                                       "./shader.fs",
+                                                       arrays ? TEXTURE_ARRAY_DEFINES : "");
+        scene_uniforms uniforms = init_scene_uniforms(program, 0.5f);
+
+        const cook_image images[2] = {gen_bench_image(texture_size, false),
+                                      gen_bench_image(texture_size, true)};
+        std::vector<cube_material> materials(arrays ? 1 : options.materials);
+        texture_array texture_arrays[2];
+        if (arrays) {
+                for (uint32_t i = 0; i < 2; ++i) {
+                        init_texture_array(texture_arrays[i],
+                                           texture_size,
+                                           texture_size,
+                                           options.materials);
+                        for (uint32_t m = 0; m < options.materials; ++m)
+                                texture_array_add(texture_arrays[i], images[i]);
+                        materials[0].textures[i] = texture_arrays[i].texture;
+                }
+                materials[0].target = GL_TEXTURE_2D_ARRAY;
+        } else {
+                for (cube_material& material : materials) {
+                        material.textures[0] = gen_bench_texture(images[0]);
+                        material.textures[1] = gen_bench_texture(images[1]);
+                }
+        }
+
+        camera_block camera;
+        camera.projection = glm::perspective(glm::radians(45.0f),
+                                             (float)BENCH_WIDTH / (float)BENCH_HEIGHT,
+                                             0.1f,
+                                             CUBE_FAR_PLANE);
+        camera.view = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -3.0f));
+        frustum view_frustum = frustum_from_matrix(camera.projection * camera.view);
+        stream_buffer camera_stream;
+        init_camera_stream(camera_stream);
+
+        frame_capture capture;
+        bool capturing = false;
+        if (options.capture != NULL) {
+                char name[96];
+                snprintf(name,
+                         sizeof(name),
+                         "capture/cubes%zu_tex%zu_%s%s",
+                         count,
+                         texture_size,
+                         draw_strategy_name(strategy),
+                         options.capture);
+                capturing = frame_capture_start(capture,
+                                                capture_format_for_path(name),
+                                                name,
+                                                BENCH_WIDTH,
+                                                BENCH_HEIGHT,
+                                                60);
+                if (!capturing)
+                        fprintf(stderr, "ERROR::BENCH::CANNOT_WRITE %s\n", name);
+        }
+
+        glEnable(GL_DEPTH_TEST);
+
+        double wall_start = 0.0;
+        double capture_start = 0.0;
+        double cpu_start = 0.0;
+        double process_cpu_start = 0.0;
+        size_t visible_sum = 0;
+        size_t issued_sum = 0;
+        size_t elided_sum = 0;
+        size_t calls_sum = 0;
+        uint32_t total = options.warmup + options.frames;
+        for (uint32_t frame = 0; frame < total; ++frame) {
+                if (frame == options.warmup) {
+                        glFinish();
+                        wall_start = clock_ms(CLOCK_MONOTONIC);
+                        cpu_start = clock_ms(CLOCK_THREAD_CPUTIME_ID);
+                        process_cpu_start = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+                        capture_start = capture.render_ms;
+                }
+
+                glBindFramebuffer(GL_FRAMEBUFFER, screen_framebuffer());
+                glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+                update_camera_stream(camera_stream, camera);
+
+                size_t n_visible = update_cubes(jobs,
+                                                field,
+                                                tree,
+                                                bench_frame_time(options, frame),
+                                                view_frustum,
+                                                models.data(),
+                                                visible);
+                draw_cubes(mesh,
+                           uniforms,
+                           program.id,
+                           materials,
+                           field,
+                           visible,
+                           models.data(),
+                           n_visible,
+                           camera.view);
+                if (frame >= options.warmup) {
+                        visible_sum += n_visible;
+                        calls_sum += mesh.queue.last_calls;
+                }
+                if (capturing)
+                        frame_capture_read(capture, screen_framebuffer());
+
+                // the final frame is read back below, before it is swapped
+                if (frame + 1 < total) {
+                        swap_buffers(window);
+                        if (frame >= options.warmup) {
+                                issued_sum += gl_state.last_issued;
+                                elided_sum += gl_state.last_elided;
+                        }
+                }
+        }
+        glFinish();
+
+        double frames = options.frames;
+        result.wall_ms = (clock_ms(CLOCK_MONOTONIC) - wall_start) / frames;
+        result.cpu_ms = (clock_ms(CLOCK_THREAD_CPUTIME_ID) - cpu_start) / frames;
+        result.process_cpu_ms = (clock_ms(CLOCK_PROCESS_CPUTIME_ID) - process_cpu_start) / frames;
+        result.fps = 1e3 / result.wall_ms;
+        result.visible = visible_sum / frames;
+        result.draw_calls = calls_sum / frames;
+        // the final frame isn't swapped before readback, so isn't counted
+        result.binds_issued = issued_sum / std::max(frames - 1.0, 1.0);
+        result.binds_elided = elided_sum / std::max(frames - 1.0, 1.0);
+        result.peak_rss_kb = peak_rss_kb();
+        result.capture_ms = (capture.render_ms - capture_start) / frames;
+        result.capture_dropped = capture.dropped;
+        result.capture_stalls = capture.stalls;
+        if (capturing && !frame_capture_stop(capture))
+                fprintf(stderr, "ERROR::BENCH::CAPTURE_FAILED\n");
+
+        rgb = read_frame();
+        swap_buffers(window);
+
+        destroy_stream_buffer(camera_stream);
+        if (arrays) {
+                destroy_texture_array(texture_arrays[0]);
+                destroy_texture_array(texture_arrays[1]);
+        } else {
+                for (cube_material& material : materials)
+                        state_delete_textures(2, material.textures);
+        }
+        state_delete_program(program.id);
+        destroy_cube_mesh(mesh);
+
+        return result;
+}
+
+/*
+ * run_config for the software rasterizer: the same scene, camera and
+ * frames, drawn with soft_raster.hpp into its own framebuffer. Materials
+ * are copies of one texture pair, so one pair stands in for them all.
+ */
+static bench_result
+run_soft_config(job_system& jobs,
+                const bench_options& options,
+                size_t count,
+                size_t texture_size,
+                std::vector<uint8_t>& rgb)
+{
+        bench_result result = {};
+        result.count = count;
+        result.texture_size = texture_size;
+        result.soft = true;
+        reset_peak_rss();
+
+        std::vector<glm::vec3> positions =
+                gen_cube_positions(cube_fixed_positions,
+                                   sizeof(cube_fixed_positions)/sizeof(cube_fixed_positions[0]),
+                                   count);
+        bvh tree;
+        bvh_build(tree, cube_bounds(positions).data(), positions.size());
+        cube_field field = gen_cube_field(positions, tree.order, options.materials);
+        std::vector<glm::mat4> models(positions.size());
+        std::vector<cull_range> visible;
+
+        uint32_t VAO = soft_init_VAO(cube_vertices, sizeof(cube_vertices));
+        soft_init_vert_attr(0, 3, 5, 0);
+        soft_init_vert_attr(1, 2, 5, 3);
+        uint32_t program = soft_create_program("./shader.vs", "./shader.fs");
+        uint32_t textures[2] = {soft_texture_image(gen_bench_image(texture_size, false)),
+                                soft_texture_image(gen_bench_image(texture_size, true))};
+        soft_bind_texture(0, textures[0]);
+        soft_bind_texture(1, textures[1]);
+
+        glm::mat4 projection = glm::perspective(glm::radians(45.0f),
+                                                (float)BENCH_WIDTH / (float)BENCH_HEIGHT,
+                                                0.1f,
+                                                CUBE_FAR_PLANE);
+        glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -3.0f));
+        frustum view_frustum = frustum_from_matrix(projection * view);
+        soft_use_program(program);
+        soft_set_uniform(soft_get_uniform<glm::mat4>(program, "projection"), projection);
+        soft_set_uniform(soft_get_uniform<glm::mat4>(program, "view"), view);
+        soft_set_uniform(soft_get_uniform<float>(program, "alpha"), 0.5f);
+        soft_set_uniform(soft_get_uniform<int32_t>(program, "texture1"), 0);
+        soft_set_uniform(soft_get_uniform<int32_t>(program, "texture2"), 1);
+        soft_uniform<glm::mat4> model = soft_get_uniform<glm::mat4>(program, "model");
+        soft_depth_test(true);
+
+        double wall_start = 0.0;
+        double cpu_start = 0.0;
+        double process_cpu_start = 0.0;
+        size_t visible_sum = 0;
+        uint32_t total = options.warmup + options.frames;
+        for (uint32_t frame = 0; frame < total; ++frame) {
+                if (frame == options.warmup) {
+                        wall_start = clock_ms(CLOCK_MONOTONIC);
+                        cpu_start = clock_ms(CLOCK_THREAD_CPUTIME_ID);
+                        process_cpu_start = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+                }
+
+                soft_clear(0.2f, 0.3f, 0.3f, 1.0f);
+                size_t n_visible = update_cubes(jobs,
+                                                field,
+                                                tree,
+                                                bench_frame_time(options, frame),
+                                                view_frustum,
+                                                models.data(),
+                                                visible);
+                for (size_t i = 0; i < n_visible; ++i) {
+                        soft_set_uniform(model, models[i]);
+                        soft_draw_arrays(0, CUBE_VERTEX_COUNT);
+                }
+                soft_finish();
+                if (frame >= options.warmup)
+                        visible_sum += n_visible;
+        }
+
+        double frames = options.frames;
+        result.wall_ms = (clock_ms(CLOCK_MONOTONIC) - wall_start) / frames;
+        result.cpu_ms = (clock_ms(CLOCK_THREAD_CPUTIME_ID) - cpu_start) / frames;
+        result.process_cpu_ms = (clock_ms(CLOCK_PROCESS_CPUTIME_ID) - process_cpu_start) / frames;
+        result.fps = 1e3 / result.wall_ms;
+        result.visible = visible_sum / frames;
+        result.draw_calls = result.visible;
+        result.peak_rss_kb = peak_rss_kb();
+
+        rgb = read_soft_frame();
+
+        soft_delete_texture(textures[0]);
+        soft_delete_texture(textures[1]);
+        soft_delete_program(program);
+        soft_delete_vertex_array(VAO);
+
+        return result;
+}
+
+/*
+ * Draws the anki quad (vertex colour times texture) with GL and with the
+ * software rasterizer and returns the fraction of pixels that differ.
+ */
+static double
+check_soft_anki(GLFWwindow *window)
+{
+        float vertices[] = {
+                -0.5f, -0.5f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+                -0.5f, 0.5f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+                0.5f, 0.5f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+                0.5f, -0.5f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f,
+        };
+        uint32_t indices[] = {
+                0, 1, 2,
+                2, 3, 0,
+        };
+        const cook_image image = gen_bench_image(256, false);
+
+        uint32_t VAO = init_VAO(vertices, sizeof(vertices), indices, sizeof(indices));
+        init_vert_attr(0, 3, 8, 0);
+        init_vert_attr(1, 3, 8, 3);
+        init_vert_attr(2, 2, 8, 6);
+        shader_program program = create_program_cached("./anki/shader.vert", "./anki/shader.frag");
+        uint32_t texture = gen_bench_texture(image);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, screen_framebuffer());
+        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        state_use_program(program.id);
+        state_bind_texture(0, GL_TEXTURE_2D, texture);
+        state_bind_vertex_array(VAO);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, NULL);
+        std::vector<uint8_t> gl_rgb = read_frame();
+        swap_buffers(window);
+
+        state_delete_textures(1, &texture);
+        state_delete_program(program.id);
+        state_delete_vertex_arrays(1, &VAO);
+
+        uint32_t soft_VAO = soft_init_VAO(vertices, sizeof(vertices), indices, sizeof(indices));
+        soft_init_vert_attr(0, 3, 8, 0);
+        soft_init_vert_attr(1, 3, 8, 3);
+        soft_init_vert_attr(2, 2, 8, 6);
+        uint32_t soft_program = soft_create_program("./anki/shader.vert", "./anki/shader.frag");
+        uint32_t soft_texture = soft_texture_image(image);
+
+        soft_clear(0.2f, 0.3f, 0.3f, 1.0f);
+        soft_use_program(soft_program);
+        soft_bind_texture(0, soft_texture);
+        soft_depth_test(false);
+        soft_draw_elements(6);
+        std::vector<uint8_t> soft_rgb = read_soft_frame();
+
+        soft_delete_texture(soft_texture);
+        soft_delete_program(soft_program);
+        soft_delete_vertex_array(soft_VAO);
+
+        return image_diff(soft_rgb, gl_rgb);
+}
+
+static bool
+write_json(const char *path, const bench_options& options, const std::vector<bench_result>& results)
+{
+        FILE *file = fopen(path, "w");
+        if (file == NULL)
+                return false;
+
+        fprintf(file,
+                "{\n  \"renderer\": \"%s\",\n  \"version\": \"%s\",\n"
+                "  \"width\": %d,\n  \"height\": %d,\n"
+                "  \"warmup\": %u,\n  \"frames\": %u,\n  \"materials\": %u,\n"
+                "  \"texture_arrays\": %s,\n"
+                "  \"results\": [",
+                (const char*)glGetString(GL_RENDERER),
+                (const char*)glGetString(GL_VERSION),
+                BENCH_WIDTH,
+                BENCH_HEIGHT,
+                options.warmup,
+                options.frames,
+                options.materials,
+                options.texture_arrays ? "true" : "false");
+        for (size_t i = 0; i < results.size(); ++i) {
+                const bench_result& r = results[i];
+                fprintf(file,
+                        "%s\n    {\"objects\": %zu, \"texture_size\": %zu, \"strategy\": \"%s\", ",
+                        (i == 0) ? "" : ",",
+                        r.count,
+                        r.texture_size,
+                        result_strategy_name(r));
+                if (r.skipped) {
+                        fprintf(file, "\"skipped\": true}");
+                        continue;
+                }
+                fprintf(file,
+                        "\"fps\": %.2f, \"wall_ms_per_frame\": %.4f, "
+                        "\"cpu_ms_per_frame\": %.4f, \"process_cpu_ms_per_frame\": %.4f, "
+                        "\"visible\": %.1f, \"peak_rss_kb\": %ld, "
+                        "\"binds_issued\": %.1f, \"binds_elided\": %.1f, "
+                        "\"queue_draw_calls\": %.1f, "
+                        "\"capture_ms_per_frame\": %.4f, \"capture_dropped\": %llu, "
+                        "\"capture_stalls\": %llu, \"uncaptured_ms_per_frame\": %.4f, "
+                        "\"image\": \"%s\", \"image_diff\": %.6f}",
+                        r.fps,
+                        r.wall_ms,
+                        r.cpu_ms,
+                        r.process_cpu_ms,
+                        r.visible,
+                        r.peak_rss_kb,
+                        r.binds_issued,
+                        r.binds_elided,
+                        r.draw_calls,
+                        r.capture_ms,
+                        (unsigned long long)r.capture_dropped,
+                        (unsigned long long)r.capture_stalls,
+                        r.uncaptured_ms,
+                        r.image,
+                        r.image_diff);
+        }
+        fprintf(file, "\n  ]\n}\n");
+
+        return fclose(file) == 0;
+}
+
+// comma-separated list of sizes
+static bool
+parse_sizes(const char *arg, std::vector<size_t>& sizes)
+{
+        sizes.clear();
+        char *end;
+        do {
+                size_t size = strtoull(arg, &end, 10);
+                if ((end == arg) || (size == 0))
+                        return false;
+                sizes.push_back(size);
+                arg = end + 1;
+        } while (*end == ',');
+
+        return *end == '\0';
+}
+
+// GL strategies, and "soft" for the software rasterizer
+static bool
+parse_strategies(const char *arg, std::vector<draw_strategy>& strategies, bool& soft)
+{
+        const draw_strategy all[] = {DRAW_PER_OBJECT,
+                                     DRAW_INSTANCED,
+                                     DRAW_MULTI_INDIRECT,
+                                     DRAW_QUEUE};
+        strategies.clear();
+        soft = false;
+        std::string list(arg);
+        size_t begin = 0;
+        while (begin <= list.size()) {
+                size_t end = list.find(',', begin);
+                if (end == std::string::npos)
+                        end = list.size();
+                std::string name = list.substr(begin, end - begin);
+                bool found = name == "soft";
+                soft = soft || found;
+                for (draw_strategy strategy : all) {
+                        if (name == draw_strategy_name(strategy)) {
+                                strategies.push_back(strategy);
+                                found = true;
+                        }
+                }
+                if (!found)
+                        return false;
+                begin = end + 1;
+        }
+
+        return true;
+}
+
+// png, y4m or hash, as the suffix frame_capture_start goes by
+static bool
+parse_capture(const char *arg, const char *&suffix)
+{
+        if (strcmp(arg, "png") == 0)
+                suffix = ".png";
+        else if (strcmp(arg, "y4m") == 0)
+                suffix = ".y4m";
+        else if (strcmp(arg, "hash") == 0)
+                suffix = ".txt";
+        else
+                return false;
+
+        return true;
+}
+
+static void
+usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [--counts N,...] [--textures N,...] [--strategies S,...]\n"
+                "          [--materials N] [--texture-arrays]\n"
+                "          [--frames N] [--warmup N] [--threads N]\n"
+                "          [--json PATH] [--golden DIR] [--update-golden]\n"
+                "          [--capture png|y4m|hash]\n"
+                "  strategies: per-draw, instanced, multi-draw, queue, soft\n",
+                prog);
+}
+
+int main(int argc, char **argv)
+{
+        bench_options options;
+        for (int32_t i = 1; i < argc; ++i) {
+                bool has_value = i + 1 < argc;
+                bool ok = true;
+                if ((strcmp(argv[i], "--counts") == 0) && has_value)
+                        ok = parse_sizes(argv[++i], options.counts);
+                else if ((strcmp(argv[i], "--textures") == 0) && has_value)
+                        ok = parse_sizes(argv[++i], options.texture_sizes);
+                else if ((strcmp(argv[i], "--strategies") == 0) && has_value)
+                        ok = parse_strategies(argv[++i], options.strategies, options.soft);
+                else if ((strcmp(argv[i], "--materials") == 0) && has_value)
+                        options.materials = strtoul(argv[++i], NULL, 10);
+                else if (strcmp(argv[i], "--texture-arrays") == 0)
+                        options.texture_arrays = true;
+                else if ((strcmp(argv[i], "--frames") == 0) && has_value)
+                        options.frames = strtoul(argv[++i], NULL, 10);
+                else if ((strcmp(argv[i], "--warmup") == 0) && has_value)
+                        options.warmup = strtoul(argv[++i], NULL, 10);
+                else if ((strcmp(argv[i], "--threads") == 0) && has_value)
+                        options.threads = strtoul(argv[++i], NULL, 10);
+                else if ((strcmp(argv[i], "--json") == 0) && has_value)
+                        options.json_path = argv[++i];
+                else if ((strcmp(argv[i], "--golden") == 0) && has_value)
+                        options.golden_dir = argv[++i];
+                else if (strcmp(argv[i], "--update-golden") == 0)
+                        options.update_golden = true;
+                else if ((strcmp(argv[i], "--capture") == 0) && has_value)
+                        ok = parse_capture(argv[++i], options.capture);
+                else
+                        ok = false;
+                if (!ok || (options.frames == 0) || (options.materials == 0)) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        // no frame limit: the benchmark decides when to stop
+        GLFWwindow *window = create_headless_window(BENCH_WIDTH, BENCH_HEIGHT, 0);
+        if (window == NULL)
+                return EXIT_FAILURE;
+        printf("renderer: %s\n", (const char*)glGetString(GL_RENDERER));
+        if (options.update_golden)
+                mkdir(options.golden_dir, 0755);
+        if (options.capture != NULL)
+                mkdir("capture", 0755);
+
+        job_system jobs;
+        job_system_start(jobs, options.threads);
+        if (options.soft && !soft_init(BENCH_WIDTH, BENCH_HEIGHT, jobs))
+                return EXIT_FAILURE;
+
+        bool ok = true;
+        std::vector<bench_result> results;
+        for (size_t count : options.counts) {
+                for (size_t texture_size : options.texture_sizes) {
+                        char name[64];
+                        snprintf(name, sizeof(name), "/cubes%zu_tex%zu.ppm", count, texture_size);
+                        std::string golden_path = std::string(options.golden_dir) + name;
+                        std::vector<uint8_t> reference;
+                        if (!options.update_golden) {
+                                reference = read_ppm(golden_path);
+                                if (reference.empty()) {
+                                        fprintf(stderr,
+                                                "ERROR::BENCH::MISSING_GOLDEN %s "
+                                                "(write it with --update-golden)\n",
+                                                golden_path.c_str());
+                                        ok = false;
+                                }
+                        }
+
+                        // the GL strategies, then the software rasterizer
+                        size_t n_runs = options.strategies.size() + (options.soft ? 1 : 0);
+                        for (size_t run = 0; run < n_runs; ++run) {
+                                std::vector<uint8_t> rgb;
+                                // the same frames uncaptured, to price capturing against
+                                double uncaptured_ms = 0.0;
+                                if ((options.capture != NULL) && (run < options.strategies.size())) {
+                                        bench_options uncaptured = options;
+                                        uncaptured.capture = NULL;
+                                        uncaptured_ms = run_config(jobs,
+                                                                   window,
+                                                                   uncaptured,
+                                                                   count,
+                                                                   texture_size,
+                                                                   options.strategies[run],
+                                                                   rgb).wall_ms;
+                                }
+                                bench_result result = (run == options.strategies.size()) ?
+                                        run_soft_config(jobs,
+                                                        options,
+                                                        count,
+                                                        texture_size,
+                                                        rgb) :
+                                        run_config(jobs,
+                                                   window,
+                                                   options,
+                                                   count,
+                                                   texture_size,
+                                                   options.strategies[run],
+                                                   rgb);
+                                result.uncaptured_ms = uncaptured_ms;
+                                if (result.skipped) {
+                                        printf("%8zu cubes  tex %5zu  %-10s  skipped (needs GL 4.3)\n",
+                                               count,
+                                               texture_size,
+                                               result_strategy_name(result));
+                                        results.push_back(result);
+                                        continue;
+                                }
+
+                                if (reference.empty()) {
+                                        reference = rgb;
+                                        result.image = "missing";
+                                        if (options.update_golden) {
+                                                bool written = write_ppm(golden_path, rgb);
+                                                result.image = written ? "updated" : "missing";
+                                                ok = ok && written;
+                                        }
+                                } else {
+                                        result.image_diff = image_diff(rgb, reference);
+                                        bool match = result.image_diff <= GOLDEN_PIXEL_TOLERANCE;
+                                        result.image = match ? "match" : "mismatch";
+                                        ok = ok && match;
+                                }
+
+                                printf("%8zu cubes  tex %5zu  %-10s  %8.1f fps  %7.3f ms  "
+                                       "cpu %7.3f ms  rss %7ld kB  image %s (%.4f%%)\n",
+                                       count,
+                                       texture_size,
+                                       result_strategy_name(result),
+                                       result.fps,
+                                       result.wall_ms,
+                                       result.cpu_ms,
+                                       result.peak_rss_kb,
+                                       result.image,
+                                       100.0 * result.image_diff);
+                                if ((options.capture != NULL) && !result.soft)
+                                        printf("%38s capture %+7.3f ms (%+.1f%%) over %.3f ms "
+                                               "uncaptured, %.3f ms in frame_capture_read, "
+                                               "%llu dropped, %llu stalls\n",
+                                               "",
+                                               result.wall_ms - result.uncaptured_ms,
+                                               100.0 * (result.wall_ms - result.uncaptured_ms) /
+                                               result.uncaptured_ms,
+                                               result.uncaptured_ms,
+                                               result.capture_ms,
+                                               (unsigned long long)result.capture_dropped,
+                                               (unsigned long long)result.capture_stalls);
+                                results.push_back(result);
+                        }
+                }
+        }
+
+        if (options.soft) {
+                double diff = check_soft_anki(window);
+                bool match = diff <= GOLDEN_PIXEL_TOLERANCE;
+                printf("anki quad, soft against GL: %s (%.4f%%)\n",
+                       match ? "match" : "mismatch",
+                       100.0 * diff);
+                ok = ok && match;
+                soft_terminate();
+        }
+
+        if (!write_json(options.json_path, options, results)) {
+                fprintf(stderr, "ERROR::BENCH::CANNOT_WRITE %s\n", options.json_path);
+                ok = false;
+        }
+
+        job_system_stop(jobs);
+        terminate_gl();
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
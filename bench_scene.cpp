@@ -0,0 +1,208 @@
+#include "learngl.hpp"
+#include "coordsystems_scene.hpp"
+#include "scene_file.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Load-time benchmark of scene files against generating the same scene.
+ * For count cubes it times, best of iterations:
+ *
+ * - generate: gen_cube_positions, bvh_build and gen_cube_field, what
+ *   coordsystems does without --scene;
+ * - open: open_scene_file, scene_cube_field and scene_bvh, with and without
+ *   checking every record;
+ * - first frame: the first update_cubes over each, which for the scene
+ *   file is where its pages are faulted in;
+ * - with --gl, upload: the cube mesh VAO of each, headless, to glFinish.
+ *
+ * The scene file is written to path (bench_scene.lscn by default) and
+ * removed afterwards. Page cache effects are not controlled: a file just
+ * written is usually cached, so open and first frame measure the warm case.
+ * The first frame's matrices are compared; any difference fails the run.
+ *
+ * usage: bench_scene [--count N] [--iterations N] [--gl] [path]
+ */
+
+#define BENCH_WIDTH 800
+#define BENCH_HEIGHT 600
+
+static double
+now_ms(void)
+{
+        return std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void
+report(const char *what, double ms, double baseline_ms)
+{
+        printf("%-24s %10.3f ms  %8.2fx\n", what, ms, baseline_ms / ms);
+}
+
+int main(int argc, char **argv)
+{
+        size_t count = 1000000;
+        uint32_t iterations = 5;
+        bool gl = false;
+        const char *path = "bench_scene" SCENE_FILE_SUFFIX;
+        for (int32_t i = 1; i < argc; ++i) {
+                if ((strcmp(argv[i], "--count") == 0) && (i + 1 < argc)) {
+                        count = strtoull(argv[++i], NULL, 10);
+                } else if ((strcmp(argv[i], "--iterations") == 0) && (i + 1 < argc)) {
+                        iterations = std::max(1ul, strtoul(argv[++i], NULL, 10));
+                } else if (strcmp(argv[i], "--gl") == 0) {
+                        gl = true;
+                } else if (argv[i][0] != '-') {
+                        path = argv[i];
+                } else {
+                        fprintf(stderr,
+                                "usage: %s [--count N] [--iterations N] [--gl] [path]\n",
+                                argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        const size_t n_fixed = sizeof(cube_fixed_positions) / sizeof(cube_fixed_positions[0]);
+
+        double generate_ms = 1e30;
+        bvh tree;
+        cube_field generated;
+        for (uint32_t it = 0; it < iterations; ++it) {
+                double start = now_ms();
+                std::vector<glm::vec3> positions = gen_cube_positions(cube_fixed_positions,
+                                                                      n_fixed,
+                                                                      count);
+                bvh_build(tree, cube_bounds(positions).data(), positions.size());
+                generated = gen_cube_field(positions, tree.order);
+                generate_ms = std::min(generate_ms, now_ms() - start);
+        }
+
+        // the same scene, as scene_convert writes a field directive
+        scene_source source;
+        const mesh_attr attrs[] = {
+                {3, 0, MESH_FLOAT},
+                {2, 3, MESH_HALF},
+        };
+        source.meshes.push_back(mesh_build(cube_vertices, CUBE_VERTEX_COUNT, 5, attrs, 2));
+        source.radii.push_back(CUBE_RADIUS);
+        source.materials.emplace_back("container.jpg", "awesomeface.png");
+        std::vector<glm::vec3> positions = gen_cube_positions(cube_fixed_positions,
+                                                              n_fixed,
+                                                              count);
+        for (size_t i = 0; i < count; ++i)
+                source.instances.push_back({positions[i], glm::radians(20.0f * i), 0, 0});
+        double start = now_ms();
+        if (!write_scene_file(path, source)) {
+                fprintf(stderr, "Failed to write %s\n", path);
+                return EXIT_FAILURE;
+        }
+        double write_ms = now_ms() - start;
+
+        double open_ms = 1e30;
+        double check_ms = 1e30;
+        scene_file scene;
+        for (uint32_t it = 0; it < 2 * iterations; ++it) {
+                bool check = it >= iterations;
+                close_scene_file(scene);
+                start = now_ms();
+                if (!open_scene_file(path, scene, check)) {
+                        fprintf(stderr, "Failed to open %s\n", path);
+                        return EXIT_FAILURE;
+                }
+                cube_field field = scene_cube_field(scene);
+                bvh_view view = scene_bvh(scene);
+                double ms = now_ms() - start;
+                if (check)
+                        check_ms = std::min(check_ms, ms);
+                else
+                        open_ms = std::min(open_ms, ms);
+                (void)field;
+                (void)view;
+        }
+
+        printf("%zu cubes, %zu byte scene file written in %.3f ms\n",
+               count,
+               scene.map_size,
+               write_ms);
+        report("generate", generate_ms, generate_ms);
+        report("open", open_ms, generate_ms);
+        report("open, checking records", check_ms, generate_ms);
+
+        // a fresh mapping, so its first frame takes the page faults
+        close_scene_file(scene);
+        open_scene_file(path, scene);
+        cube_field mapped = scene_cube_field(scene);
+
+        job_system jobs;
+        job_system_start(jobs, 0);
+        glm::mat4 projection = glm::perspective(glm::radians(45.0f),
+                                                (float)BENCH_WIDTH / (float)BENCH_HEIGHT,
+                                                0.1f,
+                                                CUBE_FAR_PLANE);
+        glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -3.0f));
+        frustum view_frustum = frustum_from_matrix(projection * view);
+        std::vector<glm::mat4> generated_models(count);
+        std::vector<glm::mat4> mapped_models(count);
+        std::vector<cull_range> visible;
+
+        start = now_ms();
+        size_t n_generated = update_cubes(jobs,
+                                          generated,
+                                          tree,
+                                          1.0f,
+                                          view_frustum,
+                                          generated_models.data(),
+                                          visible);
+        double generated_frame_ms = now_ms() - start;
+        start = now_ms();
+        size_t n_mapped = update_cubes(jobs,
+                                       mapped,
+                                       scene_bvh(scene),
+                                       1.0f,
+                                       view_frustum,
+                                       mapped_models.data(),
+                                       visible);
+        double mapped_frame_ms = now_ms() - start;
+        job_system_stop(jobs);
+
+        report("first frame, generated", generated_frame_ms, generated_frame_ms);
+        report("first frame, mapped", mapped_frame_ms, generated_frame_ms);
+        // same positions, same tree: the matrices match bit for bit
+        bool ok = (n_generated == n_mapped) &&
+                  (memcmp(generated_models.data(),
+                          mapped_models.data(),
+                          n_mapped * sizeof(glm::mat4)) == 0);
+        printf("%zu visible, %s\n", n_mapped, ok ? "ok" : "MISMATCH");
+
+        if (gl) {
+                GLFWwindow *window = create_headless_window(BENCH_WIDTH, BENCH_HEIGHT, 0);
+                if (window == NULL)
+                        return EXIT_FAILURE;
+
+                start = now_ms();
+                cube_mesh built = init_cube_mesh(DRAW_PER_OBJECT, count);
+                glFinish();
+                double built_ms = now_ms() - start;
+                start = now_ms();
+                cube_mesh loaded = init_cube_mesh_scene(DRAW_PER_OBJECT, scene, count);
+                glFinish();
+                double loaded_ms = now_ms() - start;
+                report("upload, mesh_build", built_ms, built_ms);
+                report("upload, from mapping", loaded_ms, built_ms);
+
+                destroy_cube_mesh(built);
+                destroy_cube_mesh(loaded);
+                terminate_gl();
+        }
+
+        close_scene_file(scene);
+        remove(path);
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
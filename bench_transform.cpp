@@ -0,0 +1,274 @@
+#include "transform.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+/*
+ * Microbenchmark of the batch transform kernels against the glm
+ * translate/rotate-per-object path of coordsystems.cpp. Every kernel's
+ * output is also checked against glm; a mismatch beyond TOLERANCE fails
+ * the run.
+ *
+ * usage: bench_transform [count] [iterations]
+ */
+
+#define TOLERANCE 1e-4f
+// seconds into coordsystems' simulation the benchmark poses the cubes at
+#define BENCH_TIME 10.0
+
+static double
+now_ms(void)
+{
+        return std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static float
+max_abs_diff(const std::vector<glm::mat4>& a, const std::vector<glm::mat4>& b)
+{
+        float diff = 0.0f;
+        for (size_t i = 0; i < a.size(); ++i) {
+                for (int32_t c = 0; c < 4; ++c) {
+                        for (int32_t r = 0; r < 4; ++r) {
+                                float d = std::fabs(a[i][c][r] - b[i][c][r]);
+                                // std::max would drop a NaN
+                                if (std::isnan(d))
+                                        return d;
+                                diff = std::max(diff, d);
+                        }
+                }
+        }
+
+        return diff;
+}
+
+// the reference side of reduce_angle, computed independently of it
+static float
+reference_angle(double angle)
+{
+        return (float)std::remainder(angle, 2.0 * M_PI);
+}
+
+/*
+ * Checks every kernel on random signed angles about random per-object axes,
+ * given both as axis/angle and as quaternions, with random scales. Not
+ * timed; covers the inputs the coordsystems-shaped benchmark doesn't.
+ */
+static bool
+check_random_rotations(size_t count)
+{
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        std::vector<float> px(count), py(count), pz(count), angle(count);
+        std::vector<float> ax(count), ay(count), az(count);
+        std::vector<float> qx(count), qy(count), qz(count), qw(count);
+        std::vector<float> sx(count), sy(count), sz(count);
+        std::vector<glm::mat4> expected(count);
+        for (size_t i = 0; i < count; ++i) {
+                glm::vec3 axis = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)));
+                glm::vec3 scale(1.5f + unit(rng), 1.5f + unit(rng), 1.5f + unit(rng));
+                px[i] = 10.0f * unit(rng);
+                py[i] = 10.0f * unit(rng);
+                pz[i] = 10.0f * unit(rng);
+                angle[i] = 1000.0f * unit(rng);
+                ax[i] = axis.x;
+                ay[i] = axis.y;
+                az[i] = axis.z;
+                double half = 0.5 * angle[i];
+                qx[i] = axis.x * std::sin(half);
+                qy[i] = axis.y * std::sin(half);
+                qz[i] = axis.z * std::sin(half);
+                qw[i] = std::cos(half);
+                sx[i] = scale.x;
+                sy[i] = scale.y;
+                sz[i] = scale.z;
+
+                glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(px[i], py[i], pz[i]));
+                model = glm::rotate(model, angle[i], axis);
+                expected[i] = glm::scale(model, scale);
+        }
+
+        transform_batch batch;
+        batch.count = count;
+        batch.px = px.data();
+        batch.py = py.data();
+        batch.pz = pz.data();
+        batch.sx = sx.data();
+        batch.sy = sy.data();
+        batch.sz = sz.data();
+
+        bool ok = true;
+        std::vector<glm::mat4> out(count);
+        const transform_kernel kernels[] = {TRANSFORM_SCALAR, TRANSFORM_SSE, TRANSFORM_AVX2};
+        for (transform_kernel kernel : kernels) {
+                if ((kernel != TRANSFORM_SCALAR) &&
+                    (kernel > transform_best_kernel()))
+                        continue;
+
+                for (int32_t quat = 0; quat < 2; ++quat) {
+                        batch.qx = quat ? qx.data() : NULL;
+                        batch.qy = quat ? qy.data() : NULL;
+                        batch.qz = quat ? qz.data() : NULL;
+                        batch.qw = quat ? qw.data() : NULL;
+                        batch.angle = angle.data();
+                        batch.ax = ax.data();
+                        batch.ay = ay.data();
+                        batch.az = az.data();
+                        transform_batch_build(batch, NULL, out.data(), kernel);
+
+                        float diff = max_abs_diff(out, expected);
+                        bool match = diff <= TOLERANCE;
+                        ok = ok && match;
+                        printf("%-8s random %s  max|diff| %.2e %s\n",
+                               transform_kernel_name(kernel),
+                               quat ? "quat      " : "axis/angle",
+                               diff,
+                               match ? "ok" : "MISMATCH");
+                }
+        }
+
+        return ok;
+}
+
+/*
+ * Checks every kernel on the angles a long-running simulation reaches:
+ * spins of up to 1000 rad/s at clocks of 1e6 and 3e6 s, so angle *
+ * angle_scale is up to 3e9 radians. Unreduced, sincos_batch loses unit
+ * quaternions around 1e9 and overflows to NaN by 3e9.
+ */
+static bool
+check_large_angles(size_t count)
+{
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        std::vector<float> zero(count, 0.0f), angle(count);
+        for (size_t i = 0; i < count; ++i)
+                angle[i] = 1000.0f * unit(rng);
+        const glm::vec3 axis = glm::normalize(glm::vec3(1.0f, 0.3f, 0.5f));
+
+        transform_batch batch;
+        batch.count = count;
+        batch.px = zero.data();
+        batch.py = zero.data();
+        batch.pz = zero.data();
+        batch.angle = angle.data();
+        batch.shared_axis = axis;
+
+        bool ok = true;
+        std::vector<glm::mat4> expected(count), out(count);
+        const double scales[] = {1e6, 3e6};
+        for (double scale : scales) {
+                for (size_t i = 0; i < count; ++i)
+                        expected[i] = glm::rotate(glm::mat4(1.0f),
+                                                  reference_angle(angle[i] * scale),
+                                                  axis);
+                batch.angle_scale = scale;
+
+                const transform_kernel kernels[] = {TRANSFORM_SCALAR, TRANSFORM_SSE, TRANSFORM_AVX2};
+                for (transform_kernel kernel : kernels) {
+                        if ((kernel != TRANSFORM_SCALAR) &&
+                            (kernel > transform_best_kernel()))
+                                continue;
+
+                        transform_batch_build(batch, NULL, out.data(), kernel);
+                        float diff = max_abs_diff(out, expected);
+                        bool match = diff <= TOLERANCE;
+                        ok = ok && match;
+                        printf("%-8s t = %.0e s  max|diff| %.2e %s\n",
+                               transform_kernel_name(kernel),
+                               scale,
+                               diff,
+                               match ? "ok" : "MISMATCH");
+                }
+        }
+
+        return ok;
+}
+
+int main(int argc, char **argv)
+{
+        size_t count = (argc > 1) ? strtoull(argv[1], NULL, 10) : 1000000;
+        uint32_t iterations = (argc > 2) ? strtoul(argv[2], NULL, 10) : 20;
+        // the pose of coordsystems --instances count, BENCH_TIME into its run
+        const double time = BENCH_TIME;
+
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        std::vector<float> px(count), py(count), pz(count), angle(count);
+        std::vector<glm::vec3> positions(count);
+        for (size_t i = 0; i < count; ++i) {
+                positions[i] = glm::vec3(50.0f * unit(rng), 50.0f * unit(rng), -50.0f + 50.0f * unit(rng));
+                px[i] = positions[i].x;
+                py[i] = positions[i].y;
+                pz[i] = positions[i].z;
+                angle[i] = glm::radians(20.0f * i);
+        }
+        const glm::vec3 axis(1.0f, 0.3f, 0.5f);
+        glm::mat4 view_proj = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f) *
+                              glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -3.0f));
+
+        // reference: the per-object glm path
+        std::vector<glm::mat4> expected(count);
+        std::vector<glm::mat4> expected_mvp(count);
+        double start = now_ms();
+        for (uint32_t it = 0; it < iterations; ++it) {
+                for (size_t i = 0; i < count; ++i) {
+                        glm::mat4 model = glm::mat4(1.0f);
+                        model = glm::translate(model, positions[i]);
+                        expected[i] = glm::rotate(model, reference_angle(angle[i] * time), axis);
+                }
+        }
+        double glm_ms = (now_ms() - start) / iterations;
+        for (size_t i = 0; i < count; ++i)
+                expected_mvp[i] = view_proj * expected[i];
+        printf("%-8s %9.3f ms  %7.2f ns/object\n", "glm", glm_ms, 1e6 * glm_ms / count);
+
+        transform_batch batch;
+        batch.count = count;
+        batch.px = px.data();
+        batch.py = py.data();
+        batch.pz = pz.data();
+        batch.angle = angle.data();
+        batch.angle_scale = time;
+        batch.shared_axis = glm::normalize(axis);
+
+        bool ok = true;
+        std::vector<glm::mat4> out(count);
+        const transform_kernel kernels[] = {TRANSFORM_SCALAR, TRANSFORM_SSE, TRANSFORM_AVX2};
+        for (transform_kernel kernel : kernels) {
+                if ((kernel != TRANSFORM_SCALAR) &&
+                    (kernel > transform_best_kernel()))
+                        continue;
+
+                for (int32_t with_vp = 0; with_vp < 2; ++with_vp) {
+                        const glm::mat4 *vp = with_vp ? &view_proj : NULL;
+                        std::fill(out.begin(), out.end(), glm::mat4(0.0f));
+                        start = now_ms();
+                        for (uint32_t it = 0; it < iterations; ++it)
+                                transform_batch_build(batch, vp, out.data(), kernel);
+                        double ms = (now_ms() - start) / iterations;
+
+                        float diff = max_abs_diff(out, with_vp ? expected_mvp : expected);
+                        bool match = diff <= TOLERANCE;
+                        ok = ok && match;
+                        printf("%-8s %9.3f ms  %7.2f ns/object  %5.2fx  %s  max|diff| %.2e %s\n",
+                               transform_kernel_name(kernel),
+                               ms,
+                               1e6 * ms / count,
+                               glm_ms / ms,
+                               with_vp ? "mvp  " : "model",
+                               diff,
+                               match ? "ok" : "MISMATCH");
+                }
+        }
+
+        ok = check_random_rotations(10007) && ok;
+        ok = check_large_angles(10007) && ok;
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,4 +1,10 @@
 #include "learngl.hpp"
+#include "coordsystems_scene.hpp"
+#include "frame_capture.hpp"
+#include "frame_pacing.hpp"
+#include "shared_context.hpp"
+#include "shader_reload.hpp"
+#include "texture_loader.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -9,222 +15,587 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
-#define UP 1
-#define NEUTRAL 0
-#define DOWN -1
+// held keys, as the simulation sees them
+#define INPUT_UP (1u << 0)
+#define INPUT_DOWN (1u << 1)
 #define SCR_WIDTH 800
 #define SCR_HEIGHT 600
+#define THUMBNAIL_WIDTH (SCR_WIDTH / 4)
+#define THUMBNAIL_HEIGHT (SCR_HEIGHT / 4)
+
+/*
+ * What the simulation thread advances at a fixed rate: the clock the cubes
+ * spin by and the texture mix, which the arrow keys step.
+ */
+struct scene_sim {
+        double time = 0.0;
+        float alpha = 0.5f;
+        uint32_t held = 0;
+};
 
-static float
-process_input(GLFWwindow *window,
-              uint32_t shader_prog,
-              float alpha,
-              int32_t& prev_state)
+static void
+tick_scene(scene_sim& state, uint32_t input, double step, void *)
 {
         constexpr float amt = 0.1f;
-        int32_t uni_loc;
+        uint32_t pressed = input & ~state.held;
+        if (pressed & INPUT_UP)
+                state.alpha = fmin(state.alpha + amt, 1.0f);
+        if (pressed & INPUT_DOWN)
+                state.alpha = fmax(state.alpha - amt, 0.0f);
+        state.held = input;
+        state.time += step;
+}
+
+static scene_sim
+lerp_scene(const scene_sim& a, const scene_sim& b, float t)
+{
+        scene_sim state = b;
+        state.time = a.time + t * (b.time - a.time);
+        state.alpha = a.alpha + t * (b.alpha - a.alpha);
+
+        return state;
+}
+
+// render thread; escape is handled here, the rest goes to the simulation
+static uint32_t
+sample_input(GLFWwindow *window)
+{
         if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
                 glfwSetWindowShouldClose(window, true);
-        if ((glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) &&
-            (prev_state != UP)) {
-                alpha = fmin(alpha + amt, 1.0f);
-                prev_state = UP;
 
-                uni_loc = glGetUniformLocation(shader_prog, "alpha");
-                glUniform1f(uni_loc, alpha);
-        }
-        if ((glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) && (prev_state != DOWN)) {
-                alpha = fmax(alpha - amt, 0.0f);
-                prev_state = DOWN;
+        uint32_t input = 0;
+        if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS)
+                input |= INPUT_UP;
+        if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS)
+                input |= INPUT_DOWN;
 
-                uni_loc = glGetUniformLocation(shader_prog, "alpha");
-                glUniform1f(uni_loc, alpha);
-        }
-        if ((glfwGetKey(window, GLFW_KEY_DOWN) != GLFW_PRESS) &&
-            (glfwGetKey(window, GLFW_KEY_UP) != GLFW_PRESS) &&
-            (prev_state != NEUTRAL))
-                prev_state = NEUTRAL;
-
-        return alpha;
+        return input;
 }
 
-static uint32_t
-gen_texture(const char* path, int32_t format)
+/*
+ * A thumbnail window's render thread, showing the newest frame the main
+ * context published. The program and the frames' textures live in the
+ * main context's share group; only the (empty) VAO is this context's own.
+ */
+struct thumbnail_view {
+        shared_ring *ring = NULL;
+        uint32_t program = 0;
+        uint32_t reader = 0;
+};
+
+static void
+draw_thumbnail(shared_context& ctx, void *data)
 {
-        uint32_t texture;
-        glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        int width, height, nrChannels;
-        unsigned char *data = stbi_load(path, &width, &height, &nrChannels, 0);
-        if (data) {
-                glTexImage2D(GL_TEXTURE_2D,
-                             0,
-                             format,
-                             width,
-                             height,
-                             0,
-                             format,
-                             GL_UNSIGNED_BYTE,
-                             data);
-                glGenerateMipmap(GL_TEXTURE_2D);
+        const thumbnail_view *view = (const thumbnail_view*)data;
+        uint32_t VAO;
+        glGenVertexArrays(1, &VAO);
+
+        uint64_t serial = 0;
+        while (!ctx.quit.load(std::memory_order_relaxed)) {
+                // the wait for the frame also covers the program's link,
+                // which the main context issued before it
+                int32_t slot = shared_ring_acquire(*view->ring, &serial, 100);
+                if (slot < 0)
+                        continue;
+                glBindFramebuffer(GL_FRAMEBUFFER, shared_context_framebuffer(ctx));
+                glViewport(0, 0, ctx.width, ctx.height);
+                state_use_program(view->program);
+                state_bind_vertex_array(VAO);
+                state_bind_texture(0, GL_TEXTURE_2D, view->ring->textures[slot]);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+                shared_ring_release(*view->ring, view->reader, slot);
+                shared_context_swap(ctx);
         }
-        else {
-                std::cout << "Failed to load texture" << std::endl;
-        }
-        stbi_image_free(data);
 
-        return texture;
+        state_delete_vertex_arrays(1, &VAO);
 }
 
 static void
-set_mat4(uint32_t shader_prog, glm::mat4& transform, const char* uni_name)
+usage(const char *prog)
 {
-        uint32_t trans_loc = glGetUniformLocation(shader_prog, uni_name);
-        glUniformMatrix4fv(trans_loc,
-                           1,
-                           GL_FALSE,
-                           glm::value_ptr(transform));
+        fprintf(stderr,
+                "usage: %s [--instanced | --multi-draw | --queue] [--instances N] [--threads N]\n"
+                "          [--scene FILE" SCENE_FILE_SUFFIX "] [--resources DIR]\n"
+                "          [--sim-hz N] [--frames-in-flight N] [--no-vsync]\n"
+                "          [--lod-threshold PIXELS | --no-lod] [--no-occlusion] [--views N]\n"
+                "          [--capture PATH]\n"
+                "  --scene      draw a scene file (see scene_convert.cpp) instead of\n"
+                "               generating --instances cubes\n"
+                "  --resources  where textures/ is when there's no scene; default resources\n"
+                "  --sim-hz     simulation ticks per second; default 120\n"
+                "  --frames-in-flight\n"
+                "               frames the CPU may run ahead of the GPU, 1 to %u; default 2\n"
+                "  --no-vsync   present unthrottled, for throughput measurement\n"
+                "  --lod-threshold\n"
+                "               screen-space error allowed by a coarser LOD; default 1\n"
+                "  --no-lod     draw every mesh at full detail\n"
+                "  --no-occlusion\n"
+                "               draw cubes hidden behind others too\n"
+                "  --views      thumbnail windows of the output, 0 to %u, each drawn\n"
+                "               by a thread of its own; default 0\n"
+                "  --capture    record every frame: PATH ending .png for numbered PNGs,\n"
+                "               .y4m for a video stream, anything else for frame hashes\n",
+                prog,
+                FRAME_PACER_MAX_FRAMES,
+                SHARED_MAX_READERS);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
+        draw_strategy strategy = DRAW_PER_OBJECT;
+        size_t n_instances = 10;
+        uint32_t n_threads = 0;
+        const char *scene_path = NULL;
+        std::string resources = "resources";
+        double sim_hz = 120.0;
+        uint32_t frames_in_flight = 2;
+        bool vsync = true;
+        bool lod = true;
+        bool occlusion = true;
+        uint32_t n_views = 0;
+        const char *capture_path = NULL;
+        cube_lod_options lod_options;
+        for (int32_t i = 1; i < argc; ++i) {
+                if (strcmp(argv[i], "--instanced") == 0) {
+                        strategy = DRAW_INSTANCED;
+                } else if (strcmp(argv[i], "--multi-draw") == 0) {
+                        strategy = DRAW_MULTI_INDIRECT;
+                } else if (strcmp(argv[i], "--queue") == 0) {
+                        strategy = DRAW_QUEUE;
+                } else if ((strcmp(argv[i], "--instances") == 0) &&
+                           (i + 1 < argc)) {
+                        n_instances = strtoull(argv[++i], NULL, 10);
+                } else if ((strcmp(argv[i], "--threads") == 0) &&
+                           (i + 1 < argc)) {
+                        n_threads = strtoul(argv[++i], NULL, 10);
+                } else if ((strcmp(argv[i], "--scene") == 0) &&
+                           (i + 1 < argc)) {
+                        scene_path = argv[++i];
+                } else if ((strcmp(argv[i], "--resources") == 0) &&
+                           (i + 1 < argc)) {
+                        resources = argv[++i];
+                } else if ((strcmp(argv[i], "--sim-hz") == 0) &&
+                           (i + 1 < argc)) {
+                        sim_hz = strtod(argv[++i], NULL);
+                } else if ((strcmp(argv[i], "--frames-in-flight") == 0) &&
+                           (i + 1 < argc)) {
+                        frames_in_flight = strtoul(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "--no-vsync") == 0) {
+                        vsync = false;
+                } else if ((strcmp(argv[i], "--lod-threshold") == 0) &&
+                           (i + 1 < argc)) {
+                        lod_options.threshold = strtof(argv[++i], NULL);
+                } else if (strcmp(argv[i], "--no-lod") == 0) {
+                        lod = false;
+                } else if (strcmp(argv[i], "--no-occlusion") == 0) {
+                        occlusion = false;
+                } else if ((strcmp(argv[i], "--views") == 0) &&
+                           (i + 1 < argc)) {
+                        n_views = strtoul(argv[++i], NULL, 10);
+                } else if ((strcmp(argv[i], "--capture") == 0) &&
+                           (i + 1 < argc)) {
+                        capture_path = argv[++i];
+                } else {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if ((sim_hz <= 0.0) ||
+            (lod_options.threshold <= 0.0f) ||
+            (frames_in_flight == 0) ||
+            (frames_in_flight > FRAME_PACER_MAX_FRAMES) ||
+            (n_views > SHARED_MAX_READERS)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        // the file is trusted no further than its records are checked
+        scene_file scene;
+        if ((scene_path != NULL) && !open_scene_file(scene_path, scene, true)) {
+                fprintf(stderr, "Failed to load scene %s\n", scene_path);
+                return EXIT_FAILURE;
+        }
+        // the instanced strategies draw one mesh for every instance
+        if ((scene.map != NULL) &&
+            (scene.header->n_meshes > 1) &&
+            ((strategy == DRAW_INSTANCED) || (strategy == DRAW_MULTI_INDIRECT))) {
+                fprintf(stderr,
+                        "%s has %u meshes; %s can only draw one\n",
+                        scene_path,
+                        scene.header->n_meshes,
+                        draw_strategy_name(strategy));
+                return EXIT_FAILURE;
+        }
+
         GLFWwindow* window = init_gl(SCR_WIDTH, SCR_HEIGHT);
         if (window == NULL)
                 return -1;
+        set_swap_interval(vsync ? 1 : 0);
 
-        uint32_t vertex = create_shader("./shader.vs", GL_VERTEX_SHADER);
-        uint32_t fragment = create_shader("./shader.fs", GL_FRAGMENT_SHADER);
-        uint32_t shader_prog = create_shader_program(vertex, fragment);
-
-        float vertices[] = {
-                -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
-                0.5f, -0.5f, -0.5f,  1.0f, 0.0f,
-                0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-                0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-                -0.5f,  0.5f, -0.5f,  0.0f, 1.0f,
-                -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
-
-                -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-                0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
-                0.5f,  0.5f,  0.5f,  1.0f, 1.0f,
-                0.5f,  0.5f,  0.5f,  1.0f, 1.0f,
-                -0.5f,  0.5f,  0.5f,  0.0f, 1.0f,
-                -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-
-                -0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-                -0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-                -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-                -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-                -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-                -0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-
-                0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-                0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-                0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-                0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-                0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-                0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-
-                -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-                0.5f, -0.5f, -0.5f,  1.0f, 1.0f,
-                0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
-                0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
-                -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-                -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-
-                -0.5f,  0.5f, -0.5f,  0.0f, 1.0f,
-                0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-                0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-                0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-                -0.5f,  0.5f,  0.5f,  0.0f, 0.0f,
-                -0.5f,  0.5f, -0.5f,  0.0f, 1.0f
-        };
-        glm::vec3 cube_positions[] = {
-                glm::vec3( 0.0f,  0.0f,  0.0f),
-                glm::vec3( 2.0f,  5.0f, -15.0f),
-                glm::vec3(-1.5f, -2.2f, -2.5f),
-                glm::vec3(-3.8f, -2.0f, -12.3f),
-                glm::vec3( 2.4f, -0.4f, -3.5f),
-                glm::vec3(-1.7f,  3.0f, -7.5f),
-                glm::vec3( 1.3f, -2.0f, -2.5f),
-                glm::vec3( 1.5f,  2.0f, -2.5f),
-                glm::vec3( 1.5f,  0.2f, -1.5f),
-                glm::vec3(-1.3f,  1.0f, -1.5f)
-        };
-        uint32_t VAO = init_VAO(vertices, sizeof(vertices));
-
-        init_vert_attr(0, 3, 5, 0);
-        init_vert_attr(1, 2, 5, 3);
+        if (!draw_strategy_supported(strategy)) {
+                fprintf(stderr, "%s needs GL 4.3\n", draw_strategy_name(strategy));
+                terminate_gl();
+                return EXIT_FAILURE;
+        }
 
-        stbi_set_flip_vertically_on_load(true);
-        uint32_t texture1 = gen_texture("/home/bduke/work/LearnOpenGL/resources/textures/container.jpg",
-                                        GL_RGB);
-        uint32_t texture2 = gen_texture("/home/bduke/work/LearnOpenGL/resources/textures/awesomeface.png",
-                                        GL_RGBA);
+        // edits to either shader are picked up while running
+        shader_watcher watcher;
+        reload_program shader_prog;
+        reload_program_init(shader_prog,
+                            watcher,
+                            draw_strategy_vs(strategy),
+                            "./shader.fs");
+        shader_watcher_start(watcher);
+
+        // the thumbnails share one program and the frames main publishes
+        shared_ring thumbnails;
+        shader_program thumbnail_program;
+        thumbnail_view views[SHARED_MAX_READERS];
+        shared_context view_contexts[SHARED_MAX_READERS];
+        if (n_views > 0) {
+                thumbnail_program = create_program_cached("./thumbnail.vs", "./thumbnail.fs");
+                init_shared_ring(thumbnails, THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT);
+        }
+        for (uint32_t i = 0; i < n_views; ++i) {
+                char title[32];
+                snprintf(title, sizeof(title), "LearnOpenGL view %u", i + 1);
+                if (!create_shared_context(view_contexts[i],
+                                           THUMBNAIL_WIDTH,
+                                           THUMBNAIL_HEIGHT,
+                                           title)) {
+                        n_views = i;
+                        break;
+                }
+                views[i].ring = &thumbnails;
+                views[i].program = thumbnail_program.id;
+                views[i].reader = i;
+                shared_context_start(view_contexts[i], draw_thumbnail, &views[i]);
+        }
 
-        glUseProgram(shader_prog);
-        glUniform1i(glGetUniformLocation(shader_prog, "texture1"), 0);
-        glUniform1i(glGetUniformLocation(shader_prog, "texture2"), 1);
+        // a scene file's instances and BVH are used in place
+        bvh tree;
+        bvh_view tree_view;
+        cube_field field;
+        if (scene.map != NULL) {
+                field = scene_cube_field(scene);
+                tree_view = scene_bvh(scene);
+        } else {
+                std::vector<glm::vec3> positions =
+                        gen_cube_positions(cube_fixed_positions,
+                                           sizeof(cube_fixed_positions)/sizeof(cube_fixed_positions[0]),
+                                           n_instances);
+                bvh_build(tree, cube_bounds(positions).data(), positions.size());
+                field = gen_cube_field(positions, tree.order);
+                tree_view = tree;
+        }
+        std::vector<glm::mat4> models(field.count);
+        std::vector<cull_range> visible;
+
+        // the GL thread is worker 0, so it helps with the per-frame update
+        job_system jobs;
+        job_system_start(jobs, n_threads);
+
+        // static meshes share one buffer; the cube is the only one so far
+        buffer_arena statics;
+        init_buffer_arena(statics, 1 << 20);
+        cube_mesh mesh;
+        if (scene.map != NULL) {
+                mesh = init_cube_mesh_scene(strategy, scene, models.size());
+                printf("scene: %zu meshes, %u materials, %zu instances, "
+                       "%u vertices, %u indices, %zu bytes\n",
+                       mesh.parts.size(),
+                       scene.header->n_materials,
+                       field.count,
+                       mesh.n_vertices,
+                       mesh.n_indices,
+                       mesh.packed_size);
+        } else {
+                mesh = init_cube_mesh(strategy, models.size(), &statics);
+                printf("cube mesh: %u vertices, %u indices, %zu bytes (%zu unindexed)\n",
+                       mesh.n_vertices,
+                       mesh.n_indices,
+                       mesh.packed_size,
+                       sizeof(cube_vertices));
+        }
 
-        float alpha = 0.5f;
-        int32_t uni_loc = glGetUniformLocation(shader_prog, "alpha");
-        glUniform1f(uni_loc, alpha);
-        int32_t prev_state = NEUTRAL;
+        // textures decode in the background; until they arrive the cubes
+        // render with a placeholder
+        stbi_set_flip_vertically_on_load(true);
+        double textures_start = glfwGetTime();
+        bool textures_resident = false;
+        texture_loader loader;
+        texture_loader_start(loader);
+        std::vector<cube_material> materials;
+        if (scene.map != NULL) {
+                // materials often share textures; load each file once
+                std::unordered_map<std::string, uint32_t> textures;
+                for (uint32_t m = 0; m < scene.header->n_materials; ++m) {
+                        cube_material material;
+                        for (uint32_t t = 0; t < 2; ++t) {
+                                std::string path = scene_texture_path(scene, m, t);
+                                auto it = textures.find(path);
+                                if (it == textures.end()) {
+                                        uint32_t texture = texture_loader_request(loader,
+                                                                                  path.c_str());
+                                        it = textures.emplace(path, texture).first;
+                                }
+                                material.textures[t] = it->second;
+                        }
+                        materials.push_back(material);
+                }
+        } else {
+                uint32_t texture1 = texture_loader_request(loader,
+                                                           (resources + "/textures/container.jpg").c_str());
+                uint32_t texture2 = texture_loader_request(loader,
+                                                           (resources + "/textures/awesomeface.png").c_str());
+                materials = {{{texture1, texture2}}};
+        }
 
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f),
-                                                (float)SCR_WIDTH / (float)SCR_HEIGHT,
-                                                0.1f,
-                                                100.0f);
-        glUseProgram(shader_prog);
-        set_mat4(shader_prog, projection, "projection");
+        // the simulation ticks on its own thread from here on; the loop
+        // below draws whatever it last published
+        sim_thread<scene_sim> sim;
+        sim_start(sim, scene_sim(), 1.0 / sim_hz, tick_scene);
+        frame_pacer pacer;
+        init_frame_pacer(pacer, frames_in_flight);
+
+        float alpha = scene_sim().alpha;
+        scene_uniforms uniforms = init_scene_uniforms(shader_prog.program, alpha);
+
+        camera_block camera;
+        camera.projection = glm::perspective(glm::radians(45.0f),
+                                             (float)SCR_WIDTH / (float)SCR_HEIGHT,
+                                             0.1f,
+                                             CUBE_FAR_PLANE);
+        stream_buffer camera_stream;
+        init_camera_stream(camera_stream);
+
+        // the window's size when capturing started, at the display's rate
+        frame_capture capture;
+        double capture_ms = 0.0;
+        if (capture_path != NULL) {
+                int32_t width;
+                int32_t height;
+                glfwGetFramebufferSize(window, &width, &height);
+                if (!frame_capture_start(capture,
+                                         capture_format_for_path(capture_path),
+                                         capture_path,
+                                         width,
+                                         height,
+                                         60)) {
+                        fprintf(stderr, "Failed to open %s\n", capture_path);
+                        capture_path = NULL;
+                }
+        }
 
         glEnable(GL_DEPTH_TEST);
 
+        double last_report = glfwGetTime();
+        // as of last_report
+        uint64_t views_shown[SHARED_MAX_READERS] = {};
+        uint64_t views_published = 0;
+        uint64_t views_dropped = 0;
+        size_t n_visible = 0;
+        cube_lod_stats lod_stats;
+        cube_occlusion occluders;
+        init_cube_occlusion(occluders);
         while (!glfwWindowShouldClose(window)) {
-                alpha = process_input(window, shader_prog, alpha, prev_state);
-
-                glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, texture1);
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, texture2);
-
-                glm::mat4 view = glm::mat4(1.0f);
-                view = glm::translate(view, glm::vec3(0.0f, 0.0f, -3.0f));
-
-                glUseProgram(shader_prog);
-                set_mat4(shader_prog, view, "view");
-
-                glBindVertexArray(VAO);
-                for (uint32_t i = 0;
-                     i < sizeof(cube_positions)/sizeof(cube_positions[0]);
-                     i++) {
-                        // calculate the model matrix for each object and pass it to shader before drawing
-                        glm::mat4 model = glm::mat4(1.0f);
-                        model = glm::translate(model, cube_positions[i]);
-                        float angle = 20.0f * i * glfwGetTime();
-                        model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
-                        set_mat4(shader_prog, model, "model");
-
-                        glDrawArrays(GL_TRIANGLES, 0, 36);
+                frame_pacer_begin(pacer);
+
+                {
+                        PROFILE_SCOPE("input");
+                        glfwPollEvents();
+                        sim_input(sim, sample_input(window));
+                }
+
+                if (reload_program_poll(shader_prog, watcher))
+                        uniforms = init_scene_uniforms(shader_prog.program, alpha);
+
+                double input_time;
+                scene_sim state = sim_latest(sim, sim_clock(), lerp_scene, &input_time);
+                if (state.alpha != alpha) {
+                        alpha = state.alpha;
+                        state_use_program(shader_prog.program.id);
+                        set_uniform(uniforms.alpha, alpha);
+                }
+
+                {
+                        PROFILE_SCOPE("texture upload");
+                        texture_loader_pump(loader, 2.0);
+                }
+                if (!textures_resident && texture_loader_idle(loader)) {
+                        textures_resident = true;
+                        printf("textures resident after %.3f ms\n",
+                               1000.0 * (glfwGetTime() - textures_start));
                 }
 
-                glfwSwapBuffers(window);
-                glfwPollEvents();
+                {
+                        PROFILE_GPU_SCOPE("clear");
+                        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+                        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                }
+
+                camera.view = glm::translate(glm::mat4(1.0f),
+                                             glm::vec3(0.0f, 0.0f, -3.0f));
+                update_camera_stream(camera_stream, camera);
+
+                frustum view_frustum = frustum_from_matrix(camera.projection *
+                                                           camera.view);
+                n_visible = update_cubes(jobs,
+                                         field,
+                                         tree_view,
+                                         state.time,
+                                         view_frustum,
+                                         models.data(),
+                                         visible);
+                if (occlusion)
+                        n_visible = occlude_cubes(jobs,
+                                                  occluders,
+                                                  mesh,
+                                                  field,
+                                                  visible,
+                                                  models.data(),
+                                                  n_visible,
+                                                  camera.projection,
+                                                  camera.view);
+                if (lod) {
+                        int32_t width;
+                        int32_t height;
+                        glfwGetFramebufferSize(window, &width, &height);
+                        lod_stats = select_cube_lods(jobs,
+                                                     mesh,
+                                                     field,
+                                                     visible,
+                                                     models.data(),
+                                                     camera.view,
+                                                     0.5f * height * camera.projection[1][1],
+                                                     lod_options);
+                }
+
+                {
+                        PROFILE_SCOPE("draw");
+                        PROFILE_GPU_SCOPE("draw");
+                        draw_cubes(mesh,
+                                   uniforms,
+                                   shader_prog.program.id,
+                                   materials,
+                                   field,
+                                   visible,
+                                   models.data(),
+                                   n_visible,
+                                   camera.view);
+                }
+
+                if (capture_path != NULL)
+                        frame_capture_read(capture, screen_framebuffer());
+                if (n_views > 0) {
+                        PROFILE_SCOPE("publish");
+                        int32_t width;
+                        int32_t height;
+                        glfwGetFramebufferSize(window, &width, &height);
+                        shared_ring_publish(thumbnails, screen_framebuffer(), width, height);
+                }
+
+                swap_buffers(window);
+                frame_pacer_end(pacer, input_time);
+
+                double now = glfwGetTime();
+                if (now - last_report >= 1.0) {
+                        printf("%zu cubes, %zu visible, %zu culled (%s), %u stream stalls, "
+                               "%u GL binds issued, %u elided, %u queued draws in %u calls "
+                               "last frame\n",
+                               models.size(),
+                               n_visible,
+                               models.size() - n_visible,
+                               draw_strategy_name(strategy),
+                               mesh.instances.stalls + camera_stream.stalls,
+                               gl_state.last_issued,
+                               gl_state.last_elided,
+                               mesh.queue.last_draws,
+                               mesh.queue.last_calls);
+                        if (occlusion)
+                                printf("%zu of %zu in the frustum occluded, by %u occluders "
+                                       "(%u triangles) last frame\n",
+                                       occluders.occluded,
+                                       occluders.tested,
+                                       occluders.buffer.occluders,
+                                       occluders.buffer.triangles);
+                        if (lod)
+                                printf("%zu triangles drawn, %zu saved by LOD (%.1f%%) "
+                                       "last frame\n",
+                                       lod_stats.triangles,
+                                       lod_stats.full_triangles - lod_stats.triangles,
+                                       100.0 * (lod_stats.full_triangles - lod_stats.triangles) /
+                                       std::max<size_t>(lod_stats.full_triangles, 1));
+                        if (n_views > 0) {
+                                // the ring's counts are the writer's, this thread's
+                                std::string shown;
+                                for (uint32_t i = 0; i < n_views; ++i) {
+                                        uint64_t frames = view_contexts[i].frames.load(std::memory_order_relaxed);
+                                        shown += (i > 0 ? ", " : "") +
+                                                 std::to_string(frames - views_shown[i]);
+                                        views_shown[i] = frames;
+                                }
+                                printf("%u views showed %s of %llu frames published, "
+                                       "%llu dropped\n",
+                                       n_views,
+                                       shown.c_str(),
+                                       (unsigned long long)(thumbnails.serial - views_published),
+                                       (unsigned long long)(thumbnails.dropped - views_dropped));
+                                views_published = thumbnails.serial;
+                                views_dropped = thumbnails.dropped;
+                        }
+                        if (capture_path != NULL) {
+                                double ms = capture.render_ms - capture_ms;
+                                printf("%llu frames captured, %llu written, %llu dropped, "
+                                       "%llu stalls; %.3f ms/frame on the render thread "
+                                       "(%.1f%%)\n",
+                                       (unsigned long long)capture.frames,
+                                       (unsigned long long)capture.written.load(),
+                                       (unsigned long long)capture.dropped,
+                                       (unsigned long long)capture.stalls,
+                                       ms / std::max(pacer.frames, 1u),
+                                       100.0 * ms / (1000.0 * (now - last_report)));
+                                capture_ms = capture.render_ms;
+                        }
+                        uint32_t latencies = std::max(pacer.latencies, 1u);
+                        printf("%.1f frames/s (%u in flight%s), %llu sim ticks (%llu skipped), "
+                               "%u pacing waits (%.2f ms), input to GPU done %.2f ms avg, "
+                               "%.2f ms max\n",
+                               pacer.frames / (now - last_report),
+                               pacer.frames_in_flight,
+                               vsync ? "" : ", no vsync",
+                               (unsigned long long)sim.ticks.load(),
+                               (unsigned long long)sim.skipped.load(),
+                               pacer.waits,
+                               pacer.wait_ms,
+                               pacer.latency_sum_ms / latencies,
+                               pacer.latency_max_ms);
+                        frame_pacer_reset(pacer);
+                        last_report = now;
+                }
         }
 
-        glfwTerminate();
+        sim_stop(sim);
+        if ((capture_path != NULL) && !frame_capture_stop(capture))
+                fprintf(stderr, "Failed to write all of %s\n", capture_path);
+        for (uint32_t i = 0; i < n_views; ++i)
+                destroy_shared_context(view_contexts[i]);
+        if (n_views > 0)
+                destroy_shared_ring(thumbnails);
+        destroy_frame_pacer(pacer);
+        job_system_stop(jobs);
+        shader_watcher_stop(watcher);
+        texture_loader_stop(loader);
+        terminate_gl();
+        close_scene_file(scene);
 
         return EXIT_SUCCESS;
 }
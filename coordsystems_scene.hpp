@@ -0,0 +1,1169 @@
+#ifndef _LEARN_GL_COORDSYSTEMS_SCENE_H_
+#define _LEARN_GL_COORDSYSTEMS_SCENE_H_
+
+#include "learngl.hpp"
+#include "culling.hpp"
+#include "draw_queue.hpp"
+#include "jobs.hpp"
+#include "mesh.hpp"
+#include "occlusion.hpp"
+#include "scene_file.hpp"
+#include "texture_array.hpp"
+#include "transform.hpp"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <vector>
+#include <cstring>
+
+/*
+ * The coordsystems scene: a field of spinning textured cubes, culled
+ * through a BVH (and optionally against the cubes in front of them) and
+ * transformed in parallel every frame. Shared by coordsystems.cpp and the
+ * benchmarks, so what is measured is what runs.
+ */
+
+// cubes per job when the per-frame update is split across cores
+#define CUBE_CHUNK 4096
+// bounding sphere of the unit cube, whatever its rotation
+#define CUBE_RADIUS 0.8660254f
+#define CUBE_VERTEX_COUNT 36
+// far plane of the scene camera, what draw depths are relative to
+#define CUBE_FAR_PLANE 100.0f
+// the per-instance texture array layer of shader*.vs
+#define CUBE_MATERIAL_ATTR 6
+// visible runs per job, for the passes over them after culling
+#define CUBE_RUN_CHUNK 256
+// most cubes drawn as occluders a frame, and how big they must look, as a
+// radius in occlusion buffer pixels
+#define CUBE_MAX_OCCLUDERS 256
+#define CUBE_MIN_OCCLUDER_PIXELS 4.0f
+
+// position (3) and texture coordinate (2) per vertex, non-indexed
+static const float cube_vertices[CUBE_VERTEX_COUNT * 5] = {
+        -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
+        0.5f, -0.5f, -0.5f,  1.0f, 0.0f,
+        0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+        0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+        -0.5f,  0.5f, -0.5f,  0.0f, 1.0f,
+        -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
+
+        -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+        0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
+        0.5f,  0.5f,  0.5f,  1.0f, 1.0f,
+        0.5f,  0.5f,  0.5f,  1.0f, 1.0f,
+        -0.5f,  0.5f,  0.5f,  0.0f, 1.0f,
+        -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+
+        -0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+        -0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+        -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+        -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+        -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+        -0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+
+        0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+        0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+        0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+        0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+        0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+        0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+
+        -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+        0.5f, -0.5f, -0.5f,  1.0f, 1.0f,
+        0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
+        0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
+        -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+        -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+
+        -0.5f,  0.5f, -0.5f,  0.0f, 1.0f,
+        0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+        0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+        0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+        -0.5f,  0.5f,  0.5f,  0.0f, 0.0f,
+        -0.5f,  0.5f, -0.5f,  0.0f, 1.0f
+};
+
+// the hand-placed cubes, always the first ones in the field
+static const glm::vec3 cube_fixed_positions[] = {
+        glm::vec3( 0.0f,  0.0f,  0.0f),
+        glm::vec3( 2.0f,  5.0f, -15.0f),
+        glm::vec3(-1.5f, -2.2f, -2.5f),
+        glm::vec3(-3.8f, -2.0f, -12.3f),
+        glm::vec3( 2.4f, -0.4f, -3.5f),
+        glm::vec3(-1.7f,  3.0f, -7.5f),
+        glm::vec3( 1.3f, -2.0f, -2.5f),
+        glm::vec3( 1.5f,  2.0f, -2.5f),
+        glm::vec3( 1.5f,  0.2f, -1.5f),
+        glm::vec3(-1.3f,  1.0f, -1.5f)
+};
+
+/*
+ * Returns count cube positions: the hand-placed ones first, then
+ * pseudo-random ones scattered (deterministically) all around the camera,
+ * so that like a real scene most of a large field is off screen.
+ */
+static std::vector<glm::vec3>
+gen_cube_positions(const glm::vec3 *fixed, size_t n_fixed, size_t count)
+{
+        std::vector<glm::vec3> positions(fixed, fixed + std::min(n_fixed, count));
+        positions.reserve(count);
+
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        while (positions.size() < count) {
+                positions.push_back(glm::vec3(100.0f * unit(rng),
+                                              20.0f * unit(rng),
+                                              100.0f * unit(rng)));
+        }
+
+        return positions;
+}
+
+/*
+ * Structure-of-arrays cube placements, the layout the batch transform
+ * kernels read, in BVH order. Cube j spins at angle[j] radians per second
+ * about a shared axis, and is drawn with mesh mesh[j] (0 when mesh is
+ * NULL) and material material[j]. The arrays are either generated into
+ * the field's own storage or point into a mapped scene file
+ * (scene_file.hpp); the field can be moved but not copied.
+ */
+struct cube_field {
+        size_t count = 0;
+        const float *px = NULL;
+        const float *py = NULL;
+        const float *pz = NULL;
+        const float *angle = NULL;
+        const uint32_t *material = NULL;
+        const uint32_t *mesh = NULL;
+
+        // backing of a generated field
+        std::vector<float> storage;
+        std::vector<uint32_t> material_storage;
+
+        cube_field() = default;
+        cube_field(cube_field&&) = default;
+        cube_field& operator=(cube_field&&) = default;
+};
+
+/*
+ * Entry j is cube order[j] of positions. Cube i spins at 20 * i degrees
+ * per second and has material i % n_materials, so neighbours in the BVH
+ * rarely share one.
+ */
+static cube_field
+gen_cube_field(const std::vector<glm::vec3>& positions,
+               const std::vector<uint32_t>& order,
+               uint32_t n_materials = 1)
+{
+        size_t n = order.size();
+        cube_field field;
+        field.count = n;
+        field.storage.resize(4 * n);
+        field.material_storage.resize(n);
+        for (size_t j = 0; j < n; ++j) {
+                uint32_t i = order[j];
+                field.storage[j] = positions[i].x;
+                field.storage[n + j] = positions[i].y;
+                field.storage[2 * n + j] = positions[i].z;
+                field.storage[3 * n + j] = glm::radians(20.0f * i);
+                field.material_storage[j] = i % n_materials;
+        }
+        field.px = field.storage.data();
+        field.py = field.px + n;
+        field.pz = field.py + n;
+        field.angle = field.pz + n;
+        field.material = field.material_storage.data();
+
+        return field;
+}
+
+/*
+ * The instances of a mapped scene file, in place; the field is only valid
+ * while the file stays open.
+ */
+static cube_field
+scene_cube_field(const scene_file& scene)
+{
+        cube_field field;
+        field.count = scene.header->n_instances;
+        field.px = scene_section_data<float>(scene, SCENE_PX);
+        field.py = scene_section_data<float>(scene, SCENE_PY);
+        field.pz = scene_section_data<float>(scene, SCENE_PZ);
+        field.angle = scene_section_data<float>(scene, SCENE_SPIN);
+        field.material = scene_section_data<uint32_t>(scene, SCENE_MATERIAL_INDEX);
+        field.mesh = scene_section_data<uint32_t>(scene, SCENE_MESH_INDEX);
+
+        return field;
+}
+
+static transform_batch
+cube_field_batch(const cube_field& field, double time)
+{
+        transform_batch batch;
+        batch.count = field.count;
+        batch.px = field.px;
+        batch.py = field.py;
+        batch.pz = field.pz;
+        batch.angle = field.angle;
+        batch.angle_scale = time;
+        batch.shared_axis = glm::normalize(glm::vec3(1.0f, 0.3f, 0.5f));
+
+        return batch;
+}
+
+/*
+ * Bounds of every cube in whatever orientation, for the BVH: the box around
+ * its bounding sphere.
+ */
+static std::vector<aabb>
+cube_bounds(const std::vector<glm::vec3>& positions)
+{
+        std::vector<aabb> bounds(positions.size());
+        for (size_t i = 0; i < positions.size(); ++i) {
+                bounds[i].min = positions[i] - glm::vec3(CUBE_RADIUS);
+                bounds[i].max = positions[i] + glm::vec3(CUBE_RADIUS);
+        }
+
+        return bounds;
+}
+
+/*
+ * Culls the cubes against the view frustum through the BVH, then builds the
+ * model matrices of the visible ones, packed into models, over all cores in
+ * CUBE_CHUNK-sized jobs. Returns the number visible.
+ */
+static size_t
+update_cubes(job_system& jobs,
+             const cube_field& field,
+             const bvh_view& tree,
+             double time,
+             const frustum& view_frustum,
+             glm::mat4 *models,
+             std::vector<cull_range>& visible)
+{
+        size_t n_visible;
+        {
+                PROFILE_SCOPE("cull");
+                n_visible = bvh_cull(tree, view_frustum, visible);
+        }
+        transform_batch batch = cube_field_batch(field, time);
+
+        PROFILE_SCOPE("transform build");
+        parallel_for(jobs, 0, n_visible, CUBE_CHUNK, [&](size_t begin, size_t end) {
+                PROFILE_SCOPE("transform chunk");
+                // first visible run reaching into [begin, end)
+                auto run = std::upper_bound(visible.begin(),
+                                            visible.end(),
+                                            begin,
+                                            [](size_t packed, const cull_range& range) {
+                                                    return packed < range.packed;
+                                            }) - 1;
+                for (; (run != visible.end()) && (run->packed < end); ++run) {
+                        size_t first = std::max<size_t>(begin, run->packed);
+                        size_t last = std::min<size_t>(end,
+                                                       run->packed + run->end - run->begin);
+                        size_t src = run->begin + first - run->packed;
+                        transform_batch_build(transform_batch_slice(batch,
+                                                                    src,
+                                                                    src + last - first),
+                                              NULL,
+                                              models + first);
+                }
+        });
+
+        return n_visible;
+}
+
+/*
+ * How the visible cubes are submitted: one glDrawArrays per cube with the
+ * model matrix as a uniform, one instanced draw with the matrices as a
+ * per-instance attribute, or one glMultiDrawElementsIndirect with a command
+ * per cube, each selecting its matrix through baseInstance. Or through the
+ * draw queue (draw_queue.hpp), which sorts the cubes by material and depth
+ * and batches them.
+ */
+enum draw_strategy {
+        DRAW_PER_OBJECT,
+        DRAW_INSTANCED,
+        DRAW_MULTI_INDIRECT,
+        DRAW_QUEUE,
+};
+
+static const char*
+draw_strategy_name(draw_strategy strategy)
+{
+        switch (strategy) {
+        case DRAW_PER_OBJECT:
+                return "per-draw";
+        case DRAW_INSTANCED:
+                return "instanced";
+        case DRAW_MULTI_INDIRECT:
+                return "multi-draw";
+        case DRAW_QUEUE:
+                return "queue";
+        }
+
+        return "?";
+}
+
+// the queue makes do without glMultiDrawElementsIndirect, multi-draw can't
+static bool
+draw_strategy_supported(draw_strategy strategy)
+{
+        if (strategy != DRAW_MULTI_INDIRECT)
+                return true;
+
+        return multi_draw_indirect_supported();
+}
+
+// the vertex shader each strategy reads its model matrix with
+static const char*
+draw_strategy_vs(draw_strategy strategy)
+{
+        return (strategy == DRAW_PER_OBJECT) ? "./shader.vs" : "./shader_instanced.vs";
+}
+
+/*
+ * The textures a cube is drawn with: texture1 and texture2 of shader.fs.
+ * Strategies that draw all cubes in one call use the first material only.
+ * With texture arrays (texture_array.hpp) there is one material, the two
+ * arrays, and the cube's material is the layer it samples instead, passed
+ * per instance; the program must then be built with TEXTURE_ARRAY_DEFINES.
+ */
+struct cube_material {
+        uint32_t textures[2];
+        GLenum target = GL_TEXTURE_2D;
+};
+
+// an LOD of a part: its index range, and its error in mesh units
+struct cube_lod {
+        draw_range range;
+        float error;
+};
+
+struct cube_mesh {
+        draw_strategy strategy;
+        uint32_t VAO = 0;
+        GLenum index_type = GL_UNSIGNED_SHORT;
+        uint32_t n_indices = 0;
+        // what the welded, packed mesh saves over the raw vertex array
+        size_t packed_size = 0;
+        uint32_t n_vertices = 0;
+        // bytes into the element buffer
+        size_t index_offset = 0;
+        // the index range of every mesh a field's mesh[] can name; the
+        // instanced strategies only draw the first
+        std::vector<draw_range> parts;
+        // every part's LODs, finest first, lods[p][0] being parts[p]; and
+        // its bounding radius
+        std::vector<std::vector<cube_lod>> lods;
+        std::vector<float> radii;
+        // every part's LOD 0 again, on the CPU, to draw as an occluder
+        std::vector<occluder_mesh> occluders;
+        // the LOD each cube of the field draws, as select_cube_lods last
+        // picked; empty until then, drawing everything at full detail
+        std::vector<uint8_t> instance_lods;
+        // vertex and index buffers, when the mesh owns them (scene files)
+        uint32_t buffers[2] = {0, 0};
+        // per-instance model matrices, streamed; unused for DRAW_PER_OBJECT
+        stream_buffer instances;
+        // per-instance texture array layers alongside them, if texture_arrays
+        bool texture_arrays = false;
+        stream_buffer layers;
+        // where this frame's instances start in the two streams
+        size_t instance_offset = 0;
+        size_t layer_offset = 0;
+        // DRAW_MULTI_INDIRECT only; with LODs the commands change every
+        // frame and are streamed instead
+        uint32_t indirect_buffer = 0;
+        std::vector<draw_elements_indirect> commands;
+        stream_buffer lod_commands;
+        // DRAW_QUEUE only, with the per-frame state of each material
+        draw_queue queue;
+        std::vector<draw_state> material_states;
+};
+
+/*
+ * The per-frame streams and draw commands of the mesh's strategy, for up
+ * to max_instances cubes a frame; the geometry must be set up.
+ */
+static void
+init_cube_mesh_streams(cube_mesh& mesh, size_t max_instances)
+{
+        if (mesh.strategy != DRAW_PER_OBJECT)
+                init_stream_buffer(mesh.instances,
+                                   GL_ARRAY_BUFFER,
+                                   std::max<size_t>(max_instances, 1) * sizeof(glm::mat4));
+        if ((mesh.strategy != DRAW_PER_OBJECT) && mesh.texture_arrays)
+                init_stream_buffer(mesh.layers,
+                                   GL_ARRAY_BUFFER,
+                                   std::max<size_t>(max_instances, 1) * sizeof(uint32_t));
+        if (mesh.strategy == DRAW_QUEUE)
+                init_draw_queue(mesh.queue, max_instances);
+
+        if (mesh.strategy == DRAW_MULTI_INDIRECT) {
+                // only base_instance differs between the commands
+                const draw_range& part = mesh.parts[0];
+                mesh.commands.resize(max_instances);
+                for (size_t i = 0; i < max_instances; ++i)
+                        mesh.commands[i] = {part.count,
+                                            1,
+                                            part.first,
+                                            part.base_vertex,
+                                            (uint32_t)i};
+
+                glGenBuffers(1, &mesh.indirect_buffer);
+                state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, mesh.indirect_buffer);
+                glBufferData(GL_DRAW_INDIRECT_BUFFER,
+                             max_instances * sizeof(draw_elements_indirect),
+                             mesh.commands.data(),
+                             GL_STATIC_DRAW);
+                if (mesh.lods[0].size() > 1)
+                        init_stream_buffer(mesh.lod_commands,
+                                           GL_DRAW_INDIRECT_BUFFER,
+                                           std::max<size_t>(max_instances, 1) *
+                                           sizeof(draw_elements_indirect));
+        }
+}
+
+/*
+ * The triangles of count indices from first, as an occluder; positions are
+ * three floats at position_offset bytes into each vertex_size-byte vertex.
+ */
+static occluder_mesh
+cube_part_occluder(const uint8_t *vertices,
+                   uint32_t vertex_size,
+                   uint32_t position_offset,
+                   size_t n_vertices,
+                   const uint8_t *indices,
+                   GLenum index_type,
+                   uint32_t first,
+                   uint32_t count)
+{
+        occluder_mesh occluder;
+        std::vector<uint32_t> remap(n_vertices, UINT32_MAX);
+        for (uint32_t i = first; i < first + count; ++i) {
+                uint32_t index;
+                if (index_type == GL_UNSIGNED_SHORT) {
+                        uint16_t short_index;
+                        memcpy(&short_index, indices + 2 * (size_t)i, 2);
+                        index = short_index;
+                } else {
+                        memcpy(&index, indices + 4 * (size_t)i, 4);
+                }
+                if (index >= n_vertices)
+                        return occluder_mesh();
+                if (remap[index] == UINT32_MAX) {
+                        remap[index] = occluder.positions.size();
+                        glm::vec3 p;
+                        memcpy(&p.x,
+                               vertices + (size_t)index * vertex_size + position_offset,
+                               sizeof(float) * 3);
+                        occluder.positions.push_back(p);
+                }
+                occluder.indices.push_back(remap[index]);
+        }
+
+        return occluder;
+}
+
+// adds a part, LOD 0 first, of the given bounding radius
+static void
+cube_mesh_add_part(cube_mesh& mesh,
+                   const std::vector<cube_lod>& lods,
+                   float radius,
+                   occluder_mesh occluder)
+{
+        mesh.parts.push_back(lods[0].range);
+        mesh.lods.push_back(lods);
+        mesh.radii.push_back(radius);
+        mesh.occluders.push_back(std::move(occluder));
+}
+
+/*
+ * Creates the cube VAO with whatever the strategy needs to draw up to
+ * max_instances cubes a frame. The cube goes through the mesh pipeline
+ * (mesh.hpp): its 36 vertices weld to 16, drawn through 16-bit indices, with
+ * half-float texture coordinates. Its corners and seams leave nothing to
+ * simplify within MESH_LOD_MAX_ERROR, so it has the one LOD. Given an
+ * arena, the mesh is suballocated from it rather than getting buffers of
+ * its own. With texture_arrays the materials are texture array layers.
+ */
+static cube_mesh
+init_cube_mesh(draw_strategy strategy,
+               size_t max_instances,
+               buffer_arena *arena = NULL,
+               bool texture_arrays = false)
+{
+        const mesh_attr attrs[] = {
+                {3, 0, MESH_FLOAT},
+                {2, 3, MESH_HALF},
+        };
+        mesh_packed packed = mesh_build(cube_vertices,
+                                        CUBE_VERTEX_COUNT,
+                                        5,
+                                        attrs,
+                                        2,
+                                        NULL,
+                                        0,
+                                        MESH_MAX_LODS);
+
+        cube_mesh mesh;
+        mesh.strategy = strategy;
+        mesh.VAO = init_mesh_VAO(packed, arena, &mesh.index_offset);
+        mesh.index_type = packed.index_type;
+        mesh.n_indices = packed.n_indices;
+        mesh.packed_size = mesh_packed_size(packed);
+        mesh.n_vertices = packed.n_vertices;
+        mesh.texture_arrays = texture_arrays;
+        uint32_t index_size = draw_index_size(mesh.index_type);
+        std::vector<cube_lod> lods;
+        for (const mesh_lod& lod : packed.lods)
+                lods.push_back({{GL_TRIANGLES,
+                                 mesh.index_type,
+                                 lod.count,
+                                 (uint32_t)(mesh.index_offset / index_size) + lod.first,
+                                 0},
+                                lod.error});
+        cube_mesh_add_part(mesh,
+                           lods,
+                           CUBE_RADIUS,
+                           cube_part_occluder(packed.vertices.data(),
+                                              packed.vertex_size,
+                                              packed.attr_offsets[0],
+                                              packed.n_vertices,
+                                              packed.indices.data(),
+                                              packed.index_type,
+                                              packed.lods[0].first,
+                                              packed.lods[0].count));
+
+        init_cube_mesh_streams(mesh, max_instances);
+
+        return mesh;
+}
+
+/*
+ * As init_cube_mesh, for the meshes of a scene file: part i is the scene's
+ * mesh i, all in one vertex and one index buffer uploaded from the
+ * mapping, which the cube_mesh owns.
+ */
+static cube_mesh
+init_cube_mesh_scene(draw_strategy strategy,
+                     const scene_file& scene,
+                     size_t max_instances,
+                     bool texture_arrays = false)
+{
+        const scene_file_header& header = *scene.header;
+        cube_mesh mesh;
+        mesh.strategy = strategy;
+        mesh.VAO = init_scene_VAO(scene, mesh.buffers);
+        mesh.index_type = header.index_type;
+        mesh.n_indices = header.n_indices;
+        mesh.packed_size = header.sections[SCENE_VERTICES].size +
+                           header.sections[SCENE_INDICES].size;
+        mesh.n_vertices = header.n_vertices;
+        mesh.texture_arrays = texture_arrays;
+        const scene_mesh *meshes = scene_section_data<scene_mesh>(scene, SCENE_MESHES);
+        const scene_lod *scene_lods = scene_section_data<scene_lod>(scene, SCENE_LODS);
+        for (uint32_t i = 0; i < header.n_meshes; ++i) {
+                std::vector<cube_lod> lods;
+                for (uint32_t l = 0; l < meshes[i].n_lods; ++l) {
+                        const scene_lod& lod = scene_lods[meshes[i].first_lod + l];
+                        lods.push_back({{GL_TRIANGLES,
+                                         mesh.index_type,
+                                         lod.n_indices,
+                                         lod.first_index,
+                                         meshes[i].base_vertex},
+                                        lod.error});
+                }
+                // a mesh whose positions aren't floats occludes nothing
+                occluder_mesh occluder;
+                if ((header.attrs[0].format == MESH_FLOAT) && (header.attrs[0].size == 3))
+                        occluder = cube_part_occluder(
+                                scene_section_data<uint8_t>(scene, SCENE_VERTICES) +
+                                (size_t)meshes[i].base_vertex * header.vertex_size,
+                                header.vertex_size,
+                                header.attrs[0].offset,
+                                meshes[i].n_vertices,
+                                scene_section_data<uint8_t>(scene, SCENE_INDICES),
+                                header.index_type,
+                                meshes[i].first_index,
+                                meshes[i].n_indices);
+                cube_mesh_add_part(mesh, lods, meshes[i].radius, std::move(occluder));
+        }
+
+        init_cube_mesh_streams(mesh, max_instances);
+
+        return mesh;
+}
+
+static void
+destroy_cube_mesh(cube_mesh& mesh)
+{
+        state_delete_vertex_arrays(1, &mesh.VAO);
+        if (mesh.buffers[0] != 0)
+                state_delete_buffers(2, mesh.buffers);
+        if (mesh.instances.buffer != 0)
+                destroy_stream_buffer(mesh.instances);
+        if (mesh.layers.buffer != 0)
+                destroy_stream_buffer(mesh.layers);
+        if (mesh.indirect_buffer != 0)
+                state_delete_buffers(1, &mesh.indirect_buffer);
+        if (mesh.lod_commands.buffer != 0)
+                destroy_stream_buffer(mesh.lod_commands);
+        destroy_draw_queue(mesh.queue);
+        mesh = cube_mesh();
+}
+
+struct scene_uniforms {
+        uniform<glm::mat4> model;
+        uniform<float> alpha;
+};
+
+/*
+ * Resolves the handles used by the render loop and sets the uniforms that
+ * only change on input. Run again whenever the program is reloaded.
+ */
+static scene_uniforms
+init_scene_uniforms(const shader_program& program, float alpha)
+{
+        scene_uniforms uniforms;
+        uniforms.model = get_uniform<glm::mat4>(program, "model");
+        uniforms.alpha = get_uniform<float>(program, "alpha");
+
+        state_use_program(program.id);
+        set_uniform(get_uniform<int32_t>(program, "texture1"), 0);
+        set_uniform(get_uniform<int32_t>(program, "texture2"), 1);
+        set_uniform(uniforms.alpha, alpha);
+
+        return uniforms;
+}
+
+static void
+bind_cube_material(const cube_material& material)
+{
+        state_bind_texture(0, material.target, material.textures[0]);
+        state_bind_texture(1, material.target, material.textures[1]);
+}
+
+// the entry of materials field cube i draws with
+static uint32_t
+cube_material_index(const cube_mesh& mesh,
+                    const cube_field& field,
+                    uint32_t i,
+                    size_t n_materials)
+{
+        return mesh.texture_arrays ? 0 : field.material[i] % n_materials;
+}
+
+// the entry of the mesh's parts field cube i draws
+static uint32_t
+cube_part_index(const cube_field& field, uint32_t i)
+{
+        return (field.mesh != NULL) ? field.mesh[i] : 0;
+}
+
+// the index range field cube i draws: its part, at its LOD
+static const draw_range&
+cube_draw_range(const cube_mesh& mesh, const cube_field& field, uint32_t i)
+{
+        uint32_t part = cube_part_index(field, i);
+        if (mesh.instance_lods.empty())
+                return mesh.parts[part];
+
+        return mesh.lods[part][mesh.instance_lods[i]].range;
+}
+
+/*
+ * Occlusion culling of the frustum-culled cubes against one another
+ * (occlusion.hpp). The cubes that look biggest are drawn into the
+ * occlusion buffer, at most CUBE_MAX_OCCLUDERS of them, and the bounding
+ * box of every visible cube is then tested against its pyramid. Everything
+ * is on the CPU and from this frame's matrices, so there is no readback
+ * and no frame of lag.
+ */
+struct cube_occluder {
+        float pixels;
+        uint32_t cube;
+        uint32_t packed;
+};
+
+struct cube_occlusion {
+        occlusion_buffer buffer;
+        std::vector<cube_occluder> occluders;
+        // per packed cube, whether it passed
+        std::vector<uint8_t> passed;
+        std::vector<cull_range> survivors;
+        // last frame
+        size_t tested = 0;
+        size_t occluded = 0;
+};
+
+static void
+init_cube_occlusion(cube_occlusion& occlusion)
+{
+        occlusion = cube_occlusion();
+        init_occlusion_buffer(occlusion.buffer);
+}
+
+/*
+ * Culls the n_visible cubes update_cubes left that are hidden behind
+ * others. The survivors keep their order: models is compacted in place
+ * and visible rewritten to their runs, so every draw strategy, the
+ * indirect ones included, submits just them. Returns how many survive.
+ */
+static size_t
+occlude_cubes(job_system& jobs,
+              cube_occlusion& occlusion,
+              const cube_mesh& mesh,
+              const cube_field& field,
+              std::vector<cull_range>& visible,
+              glm::mat4 *models,
+              size_t n_visible,
+              const glm::mat4& projection,
+              const glm::mat4& view)
+{
+        PROFILE_SCOPE("occlusion");
+        occlusion_buffer& buffer = occlusion.buffer;
+        occlusion_clear(buffer);
+        occlusion.tested = n_visible;
+        occlusion.occluded = 0;
+        if (n_visible == 0)
+                return 0;
+
+        // the biggest on screen make the best occluders
+        glm::vec4 view_z(view[0][2], view[1][2], view[2][2], view[3][2]);
+        float pixels = 0.5f * buffer.height * projection[1][1];
+        occlusion.occluders.clear();
+        for (const cull_range& run : visible) {
+                for (uint32_t i = run.begin; i < run.end; ++i) {
+                        uint32_t packed = run.packed + i - run.begin;
+                        float radius = mesh.radii[cube_part_index(field, i)];
+                        float depth = -glm::dot(view_z, models[packed][3]);
+                        if (depth <= radius)
+                                continue;
+                        float size = radius * pixels / depth;
+                        if (size >= CUBE_MIN_OCCLUDER_PIXELS)
+                                occlusion.occluders.push_back({size, i, packed});
+                }
+        }
+        size_t n_occluders = std::min<size_t>(occlusion.occluders.size(), CUBE_MAX_OCCLUDERS);
+        std::partial_sort(occlusion.occluders.begin(),
+                          occlusion.occluders.begin() + n_occluders,
+                          occlusion.occluders.end(),
+                          [](const cube_occluder& a, const cube_occluder& b) {
+                                  return a.pixels > b.pixels;
+                          });
+
+        glm::mat4 view_projection = projection * view;
+        {
+                PROFILE_SCOPE("occluders");
+                for (size_t o = 0; o < n_occluders; ++o) {
+                        const cube_occluder& occluder = occlusion.occluders[o];
+                        occlusion_draw(buffer,
+                                       view_projection * models[occluder.packed],
+                                       mesh.occluders[cube_part_index(field, occluder.cube)]);
+                }
+                occlusion_build_pyramid(buffer);
+        }
+
+        occlusion.passed.resize(n_visible);
+        parallel_for(jobs, 0, visible.size(), CUBE_RUN_CHUNK, [&](size_t begin, size_t end) {
+                for (size_t r = begin; r < end; ++r) {
+                        const cull_range& run = visible[r];
+                        for (uint32_t i = run.begin; i < run.end; ++i) {
+                                float radius = mesh.radii[cube_part_index(field, i)];
+                                glm::vec3 position(field.px[i], field.py[i], field.pz[i]);
+                                aabb box = {position - glm::vec3(radius),
+                                            position + glm::vec3(radius)};
+                                occlusion.passed[run.packed + i - run.begin] =
+                                        occlusion_test(buffer, view_projection, box);
+                        }
+                }
+        });
+
+        // compact the survivors, joining what stays contiguous into runs
+        occlusion.survivors.clear();
+        size_t n_passed = 0;
+        for (const cull_range& run : visible) {
+                for (uint32_t i = run.begin; i < run.end; ++i) {
+                        uint32_t packed = run.packed + i - run.begin;
+                        if (!occlusion.passed[packed])
+                                continue;
+                        models[n_passed] = models[packed];
+                        if (!occlusion.survivors.empty() &&
+                            (occlusion.survivors.back().end == i))
+                                ++occlusion.survivors.back().end;
+                        else
+                                occlusion.survivors.push_back({i, i + 1, (uint32_t)n_passed});
+                        ++n_passed;
+                }
+        }
+        visible.swap(occlusion.survivors);
+        occlusion.occluded = n_visible - n_passed;
+
+        return n_passed;
+}
+
+/*
+ * LOD selection. A cube draws the coarsest LOD whose error, projected to
+ * the screen at the cube's view depth, is within threshold pixels; the
+ * error being how far the LOD strays from the full mesh, that is the
+ * screen-space size of the detail it drops. A cube only moves to a
+ * coarser LOD once it is within (1 - hysteresis) * threshold, so one
+ * sitting at a boundary doesn't pop back and forth every frame.
+ */
+struct cube_lod_options {
+        float threshold = 1.0f;
+        float hysteresis = 0.25f;
+};
+
+// triangles of the visible cubes, as drawn and at full detail
+struct cube_lod_stats {
+        size_t triangles = 0;
+        size_t full_triangles = 0;
+};
+
+/*
+ * Picks the LOD of every visible cube into mesh.instance_lods, starting
+ * from each one's previous pick; the models are the packed matrices
+ * update_cubes built. pixels is the viewport's height in pixels times
+ * projection[1][1] / 2, what a unit at depth 1 spans. The instanced
+ * strategy draws one index range for every cube and keeps to LOD 0,
+ * which its stats count.
+ */
+static cube_lod_stats
+select_cube_lods(job_system& jobs,
+                 cube_mesh& mesh,
+                 const cube_field& field,
+                 const std::vector<cull_range>& visible,
+                 const glm::mat4 *models,
+                 const glm::mat4& view,
+                 float pixels,
+                 const cube_lod_options& options)
+{
+        PROFILE_SCOPE("lod select");
+        if (mesh.strategy == DRAW_INSTANCED) {
+                mesh.instance_lods.clear();
+                cube_lod_stats stats;
+                for (const cull_range& run : visible)
+                        stats.triangles += (size_t)(run.end - run.begin) * (mesh.parts[0].count / 3);
+                stats.full_triangles = stats.triangles;
+                return stats;
+        }
+        if (mesh.instance_lods.size() != field.count)
+                mesh.instance_lods.assign(field.count, 0);
+
+        glm::vec4 view_z(view[0][2], view[1][2], view[2][2], view[3][2]);
+        float coarsen = options.threshold * (1.0f - options.hysteresis);
+        std::atomic<size_t> triangles(0);
+        std::atomic<size_t> full_triangles(0);
+        parallel_for(jobs, 0, visible.size(), CUBE_RUN_CHUNK, [&](size_t begin, size_t end) {
+                size_t drawn = 0;
+                size_t full = 0;
+                for (size_t r = begin; r < end; ++r) {
+                        const cull_range& run = visible[r];
+                        for (uint32_t i = run.begin; i < run.end; ++i) {
+                                uint32_t part = cube_part_index(field, i);
+                                const std::vector<cube_lod>& lods = mesh.lods[part];
+                                float depth = -glm::dot(view_z,
+                                                        models[run.packed + i - run.begin][3]);
+                                uint32_t lod = 0;
+                                // close enough to clip the camera, full detail
+                                if (depth > mesh.radii[part]) {
+                                        float scale = pixels / depth;
+                                        lod = std::min<uint32_t>(mesh.instance_lods[i],
+                                                                 lods.size() - 1);
+                                        while ((lod > 0) &&
+                                               (lods[lod].error * scale > options.threshold))
+                                                --lod;
+                                        while ((lod + 1 < lods.size()) &&
+                                               (lods[lod + 1].error * scale <= coarsen))
+                                                ++lod;
+                                }
+                                mesh.instance_lods[i] = lod;
+                                drawn += lods[lod].range.count / 3;
+                                full += lods[0].range.count / 3;
+                        }
+                }
+                triangles += drawn;
+                full_triangles += full;
+        });
+
+        cube_lod_stats stats;
+        stats.triangles = triangles;
+        stats.full_triangles = full_triangles;
+
+        return stats;
+}
+
+/*
+ * Streams this frame's n_visible matrices into the mesh's instance stream,
+ * and with texture arrays each visible cube's layer into the layer stream,
+ * in the same packed order. False if either stream could not be written,
+ * and the cubes must not be drawn this frame.
+ */
+static bool
+stream_cube_instances(cube_mesh& mesh,
+                      const cube_field& field,
+                      const std::vector<cull_range>& visible,
+                      const glm::mat4 *models,
+                      size_t n_visible)
+{
+        stream_buffer_next_frame(mesh.instances);
+        void *dst = stream_buffer_alloc(mesh.instances,
+                                        n_visible * sizeof(glm::mat4),
+                                        sizeof(glm::mat4),
+                                        &mesh.instance_offset);
+        if (dst == NULL)
+                return false;
+        memcpy(dst, models, n_visible * sizeof(glm::mat4));
+        stream_buffer_unmap(mesh.instances);
+        if (!mesh.texture_arrays)
+                return true;
+
+        stream_buffer_next_frame(mesh.layers);
+        uint32_t *layers = (uint32_t*)stream_buffer_alloc(mesh.layers,
+                                                          n_visible * sizeof(uint32_t),
+                                                          sizeof(uint32_t),
+                                                          &mesh.layer_offset);
+        if (layers == NULL)
+                return false;
+        for (const cull_range& run : visible)
+                for (uint32_t i = run.begin; i < run.end; ++i)
+                        layers[run.packed + i - run.begin] = field.material[i];
+        stream_buffer_unmap(mesh.layers);
+        return true;
+}
+
+/*
+ * Points the bound VAO's instance attributes at this frame's instance
+ * first_instance onwards; data is the cube_mesh. The draw queue's
+ * bind_instances.
+ */
+static void
+bind_cube_instances(void *data, uint32_t first_instance)
+{
+        const cube_mesh& mesh = *(const cube_mesh*)data;
+        bind_instance_mat4_attr(2,
+                                mesh.instances.buffer,
+                                mesh.instance_offset + first_instance * sizeof(glm::mat4));
+        if (!mesh.texture_arrays)
+                return;
+
+        state_bind_buffer(GL_ARRAY_BUFFER, mesh.layers.buffer);
+        glVertexAttribIPointer(CUBE_MATERIAL_ATTR,
+                               1,
+                               GL_UNSIGNED_INT,
+                               sizeof(uint32_t),
+                               (void*)(mesh.layer_offset + first_instance * sizeof(uint32_t)));
+        glEnableVertexAttribArray(CUBE_MATERIAL_ATTR);
+        glVertexAttribDivisor(CUBE_MATERIAL_ATTR, 1);
+}
+
+// draws count instances of one part, starting at the packed instance first
+static void
+draw_cube_run(cube_mesh& mesh, const draw_range& part, uint32_t first, uint32_t count)
+{
+        bind_cube_instances(&mesh, first);
+        size_t offset = part.first * draw_index_size(part.index_type);
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES,
+                                          part.count,
+                                          part.index_type,
+                                          (void*)offset,
+                                          count,
+                                          part.base_vertex);
+}
+
+/*
+ * Records every visible cube into the mesh's draw queue, keyed by its
+ * material and view depth, with its matrix as its instance, then sorts
+ * and submits the queue.
+ */
+static void
+queue_cubes(cube_mesh& mesh,
+            uint32_t program,
+            const std::vector<cube_material>& materials,
+            const cube_field& field,
+            const std::vector<cull_range>& visible,
+            const glm::mat4 *models,
+            size_t n_visible,
+            const glm::mat4& view)
+{
+        draw_queue& queue = mesh.queue;
+        draw_queue_reset(queue);
+        if (!stream_cube_instances(mesh, field, visible, models, n_visible)) {
+                // nothing drawn, but the queue's counts still say so
+                draw_queue_submit(queue);
+                return;
+        }
+        queue.bind_instances = bind_cube_instances;
+        queue.bind_instances_data = &mesh;
+
+        mesh.material_states.clear();
+        for (const cube_material& material : materials)
+                mesh.material_states.push_back(draw_queue_state(queue,
+                                                                DRAW_PASS_OPAQUE,
+                                                                program,
+                                                                material.target,
+                                                                material.textures,
+                                                                2,
+                                                                mesh.VAO));
+
+        {
+                PROFILE_SCOPE("draw record");
+                glm::vec4 view_z(view[0][2], view[1][2], view[2][2], view[3][2]);
+                for (const cull_range& run : visible) {
+                        for (uint32_t i = run.begin; i < run.end; ++i) {
+                                uint32_t packed = run.packed + i - run.begin;
+                                uint32_t material = cube_material_index(mesh,
+                                                                        field,
+                                                                        i,
+                                                                        materials.size());
+                                float depth = -glm::dot(view_z, models[packed][3]);
+                                draw_queue_push(queue,
+                                                mesh.material_states[material],
+                                                depth / CUBE_FAR_PLANE,
+                                                cube_draw_range(mesh, field, i),
+                                                packed);
+                        }
+                }
+        }
+        draw_queue_submit(queue);
+}
+
+/*
+ * Submits the n_visible packed model matrices the way the mesh's strategy
+ * says, visible being the runs of the field they were built from. Binds
+ * program, the mesh and the materials itself.
+ */
+static void
+draw_cubes(cube_mesh& mesh,
+           const scene_uniforms& uniforms,
+           uint32_t program,
+           const std::vector<cube_material>& materials,
+           const cube_field& field,
+           const std::vector<cull_range>& visible,
+           const glm::mat4 *models,
+           size_t n_visible,
+           const glm::mat4& view)
+{
+        if (mesh.strategy == DRAW_QUEUE) {
+                if (n_visible > 0)
+                        queue_cubes(mesh, program, materials, field, visible, models, n_visible, view);
+                return;
+        }
+
+        state_use_program(program);
+        state_bind_vertex_array(mesh.VAO);
+        if (mesh.strategy == DRAW_PER_OBJECT) {
+                // in cull order, switching material whenever the cube's differs
+                for (const cull_range& run : visible) {
+                        for (uint32_t i = run.begin; i < run.end; ++i) {
+                                uint32_t packed = run.packed + i - run.begin;
+                                uint32_t material = cube_material_index(mesh,
+                                                                        field,
+                                                                        i,
+                                                                        materials.size());
+                                bind_cube_material(materials[material]);
+                                // the layer as a constant attribute, the
+                                // array is not enabled
+                                if (mesh.texture_arrays)
+                                        glVertexAttribI4ui(CUBE_MATERIAL_ATTR,
+                                                           field.material[i],
+                                                           0,
+                                                           0,
+                                                           0);
+                                set_uniform(uniforms.model, models[packed]);
+                                const draw_range& part = cube_draw_range(mesh, field, i);
+                                size_t offset = part.first * draw_index_size(part.index_type);
+                                glDrawElementsBaseVertex(GL_TRIANGLES,
+                                                         part.count,
+                                                         part.index_type,
+                                                         (void*)offset,
+                                                         part.base_vertex);
+                        }
+                }
+                return;
+        }
+        if (n_visible == 0)
+                return;
+
+        // this frame's matrices go in the stream's next region, and the
+        // instance attribute follows them there
+        bind_cube_material(materials[0]);
+        if (!stream_cube_instances(mesh, field, visible, models, n_visible))
+                return;
+        bind_cube_instances(&mesh, 0);
+        if (mesh.strategy == DRAW_INSTANCED) {
+                const draw_range& part = mesh.parts[0];
+                size_t offset = part.first * draw_index_size(part.index_type);
+                glDrawElementsInstancedBaseVertex(GL_TRIANGLES,
+                                                  part.count,
+                                                  part.index_type,
+                                                  (void*)offset,
+                                                  n_visible,
+                                                  part.base_vertex);
+                return;
+        }
+
+        // the commands never change, only how many of them are drawn,
+        // unless the cubes pick LODs
+        if (mesh.instance_lods.empty() || (mesh.lod_commands.buffer == 0)) {
+                state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, mesh.indirect_buffer);
+                glMultiDrawElementsIndirect(GL_TRIANGLES, mesh.index_type, NULL, n_visible, 0);
+                return;
+        }
+
+        stream_buffer_next_frame(mesh.lod_commands);
+        size_t offset = 0;
+        draw_elements_indirect *commands =
+                (draw_elements_indirect*)stream_buffer_alloc(mesh.lod_commands,
+                                                             n_visible *
+                                                             sizeof(draw_elements_indirect),
+                                                             4,
+                                                             &offset);
+        if (commands == NULL) {
+                // no room for the commands: one instanced draw per run of
+                // cubes that picked the same LOD, the instances rebound at
+                // the run's first
+                const draw_range *part = NULL;
+                uint32_t first = 0;
+                uint32_t count = 0;
+                for (const cull_range& run : visible) {
+                        for (uint32_t i = run.begin; i < run.end; ++i) {
+                                const draw_range *range = &cube_draw_range(mesh, field, i);
+                                if (range == part) {
+                                        ++count;
+                                        continue;
+                                }
+                                if (count != 0)
+                                        draw_cube_run(mesh, *part, first, count);
+                                part = range;
+                                first = run.packed + i - run.begin;
+                                count = 1;
+                        }
+                }
+                if (count != 0)
+                        draw_cube_run(mesh, *part, first, count);
+                return;
+        }
+        for (const cull_range& run : visible) {
+                for (uint32_t i = run.begin; i < run.end; ++i) {
+                        uint32_t packed = run.packed + i - run.begin;
+                        const draw_range& range = cube_draw_range(mesh, field, i);
+                        commands[packed] = {range.count, 1, range.first, range.base_vertex, packed};
+                }
+        }
+        stream_buffer_unmap(mesh.lod_commands);
+        state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, mesh.lod_commands.buffer);
+        glMultiDrawElementsIndirect(GL_TRIANGLES,
+                                    mesh.index_type,
+                                    (void*)offset,
+                                    n_visible,
+                                    0);
+}
+
+#endif /* _LEARN_GL_COORDSYSTEMS_SCENE_H_ */
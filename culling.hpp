@@ -0,0 +1,422 @@
+#ifndef _LEARN_GL_CULLING_H_
+#define _LEARN_GL_CULLING_H_
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * View frustum as six inward-facing planes (xyz normal, w distance), in
+ * the space the matrix it was extracted from maps out of.
+ */
+struct frustum {
+        glm::vec4 planes[6];
+};
+
+/*
+ * Gribb/Hartmann plane extraction: for a (view-)projection matrix the clip
+ * planes are sums/differences of its fourth row with the other rows.
+ */
+static frustum
+frustum_from_matrix(const glm::mat4& m)
+{
+        glm::vec4 row[4];
+        for (int32_t r = 0; r < 4; ++r)
+                row[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+
+        frustum f;
+        f.planes[0] = row[3] + row[0];  // left
+        f.planes[1] = row[3] - row[0];  // right
+        f.planes[2] = row[3] + row[1];  // bottom
+        f.planes[3] = row[3] - row[1];  // top
+        f.planes[4] = row[3] + row[2];  // near
+        f.planes[5] = row[3] - row[2];  // far
+        for (glm::vec4& plane : f.planes)
+                plane = plane / glm::length(glm::vec3(plane.x, plane.y, plane.z));
+
+        return f;
+}
+
+/*
+ * Tests four AABBs, given as SoA bounds, against the frustum at once. Bit i
+ * of visible is set if box i is at least partly inside, bit i of inside if
+ * it is wholly inside. Only the low n bits are meaningful.
+ *
+ * Per plane only the box corner furthest along the normal (the p-vertex)
+ * can be in front of it and the nearest (n-vertex) behind it; both are
+ * picked per axis from the sign of the normal, the same for all four boxes.
+ */
+static void
+frustum_test_aabb4(const frustum& f,
+                   const float *min_x,
+                   const float *min_y,
+                   const float *min_z,
+                   const float *max_x,
+                   const float *max_y,
+                   const float *max_z,
+                   uint32_t n,
+                   uint32_t& visible,
+                   uint32_t& inside)
+{
+        uint32_t outside_mask = 0;
+        uint32_t partial_mask = 0;
+#if defined(__SSE2__)
+        __m128 zero = _mm_setzero_ps();
+        __m128 outside = zero;
+        __m128 partial = zero;
+        for (const glm::vec4& plane : f.planes) {
+                __m128 nx = _mm_set1_ps(plane.x);
+                __m128 ny = _mm_set1_ps(plane.y);
+                __m128 nz = _mm_set1_ps(plane.z);
+                __m128 w = _mm_set1_ps(plane.w);
+                __m128 far_d = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(plane.x > 0.0f ? max_x : min_x)),
+                                   _mm_mul_ps(ny, _mm_loadu_ps(plane.y > 0.0f ? max_y : min_y))),
+                        _mm_add_ps(_mm_mul_ps(nz, _mm_loadu_ps(plane.z > 0.0f ? max_z : min_z)),
+                                   w));
+                __m128 near_d = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(plane.x > 0.0f ? min_x : max_x)),
+                                   _mm_mul_ps(ny, _mm_loadu_ps(plane.y > 0.0f ? min_y : max_y))),
+                        _mm_add_ps(_mm_mul_ps(nz, _mm_loadu_ps(plane.z > 0.0f ? min_z : max_z)),
+                                   w));
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(far_d, zero));
+                partial = _mm_or_ps(partial, _mm_cmplt_ps(near_d, zero));
+        }
+        outside_mask = _mm_movemask_ps(outside);
+        partial_mask = _mm_movemask_ps(partial);
+#else
+        for (uint32_t i = 0; i < n; ++i) {
+                for (const glm::vec4& plane : f.planes) {
+                        float far_d = plane.x * (plane.x > 0.0f ? max_x[i] : min_x[i]) +
+                                      plane.y * (plane.y > 0.0f ? max_y[i] : min_y[i]) +
+                                      plane.z * (plane.z > 0.0f ? max_z[i] : min_z[i]) +
+                                      plane.w;
+                        float near_d = plane.x * (plane.x > 0.0f ? min_x[i] : max_x[i]) +
+                                       plane.y * (plane.y > 0.0f ? min_y[i] : max_y[i]) +
+                                       plane.z * (plane.z > 0.0f ? min_z[i] : max_z[i]) +
+                                       plane.w;
+                        if (far_d < 0.0f)
+                                outside_mask |= 1u << i;
+                        if (near_d < 0.0f)
+                                partial_mask |= 1u << i;
+                }
+        }
+#endif
+        uint32_t valid = (1u << n) - 1;
+        visible = ~outside_mask & valid;
+        inside = visible & ~partial_mask;
+}
+
+struct aabb {
+        glm::vec3 min;
+        glm::vec3 max;
+};
+
+#define BVH_WIDTH 4
+// ranges of at most this many objects become leaves
+#define BVH_LEAF_SIZE 16
+
+/*
+ * Four-wide BVH node. Child bounds are stored SoA so all children are
+ * culled with one frustum_test_aabb4.
+ */
+struct bvh_node {
+        float min_x[BVH_WIDTH];
+        float min_y[BVH_WIDTH];
+        float min_z[BVH_WIDTH];
+        float max_x[BVH_WIDTH];
+        float max_y[BVH_WIDTH];
+        float max_z[BVH_WIDTH];
+        // index of an inner child node, -1 for a leaf
+        int32_t child[BVH_WIDTH];
+        // the objects under each child, as a range in tree order
+        uint32_t begin[BVH_WIDTH];
+        uint32_t end[BVH_WIDTH];
+        uint32_t n_children;
+};
+
+/*
+ * Bounding volume hierarchy over static object bounds. Building it sorts
+ * the objects so every subtree covers a contiguous range; order maps that
+ * tree order back to the caller's indices, and callers are expected to
+ * store their per-object data in tree order so that culling results are
+ * runs of consecutive objects.
+ */
+struct bvh {
+        std::vector<bvh_node> nodes;
+        std::vector<uint32_t> order;
+
+        // object bounds in tree order, padded to a multiple of four
+        std::vector<float> min_x;
+        std::vector<float> min_y;
+        std::vector<float> min_z;
+        std::vector<float> max_x;
+        std::vector<float> max_y;
+        std::vector<float> max_z;
+};
+
+/*
+ * What culling reads of a bvh, without owning it: a built tree, or one
+ * mapped from a scene file (scene_file.hpp), which stores the same arrays.
+ */
+struct bvh_view {
+        const bvh_node *nodes = NULL;
+        size_t n_nodes = 0;
+        const float *min_x = NULL;
+        const float *min_y = NULL;
+        const float *min_z = NULL;
+        const float *max_x = NULL;
+        const float *max_y = NULL;
+        const float *max_z = NULL;
+
+        bvh_view() = default;
+        bvh_view(const bvh& tree)
+                : nodes(tree.nodes.data()),
+                  n_nodes(tree.nodes.size()),
+                  min_x(tree.min_x.data()),
+                  min_y(tree.min_y.data()),
+                  min_z(tree.min_z.data()),
+                  max_x(tree.max_x.data()),
+                  max_y(tree.max_y.data()),
+                  max_z(tree.max_z.data())
+        {
+        }
+};
+
+/*
+ * Visible objects [begin, end) in tree order, which land at
+ * [packed, packed + end - begin) once the visible set is packed.
+ */
+struct cull_range {
+        uint32_t begin;
+        uint32_t end;
+        uint32_t packed;
+};
+
+static aabb
+bvh_range_bounds(const bvh& tree, const aabb *bounds, uint32_t begin, uint32_t end)
+{
+        aabb box = bounds[tree.order[begin]];
+        for (uint32_t i = begin + 1; i < end; ++i) {
+                box.min = glm::min(box.min, bounds[tree.order[i]].min);
+                box.max = glm::max(box.max, bounds[tree.order[i]].max);
+        }
+
+        return box;
+}
+
+// partitions [begin, end) at the median centroid along its longest axis
+static uint32_t
+bvh_split(bvh& tree, const glm::vec3 *centers, uint32_t begin, uint32_t end)
+{
+        glm::vec3 lo = centers[tree.order[begin]];
+        glm::vec3 hi = lo;
+        for (uint32_t i = begin + 1; i < end; ++i) {
+                lo = glm::min(lo, centers[tree.order[i]]);
+                hi = glm::max(hi, centers[tree.order[i]]);
+        }
+        glm::vec3 extent = hi - lo;
+        int32_t axis = (extent.x > extent.y) ? 0 : 1;
+        if (extent.z > extent[axis])
+                axis = 2;
+
+        uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(tree.order.begin() + begin,
+                         tree.order.begin() + mid,
+                         tree.order.begin() + end,
+                         [&](uint32_t a, uint32_t b) {
+                                 return centers[a][axis] < centers[b][axis];
+                         });
+
+        return mid;
+}
+
+static int32_t
+bvh_build_node(bvh& tree,
+               const aabb *bounds,
+               const glm::vec3 *centers,
+               uint32_t begin,
+               uint32_t end)
+{
+        // halve the range, then halve the halves, for up to four children
+        uint32_t ranges[BVH_WIDTH][2] = {{begin, end}};
+        uint32_t n = 1;
+        for (int32_t pass = 0; pass < 2; ++pass) {
+                for (uint32_t i = n; i-- > 0; ) {
+                        uint32_t b = ranges[i][0];
+                        uint32_t e = ranges[i][1];
+                        if (e - b <= BVH_LEAF_SIZE)
+                                continue;
+
+                        uint32_t mid = bvh_split(tree, centers, b, e);
+                        for (uint32_t j = n; j > i + 1; --j) {
+                                ranges[j][0] = ranges[j - 1][0];
+                                ranges[j][1] = ranges[j - 1][1];
+                        }
+                        ranges[i][1] = mid;
+                        ranges[i + 1][0] = mid;
+                        ranges[i + 1][1] = e;
+                        ++n;
+                }
+        }
+
+        int32_t index = tree.nodes.size();
+        tree.nodes.push_back(bvh_node());
+        tree.nodes[index].n_children = n;
+        for (uint32_t i = 0; i < BVH_WIDTH; ++i) {
+                uint32_t b = (i < n) ? ranges[i][0] : 0;
+                uint32_t e = (i < n) ? ranges[i][1] : 0;
+                aabb box = {glm::vec3(0.0f), glm::vec3(0.0f)};
+                int32_t child = -1;
+                if (i < n) {
+                        box = bvh_range_bounds(tree, bounds, b, e);
+                        if (e - b > BVH_LEAF_SIZE)
+                                child = bvh_build_node(tree, bounds, centers, b, e);
+                }
+
+                // the recursion may have reallocated nodes
+                bvh_node& node = tree.nodes[index];
+                node.min_x[i] = box.min.x;
+                node.min_y[i] = box.min.y;
+                node.min_z[i] = box.min.z;
+                node.max_x[i] = box.max.x;
+                node.max_y[i] = box.max.y;
+                node.max_z[i] = box.max.z;
+                node.child[i] = child;
+                node.begin[i] = b;
+                node.end[i] = e;
+        }
+
+        return index;
+}
+
+static void
+bvh_build(bvh& tree, const aabb *bounds, size_t count)
+{
+        tree.nodes.clear();
+        tree.order.resize(count);
+        for (size_t i = 0; i < count; ++i)
+                tree.order[i] = i;
+
+        std::vector<glm::vec3> centers(count);
+        for (size_t i = 0; i < count; ++i)
+                centers[i] = 0.5f * (bounds[i].min + bounds[i].max);
+
+        if (count > 0)
+                bvh_build_node(tree, bounds, centers.data(), 0, count);
+
+        // 3 floats of padding so the last group of four can always be loaded
+        size_t padded = count + 3;
+        tree.min_x.assign(padded, 0.0f);
+        tree.min_y.assign(padded, 0.0f);
+        tree.min_z.assign(padded, 0.0f);
+        tree.max_x.assign(padded, 0.0f);
+        tree.max_y.assign(padded, 0.0f);
+        tree.max_z.assign(padded, 0.0f);
+        for (size_t i = 0; i < count; ++i) {
+                const aabb& box = bounds[tree.order[i]];
+                tree.min_x[i] = box.min.x;
+                tree.min_y[i] = box.min.y;
+                tree.min_z[i] = box.min.z;
+                tree.max_x[i] = box.max.x;
+                tree.max_y[i] = box.max.y;
+                tree.max_z[i] = box.max.z;
+        }
+}
+
+static void
+cull_emit(std::vector<cull_range>& visible, uint32_t begin, uint32_t end)
+{
+        if (!visible.empty() && (visible.back().end == begin)) {
+                visible.back().end = end;
+                return;
+        }
+
+        uint32_t packed = 0;
+        if (!visible.empty())
+                packed = visible.back().packed + visible.back().end - visible.back().begin;
+        visible.push_back({begin, end, packed});
+}
+
+static void
+bvh_cull_leaf(const bvh_view& tree,
+              const frustum& f,
+              uint32_t begin,
+              uint32_t end,
+              std::vector<cull_range>& visible)
+{
+        for (uint32_t i = begin; i < end; i += 4) {
+                uint32_t vis;
+                uint32_t inside;
+                frustum_test_aabb4(f,
+                                   &tree.min_x[i],
+                                   &tree.min_y[i],
+                                   &tree.min_z[i],
+                                   &tree.max_x[i],
+                                   &tree.max_y[i],
+                                   &tree.max_z[i],
+                                   std::min<uint32_t>(4, end - i),
+                                   vis,
+                                   inside);
+                for (uint32_t j = 0; vis != 0; ++j, vis >>= 1)
+                        if (vis & 1)
+                                cull_emit(visible, i + j, i + j + 1);
+        }
+}
+
+static void
+bvh_cull_node(const bvh_view& tree,
+              const frustum& f,
+              int32_t index,
+              std::vector<cull_range>& visible)
+{
+        const bvh_node& node = tree.nodes[index];
+        uint32_t vis;
+        uint32_t inside;
+        frustum_test_aabb4(f,
+                           node.min_x,
+                           node.min_y,
+                           node.min_z,
+                           node.max_x,
+                           node.max_y,
+                           node.max_z,
+                           node.n_children,
+                           vis,
+                           inside);
+
+        for (uint32_t i = 0; i < node.n_children; ++i) {
+                if (!(vis & (1u << i)))
+                        continue;
+
+                if (inside & (1u << i))
+                        cull_emit(visible, node.begin[i], node.end[i]);
+                else if (node.child[i] < 0)
+                        bvh_cull_leaf(tree, f, node.begin[i], node.end[i], visible);
+                else
+                        bvh_cull_node(tree, f, node.child[i], visible);
+        }
+}
+
+/*
+ * Replaces visible with the runs of objects, in tree order, whose bounds
+ * touch the frustum. Subtrees wholly inside are taken without testing
+ * their objects. Returns the number of visible objects.
+ */
+static size_t
+bvh_cull(const bvh_view& tree, const frustum& f, std::vector<cull_range>& visible)
+{
+        visible.clear();
+        if (tree.n_nodes > 0)
+                bvh_cull_node(tree, f, 0, visible);
+
+        if (visible.empty())
+                return 0;
+
+        return visible.back().packed + visible.back().end - visible.back().begin;
+}
+
+#endif /* _LEARN_GL_CULLING_H_ */
@@ -0,0 +1,537 @@
+#ifndef _LEARN_GL_DRAW_QUEUE_H_
+#define _LEARN_GL_DRAW_QUEUE_H_
+
+#include "learngl.hpp"
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <cstring>
+
+/*
+ * Command-bucket renderer. Draws are recorded during the frame rather than
+ * issued where they are built: each is a 64-bit sort key and a small
+ * payload saying what to draw. Once per frame the keys are radix sorted,
+ * so draws sharing a program, texture set and VAO end up next to each
+ * other, opaque ones front to back within that and translucent ones back
+ * to front, and each run of compatible draws goes to the driver as one
+ * glMultiDraw*Indirect call (glMultiDrawElementsBaseVertex/glMultiDrawArrays
+ * or merged instanced draws where indirect drawing is missing).
+ *
+ * Key, from the most significant bit:
+ *   opaque:      pass 4 | program 10 | texture set 12 | VAO 10 | depth 24 | 4
+ *   translucent: pass 4 | far-to-near depth 24 | program 10 | textures 12 | VAO 10 | 4
+ * Programs, texture sets and VAOs get small ids in the order the queue
+ * first sees them; past what a field holds they share its last value,
+ * which only costs sorting quality, as batching compares the payloads.
+ *
+ * Per-draw data (the model matrix, a material layer) is reached through
+ * baseInstance into instanced attributes the caller streams. The caller's
+ * bind_instances points the attributes of every VAO the queue switches to
+ * there, and without baseInstance is asked to offset them per draw.
+ */
+
+#define DRAW_MAX_TEXTURES 4
+#define DRAW_KEY_PROGRAM_BITS 10
+#define DRAW_KEY_TEXTURES_BITS 12
+#define DRAW_KEY_VAO_BITS 10
+#define DRAW_KEY_DEPTH_BITS 24
+// base_instance of draws without per-instance data
+#define DRAW_NO_INSTANCE UINT32_MAX
+
+enum draw_pass {
+        DRAW_PASS_OPAQUE,
+        DRAW_PASS_TRANSLUCENT,
+};
+
+// what a draw binds, as returned by draw_queue_state
+struct draw_state {
+        uint32_t pass;
+        uint32_t program;
+        uint32_t VAO;
+        uint32_t texture_set;
+        // program, texture set and VAO ids, packed as they go in the key
+        uint32_t bits;
+};
+
+// what a draw draws; index_type 0 for glDrawArrays
+struct draw_range {
+        GLenum mode;
+        GLenum index_type;
+        uint32_t count;
+        // first index (elements) or vertex (arrays)
+        uint32_t first;
+        int32_t base_vertex;
+};
+
+struct draw_item {
+        draw_state state;
+        draw_range range;
+        uint32_t base_instance;
+        uint32_t instance_count;
+};
+
+struct draw_sort_entry {
+        uint64_t key;
+        uint32_t item;
+};
+
+struct draw_texture_set {
+        GLenum target;
+        uint32_t n;
+        uint32_t textures[DRAW_MAX_TEXTURES];
+};
+
+struct draw_elements_indirect {
+        uint32_t count;
+        uint32_t instance_count;
+        uint32_t first_index;
+        int32_t base_vertex;
+        uint32_t base_instance;
+};
+
+struct draw_arrays_indirect {
+        uint32_t count;
+        uint32_t instance_count;
+        uint32_t first;
+        uint32_t base_instance;
+};
+
+struct draw_queue {
+        std::unordered_map<uint32_t, uint32_t> program_ids;
+        std::unordered_map<uint32_t, uint32_t> VAO_ids;
+        std::unordered_map<uint64_t, uint32_t> texture_set_ids;
+        std::vector<draw_texture_set> texture_sets;
+
+        std::vector<draw_item> items;
+        std::vector<draw_sort_entry> entries;
+        std::vector<draw_sort_entry> scratch;
+
+        // glMultiDraw*Indirect commands, streamed
+        bool indirect = false;
+        stream_buffer commands;
+        std::vector<uint8_t> staging;
+        // glMultiDrawElementsBaseVertex arguments, without indirect drawing
+        std::vector<GLsizei> counts;
+        std::vector<const void*> offsets;
+        std::vector<GLint> firsts;
+        std::vector<GLint> base_vertices;
+
+        // points the bound VAO's per-instance attributes at this frame's
+        // instance first_instance; NULL if draws have no instance data
+        void (*bind_instances)(void *data, uint32_t first_instance) = NULL;
+        void *bind_instances_data = NULL;
+
+        // the last submit: draws recorded, GL draw calls, state changes
+        uint32_t last_draws = 0;
+        uint32_t last_calls = 0;
+        uint32_t last_changes = 0;
+};
+
+// glMultiDraw*Indirect need GL 4.3 or ARB_multi_draw_indirect
+static bool
+multi_draw_indirect_supported(void)
+{
+        return GLAD_GL_VERSION_4_3 || GLAD_GL_ARB_multi_draw_indirect;
+}
+
+// room for max_draws commands a frame to start with; it grows as needed
+static void
+init_draw_queue(draw_queue& queue, size_t max_draws)
+{
+        queue.indirect = multi_draw_indirect_supported();
+        if (queue.indirect)
+                init_stream_buffer(queue.commands,
+                                   GL_DRAW_INDIRECT_BUFFER,
+                                   std::max<size_t>(max_draws, 1) * sizeof(draw_elements_indirect));
+}
+
+static void
+destroy_draw_queue(draw_queue& queue)
+{
+        if (queue.commands.buffer != 0)
+                destroy_stream_buffer(queue.commands);
+        queue = draw_queue();
+}
+
+// the next id of an n_bits wide key field, saturating
+static uint32_t
+draw_key_id(std::unordered_map<uint32_t, uint32_t>& ids, uint32_t name, uint32_t n_bits)
+{
+        auto it = ids.find(name);
+        if (it != ids.end())
+                return it->second;
+
+        uint32_t id = std::min<uint32_t>(ids.size(), (1u << n_bits) - 1);
+        ids.emplace(name, id);
+
+        return id;
+}
+
+static uint32_t
+draw_queue_texture_set(draw_queue& queue, GLenum target, const uint32_t *textures, uint32_t n)
+{
+        draw_texture_set set = {};
+        set.target = target;
+        set.n = std::min<uint32_t>(n, DRAW_MAX_TEXTURES);
+        memcpy(set.textures, textures, set.n * sizeof(uint32_t));
+
+        uint64_t hash = fnv1a_64(&set, sizeof(set));
+        auto it = queue.texture_set_ids.find(hash);
+        if ((it != queue.texture_set_ids.end()) &&
+            (memcmp(&queue.texture_sets[it->second], &set, sizeof(set)) == 0))
+                return it->second;
+
+        // a colliding set is simply never found through the map again
+        uint32_t id = queue.texture_sets.size();
+        queue.texture_sets.push_back(set);
+        queue.texture_set_ids.emplace(hash, id);
+
+        return id;
+}
+
+/*
+ * The state of draws made with program, the n textures on units 0..n-1 of
+ * target and VAO. Cheap enough to call per material per frame, which
+ * keeps reloaded programs right.
+ */
+static draw_state
+draw_queue_state(draw_queue& queue,
+                 draw_pass pass,
+                 uint32_t program,
+                 GLenum target,
+                 const uint32_t *textures,
+                 uint32_t n_textures,
+                 uint32_t VAO)
+{
+        draw_state state;
+        state.pass = pass;
+        state.program = program;
+        state.VAO = VAO;
+        state.texture_set = draw_queue_texture_set(queue, target, textures, n_textures);
+
+        uint32_t texture_id = std::min<uint32_t>(state.texture_set,
+                                                 (1u << DRAW_KEY_TEXTURES_BITS) - 1);
+        state.bits = draw_key_id(queue.program_ids, program, DRAW_KEY_PROGRAM_BITS);
+        state.bits = (state.bits << DRAW_KEY_TEXTURES_BITS) | texture_id;
+        state.bits = (state.bits << DRAW_KEY_VAO_BITS) |
+                     draw_key_id(queue.VAO_ids, VAO, DRAW_KEY_VAO_BITS);
+
+        return state;
+}
+
+// depth in [0, 1], 0 nearest
+static uint64_t
+draw_key(const draw_state& state, float depth)
+{
+        uint64_t max_depth = (1u << DRAW_KEY_DEPTH_BITS) - 1;
+        uint64_t z = std::min(std::max(depth, 0.0f), 1.0f) * max_depth;
+        uint64_t key = (uint64_t)state.pass << 60;
+        if (state.pass == DRAW_PASS_TRANSLUCENT)
+                return key | ((max_depth - z) << 36) | ((uint64_t)state.bits << 4);
+
+        return key | ((uint64_t)state.bits << 28) | (z << 4);
+}
+
+static void
+draw_queue_reset(draw_queue& queue)
+{
+        queue.items.clear();
+        queue.entries.clear();
+        queue.bind_instances = NULL;
+}
+
+static void
+draw_queue_push(draw_queue& queue,
+                const draw_state& state,
+                float depth,
+                const draw_range& range,
+                uint32_t base_instance = DRAW_NO_INSTANCE,
+                uint32_t instance_count = 1)
+{
+        queue.entries.push_back({draw_key(state, depth), (uint32_t)queue.items.size()});
+        queue.items.push_back({state, range, base_instance, instance_count});
+}
+
+/*
+ * LSD radix sort of the keys, a byte at a time. All eight histograms come
+ * from one pass over the keys, and a byte that is the same in every key
+ * (a single pass, or the unused low bits) costs no scatter pass at all.
+ */
+static void
+draw_queue_sort(draw_queue& queue)
+{
+        PROFILE_SCOPE("draw sort");
+        size_t n = queue.entries.size();
+        if (n < 2)
+                return;
+
+        uint32_t histograms[8][256] = {};
+        for (const draw_sort_entry& entry : queue.entries)
+                for (uint32_t byte = 0; byte < 8; ++byte)
+                        ++histograms[byte][(entry.key >> (8 * byte)) & 0xff];
+
+        queue.scratch.resize(n);
+        draw_sort_entry *src = queue.entries.data();
+        draw_sort_entry *dst = queue.scratch.data();
+        for (uint32_t byte = 0; byte < 8; ++byte) {
+                uint32_t *histogram = histograms[byte];
+                if (histogram[(src[0].key >> (8 * byte)) & 0xff] == n)
+                        continue;
+
+                uint32_t sum = 0;
+                for (uint32_t digit = 0; digit < 256; ++digit) {
+                        uint32_t count = histogram[digit];
+                        histogram[digit] = sum;
+                        sum += count;
+                }
+                for (size_t i = 0; i < n; ++i)
+                        dst[histogram[(src[i].key >> (8 * byte)) & 0xff]++] = src[i];
+                std::swap(src, dst);
+        }
+        if (src != queue.entries.data())
+                queue.entries.swap(queue.scratch);
+}
+
+static bool
+draw_compatible(const draw_item& a, const draw_item& b)
+{
+        return (a.state.pass == b.state.pass) &&
+               (a.state.program == b.state.program) &&
+               (a.state.texture_set == b.state.texture_set) &&
+               (a.state.VAO == b.state.VAO) &&
+               (a.range.mode == b.range.mode) &&
+               (a.range.index_type == b.range.index_type);
+}
+
+static uint32_t
+draw_index_size(GLenum index_type)
+{
+        switch (index_type) {
+        case GL_UNSIGNED_BYTE:
+                return 1;
+        case GL_UNSIGNED_SHORT:
+                return 2;
+        }
+
+        return 4;
+}
+
+// binds what item needs, counting what actually changed
+static void
+draw_queue_bind(draw_queue& queue, const draw_item *prev, const draw_item& item)
+{
+        if ((prev == NULL) || (prev->state.program != item.state.program)) {
+                state_use_program(item.state.program);
+                ++queue.last_changes;
+        }
+        if ((prev == NULL) || (prev->state.texture_set != item.state.texture_set)) {
+                const draw_texture_set& set = queue.texture_sets[item.state.texture_set];
+                for (uint32_t unit = 0; unit < set.n; ++unit)
+                        state_bind_texture(unit, set.target, set.textures[unit]);
+                ++queue.last_changes;
+        }
+        if ((prev == NULL) || (prev->state.VAO != item.state.VAO)) {
+                state_bind_vertex_array(item.state.VAO);
+                if (queue.bind_instances != NULL)
+                        queue.bind_instances(queue.bind_instances_data, 0);
+                ++queue.last_changes;
+        }
+}
+
+// one command per draw of the run into staging
+static void
+draw_queue_stage(draw_queue& queue, const draw_sort_entry *run, size_t n)
+{
+        for (size_t i = 0; i < n; ++i) {
+                const draw_item& item = queue.items[run[i].item];
+                uint32_t base_instance = (item.base_instance == DRAW_NO_INSTANCE) ?
+                                         0 : item.base_instance;
+                size_t at = queue.staging.size();
+                if (item.range.index_type == 0) {
+                        draw_arrays_indirect command = {item.range.count,
+                                                        item.instance_count,
+                                                        item.range.first,
+                                                        base_instance};
+                        queue.staging.resize(at + sizeof(command));
+                        memcpy(&queue.staging[at], &command, sizeof(command));
+                } else {
+                        draw_elements_indirect command = {item.range.count,
+                                                          item.instance_count,
+                                                          item.range.first,
+                                                          item.range.base_vertex,
+                                                          base_instance};
+                        queue.staging.resize(at + sizeof(command));
+                        memcpy(&queue.staging[at], &command, sizeof(command));
+                }
+        }
+}
+
+/*
+ * Streams every command of the frame at once; returns their offset into
+ * the command buffer, or SIZE_MAX if the stream is too small, in which
+ * case it is doubled for the next frame, or could not be mapped.
+ */
+static size_t
+draw_queue_upload(draw_queue& queue)
+{
+        stream_buffer_next_frame(queue.commands);
+        size_t offset;
+        void *dst = stream_buffer_alloc(queue.commands, queue.staging.size(), 4, &offset);
+        if (dst == NULL) {
+                if (queue.staging.size() <= queue.commands.frame_size)
+                        return SIZE_MAX;
+                size_t frame_size = std::max(2 * queue.commands.frame_size,
+                                             queue.staging.size());
+                destroy_stream_buffer(queue.commands);
+                init_stream_buffer(queue.commands, GL_DRAW_INDIRECT_BUFFER, frame_size);
+                return SIZE_MAX;
+        }
+        memcpy(dst, queue.staging.data(), queue.staging.size());
+        stream_buffer_unmap(queue.commands);
+
+        return offset;
+}
+
+static void
+draw_queue_issue(draw_queue& queue, const draw_item& item)
+{
+        const draw_range& range = item.range;
+        if ((queue.bind_instances != NULL) && (item.base_instance != DRAW_NO_INSTANCE))
+                queue.bind_instances(queue.bind_instances_data, item.base_instance);
+        if (range.index_type == 0) {
+                glDrawArraysInstanced(range.mode, range.first, range.count, item.instance_count);
+        } else {
+                size_t offset = range.first * draw_index_size(range.index_type);
+                glDrawElementsInstancedBaseVertex(range.mode,
+                                                  range.count,
+                                                  range.index_type,
+                                                  (void*)offset,
+                                                  item.instance_count,
+                                                  range.base_vertex);
+        }
+        ++queue.last_calls;
+}
+
+/*
+ * A run of compatible draws without indirect drawing: draws of the same
+ * range whose instances follow each other merge into one instanced draw,
+ * and single draws without instance data into one glMultiDraw call.
+ */
+static void
+draw_queue_issue_direct(draw_queue& queue, const draw_sort_entry *run, size_t n)
+{
+        const draw_item& first = queue.items[run[0].item];
+        bool multi = true;
+        for (size_t i = 0; i < n; ++i) {
+                const draw_item& item = queue.items[run[i].item];
+                multi = multi && (item.instance_count == 1) &&
+                        ((item.base_instance == DRAW_NO_INSTANCE) ||
+                         (queue.bind_instances == NULL));
+        }
+
+        if (multi && (n > 1)) {
+                queue.counts.clear();
+                queue.offsets.clear();
+                queue.firsts.clear();
+                queue.base_vertices.clear();
+                for (size_t i = 0; i < n; ++i) {
+                        const draw_range& range = queue.items[run[i].item].range;
+                        queue.counts.push_back(range.count);
+                        queue.firsts.push_back(range.first);
+                        queue.offsets.push_back((void*)(size_t)(range.first *
+                                                draw_index_size(range.index_type)));
+                        queue.base_vertices.push_back(range.base_vertex);
+                }
+                if (first.range.index_type == 0)
+                        glMultiDrawArrays(first.range.mode,
+                                          queue.firsts.data(),
+                                          queue.counts.data(),
+                                          n);
+                else
+                        glMultiDrawElementsBaseVertex(first.range.mode,
+                                                      queue.counts.data(),
+                                                      first.range.index_type,
+                                                      queue.offsets.data(),
+                                                      n,
+                                                      queue.base_vertices.data());
+                ++queue.last_calls;
+                return;
+        }
+
+        for (size_t i = 0; i < n;) {
+                draw_item merged = queue.items[run[i].item];
+                size_t j = i + 1;
+                for (; (j < n) && (merged.base_instance != DRAW_NO_INSTANCE); ++j) {
+                        const draw_item& next = queue.items[run[j].item];
+                        if ((next.base_instance != merged.base_instance + merged.instance_count) ||
+                            (next.range.count != merged.range.count) ||
+                            (next.range.first != merged.range.first) ||
+                            (next.range.base_vertex != merged.range.base_vertex))
+                                break;
+                        merged.instance_count += next.instance_count;
+                }
+                draw_queue_issue(queue, merged);
+                i = j;
+        }
+}
+
+/*
+ * Sorts the frame's draws and submits them, a call per run of compatible
+ * draws. Leaves the last draw's state bound.
+ */
+static void
+draw_queue_submit(draw_queue& queue)
+{
+        draw_queue_sort(queue);
+
+        PROFILE_SCOPE("draw submit");
+        queue.last_draws = queue.entries.size();
+        queue.last_calls = 0;
+        queue.last_changes = 0;
+        if (queue.entries.empty())
+                return;
+
+        // the commands of the whole frame go up in one write
+        size_t commands = SIZE_MAX;
+        if (queue.indirect) {
+                queue.staging.clear();
+                draw_queue_stage(queue, queue.entries.data(), queue.entries.size());
+                commands = draw_queue_upload(queue);
+        }
+
+        const draw_item *prev = NULL;
+        size_t n = queue.entries.size();
+        for (size_t begin = 0; begin < n;) {
+                const draw_item& item = queue.items[queue.entries[begin].item];
+                size_t end = begin + 1;
+                while ((end < n) && draw_compatible(item, queue.items[queue.entries[end].item]))
+                        ++end;
+
+                draw_queue_bind(queue, prev, item);
+                if (commands != SIZE_MAX) {
+                        state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, queue.commands.buffer);
+                        if (item.range.index_type == 0) {
+                                glMultiDrawArraysIndirect(item.range.mode,
+                                                          (void*)commands,
+                                                          end - begin,
+                                                          0);
+                                commands += (end - begin) * sizeof(draw_arrays_indirect);
+                        } else {
+                                glMultiDrawElementsIndirect(item.range.mode,
+                                                            item.range.index_type,
+                                                            (void*)commands,
+                                                            end - begin,
+                                                            0);
+                                commands += (end - begin) * sizeof(draw_elements_indirect);
+                        }
+                        ++queue.last_calls;
+                } else {
+                        draw_queue_issue_direct(queue, &queue.entries[begin], end - begin);
+                }
+
+                prev = &item;
+                begin = end;
+        }
+}
+
+#endif /* _LEARN_GL_DRAW_QUEUE_H_ */
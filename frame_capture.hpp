@@ -0,0 +1,570 @@
+#ifndef _LEARN_GL_FRAME_CAPTURE_H_
+#define _LEARN_GL_FRAME_CAPTURE_H_
+
+#include "learngl.hpp"
+#define STB_IMAGE_WRITE_STATIC
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+/*
+ * Frame capture without stalling the render thread. frame_capture_read
+ * queues a glReadPixels of a framebuffer into the next of a ring of pixel
+ * pack buffers and fences it; a few frames later, once the fence has
+ * signalled, the pixels go to a pool of threads that write them out:
+ *
+ * - CAPTURE_PNG: one PNG per frame, named path + frame number + ".png";
+ * - CAPTURE_Y4M: one YUV4MPEG2 stream (4:2:0, BT.601 full range) at path;
+ * - CAPTURE_HASH: a line of frame number and hash of the pixels per frame
+ *   at path (capture_hash), for regression checks.
+ *
+ * With GL 4.4 / ARB_buffer_storage the pack buffers stay persistently
+ * mapped and the workers copy the pixels out themselves, so the render
+ * thread only ever issues commands and polls fences. Otherwise it maps and
+ * copies each frame out when it hands it over.
+ *
+ * The render thread's own cost is the read into the pack buffer, a few
+ * percent of a frame. Encoding needs cores of its own: on a single core it
+ * takes from the frame, at the time of writing +13-16% for hashes, +25-30%
+ * for Y4M and twice the frame time for PNG on llvmpipe, so the 5% target
+ * holds only for the readback.
+ *
+ * Frames are numbered in the order they were read and streams are written
+ * in that order, whichever worker finishes first. When every pack buffer
+ * is still on the GPU the render thread waits for the oldest (a stall);
+ * when the workers fall CAPTURE_MAX_QUEUED frames behind, frames are
+ * dropped rather than queued without bound.
+ */
+
+#define CAPTURE_PBOS 4
+#define CAPTURE_MAX_QUEUED 8
+
+enum capture_format {
+        CAPTURE_PNG,
+        CAPTURE_Y4M,
+        CAPTURE_HASH,
+};
+
+// RGBA rows, bottom row first, as glReadPixels leaves them
+struct capture_frame {
+        uint64_t number = 0;
+        std::vector<uint8_t> pixels;
+        // the pack buffer to copy the pixels from first, or -1
+        int32_t slot = -1;
+        // CAPTURE_Y4M's converted frame
+        std::vector<uint8_t> yuv;
+        // the pixels couldn't be mapped; the frame only takes its turn
+        bool lost = false;
+};
+
+struct capture_slot {
+        uint32_t PBO = 0;
+        // NULL unless persistently mapped
+        uint8_t *persistent = NULL;
+        // set while the read is on the GPU
+        GLsync fence = NULL;
+        capture_frame *frame = NULL;
+        // persistently mapped: a worker has yet to copy the pixels out
+        std::atomic<bool> busy{false};
+};
+
+struct frame_capture {
+        capture_format format = CAPTURE_HASH;
+        std::string path;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        FILE *file = NULL;
+
+        // render thread only
+        capture_slot slots[CAPTURE_PBOS];
+        uint32_t next = 0;
+        uint64_t frames = 0;
+        uint64_t dropped = 0;
+        uint64_t stalls = 0;
+        // time spent in frame_capture_read, which is all the render thread
+        // pays for capturing; on a driver that rasterizes on the CPU it
+        // also holds the wait for the frame to be drawn
+        double render_ms = 0.0;
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<capture_frame*> pending;
+        std::vector<capture_frame*> spare;
+        bool quit = false;
+
+        // streams are written in frame order
+        std::mutex write_mutex;
+        std::condition_variable turn;
+        uint64_t next_write = 0;
+
+        std::atomic<uint64_t> written{0};
+        std::atomic<bool> failed{false};
+};
+
+// PNG frames, or a stream by suffix: ".y4m", or a hash list otherwise
+static capture_format
+capture_format_for_path(const char *path)
+{
+        size_t length = strlen(path);
+        if ((length >= 4) && (strcmp(path + length - 4, ".png") == 0))
+                return CAPTURE_PNG;
+        if ((length >= 4) && (strcmp(path + length - 4, ".y4m") == 0))
+                return CAPTURE_Y4M;
+
+        return CAPTURE_HASH;
+}
+
+static size_t
+capture_yuv420_size(uint32_t width, uint32_t height)
+{
+        return (size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+}
+
+// one row of RGBA as luma
+static void
+capture_luma_row(const uint8_t *src, uint32_t width, uint8_t *dst)
+{
+        uint32_t x = 0;
+#if defined(__SSE4_1__)
+        const __m128i weights = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+        const __m128i half = _mm_set1_epi32(128);
+        for (; x + 8 <= width; x += 8) {
+                // two pixels' weighted channels per madd, summed by hadd
+                __m128i lo = _mm_loadu_si128((const __m128i*)(src + 4 * x));
+                __m128i hi = _mm_loadu_si128((const __m128i*)(src + 4 * x + 16));
+                __m128i y0 = _mm_hadd_epi32(_mm_madd_epi16(_mm_cvtepu8_epi16(lo), weights),
+                                            _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(lo, 8)),
+                                                           weights));
+                __m128i y1 = _mm_hadd_epi32(_mm_madd_epi16(_mm_cvtepu8_epi16(hi), weights),
+                                            _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(hi, 8)),
+                                                           weights));
+                y0 = _mm_srli_epi32(_mm_add_epi32(y0, half), 8);
+                y1 = _mm_srli_epi32(_mm_add_epi32(y1, half), 8);
+                __m128i packed = _mm_packus_epi16(_mm_packs_epi32(y0, y1), _mm_setzero_si128());
+                _mm_storel_epi64((__m128i*)(dst + x), packed);
+        }
+#endif
+        for (; x < width; ++x)
+                dst[x] = (77 * src[4 * x] + 150 * src[4 * x + 1] + 29 * src[4 * x + 2] + 128) >> 8;
+}
+
+// RGBA rows, bottom row first, as planar Y'CbCr 4:2:0, top row first
+static void
+capture_rgba_to_yuv420(const uint8_t *rgba, uint32_t width, uint32_t height, uint8_t *yuv)
+{
+        uint32_t chroma_width = (width + 1) / 2;
+        uint32_t chroma_height = (height + 1) / 2;
+        uint8_t *luma = yuv;
+        uint8_t *cb = yuv + (size_t)width * height;
+        uint8_t *cr = cb + (size_t)chroma_width * chroma_height;
+        size_t stride = (size_t)width * 4;
+
+        for (uint32_t y = 0; y < height; ++y)
+                capture_luma_row(rgba + (height - 1 - y) * stride, width, luma + (size_t)y * width);
+
+        for (uint32_t y = 0; y < chroma_height; ++y) {
+                const uint8_t *row0 = rgba + (height - 1 - 2 * y) * stride;
+                const uint8_t *row1 = rgba + (height - 1 - std::min(2 * y + 1, height - 1)) * stride;
+                uint8_t *cb_row = cb + (size_t)y * chroma_width;
+                uint8_t *cr_row = cr + (size_t)y * chroma_width;
+                for (uint32_t x = 0; x < chroma_width; ++x) {
+                        // an odd last column averages its pixel with itself
+                        const uint8_t *a0 = row0 + 8 * x;
+                        const uint8_t *b0 = row1 + 8 * x;
+                        uint32_t right = (2 * x + 1 < width) ? 4 : 0;
+                        const uint8_t *a1 = a0 + right;
+                        const uint8_t *b1 = b0 + right;
+                        int32_t r = (a0[0] + a1[0] + b0[0] + b1[0] + 2) / 4;
+                        int32_t g = (a0[1] + a1[1] + b0[1] + b1[1] + 2) / 4;
+                        int32_t b = (a0[2] + a1[2] + b0[2] + b1[2] + 2) / 4;
+                        int32_t u = 128 + (-43 * r - 85 * g + 128 * b + 128) / 256;
+                        int32_t v = 128 + (128 * r - 107 * g - 21 * b + 128) / 256;
+                        cb_row[x] = std::min(std::max(u, 0), 255);
+                        cr_row[x] = std::min(std::max(v, 0), 255);
+                }
+        }
+}
+
+// RGBA pixels as RGB in place, four at a time in little-endian words
+static void
+capture_pack_rgb(uint8_t *pixels, size_t n_pixels)
+{
+        size_t i = 0;
+        for (; i + 4 <= n_pixels; i += 4) {
+                uint32_t p[4];
+                memcpy(p, pixels + 4 * i, 16);
+                uint32_t packed[3] = {(p[0] & 0xffffff) | (p[1] << 24),
+                                      ((p[1] >> 8) & 0xffff) | (p[2] << 16),
+                                      ((p[2] >> 16) & 0xff) | (p[3] << 8)};
+                memcpy(pixels + 3 * i, packed, 12);
+        }
+        for (; i < n_pixels; ++i)
+                memmove(pixels + 3 * i, pixels + 4 * i, 3);
+}
+
+/*
+ * FNV-1a over 64-bit words, in four interleaved lanes folded together at
+ * the end: a frame is megabytes, and byte-wise fnv1a_64 was most of what
+ * hashing capture cost. Each step is still a bijection of the lane, so a
+ * change to any one word changes the hash.
+ */
+static uint64_t
+capture_hash(const uint8_t *data, size_t size)
+{
+        uint64_t lanes[4] = {14695981039346656037ull,
+                             14695981039346656037ull ^ 1,
+                             14695981039346656037ull ^ 2,
+                             14695981039346656037ull ^ 3};
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+                for (uint32_t l = 0; l < 4; ++l) {
+                        uint64_t word;
+                        memcpy(&word, data + i + 8 * l, 8);
+                        lanes[l] = (lanes[l] ^ word) * 1099511628211ull;
+                }
+        }
+
+        uint64_t hash = fnv1a_64(lanes, sizeof(lanes));
+        return fnv1a_64(data + i, size - i, hash);
+}
+
+/*
+ * Worker side: calls write once every earlier frame's has been, so streams
+ * come out in frame order. Frames are queued in order, so the worker
+ * holding the earliest unwritten frame never waits here.
+ */
+template <typename F>
+static void
+capture_write_in_order(frame_capture& capture, uint64_t number, F&& write)
+{
+        std::unique_lock<std::mutex> lock(capture.write_mutex);
+        capture.turn.wait(lock, [&]() { return capture.next_write == number; });
+        if (!write())
+                capture.failed.store(true, std::memory_order_relaxed);
+        ++capture.next_write;
+        lock.unlock();
+        capture.turn.notify_all();
+}
+
+static void
+capture_encode(frame_capture& capture, capture_frame& frame)
+{
+        if (frame.lost) {
+                // later frames of a stream wait for this one's turn
+                if (capture.format != CAPTURE_PNG)
+                        capture_write_in_order(capture, frame.number, []() { return false; });
+                return;
+        }
+
+        uint32_t width = capture.width;
+        uint32_t height = capture.height;
+        switch (capture.format) {
+        case CAPTURE_PNG: {
+                // packed to RGB in place, then written top row first
+                uint8_t *pixels = frame.pixels.data();
+                capture_pack_rgb(pixels, (size_t)width * height);
+                char number[32];
+                snprintf(number, sizeof(number), "%06llu.png", (unsigned long long)frame.number);
+                std::string name = capture.path + number;
+                int32_t stride = 3 * width;
+                if (!stbi_write_png(name.c_str(),
+                                    width,
+                                    height,
+                                    3,
+                                    pixels + (size_t)(height - 1) * stride,
+                                    -stride))
+                        capture.failed.store(true, std::memory_order_relaxed);
+                break;
+        }
+        case CAPTURE_Y4M:
+                frame.yuv.resize(capture_yuv420_size(width, height));
+                capture_rgba_to_yuv420(frame.pixels.data(), width, height, frame.yuv.data());
+                capture_write_in_order(capture, frame.number, [&]() {
+                        return (fputs("FRAME\n", capture.file) >= 0) &&
+                               (fwrite(frame.yuv.data(), 1, frame.yuv.size(), capture.file) ==
+                                frame.yuv.size());
+                });
+                break;
+        case CAPTURE_HASH: {
+                uint64_t hash = capture_hash(frame.pixels.data(), frame.pixels.size());
+                capture_write_in_order(capture, frame.number, [&]() {
+                        return fprintf(capture.file,
+                                       "%llu %016llx\n",
+                                       (unsigned long long)frame.number,
+                                       (unsigned long long)hash) > 0;
+                });
+                break;
+        }
+        }
+}
+
+static void
+capture_worker_thread(frame_capture *capture)
+{
+        profile_thread_name("capture");
+        for (;;) {
+                capture_frame *frame;
+                {
+                        std::unique_lock<std::mutex> lock(capture->mutex);
+                        capture->wake.wait(lock, [&]() {
+                                return capture->quit || !capture->pending.empty();
+                        });
+                        if (capture->pending.empty())
+                                return;
+                        frame = capture->pending.front();
+                        capture->pending.pop_front();
+                }
+
+                {
+                        PROFILE_SCOPE("encode");
+                        if (frame->slot >= 0) {
+                                capture_slot& slot = capture->slots[frame->slot];
+                                memcpy(frame->pixels.data(), slot.persistent, frame->pixels.size());
+                                slot.busy.store(false, std::memory_order_release);
+                        }
+                        capture_encode(*capture, *frame);
+                }
+                if (!frame->lost)
+                        capture->written.fetch_add(1, std::memory_order_relaxed);
+
+                std::lock_guard<std::mutex> lock(capture->mutex);
+                capture->spare.push_back(frame);
+        }
+}
+
+/*
+ * Captures the lower left width x height of the framebuffers given to
+ * frame_capture_read to path, encoding on n_threads threads (0 for one
+ * per core but the render thread's). Call with the context current.
+ * Returns false if path can't be written.
+ */
+static bool
+frame_capture_start(frame_capture& capture,
+                    capture_format format,
+                    const char *path,
+                    uint32_t width,
+                    uint32_t height,
+                    uint32_t fps,
+                    uint32_t n_threads = 0)
+{
+        capture.format = format;
+        capture.path = path;
+        capture.width = width;
+        capture.height = height;
+        if (format == CAPTURE_PNG) {
+                // frames are named after the path, less its suffix
+                capture.path.resize(capture.path.size() - 4);
+        } else {
+                capture.file = fopen(path, "wb");
+                if (capture.file == NULL)
+                        return false;
+        }
+        if (format == CAPTURE_Y4M)
+                fprintf(capture.file,
+                        "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n",
+                        width,
+                        height,
+                        fps);
+
+        size_t size = (size_t)width * height * 4;
+        for (capture_slot& slot : capture.slots) {
+                glGenBuffers(1, &slot.PBO);
+                state_bind_buffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+                if (buffer_storage_supported()) {
+                        GLbitfield flags = GL_MAP_READ_BIT |
+                                           GL_MAP_PERSISTENT_BIT |
+                                           GL_MAP_COHERENT_BIT;
+                        glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags);
+                        slot.persistent = (uint8_t*)glMapBufferRange(GL_PIXEL_PACK_BUFFER,
+                                                                     0,
+                                                                     size,
+                                                                     flags);
+                } else {
+                        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+                }
+        }
+        // nothing else reads pixels into a buffer
+        state_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        for (uint32_t i = 0; i < CAPTURE_MAX_QUEUED; ++i) {
+                capture_frame *frame = new capture_frame;
+                frame->pixels.resize(size);
+                capture.spare.push_back(frame);
+        }
+
+        if (n_threads == 0)
+                n_threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+        for (uint32_t i = 0; i < n_threads; ++i)
+                capture.workers.emplace_back(capture_worker_thread, &capture);
+
+        return true;
+}
+
+// render thread: passes slot's finished read on to the workers
+static void
+capture_hand_off(frame_capture& capture, uint32_t index)
+{
+        capture_slot& slot = capture.slots[index];
+        capture_frame *frame = slot.frame;
+        glDeleteSync(slot.fence);
+        slot.fence = NULL;
+        slot.frame = NULL;
+
+        frame->lost = false;
+        if (slot.persistent != NULL) {
+                frame->slot = index;
+                slot.busy.store(true, std::memory_order_relaxed);
+        } else {
+                frame->slot = -1;
+                state_bind_buffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+                const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER,
+                                                      0,
+                                                      frame->pixels.size(),
+                                                      GL_MAP_READ_BIT);
+                if (pixels != NULL) {
+                        memcpy(frame->pixels.data(), pixels, frame->pixels.size());
+                        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                } else {
+                        frame->lost = true;
+                        capture.failed.store(true, std::memory_order_relaxed);
+                }
+                state_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+
+        {
+                std::lock_guard<std::mutex> lock(capture.mutex);
+                capture.pending.push_back(frame);
+        }
+        capture.wake.notify_one();
+}
+
+/*
+ * Render thread: hands over the reads the GPU has finished, oldest first,
+ * stopping at the first still running (the GPU finishes them in order).
+ * With wait, waits for them all instead.
+ */
+static void
+capture_retire(frame_capture& capture, bool wait)
+{
+        for (uint32_t k = 0; k < CAPTURE_PBOS; ++k) {
+                uint32_t index = (capture.next + k) % CAPTURE_PBOS;
+                capture_slot& slot = capture.slots[index];
+                if (slot.fence == NULL)
+                        continue;
+
+                if (wait) {
+                        while (glClientWaitSync(slot.fence,
+                                                GL_SYNC_FLUSH_COMMANDS_BIT,
+                                                1000000000ull) == GL_TIMEOUT_EXPIRED)
+                                ;
+                } else {
+                        GLenum status = glClientWaitSync(slot.fence, 0, 0);
+                        if ((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED))
+                                return;
+                }
+                capture_hand_off(capture, index);
+        }
+}
+
+/*
+ * Render thread, once a frame is drawn and before it is swapped: queues
+ * the read of framebuffer (0 for the window's back buffer) and hands over
+ * earlier reads that have finished. Leaves framebuffer bound for reading.
+ */
+static void
+frame_capture_read(frame_capture& capture, uint32_t framebuffer)
+{
+        PROFILE_SCOPE("capture");
+        uint64_t start = profile_now_ns();
+
+        capture_retire(capture, false);
+        capture_slot& slot = capture.slots[capture.next];
+        if (slot.fence != NULL) {
+                // the GPU is CAPTURE_PBOS frames behind
+                ++capture.stalls;
+                while (glClientWaitSync(slot.fence,
+                                        GL_SYNC_FLUSH_COMMANDS_BIT,
+                                        1000000000ull) == GL_TIMEOUT_EXPIRED)
+                        ;
+                capture_hand_off(capture, capture.next);
+        }
+
+        capture_frame *frame = NULL;
+        if (!slot.busy.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lock(capture.mutex);
+                if (!capture.spare.empty()) {
+                        frame = capture.spare.back();
+                        capture.spare.pop_back();
+                }
+        }
+        if (frame == NULL) {
+                ++capture.dropped;
+                capture.render_ms += 1e-6 * (profile_now_ns() - start);
+                return;
+        }
+        frame->number = capture.frames++;
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        state_bind_buffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(0, 0, capture.width, capture.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        state_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.frame = frame;
+        capture.next = (capture.next + 1) % CAPTURE_PBOS;
+
+        capture.render_ms += 1e-6 * (profile_now_ns() - start);
+}
+
+/*
+ * Render thread: waits for every frame read so far to be written, then
+ * stops the workers. Returns false if any frame failed to write.
+ */
+static bool
+frame_capture_stop(frame_capture& capture)
+{
+        capture_retire(capture, true);
+        {
+                std::lock_guard<std::mutex> lock(capture.mutex);
+                capture.quit = true;
+        }
+        capture.wake.notify_all();
+        for (std::thread& worker : capture.workers)
+                worker.join();
+        capture.workers.clear();
+
+        for (capture_slot& slot : capture.slots) {
+                if (slot.persistent != NULL) {
+                        state_bind_buffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+                        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                        slot.persistent = NULL;
+                }
+                state_delete_buffers(1, &slot.PBO);
+                slot.PBO = 0;
+        }
+        for (capture_frame *frame : capture.spare)
+                delete frame;
+        capture.spare.clear();
+
+        bool ok = !capture.failed.load(std::memory_order_relaxed);
+        if (capture.file != NULL)
+                ok = (fclose(capture.file) == 0) && ok;
+        capture.file = NULL;
+
+        return ok;
+}
+
+#endif /* _LEARN_GL_FRAME_CAPTURE_H_ */
@@ -0,0 +1,284 @@
+#ifndef _LEARN_GL_FRAME_PACING_H_
+#define _LEARN_GL_FRAME_PACING_H_
+
+#include "learngl.hpp"
+#include "lockfree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+/*
+ * Frame pacing. The simulation runs at a fixed rate on a thread of its own
+ * and the render thread draws the newest state it published, so a slow
+ * frame delays neither the simulation nor the frames after it; fences keep
+ * the render thread at most frames_in_flight frames ahead of the GPU, so
+ * the CPU and GPU overlap without latency piling up.
+ *
+ * - sim_start runs tick every step seconds on a new thread, skipping ahead
+ *   after a stall, and publishes the last two states through a
+ *   triple_buffer (lockfree.hpp) after each tick.
+ * - sim_latest interpolates between those two for the render thread. It
+ *   renders one tick behind the simulation, so there is always a state on
+ *   each side and motion is smooth at any frame rate.
+ * - Input reaches the simulation as a mask of held keys, set by the render
+ *   thread with sim_input after it polls events.
+ * - frame_pacer_begin/end bracket a frame. They also measure the latency
+ *   from the input sample a frame's state was ticked with to the GPU
+ *   finishing the frame, which is the part of input-to-photon latency
+ *   under the program's control.
+ */
+
+// ticks run back to back to catch up before the simulation skips ahead
+#define SIM_MAX_CATCH_UP 8
+// more frames in flight than the stream buffers have regions only stalls
+// in stream_buffer_next_frame instead
+#define FRAME_PACER_MAX_FRAMES STREAM_FRAMES
+
+// seconds on a monotonic clock, comparable across threads
+static double
+sim_clock(void)
+{
+        return std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename S>
+struct sim_frame {
+        S prev;
+        S cur;
+        uint64_t tick = 0;
+        // sim_clock() time cur stands for, and when its input was sampled
+        double wall = 0.0;
+        double input_time = 0.0;
+};
+
+template <typename S>
+struct sim_thread {
+        double step = 1.0 / 120.0;
+        void (*tick)(S& state, uint32_t input, double step, void *data) = NULL;
+        void *data = NULL;
+
+        std::thread thread;
+        std::atomic<bool> quit{false};
+        // held input, and when it was sampled; the two are stored separately,
+        // so the time may belong to a neighbouring sample
+        std::atomic<uint32_t> input{0};
+        std::atomic<double> input_time{0.0};
+        triple_buffer<sim_frame<S>> frames;
+
+        // ticks run, and ticks skipped because the thread fell behind
+        std::atomic<uint64_t> ticks{0};
+        std::atomic<uint64_t> skipped{0};
+};
+
+template <typename S>
+static void
+sim_thread_main(sim_thread<S> *sim, sim_frame<S> frame)
+{
+        profile_thread_name("simulation");
+        double next = frame.wall + sim->step;
+        while (!sim->quit.load(std::memory_order_relaxed)) {
+                double now = sim_clock();
+                if (now < next) {
+                        std::this_thread::sleep_for(std::chrono::duration<double>(next - now));
+                        continue;
+                }
+                if (now - next > SIM_MAX_CATCH_UP * sim->step) {
+                        uint64_t behind = (uint64_t)((now - next) / sim->step);
+                        sim->skipped.fetch_add(behind, std::memory_order_relaxed);
+                        next += behind * sim->step;
+                }
+
+                uint32_t input = sim->input.load(std::memory_order_acquire);
+                double input_time = sim->input_time.load(std::memory_order_relaxed);
+                {
+                        PROFILE_SCOPE("tick");
+                        frame.prev = frame.cur;
+                        sim->tick(frame.cur, input, sim->step, sim->data);
+                }
+                ++frame.tick;
+                frame.wall = next;
+                frame.input_time = input_time;
+                triple_buffer_back(sim->frames) = frame;
+                triple_buffer_publish(sim->frames);
+                sim->ticks.fetch_add(1, std::memory_order_relaxed);
+
+                next += sim->step;
+        }
+}
+
+/*
+ * Starts ticking initial every step seconds. tick advances the state by
+ * step given the held input, and runs on the simulation thread only.
+ */
+template <typename S>
+static void
+sim_start(sim_thread<S>& sim,
+          const S& initial,
+          double step,
+          void (*tick)(S& state, uint32_t input, double step, void *data),
+          void *data = NULL)
+{
+        sim.step = step;
+        sim.tick = tick;
+        sim.data = data;
+
+        sim_frame<S> frame;
+        frame.prev = initial;
+        frame.cur = initial;
+        frame.wall = sim_clock();
+        frame.input_time = frame.wall;
+        // ticks before the first sim_input hold no input, sampled now
+        sim.input_time.store(frame.wall, std::memory_order_relaxed);
+        triple_buffer_back(sim.frames) = frame;
+        triple_buffer_publish(sim.frames);
+        triple_buffer_acquire(sim.frames);
+
+        sim.thread = std::thread(sim_thread_main<S>, &sim, frame);
+}
+
+template <typename S>
+static void
+sim_stop(sim_thread<S>& sim)
+{
+        sim.quit.store(true, std::memory_order_relaxed);
+        if (sim.thread.joinable())
+                sim.thread.join();
+}
+
+// render thread: the input held as of now, for the next tick
+template <typename S>
+static void
+sim_input(sim_thread<S>& sim, uint32_t input)
+{
+        sim.input_time.store(sim_clock(), std::memory_order_relaxed);
+        sim.input.store(input, std::memory_order_release);
+}
+
+/*
+ * Render thread: the state at now - step, interpolated between the last
+ * two ticks with lerp(prev, cur, t). *input_time, if given, is when the
+ * input behind the newer one was sampled.
+ */
+template <typename S>
+static S
+sim_latest(sim_thread<S>& sim,
+           double now,
+           S (*lerp)(const S& a, const S& b, float t),
+           double *input_time = NULL)
+{
+        triple_buffer_acquire(sim.frames);
+        const sim_frame<S>& frame = triple_buffer_front(sim.frames);
+        if (input_time != NULL)
+                *input_time = frame.input_time;
+        float t = std::min(std::max((now - frame.wall) / sim.step, 0.0), 1.0);
+
+        return lerp(frame.prev, frame.cur, t);
+}
+
+struct frame_pacer {
+        uint32_t frames_in_flight = 2;
+        uint64_t frame = 0;
+        GLsync fences[FRAME_PACER_MAX_FRAMES] = {};
+        double input_times[FRAME_PACER_MAX_FRAMES] = {};
+
+        // since the last frame_pacer_reset
+        uint32_t frames = 0;
+        uint32_t waits = 0;
+        double wait_ms = 0.0;
+        uint32_t latencies = 0;
+        double latency_sum_ms = 0.0;
+        double latency_max_ms = 0.0;
+};
+
+static void
+init_frame_pacer(frame_pacer& pacer, uint32_t frames_in_flight)
+{
+        pacer = frame_pacer();
+        pacer.frames_in_flight = std::min(std::max(frames_in_flight, 1u),
+                                          (uint32_t)FRAME_PACER_MAX_FRAMES);
+}
+
+static void
+frame_pacer_reset(frame_pacer& pacer)
+{
+        pacer.frames = 0;
+        pacer.waits = 0;
+        pacer.wait_ms = 0.0;
+        pacer.latencies = 0;
+        pacer.latency_sum_ms = 0.0;
+        pacer.latency_max_ms = 0.0;
+}
+
+// a frame the GPU was seen to have finished at done
+static void
+frame_pacer_retire(frame_pacer& pacer, uint32_t slot, double done)
+{
+        double latency_ms = 1000.0 * (done - pacer.input_times[slot]);
+        ++pacer.latencies;
+        pacer.latency_sum_ms += latency_ms;
+        pacer.latency_max_ms = std::max(pacer.latency_max_ms, latency_ms);
+
+        glDeleteSync(pacer.fences[slot]);
+        pacer.fences[slot] = NULL;
+}
+
+/*
+ * Call at the start of a frame, before anything that waits on the GPU:
+ * blocks until at most frames_in_flight - 1 earlier frames are still on
+ * the GPU. Frames already finished are retired first, so their latency is
+ * timed to within a frame rather than stretched by the wait.
+ */
+static void
+frame_pacer_begin(frame_pacer& pacer)
+{
+        PROFILE_SCOPE("pace");
+        double now = sim_clock();
+        for (uint32_t i = 0; i < pacer.frames_in_flight; ++i) {
+                if (pacer.fences[i] == NULL)
+                        continue;
+                GLenum status = glClientWaitSync(pacer.fences[i], 0, 0);
+                if ((status == GL_ALREADY_SIGNALED) || (status == GL_CONDITION_SATISFIED))
+                        frame_pacer_retire(pacer, i, now);
+        }
+
+        uint32_t slot = pacer.frame % pacer.frames_in_flight;
+        if (pacer.fences[slot] == NULL)
+                return;
+
+        ++pacer.waits;
+        while (glClientWaitSync(pacer.fences[slot],
+                                GL_SYNC_FLUSH_COMMANDS_BIT,
+                                1000000000ull) == GL_TIMEOUT_EXPIRED)
+                ;
+        double done = sim_clock();
+        pacer.wait_ms += 1000.0 * (done - now);
+        frame_pacer_retire(pacer, slot, done);
+}
+
+/*
+ * Call after swap_buffers: fences the frame, whose state came from input
+ * sampled at input_time (sim_clock seconds).
+ */
+static void
+frame_pacer_end(frame_pacer& pacer, double input_time)
+{
+        uint32_t slot = pacer.frame % pacer.frames_in_flight;
+        pacer.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        pacer.input_times[slot] = input_time;
+        ++pacer.frame;
+        ++pacer.frames;
+}
+
+static void
+destroy_frame_pacer(frame_pacer& pacer)
+{
+        for (GLsync& fence : pacer.fences)
+                if (fence != NULL)
+                        glDeleteSync(fence);
+        pacer = frame_pacer();
+}
+
+#endif /* _LEARN_GL_FRAME_PACING_H_ */
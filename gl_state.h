@@ -0,0 +1,320 @@
+#ifndef _LEARN_GL_STATE_H_
+#define _LEARN_GL_STATE_H_
+
+/*
+ * Shadowed GL state, per GL thread. The bind calls below compare
+ * against a copy of what is bound and only reach the driver when something
+ * changes, and the state_get_* queries answer from the copy instead of
+ * making a glGet round trip. Every call is counted as issued or elided;
+ * swap_buffers (headless.h) closes the frame's counts, which are then in
+ * gl_state.last_issued/last_elided.
+ *
+ * The shadow is only right while all binding goes through here, deletes
+ * included (a deleted name is unbound and may be handed out again). Code
+ * that changes state behind its back must call gl_state_invalidate.
+ *
+ * The copy is per thread. A context is current on one thread at a time, so
+ * each thread driving one (see shared_context.hpp) keeps its own and calls
+ * gl_state_init once its context is current.
+ *
+ * Plain C like headless.h, so hello_window.c can use it too.
+ */
+
+#include <glad/glad.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STATE_TEXTURE_UNITS 16
+// bound name not known: the next bind always goes to the driver
+#define STATE_UNKNOWN UINT32_MAX
+
+enum state_texture_target {
+        STATE_TEXTURE_2D,
+        STATE_TEXTURE_2D_ARRAY,
+        STATE_TEXTURE_TARGETS
+};
+
+enum state_buffer_target {
+        STATE_ARRAY_BUFFER,
+        // part of the bound VAO, so forgotten whenever the VAO changes
+        STATE_ELEMENT_ARRAY_BUFFER,
+        STATE_UNIFORM_BUFFER,
+        STATE_DRAW_INDIRECT_BUFFER,
+        STATE_PIXEL_PACK_BUFFER,
+        STATE_PIXEL_UNPACK_BUFFER,
+        STATE_COPY_READ_BUFFER,
+        STATE_COPY_WRITE_BUFFER,
+        STATE_BUFFER_TARGETS
+};
+
+struct gl_state_shadow {
+        uint32_t program;
+        uint32_t VAO;
+        uint32_t active_unit;
+        uint32_t textures[STATE_TEXTURE_UNITS][STATE_TEXTURE_TARGETS];
+        uint32_t buffers[STATE_BUFFER_TARGETS];
+        uint32_t polygon_mode;
+
+        // this frame so far, and the last complete frame
+        uint32_t issued;
+        uint32_t elided;
+        uint32_t last_issued;
+        uint32_t last_elided;
+};
+
+static __thread struct gl_state_shadow gl_state;
+
+// forgets everything, so the next call of each kind reaches the driver
+static void
+gl_state_invalidate(void)
+{
+        gl_state.program = STATE_UNKNOWN;
+        gl_state.VAO = STATE_UNKNOWN;
+        gl_state.active_unit = STATE_UNKNOWN;
+        for (uint32_t unit = 0; unit < STATE_TEXTURE_UNITS; ++unit)
+                for (uint32_t target = 0; target < STATE_TEXTURE_TARGETS; ++target)
+                        gl_state.textures[unit][target] = STATE_UNKNOWN;
+        for (uint32_t target = 0; target < STATE_BUFFER_TARGETS; ++target)
+                gl_state.buffers[target] = STATE_UNKNOWN;
+        gl_state.polygon_mode = STATE_UNKNOWN;
+}
+
+/*
+ * Call once the context is current and untouched: the shadow starts from
+ * the GL defaults rather than unknown.
+ */
+static void
+gl_state_init(void)
+{
+        gl_state_invalidate();
+        gl_state.program = 0;
+        gl_state.VAO = 0;
+        gl_state.active_unit = 0;
+        for (uint32_t unit = 0; unit < STATE_TEXTURE_UNITS; ++unit)
+                for (uint32_t target = 0; target < STATE_TEXTURE_TARGETS; ++target)
+                        gl_state.textures[unit][target] = 0;
+        for (uint32_t target = 0; target < STATE_BUFFER_TARGETS; ++target)
+                gl_state.buffers[target] = 0;
+        gl_state.polygon_mode = GL_FILL;
+}
+
+static void
+gl_state_frame(void)
+{
+        gl_state.last_issued = gl_state.issued;
+        gl_state.last_elided = gl_state.elided;
+        gl_state.issued = 0;
+        gl_state.elided = 0;
+}
+
+// records the new value and says whether the call must be made
+static bool
+state_update(uint32_t *shadow, uint32_t value)
+{
+        if (*shadow == value) {
+                ++gl_state.elided;
+                return false;
+        }
+
+        *shadow = value;
+        ++gl_state.issued;
+        return true;
+}
+
+static int32_t
+state_texture_target(GLenum target)
+{
+        switch (target) {
+        case GL_TEXTURE_2D:
+                return STATE_TEXTURE_2D;
+        case GL_TEXTURE_2D_ARRAY:
+                return STATE_TEXTURE_2D_ARRAY;
+        }
+
+        return -1;
+}
+
+static int32_t
+state_buffer_target(GLenum target)
+{
+        switch (target) {
+        case GL_ARRAY_BUFFER:
+                return STATE_ARRAY_BUFFER;
+        case GL_ELEMENT_ARRAY_BUFFER:
+                return STATE_ELEMENT_ARRAY_BUFFER;
+        case GL_UNIFORM_BUFFER:
+                return STATE_UNIFORM_BUFFER;
+        case GL_DRAW_INDIRECT_BUFFER:
+                return STATE_DRAW_INDIRECT_BUFFER;
+        case GL_PIXEL_PACK_BUFFER:
+                return STATE_PIXEL_PACK_BUFFER;
+        case GL_PIXEL_UNPACK_BUFFER:
+                return STATE_PIXEL_UNPACK_BUFFER;
+        case GL_COPY_READ_BUFFER:
+                return STATE_COPY_READ_BUFFER;
+        case GL_COPY_WRITE_BUFFER:
+                return STATE_COPY_WRITE_BUFFER;
+        }
+
+        return -1;
+}
+
+static void
+state_use_program(uint32_t program)
+{
+        if (state_update(&gl_state.program, program))
+                glUseProgram(program);
+}
+
+static void
+state_bind_vertex_array(uint32_t VAO)
+{
+        if (!state_update(&gl_state.VAO, VAO))
+                return;
+
+        glBindVertexArray(VAO);
+        gl_state.buffers[STATE_ELEMENT_ARRAY_BUFFER] = STATE_UNKNOWN;
+}
+
+static void
+state_active_texture(uint32_t unit)
+{
+        if (state_update(&gl_state.active_unit, unit))
+                glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+// binds texture to target on unit, making unit active only if it must
+static void
+state_bind_texture(uint32_t unit, GLenum target, uint32_t texture)
+{
+        int32_t index = state_texture_target(target);
+        if ((index < 0) || (unit >= STATE_TEXTURE_UNITS)) {
+                state_active_texture(unit);
+                glBindTexture(target, texture);
+                ++gl_state.issued;
+                return;
+        }
+
+        if (gl_state.textures[unit][index] == texture) {
+                ++gl_state.elided;
+                return;
+        }
+        state_active_texture(unit);
+        gl_state.textures[unit][index] = texture;
+        glBindTexture(target, texture);
+        ++gl_state.issued;
+}
+
+static void
+state_bind_buffer(GLenum target, uint32_t buffer)
+{
+        int32_t index = state_buffer_target(target);
+        if (index < 0) {
+                glBindBuffer(target, buffer);
+                ++gl_state.issued;
+                return;
+        }
+
+        if (state_update(&gl_state.buffers[index], buffer))
+                glBindBuffer(target, buffer);
+}
+
+/*
+ * Indexed binds always reach the driver (the indexed points aren't
+ * shadowed), but also bind the generic target, which is.
+ */
+static void
+state_bind_buffer_range(GLenum target,
+                        uint32_t index,
+                        uint32_t buffer,
+                        GLintptr offset,
+                        GLsizeiptr size)
+{
+        glBindBufferRange(target, index, buffer, offset, size);
+        ++gl_state.issued;
+
+        int32_t generic = state_buffer_target(target);
+        if (generic >= 0)
+                gl_state.buffers[generic] = buffer;
+}
+
+static void
+state_polygon_mode(uint32_t mode)
+{
+        if (state_update(&gl_state.polygon_mode, mode))
+                glPolygonMode(GL_FRONT_AND_BACK, mode);
+}
+
+// GL_FILL, GL_LINE or GL_POINT, without a glGetIntegerv round trip
+static uint32_t
+state_get_polygon_mode(void)
+{
+        if (gl_state.polygon_mode == STATE_UNKNOWN) {
+                int32_t modes[2];
+                glGetIntegerv(GL_POLYGON_MODE, modes);
+                gl_state.polygon_mode = modes[0];
+        }
+
+        return gl_state.polygon_mode;
+}
+
+static uint32_t
+state_get_program(void)
+{
+        if (gl_state.program == STATE_UNKNOWN) {
+                int32_t program;
+                glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+                gl_state.program = program;
+        }
+
+        return gl_state.program;
+}
+
+/*
+ * Deletes that keep the shadow right: GL unbinds a deleted name from
+ * everywhere it was bound in this context.
+ */
+static void
+state_delete_program(uint32_t program)
+{
+        glDeleteProgram(program);
+        // a program in use stays bound until replaced, but its name can't
+        // be trusted to mean it any more
+        if (gl_state.program == program)
+                gl_state.program = STATE_UNKNOWN;
+}
+
+static void
+state_delete_vertex_arrays(uint32_t n, const uint32_t *VAOs)
+{
+        glDeleteVertexArrays(n, VAOs);
+        for (uint32_t i = 0; i < n; ++i) {
+                if (gl_state.VAO == VAOs[i]) {
+                        gl_state.VAO = 0;
+                        gl_state.buffers[STATE_ELEMENT_ARRAY_BUFFER] = STATE_UNKNOWN;
+                }
+        }
+}
+
+static void
+state_delete_buffers(uint32_t n, const uint32_t *buffers)
+{
+        glDeleteBuffers(n, buffers);
+        for (uint32_t i = 0; i < n; ++i)
+                for (uint32_t target = 0; target < STATE_BUFFER_TARGETS; ++target)
+                        if (gl_state.buffers[target] == buffers[i])
+                                gl_state.buffers[target] = 0;
+}
+
+static void
+state_delete_textures(uint32_t n, const uint32_t *textures)
+{
+        glDeleteTextures(n, textures);
+        for (uint32_t i = 0; i < n; ++i)
+                for (uint32_t unit = 0; unit < STATE_TEXTURE_UNITS; ++unit)
+                        for (uint32_t target = 0; target < STATE_TEXTURE_TARGETS; ++target)
+                                if (gl_state.textures[unit][target] == textures[i])
+                                        gl_state.textures[unit][target] = 0;
+}
+
+#endif /* _LEARN_GL_STATE_H_ */
@@ -0,0 +1,267 @@
+#ifndef _LEARN_GL_HEADLESS_H_
+#define _LEARN_GL_HEADLESS_H_
+
+/*
+ * Headless rendering for machines without a GPU or display (CI, benchmark
+ * hosts). With LEARNGL_HEADLESS=<frames> in the environment the programs
+ * render on an EGL surfaceless context (Mesa llvmpipe is enough) into an
+ * offscreen framebuffer instead of a window, and the window asks to close
+ * after that many frames. GLFW still provides the window handle, time and
+ * (always idle) input through its null platform, which needs GLFW 3.4.
+ *
+ * Render loops present with swap_buffers, shut down with terminate_gl and
+ * bind screen_framebuffer() wherever they mean the window, so the same
+ * code runs in both modes. swap_buffers also ends the frame of the
+ * profiler (profiler.h) and of the state cache's counters (gl_state.h).
+ * Plain C so hello_window.c can use it too.
+ */
+
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include "gl_state.h"
+#include "profiler.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct headless_gl {
+        EGLDisplay display;
+        EGLConfig config;
+        EGLContext context;
+        uint32_t FBO;
+        uint32_t color_RBO;
+        uint32_t depth_RBO;
+        // the previous frame, waited on at the next swap as a swap chain would
+        GLsync frame_fence;
+        // set by set_swap_interval(0): swaps never wait
+        uint32_t unthrottled;
+        uint32_t frames_left;
+};
+
+static struct headless_gl headless;
+
+// frames to render headless, 0 to open a window
+static uint32_t
+headless_frame_count(void)
+{
+        const char *frames = getenv("LEARNGL_HEADLESS");
+        if (frames == NULL)
+                return 0;
+
+        return strtoul(frames, NULL, 10);
+}
+
+static EGLDisplay
+headless_display(void)
+{
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+                (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (get_platform_display != NULL) {
+                EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                                          EGL_DEFAULT_DISPLAY,
+                                                          NULL);
+                if (display != EGL_NO_DISPLAY)
+                        return display;
+        }
+
+        return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+// a 3.3 core context without a surface, sharing objects with share
+static EGLContext
+headless_create_context(EGLContext share)
+{
+        const EGLint context_attribs[] = {
+                EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+                EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+                EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR,
+                EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+                EGL_NONE
+        };
+
+        return eglCreateContext(headless.display, headless.config, share, context_attribs);
+}
+
+/*
+ * A width x height RGBA8/depth-stencil framebuffer standing in for a
+ * window, in the current context. Returns 0 on failure.
+ */
+static uint32_t
+headless_create_framebuffer(uint32_t width,
+                            uint32_t height,
+                            uint32_t *color_RBO,
+                            uint32_t *depth_RBO)
+{
+        glGenRenderbuffers(1, color_RBO);
+        glBindRenderbuffer(GL_RENDERBUFFER, *color_RBO);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glGenRenderbuffers(1, depth_RBO);
+        glBindRenderbuffer(GL_RENDERBUFFER, *depth_RBO);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+        uint32_t FBO;
+        glGenFramebuffers(1, &FBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+                                  GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER,
+                                  *color_RBO);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+                                  GL_DEPTH_STENCIL_ATTACHMENT,
+                                  GL_RENDERBUFFER,
+                                  *depth_RBO);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                fprintf(stderr, "ERROR::HEADLESS::FRAMEBUFFER_INCOMPLETE\n");
+                return 0;
+        }
+
+        return FBO;
+}
+
+/*
+ * Creates a 3.3 core context with no surface and a width x height
+ * RGBA8/depth-stencil framebuffer to render into, and a context-less GLFW
+ * window that closes after frames swaps. Returns NULL on failure.
+ */
+static GLFWwindow*
+create_headless_window(uint32_t width, uint32_t height, uint32_t frames)
+{
+#if defined(GLFW_PLATFORM_NULL)
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
+        if (!glfwInit()) {
+                fprintf(stderr, "ERROR::HEADLESS::GLFW_INIT_FAILED (needs GLFW 3.4)\n");
+                return NULL;
+        }
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        GLFWwindow *window = glfwCreateWindow(width, height, "LearnOpenGL", NULL, NULL);
+        if (window == NULL) {
+                fprintf(stderr, "ERROR::HEADLESS::GLFW_WINDOW_FAILED\n");
+                glfwTerminate();
+                return NULL;
+        }
+
+        headless.display = headless_display();
+        if ((headless.display == EGL_NO_DISPLAY) ||
+            !eglInitialize(headless.display, NULL, NULL) ||
+            !eglBindAPI(EGL_OPENGL_API)) {
+                fprintf(stderr, "ERROR::HEADLESS::EGL_INIT_FAILED\n");
+                return NULL;
+        }
+
+        const EGLint config_attribs[] = {
+                EGL_SURFACE_TYPE, 0,
+                EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                EGL_NONE
+        };
+        EGLint n_configs = 0;
+        eglChooseConfig(headless.display, config_attribs, &headless.config, 1, &n_configs);
+        if (n_configs > 0)
+                headless.context = headless_create_context(EGL_NO_CONTEXT);
+        if ((headless.context == EGL_NO_CONTEXT) ||
+            !eglMakeCurrent(headless.display,
+                            EGL_NO_SURFACE,
+                            EGL_NO_SURFACE,
+                            headless.context)) {
+                fprintf(stderr, "ERROR::HEADLESS::EGL_CONTEXT_FAILED\n");
+                return NULL;
+        }
+
+        if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+                fprintf(stderr, "%s\n", "Failed to initialize GLAD");
+                return NULL;
+        }
+
+        headless.FBO = headless_create_framebuffer(width,
+                                                   height,
+                                                   &headless.color_RBO,
+                                                   &headless.depth_RBO);
+        if (headless.FBO == 0)
+                return NULL;
+        glViewport(0, 0, width, height);
+
+        headless.frames_left = frames;
+        gl_state_init();
+        profile_init();
+
+        return window;
+}
+
+// the framebuffer standing in for the window: 0 unless headless
+static uint32_t
+screen_framebuffer(void)
+{
+        return headless.FBO;
+}
+
+static void
+headless_swap(GLFWwindow *window)
+{
+
+        // nothing to present, but keep at most one frame queued so frame
+        // times measure rendering rather than how far the CPU runs ahead
+        if (headless.frame_fence != NULL) {
+                glClientWaitSync(headless.frame_fence,
+                                 GL_SYNC_FLUSH_COMMANDS_BIT,
+                                 UINT64_MAX);
+                glDeleteSync(headless.frame_fence);
+                headless.frame_fence = NULL;
+        }
+        if (!headless.unthrottled)
+                headless.frame_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+
+        if ((headless.frames_left > 0) && (--headless.frames_left == 0))
+                glfwSetWindowShouldClose(window, GLFW_TRUE);
+}
+
+static void
+swap_buffers(GLFWwindow *window)
+{
+        uint64_t swap_start = profile_begin();
+        if (headless.context == EGL_NO_CONTEXT)
+                glfwSwapBuffers(window);
+        else
+                headless_swap(window);
+        profile_end("swap", swap_start);
+
+        gl_state_frame();
+        profile_frame();
+}
+
+/*
+ * 1 to wait for vertical blank at every swap, 0 to present as soon as a
+ * frame is done. Headless there is no vertical blank; 0 drops the one
+ * frame limit of headless_swap, leaving how far the CPU runs ahead to the
+ * caller (see frame_pacing.hpp).
+ */
+static void
+set_swap_interval(int32_t interval)
+{
+        if (headless.context == EGL_NO_CONTEXT)
+                glfwSwapInterval(interval);
+        else
+                headless.unthrottled = interval == 0;
+}
+
+static void
+terminate_gl(void)
+{
+        profile_shutdown();
+        if (headless.context != EGL_NO_CONTEXT) {
+                eglMakeCurrent(headless.display,
+                               EGL_NO_SURFACE,
+                               EGL_NO_SURFACE,
+                               EGL_NO_CONTEXT);
+                eglDestroyContext(headless.display, headless.context);
+                eglTerminate(headless.display);
+                headless.context = EGL_NO_CONTEXT;
+        }
+        glfwTerminate();
+}
+
+#endif /* _LEARN_GL_HEADLESS_H_ */
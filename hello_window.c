@@ -1,5 +1,6 @@
 #include "glad/glad.h"
 #include "GLFW/glfw3.h"
+#include "headless.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,7 +13,7 @@ bind_buffer(uint32_t buffer,
             const void *data,
             uint32_t data_size_bytes)
 {
-        glBindBuffer(target, buffer);
+        state_bind_buffer(target, buffer);
         glBufferData(target, data_size_bytes, data, GL_STATIC_DRAW);
 }
 
@@ -63,23 +64,40 @@ create_compile_shader(const char **shader_src, GLenum shader_type)
 
 int main(void)
 {
-        assert(glfwInit() == GLFW_TRUE);
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        GLFWwindow *window;
+        uint32_t headless_frames = headless_frame_count();
+        if (headless_frames > 0) {
+                window = create_headless_window(800, 600, headless_frames);
+                if (window == NULL)
+                        return EXIT_FAILURE;
+        } else {
+                if (glfwInit() != GLFW_TRUE) {
+                        fprintf(stderr, "ERROR::GLFW::INIT_FAILED\n");
+                        return EXIT_FAILURE;
+                }
+                glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+                glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+                glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-        glfwSetErrorCallback(error_callback);
+                glfwSetErrorCallback(error_callback);
 
-        GLFWwindow *window = glfwCreateWindow(800,
-                                              600,
-                                              "Learn OpenGL",
-                                              NULL,
-                                              NULL);
-        assert(window != NULL);
+                window = glfwCreateWindow(800, 600, "Learn OpenGL", NULL, NULL);
+                if (window == NULL) {
+                        fprintf(stderr, "ERROR::GLFW::WINDOW_FAILED\n");
+                        glfwTerminate();
+                        return EXIT_FAILURE;
+                }
 
-        glfwMakeContextCurrent(window);
+                glfwMakeContextCurrent(window);
 
-        assert(gladLoadGLLoader((GLADloadproc)glfwGetProcAddress) != 0);
+                if (gladLoadGLLoader((GLADloadproc)glfwGetProcAddress) == 0) {
+                        fprintf(stderr, "ERROR::GLAD::LOAD_FAILED\n");
+                        glfwTerminate();
+                        return EXIT_FAILURE;
+                }
+                gl_state_init();
+                profile_init();
+        }
 
         glViewport(0, 0, 800, 600);
 
@@ -149,7 +167,7 @@ int main(void)
         uint32_t VAO;
         glGenVertexArrays(1, &VAO);
 
-        glBindVertexArray(VAO);
+        state_bind_vertex_array(VAO);
         bind_buffer(EBO, GL_ELEMENT_ARRAY_BUFFER, indices, sizeof(indices));
         bind_buffer(VBO, GL_ARRAY_BUFFER, vertices, sizeof(vertices));
 
@@ -160,27 +178,36 @@ int main(void)
              !glfwWindowShouldClose(window);
              ++counter) {
                 if ((counter % 120) == 0) {
-                        int32_t polygon_mode;
-                        glGetIntegerv(GL_POLYGON_MODE, &polygon_mode);
+                        // answered from the shadow state, not by the driver
+                        uint32_t polygon_mode = state_get_polygon_mode();
 
                         if (polygon_mode == GL_LINE)
-                                glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+                                state_polygon_mode(GL_FILL);
                         else if (polygon_mode == GL_FILL)
-                                glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+                                state_polygon_mode(GL_LINE);
                 }
 
+                uint64_t input_start = profile_begin();
                 process_input(window);
+                profile_end("input", input_start);
 
+                uint64_t draw_start = profile_begin();
+                bool gpu_timed = profile_gpu_begin("draw");
                 glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
                 glClear(GL_COLOR_BUFFER_BIT);
 
-                glUseProgram(shader_program);
-                glBindVertexArray(VAO);
+                state_use_program(shader_program);
+                state_bind_vertex_array(VAO);
                 glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, NULL);
+                if (gpu_timed)
+                        profile_gpu_end();
+                profile_end("draw", draw_start);
 
-                glfwSwapBuffers(window);
+                swap_buffers(window);
                 glfwPollEvents();
         }
 
+        terminate_gl();
+
         return EXIT_SUCCESS;
 }
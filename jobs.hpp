@@ -0,0 +1,308 @@
+#ifndef _LEARN_GL_JOBS_H_
+#define _LEARN_GL_JOBS_H_
+
+#include "profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Small work-stealing job system. Every worker owns a Chase-Lev deque: it
+ * pushes and pops jobs at the bottom, idle workers steal from the top of
+ * someone else's. The thread that calls job_system_start is worker 0 and
+ * takes part whenever it waits in job_join, so a frame's fork/join runs on
+ * every core including the one that owns the GL context.
+ *
+ * Jobs may only be spawned from worker threads (worker 0 included).
+ */
+
+struct job_counter {
+        std::atomic<uint32_t> pending{0};
+};
+
+struct job {
+        void (*fn)(void *data, size_t begin, size_t end);
+        void *data;
+        size_t begin;
+        size_t end;
+        // ranges longer than this are split in two before running
+        size_t grain;
+        job_counter *counter;
+};
+
+#define JOB_DEQUE_SIZE 4096
+
+/*
+ * Chase-Lev deque (Le, Pop, Cohen, Zappa Nardelli, "Correct and Efficient
+ * Work-Stealing for Weak Memory Models"), fixed size.
+ */
+struct job_deque {
+        alignas(64) std::atomic<int64_t> top{0};
+        alignas(64) std::atomic<int64_t> bottom{0};
+        std::atomic<job*> jobs[JOB_DEQUE_SIZE];
+};
+
+// owner only; false when full
+static bool
+job_deque_push(job_deque& deque, job *j)
+{
+        int64_t b = deque.bottom.load(std::memory_order_relaxed);
+        int64_t t = deque.top.load(std::memory_order_acquire);
+        if (b - t >= JOB_DEQUE_SIZE)
+                return false;
+
+        deque.jobs[b % JOB_DEQUE_SIZE].store(j, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        deque.bottom.store(b + 1, std::memory_order_relaxed);
+
+        return true;
+}
+
+// owner only
+static job*
+job_deque_pop(job_deque& deque)
+{
+        int64_t b = deque.bottom.load(std::memory_order_relaxed) - 1;
+        deque.bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = deque.top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+                deque.bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+        }
+
+        job *j = deque.jobs[b % JOB_DEQUE_SIZE].load(std::memory_order_relaxed);
+        if (t == b) {
+                // last job: race the thieves for it
+                if (!deque.top.compare_exchange_strong(t,
+                                                       t + 1,
+                                                       std::memory_order_seq_cst,
+                                                       std::memory_order_relaxed))
+                        j = nullptr;
+                deque.bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        return j;
+}
+
+// any thread
+static job*
+job_deque_steal(job_deque& deque)
+{
+        int64_t t = deque.top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = deque.bottom.load(std::memory_order_acquire);
+        if (t >= b)
+                return nullptr;
+
+        job *j = deque.jobs[t % JOB_DEQUE_SIZE].load(std::memory_order_relaxed);
+        if (!deque.top.compare_exchange_strong(t,
+                                               t + 1,
+                                               std::memory_order_seq_cst,
+                                               std::memory_order_relaxed))
+                return nullptr;
+
+        return j;
+}
+
+struct job_system {
+        std::vector<job_deque*> deques;
+        std::vector<std::thread> threads;
+        std::atomic<bool> quit{false};
+
+        // idle workers sleep here rather than spin between frames
+        std::mutex sleep_mutex;
+        std::condition_variable sleep_cv;
+        std::atomic<uint32_t> sleepers{0};
+};
+
+// index of the calling thread's deque, -1 for threads outside the system
+static thread_local int32_t job_worker_index = -1;
+
+static void job_run(job_system& system, job *j);
+
+static void
+job_push(job_system& system, job *j)
+{
+        if (!job_deque_push(*system.deques[job_worker_index], j)) {
+                // deque full: no parallelism left to gain, run it here
+                job_run(system, j);
+                return;
+        }
+        if (system.sleepers.load(std::memory_order_relaxed) > 0)
+                system.sleep_cv.notify_one();
+}
+
+/*
+ * Runs a job, first splitting off the upper halves of its range as new
+ * jobs for thieves until what's left is at most one grain. Split points
+ * stay on multiples of grain from the original begin, so every range fn
+ * sees is [begin + k * grain, min(begin + (k + 1) * grain, end)).
+ */
+static void
+job_run(job_system& system, job *j)
+{
+        while (j->end - j->begin > j->grain) {
+                size_t chunks = (j->end - j->begin + j->grain - 1) / j->grain;
+                size_t mid = j->begin + (chunks / 2) * j->grain;
+
+                job *half = new job(*j);
+                half->begin = mid;
+                j->end = mid;
+                j->counter->pending.fetch_add(1, std::memory_order_relaxed);
+                job_push(system, half);
+        }
+
+        j->fn(j->data, j->begin, j->end);
+        j->counter->pending.fetch_sub(1, std::memory_order_release);
+        delete j;
+}
+
+/*
+ * Finds a job for the calling worker: its own deque first, then the others
+ * starting from a neighbour. Returns false if there was nothing to run.
+ */
+static bool
+job_run_one(job_system& system)
+{
+        int32_t self = job_worker_index;
+        job *j = job_deque_pop(*system.deques[self]);
+
+        int32_t n = system.deques.size();
+        for (int32_t i = 1; (j == nullptr) && (i < n); ++i)
+                j = job_deque_steal(*system.deques[(self + i) % n]);
+
+        if (j == nullptr)
+                return false;
+        job_run(system, j);
+
+        return true;
+}
+
+static void
+job_worker_thread(job_system *system, int32_t index)
+{
+        job_worker_index = index;
+        profile_thread_name("job worker");
+        uint32_t idle = 0;
+        while (!system->quit.load(std::memory_order_relaxed)) {
+                if (job_run_one(*system)) {
+                        idle = 0;
+                        continue;
+                }
+                if (++idle < 64) {
+                        std::this_thread::yield();
+                        continue;
+                }
+
+                // a spawn between the failed steal and the wait is picked up
+                // at the timeout at the latest
+                std::unique_lock<std::mutex> lock(system->sleep_mutex);
+                system->sleepers.fetch_add(1, std::memory_order_relaxed);
+                system->sleep_cv.wait_for(lock, std::chrono::milliseconds(1));
+                system->sleepers.fetch_sub(1, std::memory_order_relaxed);
+                idle = 0;
+        }
+}
+
+/*
+ * Starts n_threads - 1 workers next to the calling thread (one per core
+ * when 0).
+ */
+static void
+job_system_start(job_system& system, uint32_t n_threads = 0)
+{
+        if (n_threads == 0)
+                n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (uint32_t i = 0; i < n_threads; ++i)
+                system.deques.push_back(new job_deque);
+
+        job_worker_index = 0;
+        for (uint32_t i = 1; i < n_threads; ++i)
+                system.threads.emplace_back(job_worker_thread, &system, i);
+}
+
+static void
+job_system_stop(job_system& system)
+{
+        system.quit = true;
+        system.sleep_cv.notify_all();
+        for (std::thread& thread : system.threads)
+                thread.join();
+        system.threads.clear();
+
+        for (job_deque *deque : system.deques)
+                delete deque;
+        system.deques.clear();
+        job_worker_index = -1;
+}
+
+/*
+ * Queues fn(data, begin, end) under counter; ranges longer than grain are
+ * split across workers (see job_run). Returns immediately.
+ */
+static void
+job_spawn(job_system& system,
+          job_counter& counter,
+          void (*fn)(void *data, size_t begin, size_t end),
+          void *data,
+          size_t begin,
+          size_t end,
+          size_t grain)
+{
+        if (begin >= end)
+                return;
+
+        job *j = new job;
+        j->fn = fn;
+        j->data = data;
+        j->begin = begin;
+        j->end = end;
+        j->grain = std::max<size_t>(grain, 1);
+        j->counter = &counter;
+        counter.pending.fetch_add(1, std::memory_order_relaxed);
+        job_push(system, j);
+}
+
+/*
+ * Runs jobs, its own or stolen, until everything spawned under counter has
+ * finished.
+ */
+static void
+job_join(job_system& system, job_counter& counter)
+{
+        while (counter.pending.load(std::memory_order_acquire) > 0)
+                if (!job_run_one(system))
+                        std::this_thread::yield();
+}
+
+/*
+ * Fork/join loop: calls f(begin, end) on grain-sized pieces of [begin, end)
+ * across all workers and returns once every piece is done.
+ */
+template <typename F>
+static void
+parallel_for(job_system& system, size_t begin, size_t end, size_t grain, F&& f)
+{
+        typedef typename std::remove_reference<F>::type func;
+        job_counter counter;
+        job_spawn(system,
+                  counter,
+                  [](void *data, size_t b, size_t e) { (*(func*)data)(b, e); },
+                  (void*)&f,
+                  begin,
+                  end,
+                  grain);
+        job_join(system, counter);
+}
+
+#endif /* _LEARN_GL_JOBS_H_ */
@@ -5,11 +5,17 @@
 #include "stb_image.h"
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include "headless.h"
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
 
 static void
 checkCompileErrors(uint32_t shader, std::string type)
@@ -32,8 +38,8 @@ checkCompileErrors(uint32_t shader, std::string type)
         }
 }
 
-static uint32_t
-create_shader(const char* path, int32_t shader_type)
+static std::string
+read_shader_source(const char* path)
 {
         std::string code;
         std::ifstream shader_file;
@@ -56,16 +62,28 @@ create_shader(const char* path, int32_t shader_type)
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
         }
 
+        return code;
+}
+
+static uint32_t
+compile_shader(const std::string& code, int32_t shader_type, const char* name)
+{
         const char* code_c = code.c_str();
 
         uint32_t shader = glCreateShader(shader_type);
         glShaderSource(shader, 1, &code_c, NULL);
         glCompileShader(shader);
-        checkCompileErrors(shader, path);
+        checkCompileErrors(shader, name);
 
         return shader;
 }
 
+static uint32_t
+create_shader(const char* path, int32_t shader_type)
+{
+        return compile_shader(read_shader_source(path), shader_type, path);
+}
+
 static uint32_t
 create_shader_program(uint32_t vertex, uint32_t fragment)
 {
@@ -81,6 +99,363 @@ create_shader_program(uint32_t vertex, uint32_t fragment)
         return shaderProgram;
 }
 
+/*
+ * FNV-1a hash of a uniform name. constexpr so that names given as literals
+ * are hashed at compile time and uniform lookups never touch a string.
+ */
+static constexpr uint32_t
+uniform_hash(const char *name, uint32_t hash = 2166136261u)
+{
+        return (*name == '\0') ?
+                hash :
+                uniform_hash(name + 1, (hash ^ (uint8_t)*name) * 16777619u);
+}
+
+/*
+ * Typed handle to a uniform location. T selects the glUniform* overload in
+ * set_uniform, so a handle can't be fed the wrong kind of value.
+ */
+template <typename T>
+struct uniform {
+        int32_t location = -1;
+};
+
+/*
+ * Camera state shared by every program through the std140 "Camera" uniform
+ * block, which create_program attaches to CAMERA_UBO_BINDING. Member order
+ * and types must match the block declared in the vertex shaders.
+ */
+#define CAMERA_UBO_BINDING 0
+
+struct camera_block {
+        glm::mat4 view;
+        glm::mat4 projection;
+};
+static_assert(sizeof(camera_block) == 2 * 64, "camera_block must match std140");
+
+struct shader_program {
+        uint32_t id = 0;
+        // active uniform locations keyed by uniform_hash of their name
+        std::unordered_map<uint32_t, int32_t> locations;
+};
+
+/*
+ * Enumerates the active uniforms of a linked program once, so that handles
+ * can be resolved without calling glGetUniformLocation, and attaches its
+ * Camera block (if any) to CAMERA_UBO_BINDING.
+ */
+static void
+init_program_uniforms(shader_program& program)
+{
+        program.locations.clear();
+
+        int32_t n_uniforms = 0;
+        glGetProgramiv(program.id, GL_ACTIVE_UNIFORMS, &n_uniforms);
+        int32_t max_len = 0;
+        glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_len);
+
+        std::string name(max_len, '\0');
+        for (int32_t i = 0; i < n_uniforms; ++i) {
+                int32_t len;
+                int32_t size;
+                GLenum type;
+                glGetActiveUniform(program.id,
+                                   i,
+                                   max_len,
+                                   &len,
+                                   &size,
+                                   &type,
+                                   &name[0]);
+                // arrays are reported as "name[0]", but looked up as "name"
+                std::string key = name.substr(0, len);
+                if ((key.size() > 3) &&
+                    (key.compare(key.size() - 3, 3, "[0]") == 0))
+                        key.resize(key.size() - 3);
+
+                // uniforms in blocks have no location of their own
+                int32_t location = glGetUniformLocation(program.id, key.c_str());
+                if (location < 0)
+                        continue;
+
+                uint32_t hash = uniform_hash(key.c_str());
+                if (program.locations.count(hash) != 0)
+                        fprintf(stderr,
+                                "ERROR::PROGRAM::UNIFORM_HASH_COLLISION %s\n",
+                                key.c_str());
+                program.locations[hash] = location;
+        }
+
+        uint32_t camera_index = glGetUniformBlockIndex(program.id, "Camera");
+        if (camera_index != GL_INVALID_INDEX)
+                glUniformBlockBinding(program.id, camera_index, CAMERA_UBO_BINDING);
+}
+
+/*
+ * Links vertex and fragment into a program (see create_shader_program) and
+ * builds its uniform table.
+ */
+static shader_program
+create_program(uint32_t vertex, uint32_t fragment)
+{
+        shader_program program;
+        program.id = create_shader_program(vertex, fragment);
+        init_program_uniforms(program);
+
+        return program;
+}
+
+/*
+ * On-disk program binary cache. Entries are keyed by a hash of both
+ * shader sources, the defines and the driver's vendor/renderer/version, so
+ * a driver update or shader edit simply misses. A binary the driver
+ * rejects is treated as a miss and overwritten.
+ */
+#define SHADER_CACHE_DIR "./shader_cache"
+#define SHADER_CACHE_MAGIC 0x4c475042u /* "LGPB" */
+
+struct shader_cache_header {
+        uint32_t magic;
+        uint32_t format;
+        uint32_t length;
+        uint32_t reserved;
+};
+
+static uint64_t
+fnv1a_64(const void *data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+        const uint8_t *bytes = (const uint8_t*)data;
+        for (size_t i = 0; i < size; ++i)
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+
+        return hash;
+}
+
+static uint64_t
+fnv1a_64(const char *str, uint64_t hash)
+{
+        // the terminator is hashed too, so "ab" + "c" != "a" + "bc"
+        return fnv1a_64(str, strlen(str) + 1, hash);
+}
+
+/*
+ * Inserts defines (e.g. "#define FOO 1\n") after the #version line, which
+ * must stay first.
+ */
+static std::string
+insert_defines(const std::string& code, const char* defines)
+{
+        if (*defines == '\0')
+                return code;
+
+        size_t pos = 0;
+        if (code.compare(0, 8, "#version") == 0) {
+                pos = code.find('\n');
+                pos = (pos == std::string::npos) ? code.size() : pos + 1;
+        }
+
+        return code.substr(0, pos) + defines + code.substr(pos);
+}
+
+static bool
+program_binaries_supported(void)
+{
+        if (!GLAD_GL_VERSION_4_1 && !GLAD_GL_ARB_get_program_binary)
+                return false;
+
+        int32_t n_formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
+
+        return n_formats > 0;
+}
+
+static std::string
+shader_cache_path(const std::string& vs_code,
+                  const std::string& fs_code,
+                  const char* defines)
+{
+        uint64_t hash = fnv1a_64(vs_code.c_str(), 14695981039346656037ull);
+        hash = fnv1a_64(fs_code.c_str(), hash);
+        hash = fnv1a_64(defines, hash);
+        hash = fnv1a_64((const char*)glGetString(GL_VENDOR), hash);
+        hash = fnv1a_64((const char*)glGetString(GL_RENDERER), hash);
+        hash = fnv1a_64((const char*)glGetString(GL_VERSION), hash);
+
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)hash);
+
+        return std::string(SHADER_CACHE_DIR) + name;
+}
+
+/*
+ * Returns a linked program loaded from the cache file at path, or 0 if
+ * there is no usable entry: a binary whose length is not what follows the
+ * header, as a truncated or corrupt file has, is a miss.
+ */
+static uint32_t
+load_program_binary(const std::string& path)
+{
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == NULL)
+                return 0;
+
+        long size = -1;
+        if (fseek(file, 0, SEEK_END) == 0)
+                size = ftell(file);
+        rewind(file);
+
+        shader_cache_header header;
+        std::string binary;
+        bool ok = (size >= (long)sizeof(header)) &&
+                  (fread(&header, sizeof(header), 1, file) == 1) &&
+                  (header.magic == SHADER_CACHE_MAGIC) &&
+                  (header.length != 0) &&
+                  (header.length == (unsigned long)size - sizeof(header));
+        if (ok) {
+                binary.resize(header.length);
+                ok = fread(&binary[0], 1, header.length, file) == header.length;
+        }
+        fclose(file);
+        if (!ok)
+                return 0;
+
+        uint32_t program = glCreateProgram();
+        glProgramBinary(program, header.format, binary.data(), header.length);
+
+        int32_t success;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        if (!success) {
+                glDeleteProgram(program);
+                return 0;
+        }
+
+        return program;
+}
+
+static void
+store_program_binary(const std::string& path, uint32_t program)
+{
+        int32_t length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+                return;
+
+        std::string binary(length, '\0');
+        GLenum format;
+        glGetProgramBinary(program, length, &length, &format, &binary[0]);
+
+        shader_cache_header header;
+        header.magic = SHADER_CACHE_MAGIC;
+        header.format = format;
+        header.length = length;
+        header.reserved = 0;
+
+        // write then rename, so a concurrent or interrupted run never sees
+        // a truncated entry
+        mkdir(SHADER_CACHE_DIR, 0755);
+        std::string tmp_path = path + ".tmp";
+        FILE *file = fopen(tmp_path.c_str(), "wb");
+        if (file == NULL)
+                return;
+        bool ok = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+                  (fwrite(binary.data(), 1, length, file) == (size_t)length);
+        ok = (fclose(file) == 0) && ok;
+        if (ok)
+                rename(tmp_path.c_str(), path.c_str());
+        else
+                remove(tmp_path.c_str());
+}
+
+/*
+ * Like create_program, but from shader files, with optional defines, and
+ * through the on-disk binary cache: a hit skips compiling and linking
+ * entirely, a miss compiles as usual and stores the linked binary.
+ */
+static shader_program
+create_program_cached(const char* vs_path,
+                      const char* fs_path,
+                      const char* defines = "")
+{
+        std::string vs_code = insert_defines(read_shader_source(vs_path), defines);
+        std::string fs_code = insert_defines(read_shader_source(fs_path), defines);
+
+        bool use_cache = program_binaries_supported();
+        std::string path;
+
+        shader_program program;
+        if (use_cache) {
+                path = shader_cache_path(vs_code, fs_code, defines);
+                program.id = load_program_binary(path);
+        }
+
+        if (program.id == 0) {
+                uint32_t vertex = compile_shader(vs_code, GL_VERTEX_SHADER, vs_path);
+                uint32_t fragment = compile_shader(fs_code, GL_FRAGMENT_SHADER, fs_path);
+
+                program.id = glCreateProgram();
+                if (use_cache)
+                        glProgramParameteri(program.id,
+                                            GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                                            GL_TRUE);
+                glAttachShader(program.id, vertex);
+                glAttachShader(program.id, fragment);
+                glLinkProgram(program.id);
+                checkCompileErrors(program.id, "PROGRAM");
+                glDeleteShader(vertex);
+                glDeleteShader(fragment);
+
+                int32_t success;
+                glGetProgramiv(program.id, GL_LINK_STATUS, &success);
+                if (use_cache && success)
+                        store_program_binary(path, program.id);
+        }
+
+        init_program_uniforms(program);
+
+        return program;
+}
+
+/*
+ * Resolves a uniform handle from the table built by create_program. Names
+ * that aren't active (e.g. optimised out) yield location -1, which the
+ * glUniform* calls silently ignore.
+ */
+template <typename T>
+static uniform<T>
+get_uniform(const shader_program& program, uint32_t name_hash)
+{
+        uniform<T> handle;
+        auto it = program.locations.find(name_hash);
+        if (it != program.locations.end())
+                handle.location = it->second;
+
+        return handle;
+}
+
+template <typename T>
+static uniform<T>
+get_uniform(const shader_program& program, const char *name)
+{
+        return get_uniform<T>(program, uniform_hash(name));
+}
+
+static void
+set_uniform(uniform<int32_t> handle, int32_t value)
+{
+        glUniform1i(handle.location, value);
+}
+
+static void
+set_uniform(uniform<float> handle, float value)
+{
+        glUniform1f(handle.location, value);
+}
+
+static void
+set_uniform(uniform<glm::mat4> handle, const glm::mat4& value)
+{
+        glUniformMatrix4fv(handle.location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
 static void
 framebuffer_size_callback(GLFWwindow* window, int32_t width, int32_t height)
 {
@@ -90,6 +465,10 @@ framebuffer_size_callback(GLFWwindow* window, int32_t width, int32_t height)
 static GLFWwindow*
 init_gl(uint32_t scrwidth, uint32_t scrheight)
 {
+        uint32_t headless_frames = headless_frame_count();
+        if (headless_frames > 0)
+                return create_headless_window(scrwidth, scrheight, headless_frames);
+
         glfwInit();
         glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
         glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -113,6 +492,8 @@ init_gl(uint32_t scrwidth, uint32_t scrheight)
                 fprintf(stderr, "%s\n", "Failed to initialize GLAD");
                 return NULL;
         }
+        gl_state_init();
+        profile_init();
 
         return window;
 }
@@ -120,29 +501,32 @@ init_gl(uint32_t scrwidth, uint32_t scrheight)
 static uint32_t
 init_VAO(float *vertices,
          size_t verts_sz,
-         uint32_t *indices,
-         size_t indices_sz)
+         uint32_t *indices = NULL,
+         size_t indices_sz = 0)
 {
         uint32_t VAO;
         uint32_t VBO;
-        uint32_t EBO;
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
-        glGenBuffers(1, &EBO);
 
-        glBindVertexArray(VAO);
+        state_bind_vertex_array(VAO);
 
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        state_bind_buffer(GL_ARRAY_BUFFER, VBO);
         glBufferData(GL_ARRAY_BUFFER,
                      verts_sz,
                      vertices,
                      GL_STATIC_DRAW);
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                     indices_sz,
-                     indices,
-                     GL_STATIC_DRAW);
+        // non-indexed meshes (drawn with glDrawArrays) don't need an EBO
+        if (indices != NULL) {
+                uint32_t EBO;
+                glGenBuffers(1, &EBO);
+                state_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                             indices_sz,
+                             indices,
+                             GL_STATIC_DRAW);
+        }
 
         return VAO;
 }
@@ -159,34 +543,300 @@ init_vert_attr(uint32_t index, int32_t size, size_t stride, size_t offset)
         glEnableVertexAttribArray(index);
 }
 
-static int32_t
-load_texture_image(const char *fname, GLenum format)
-{
-        int32_t width;
-        int32_t height;
-        int32_t nrChannels;
-        uint8_t *data = stbi_load(fname,
-                                  &width,
-                                  &height,
-                                  &nrChannels,
-                                  0);
-        if (data == NULL)
-                return 1;
-
-        glTexImage2D(GL_TEXTURE_2D,
-                     0,
-                     GL_RGB,
-                     width,
-                     height,
-                     0,
-                     format,
-                     GL_UNSIGNED_BYTE,
-                     data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        stbi_image_free(data);
-
-        return 0;
+/*
+ * Creates a per-instance mat4 attribute occupying locations index..index + 3
+ * (one vec4 column each) of the currently bound VAO, backed by a new VBO
+ * sized for max_instances matrices. The VBO is returned so the caller can
+ * refill it every frame.
+ */
+static uint32_t
+init_instance_mat4_attr(uint32_t index, size_t max_instances)
+{
+        uint32_t VBO;
+        glGenBuffers(1, &VBO);
+        state_bind_buffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER,
+                     max_instances * 16 * sizeof(float),
+                     NULL,
+                     GL_STREAM_DRAW);
+
+        for (uint32_t col = 0; col < 4; ++col) {
+                init_vert_attr(index + col, 4, 16, 4 * col);
+                glVertexAttribDivisor(index + col, 1);
+        }
+
+        return VBO;
+}
+
+/*
+ * Streaming buffer for data rewritten every frame (instance attributes,
+ * uniform blocks). One buffer holds STREAM_FRAMES regions of frame_size
+ * bytes; each frame sub-allocates from the next region, and a fence placed
+ * when the frame moves on keeps the CPU from overwriting a region until
+ * the GPU is done with it. Writing is then a plain memcpy, with no driver
+ * synchronisation or orphaning.
+ *
+ * With GL 4.4 / ARB_buffer_storage the buffer stays persistently and
+ * coherently mapped. Otherwise every allocation maps its range
+ * unsynchronized (the fences provide the synchronisation) and
+ * stream_buffer_unmap must be called before drawing from it.
+ */
+#define STREAM_FRAMES 3
+
+struct stream_buffer {
+        uint32_t buffer = 0;
+        GLenum target = GL_ARRAY_BUFFER;
+        size_t frame_size = 0;
+        // NULL unless persistently mapped
+        uint8_t *persistent = NULL;
+        bool mapped = false;
+
+        uint32_t frame = 0;
+        size_t head = 0;
+        GLsync fences[STREAM_FRAMES] = {};
+        // frames that had to wait for the GPU to release their region
+        uint32_t stalls = 0;
+};
+
+static bool
+buffer_storage_supported(void)
+{
+        return GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage;
+}
+
+static void
+init_stream_buffer(stream_buffer& stream, GLenum target, size_t frame_size)
+{
+        stream = stream_buffer();
+        stream.target = target;
+        stream.frame_size = frame_size;
+        size_t size = STREAM_FRAMES * frame_size;
+
+        glGenBuffers(1, &stream.buffer);
+        state_bind_buffer(target, stream.buffer);
+        if (buffer_storage_supported()) {
+                GLbitfield flags = GL_MAP_WRITE_BIT |
+                                   GL_MAP_PERSISTENT_BIT |
+                                   GL_MAP_COHERENT_BIT;
+                glBufferStorage(target, size, NULL, flags);
+                stream.persistent = (uint8_t*)glMapBufferRange(target, 0, size, flags);
+        } else {
+                glBufferData(target, size, NULL, GL_STREAM_DRAW);
+        }
+}
+
+static void
+destroy_stream_buffer(stream_buffer& stream)
+{
+        for (GLsync& fence : stream.fences)
+                if (fence != NULL)
+                        glDeleteSync(fence);
+        if (stream.persistent != NULL) {
+                state_bind_buffer(stream.target, stream.buffer);
+                glUnmapBuffer(stream.target);
+        }
+        state_delete_buffers(1, &stream.buffer);
+        stream = stream_buffer();
+}
+
+/*
+ * Starts the stream's next frame: fences the region just written and waits,
+ * if it must, for the GPU to finish with the one about to be reused. Call
+ * once per frame, before the frame's first stream_buffer_alloc.
+ */
+static void
+stream_buffer_next_frame(stream_buffer& stream)
+{
+        if (stream.fences[stream.frame] != NULL)
+                glDeleteSync(stream.fences[stream.frame]);
+        stream.fences[stream.frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        stream.frame = (stream.frame + 1) % STREAM_FRAMES;
+        stream.head = 0;
+        GLsync fence = stream.fences[stream.frame];
+        if (fence == NULL)
+                return;
+
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if ((status == GL_TIMEOUT_EXPIRED) || (status == GL_WAIT_FAILED)) {
+                ++stream.stalls;
+                while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) ==
+                       GL_TIMEOUT_EXPIRED)
+                        ;
+        }
+        glDeleteSync(fence);
+        stream.fences[stream.frame] = NULL;
+}
+
+/*
+ * Returns a write pointer to size bytes of this frame's region, aligned to
+ * align (a power of two), and their offset into the buffer; NULL if the
+ * region is full, or if mapping the range failed, in which case the range
+ * is still taken and its offset set, for glBufferSubData. Leaves the
+ * buffer bound to its target.
+ */
+static void*
+stream_buffer_alloc(stream_buffer& stream, size_t size, size_t align, size_t *offset)
+{
+        size_t head = (stream.head + align - 1) & ~(align - 1);
+        if (head + size > stream.frame_size)
+                return NULL;
+        stream.head = head + size;
+        *offset = stream.frame * stream.frame_size + head;
+
+        state_bind_buffer(stream.target, stream.buffer);
+        if (stream.persistent != NULL)
+                return stream.persistent + *offset;
+
+        void *dst = glMapBufferRange(stream.target,
+                                     *offset,
+                                     size,
+                                     GL_MAP_WRITE_BIT |
+                                     GL_MAP_INVALIDATE_RANGE_BIT |
+                                     GL_MAP_UNSYNCHRONIZED_BIT);
+        stream.mapped = (dst != NULL);
+        return dst;
+}
+
+// ends the write of the last stream_buffer_alloc; free when persistent
+static void
+stream_buffer_unmap(stream_buffer& stream)
+{
+        if (!stream.mapped)
+                return;
+
+        state_bind_buffer(stream.target, stream.buffer);
+        glUnmapBuffer(stream.target);
+        stream.mapped = false;
+}
+
+/*
+ * Suballocating arena for static data (meshes): one immutable-sized buffer
+ * that many meshes' vertices and indices are packed into, so they share a
+ * buffer object instead of each paying for its own. Allocations are never
+ * freed individually; the arena goes away as a whole.
+ */
+struct buffer_arena {
+        uint32_t buffer = 0;
+        size_t size = 0;
+        size_t head = 0;
+};
+
+static void
+init_buffer_arena(buffer_arena& arena, size_t size)
+{
+        arena = buffer_arena();
+        arena.size = size;
+        glGenBuffers(1, &arena.buffer);
+        // bound to COPY_WRITE so no VAO's element binding is disturbed
+        state_bind_buffer(GL_COPY_WRITE_BUFFER, arena.buffer);
+        if (buffer_storage_supported())
+                glBufferStorage(GL_COPY_WRITE_BUFFER, size, NULL, GL_DYNAMIC_STORAGE_BIT);
+        else
+                glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STATIC_DRAW);
+}
+
+/*
+ * Copies size bytes of data into the arena at an offset aligned to align
+ * (a power of two) and returns that offset, or SIZE_MAX if it is full.
+ */
+static size_t
+buffer_arena_upload(buffer_arena& arena, const void *data, size_t size, size_t align)
+{
+        size_t offset = (arena.head + align - 1) & ~(align - 1);
+        if (offset + size > arena.size)
+                return SIZE_MAX;
+        arena.head = offset + size;
+
+        state_bind_buffer(GL_COPY_WRITE_BUFFER, arena.buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+
+        return offset;
+}
+
+static void
+destroy_buffer_arena(buffer_arena& arena)
+{
+        state_delete_buffers(1, &arena.buffer);
+        arena = buffer_arena();
+}
+
+/*
+ * Points the per-instance mat4 attribute at locations index..index + 3 of
+ * the bound VAO at offset bytes into buffer.
+ */
+static void
+bind_instance_mat4_attr(uint32_t index, uint32_t buffer, size_t offset)
+{
+        state_bind_buffer(GL_ARRAY_BUFFER, buffer);
+        for (uint32_t col = 0; col < 4; ++col) {
+                glVertexAttribPointer(index + col,
+                                      4,
+                                      GL_FLOAT,
+                                      GL_FALSE,
+                                      16 * sizeof(float),
+                                      (void*)(offset + 4 * col * sizeof(float)));
+                glEnableVertexAttribArray(index + col);
+                glVertexAttribDivisor(index + col, 1);
+        }
+}
+
+/*
+ * The camera block streams through a ring (see stream_buffer), bound to
+ * CAMERA_UBO_BINDING where every program created by create_program looks
+ * for it. Room for a few updates a frame.
+ */
+#define CAMERA_UPDATES_PER_FRAME 4
+
+// queried once; it is a constant of the implementation
+static size_t
+uniform_buffer_alignment(void)
+{
+        static int32_t align = 0;
+        if (align == 0)
+                glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+
+        return align;
+}
+
+static void
+init_camera_stream(stream_buffer& stream)
+{
+        size_t align = uniform_buffer_alignment();
+        size_t slot = (sizeof(camera_block) + align - 1) & ~(align - 1);
+        init_stream_buffer(stream, GL_UNIFORM_BUFFER, CAMERA_UPDATES_PER_FRAME * slot);
+}
+
+/*
+ * Writes this frame's camera once for all programs. The first update of a
+ * frame must say so, to move the ring on.
+ */
+static void
+update_camera_stream(stream_buffer& stream, const camera_block& camera, bool new_frame = true)
+{
+        if (new_frame)
+                stream_buffer_next_frame(stream);
+
+        size_t offset = SIZE_MAX;
+        void *dst = stream_buffer_alloc(stream,
+                                        sizeof(camera_block),
+                                        uniform_buffer_alignment(),
+                                        &offset);
+        if (dst != NULL) {
+                memcpy(dst, &camera, sizeof(camera_block));
+                stream_buffer_unmap(stream);
+        } else if (offset != SIZE_MAX) {
+                // the map failed, the range is still ours
+                glBufferSubData(stream.target, offset, sizeof(camera_block), &camera);
+        } else {
+                return;
+        }
+
+        state_bind_buffer_range(GL_UNIFORM_BUFFER,
+                                CAMERA_UBO_BINDING,
+                                stream.buffer,
+                                offset,
+                                sizeof(camera_block));
 }
 
 #endif /* _LEARN_GL_H_ */
@@ -0,0 +1,127 @@
+#ifndef _LEARN_GL_LOCKFREE_H_
+#define _LEARN_GL_LOCKFREE_H_
+
+#include <atomic>
+
+/*
+ * Intrusive multi-producer/single-consumer queue (Vyukov). Producers never
+ * block or spin: a push is one atomic exchange plus a store. Embed an
+ * mpsc_node as the first base of whatever is being queued.
+ */
+struct mpsc_node {
+        std::atomic<mpsc_node*> next{nullptr};
+};
+
+struct mpsc_queue {
+        std::atomic<mpsc_node*> head;
+        mpsc_node *tail;
+        mpsc_node stub;
+
+        mpsc_queue() : head(&stub), tail(&stub) {}
+        mpsc_queue(const mpsc_queue&) = delete;
+        mpsc_queue& operator=(const mpsc_queue&) = delete;
+};
+
+static void
+mpsc_push(mpsc_queue& queue, mpsc_node *node)
+{
+        node->next.store(nullptr, std::memory_order_relaxed);
+        mpsc_node *prev = queue.head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+}
+
+/*
+ * Consumer side only. Returns NULL when the queue is empty, or when a
+ * producer is midway through a push (the node shows up on a later pop).
+ */
+static mpsc_node*
+mpsc_pop(mpsc_queue& queue)
+{
+        mpsc_node *tail = queue.tail;
+        mpsc_node *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &queue.stub) {
+                if (next == nullptr)
+                        return nullptr;
+                queue.tail = next;
+                tail = next;
+                next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+                queue.tail = next;
+                return tail;
+        }
+        if (tail != queue.head.load(std::memory_order_acquire))
+                return nullptr;
+
+        mpsc_push(queue, &queue.stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+                queue.tail = next;
+                return tail;
+        }
+
+        return nullptr;
+}
+
+/*
+ * Single-producer/single-consumer triple buffer. The producer always has a
+ * slot of its own to write and the consumer always holds the newest
+ * complete one, so neither side ever waits for the other; values the
+ * consumer is too slow to see are dropped. Publishing swaps the written
+ * slot with the shared middle one, and acquiring swaps the middle one in
+ * if it was published since.
+ */
+#define TRIPLE_BUFFER_FRESH 4u
+
+template <typename T>
+struct triple_buffer {
+        T slots[3];
+        // the middle slot, | TRIPLE_BUFFER_FRESH until the consumer takes it
+        std::atomic<uint32_t> middle{1};
+        // producer only
+        uint32_t back = 0;
+        // consumer only
+        uint32_t front = 2;
+};
+
+// the producer's slot; it holds whatever was published two swaps ago
+template <typename T>
+static T&
+triple_buffer_back(triple_buffer<T>& buffer)
+{
+        return buffer.slots[buffer.back];
+}
+
+template <typename T>
+static void
+triple_buffer_publish(triple_buffer<T>& buffer)
+{
+        uint32_t old = buffer.middle.exchange(buffer.back | TRIPLE_BUFFER_FRESH,
+                                              std::memory_order_acq_rel);
+        buffer.back = old & 3;
+}
+
+/*
+ * Consumer side: takes the newest published value, if there is one the
+ * consumer hasn't seen, and returns whether it did.
+ */
+template <typename T>
+static bool
+triple_buffer_acquire(triple_buffer<T>& buffer)
+{
+        if ((buffer.middle.load(std::memory_order_relaxed) & TRIPLE_BUFFER_FRESH) == 0)
+                return false;
+        uint32_t old = buffer.middle.exchange(buffer.front, std::memory_order_acq_rel);
+        buffer.front = old & 3;
+
+        return true;
+}
+
+template <typename T>
+static const T&
+triple_buffer_front(const triple_buffer<T>& buffer)
+{
+        return buffer.slots[buffer.front];
+}
+
+#endif /* _LEARN_GL_LOCKFREE_H_ */
@@ -0,0 +1,1020 @@
+#ifndef _LEARN_GL_MESH_H_
+#define _LEARN_GL_MESH_H_
+
+#include "learngl.hpp"
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <cmath>
+#include <cstring>
+
+/*
+ * Mesh processing, run once when a mesh is built or loaded:
+ *
+ * - mesh_weld turns a non-indexed (or badly indexed) vertex stream into
+ *   unique vertices plus an index buffer, keying vertices by a hash of
+ *   their bits.
+ * - mesh_optimize_vertex_cache reorders triangles for the post-transform
+ *   vertex cache (Forsyth, "Linear-Speed Vertex Cache Optimisation"), so
+ *   shared vertices are shaded once rather than once per triangle.
+ * - mesh_optimize_vertex_fetch renumbers vertices in first-use order so
+ *   fetches walk the vertex buffer forwards.
+ * - mesh_generate_lods appends coarser index buffers over the same vertices
+ *   (mesh_simplify, quadric error metrics), for drawing far-away copies.
+ * - mesh_pack writes the final GPU layout: 16-bit indices when they fit,
+ *   and each attribute as float, half float or snorm16.
+ *
+ * Meshes are interleaved floats, stride floats per vertex, as init_VAO and
+ * init_vert_attr use.
+ */
+
+#define MESH_CACHE_SIZE 32
+// most LODs mesh_generate_lods makes, the full mesh included
+#define MESH_MAX_LODS 8
+// largest error mesh_generate_lods accepts, as a fraction of the mesh's
+// bounding radius
+#define MESH_LOD_MAX_ERROR 0.1f
+// border edges are held in place this much harder than faces are
+#define MESH_BORDER_WEIGHT 10.0f
+
+/*
+ * One level of detail: count indices from first, and how far from the full
+ * mesh its surface may be, in mesh units.
+ */
+struct mesh_lod {
+        uint32_t first;
+        uint32_t count;
+        float error;
+};
+
+struct mesh {
+        uint32_t stride = 0;
+        std::vector<float> vertices;
+        std::vector<uint32_t> indices;
+        // finest first; empty means one LOD of all the indices
+        std::vector<mesh_lod> lods;
+};
+
+/*
+ * Hashes and compares vertices (stride floats into a shared array) by
+ * their bits, with -0.0 taken as 0.0 so mirrored data still welds.
+ */
+struct mesh_vertex_key {
+        const float *vertices;
+        uint32_t stride;
+
+        uint32_t bits(uint32_t vertex, uint32_t i) const
+        {
+                float value = vertices[(size_t)vertex * stride + i];
+                if (value == 0.0f)
+                        value = 0.0f;
+                uint32_t b;
+                memcpy(&b, &value, sizeof(b));
+
+                return b;
+        }
+
+        size_t operator()(uint32_t vertex) const
+        {
+                uint64_t hash = 14695981039346656037ull;
+                for (uint32_t i = 0; i < stride; ++i) {
+                        uint32_t b = bits(vertex, i);
+                        hash = fnv1a_64(&b, sizeof(b), hash);
+                }
+
+                return hash;
+        }
+
+        bool operator()(uint32_t a, uint32_t b) const
+        {
+                for (uint32_t i = 0; i < stride; ++i)
+                        if (bits(a, i) != bits(b, i))
+                                return false;
+
+                return true;
+        }
+};
+
+/*
+ * Welds identical vertices. indices may be NULL for a non-indexed stream
+ * of n_vertices vertices (every three making a triangle); otherwise it
+ * holds n_indices indices into vertices.
+ */
+static mesh
+mesh_weld(const float *vertices,
+          size_t n_vertices,
+          uint32_t stride,
+          const uint32_t *indices = NULL,
+          size_t n_indices = 0)
+{
+        if (indices == NULL)
+                n_indices = n_vertices;
+
+        mesh_vertex_key key = {vertices, stride};
+        std::unordered_map<uint32_t, uint32_t, mesh_vertex_key, mesh_vertex_key>
+                unique(n_vertices, key, key);
+
+        mesh welded;
+        welded.stride = stride;
+        welded.indices.reserve(n_indices);
+        for (size_t i = 0; i < n_indices; ++i) {
+                uint32_t vertex = (indices != NULL) ? indices[i] : (uint32_t)i;
+                auto it = unique.emplace(vertex, (uint32_t)unique.size()).first;
+                if (it->second == welded.vertices.size() / stride) {
+                        const float *src = &vertices[(size_t)vertex * stride];
+                        welded.vertices.insert(welded.vertices.end(), src, src + stride);
+                }
+                welded.indices.push_back(it->second);
+        }
+
+        return welded;
+}
+
+static size_t
+mesh_vertex_count(const mesh& m)
+{
+        return m.vertices.size() / m.stride;
+}
+
+/*
+ * Average cache miss ratio: vertices transformed per triangle with a FIFO
+ * post-transform cache of cache_size entries. 3 is a triangle soup, ~0.5-0.7
+ * a well-ordered grid.
+ */
+static float
+mesh_acmr(const uint32_t *indices, size_t n_indices, uint32_t cache_size = MESH_CACHE_SIZE)
+{
+        if (n_indices < 3)
+                return 0.0f;
+
+        std::vector<uint32_t> fifo(cache_size, UINT32_MAX);
+        size_t head = 0;
+        size_t misses = 0;
+        for (size_t i = 0; i < n_indices; ++i) {
+                if (std::find(fifo.begin(), fifo.end(), indices[i]) != fifo.end())
+                        continue;
+                fifo[head] = indices[i];
+                head = (head + 1) % cache_size;
+                ++misses;
+        }
+
+        return (float)misses / (n_indices / 3);
+}
+
+static float
+forsyth_vertex_score(int32_t cache_position, uint32_t remaining)
+{
+        if (remaining == 0)
+                return -1.0f;
+
+        float score = 0.0f;
+        if (cache_position >= 0) {
+                // the last triangle's vertices score the same whatever their
+                // order, so it isn't favoured to emit it again
+                if (cache_position < 3)
+                        score = 0.75f;
+                else
+                        score = powf(1.0f - (cache_position - 3) /
+                                            (float)(MESH_CACHE_SIZE - 3),
+                                     1.5f);
+        }
+        // favour finishing off vertices with few triangles left
+        score += 2.0f * powf((float)remaining, -0.5f);
+
+        return score;
+}
+
+/*
+ * Greedy triangle reordering for the post-transform vertex cache. Every
+ * vertex is scored by its position in a simulated LRU cache and its count
+ * of unemitted triangles; the next triangle is the best scoring one
+ * touching the cache, falling back to the next unemitted one in order.
+ */
+static void
+optimize_vertex_cache(uint32_t *indices, size_t n_indices, size_t n_vertices)
+{
+        size_t n_triangles = n_indices / 3;
+        if (n_triangles == 0)
+                return;
+
+        // triangles of each vertex, as [offsets[v], offsets[v] + remaining[v])
+        std::vector<uint32_t> remaining(n_vertices, 0);
+        for (size_t i = 0; i < n_indices; ++i)
+                ++remaining[indices[i]];
+        std::vector<uint32_t> offsets(n_vertices + 1, 0);
+        for (size_t v = 0; v < n_vertices; ++v)
+                offsets[v + 1] = offsets[v] + remaining[v];
+        std::vector<uint32_t> adjacency(n_indices);
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t t = 0; t < n_triangles; ++t)
+                for (size_t k = 0; k < 3; ++k)
+                        adjacency[fill[indices[3 * t + k]]++] = t;
+
+        std::vector<int32_t> cache_position(n_vertices, -1);
+        std::vector<float> vertex_score(n_vertices);
+        for (size_t v = 0; v < n_vertices; ++v)
+                vertex_score[v] = forsyth_vertex_score(-1, remaining[v]);
+
+        std::vector<float> triangle_score(n_triangles);
+        std::vector<bool> emitted(n_triangles, false);
+        for (size_t t = 0; t < n_triangles; ++t)
+                triangle_score[t] = vertex_score[indices[3 * t]] +
+                                    vertex_score[indices[3 * t + 1]] +
+                                    vertex_score[indices[3 * t + 2]];
+
+        std::vector<uint32_t> cache;
+        std::vector<uint32_t> next_cache;
+        std::vector<uint32_t> ordered;
+        ordered.reserve(n_indices);
+        size_t cursor = 0;
+        int64_t best = 0;
+        while (ordered.size() < n_indices) {
+                if (best < 0) {
+                        while (emitted[cursor])
+                                ++cursor;
+                        best = cursor;
+                }
+
+                const uint32_t *tri = &indices[3 * best];
+                emitted[best] = true;
+                ordered.insert(ordered.end(), tri, tri + 3);
+
+                // move the triangle's vertices to the front of the cache
+                next_cache.assign(tri, tri + 3);
+                for (uint32_t v : cache)
+                        if ((v != tri[0]) && (v != tri[1]) && (v != tri[2]))
+                                next_cache.push_back(v);
+                for (size_t k = 0; k < 3; ++k) {
+                        uint32_t v = tri[k];
+                        uint32_t *first = &adjacency[offsets[v]];
+                        uint32_t *last = first + remaining[v];
+                        std::remove(first, last, (uint32_t)best);
+                        --remaining[v];
+                }
+
+                for (size_t i = 0; i < next_cache.size(); ++i) {
+                        uint32_t v = next_cache[i];
+                        cache_position[v] = (i < MESH_CACHE_SIZE) ? (int32_t)i : -1;
+                        vertex_score[v] = forsyth_vertex_score(cache_position[v], remaining[v]);
+                }
+                for (uint32_t v : next_cache)
+                        for (uint32_t i = 0; i < remaining[v]; ++i) {
+                                uint32_t t = adjacency[offsets[v] + i];
+                                triangle_score[t] = vertex_score[indices[3 * t]] +
+                                                    vertex_score[indices[3 * t + 1]] +
+                                                    vertex_score[indices[3 * t + 2]];
+                        }
+                if (next_cache.size() > MESH_CACHE_SIZE)
+                        next_cache.resize(MESH_CACHE_SIZE);
+                cache.swap(next_cache);
+
+                best = -1;
+                float best_score = -1.0f;
+                for (uint32_t v : cache)
+                        for (uint32_t i = 0; i < remaining[v]; ++i) {
+                                uint32_t t = adjacency[offsets[v] + i];
+                                if (triangle_score[t] > best_score) {
+                                        best_score = triangle_score[t];
+                                        best = t;
+                                }
+                        }
+        }
+
+        std::copy(ordered.begin(), ordered.end(), indices);
+}
+
+/*
+ * Reorders m's triangles for the vertex cache, each LOD's on their own so
+ * they stay in their ranges.
+ */
+static void
+mesh_optimize_vertex_cache(mesh& m)
+{
+        if (m.lods.empty()) {
+                optimize_vertex_cache(m.indices.data(), m.indices.size(), mesh_vertex_count(m));
+                return;
+        }
+        for (const mesh_lod& lod : m.lods)
+                optimize_vertex_cache(&m.indices[lod.first], lod.count, mesh_vertex_count(m));
+}
+
+/*
+ * Renumbers vertices in the order the index buffer first uses them, and
+ * drops vertices it never uses.
+ */
+static void
+mesh_optimize_vertex_fetch(mesh& m)
+{
+        std::vector<uint32_t> remap(mesh_vertex_count(m), UINT32_MAX);
+        std::vector<float> vertices;
+        vertices.reserve(m.vertices.size());
+        for (uint32_t& index : m.indices) {
+                if (remap[index] == UINT32_MAX) {
+                        remap[index] = vertices.size() / m.stride;
+                        const float *src = &m.vertices[(size_t)index * m.stride];
+                        vertices.insert(vertices.end(), src, src + m.stride);
+                }
+                index = remap[index];
+        }
+
+        m.vertices.swap(vertices);
+}
+
+/*
+ * The quadric of Garland and Heckbert, "Surface Simplification Using
+ * Quadric Error Metrics": the sum of squared distances to a set of planes,
+ * p.A.p + 2 b.p + c, with A symmetric. weight is the face area summed in,
+ * so error / weight is a mean squared distance.
+ */
+struct mesh_quadric {
+        double a00 = 0.0, a01 = 0.0, a02 = 0.0, a11 = 0.0, a12 = 0.0, a22 = 0.0;
+        double b0 = 0.0, b1 = 0.0, b2 = 0.0;
+        double c = 0.0;
+        double weight = 0.0;
+};
+
+// the plane n.p + d = 0, n unit length, w times
+static void
+quadric_add_plane(mesh_quadric& q, const glm::vec3& n, float d, double w)
+{
+        q.a00 += w * n.x * n.x;
+        q.a01 += w * n.x * n.y;
+        q.a02 += w * n.x * n.z;
+        q.a11 += w * n.y * n.y;
+        q.a12 += w * n.y * n.z;
+        q.a22 += w * n.z * n.z;
+        q.b0 += w * n.x * d;
+        q.b1 += w * n.y * d;
+        q.b2 += w * n.z * d;
+        q.c += w * d * d;
+}
+
+static void
+quadric_add(mesh_quadric& q, const mesh_quadric& r)
+{
+        q.a00 += r.a00;
+        q.a01 += r.a01;
+        q.a02 += r.a02;
+        q.a11 += r.a11;
+        q.a12 += r.a12;
+        q.a22 += r.a22;
+        q.b0 += r.b0;
+        q.b1 += r.b1;
+        q.b2 += r.b2;
+        q.c += r.c;
+        q.weight += r.weight;
+}
+
+// mean squared distance of p to q's planes
+static float
+quadric_error(const mesh_quadric& q, const glm::vec3& p)
+{
+        double x = p.x;
+        double y = p.y;
+        double z = p.z;
+        double e = x * (q.a00 * x + 2.0 * (q.a01 * y + q.a02 * z + q.b0)) +
+                   y * (q.a11 * y + 2.0 * (q.a12 * z + q.b1)) +
+                   z * (q.a22 * z + 2.0 * q.b2) +
+                   q.c;
+
+        return (float)(std::max(e, 0.0) / std::max(q.weight, 1e-20));
+}
+
+struct mesh_collapse {
+        // positions, by the first vertex at each
+        uint32_t from;
+        uint32_t to;
+        float error;
+};
+
+/*
+ * Working state of mesh_simplify. Vertices at the same position are
+ * wedges of it; position[v] is the first of them, and wedge[] links each
+ * position's wedges in a ring.
+ */
+struct mesh_simplifier {
+        std::vector<glm::vec3> points;
+        std::vector<uint32_t> position;
+        std::vector<uint32_t> wedge;
+        std::vector<mesh_quadric> quadrics;
+        std::vector<uint32_t> indices;
+        // triangles around each position, as [offsets[p], offsets[p + 1])
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> adjacency;
+};
+
+static void
+simplifier_adjacency(mesh_simplifier& s)
+{
+        size_t n_vertices = s.position.size();
+        s.offsets.assign(n_vertices + 1, 0);
+        for (uint32_t index : s.indices)
+                ++s.offsets[s.position[index] + 1];
+        for (size_t v = 0; v < n_vertices; ++v)
+                s.offsets[v + 1] += s.offsets[v];
+        s.adjacency.resize(s.indices.size());
+        std::vector<uint32_t> fill(s.offsets.begin(), s.offsets.end() - 1);
+        for (size_t i = 0; i < s.indices.size(); ++i)
+                s.adjacency[fill[s.position[s.indices[i]]]++] = i / 3;
+}
+
+/*
+ * Where each wedge of c.from goes when it moves onto c.to: the wedge of
+ * c.to it shares a triangle with. Fails if a wedge has none, or more than
+ * one, as it would then stretch its attributes (texture coordinates)
+ * across a seam.
+ */
+static bool
+simplifier_wedge_targets(const mesh_simplifier& s,
+                         const mesh_collapse& c,
+                         std::vector<std::pair<uint32_t, uint32_t>>& targets)
+{
+        targets.clear();
+        uint32_t w = c.from;
+        do {
+                uint32_t target = UINT32_MAX;
+                bool used = false;
+                for (uint32_t i = s.offsets[c.from]; i < s.offsets[c.from + 1]; ++i) {
+                        const uint32_t *tri = &s.indices[3 * s.adjacency[i]];
+                        if ((tri[0] != w) && (tri[1] != w) && (tri[2] != w))
+                                continue;
+                        used = true;
+                        for (uint32_t k = 0; k < 3; ++k) {
+                                if (s.position[tri[k]] != c.to)
+                                        continue;
+                                if ((target != UINT32_MAX) && (target != tri[k]))
+                                        return false;
+                                target = tri[k];
+                        }
+                }
+                if (used && (target == UINT32_MAX))
+                        return false;
+                if (used)
+                        targets.emplace_back(w, target);
+                w = s.wedge[w];
+        } while (w != c.from);
+
+        return true;
+}
+
+/*
+ * Whether moving c.from onto c.to turns any remaining triangle over, or
+ * tilts it by more than ~75 degrees, which is how slivers start.
+ */
+static bool
+simplifier_flips(const mesh_simplifier& s, const mesh_collapse& c)
+{
+        const glm::vec3& moved = s.points[c.to];
+        for (uint32_t i = s.offsets[c.from]; i < s.offsets[c.from + 1]; ++i) {
+                const uint32_t *tri = &s.indices[3 * s.adjacency[i]];
+                uint32_t p[3] = {s.position[tri[0]], s.position[tri[1]], s.position[tri[2]]};
+                if ((p[0] == c.to) || (p[1] == c.to) || (p[2] == c.to))
+                        continue;
+                glm::vec3 before[3] = {s.points[p[0]], s.points[p[1]], s.points[p[2]]};
+                glm::vec3 after[3] = {before[0], before[1], before[2]};
+                for (uint32_t k = 0; k < 3; ++k)
+                        if (p[k] == c.from)
+                                after[k] = moved;
+                glm::vec3 n0 = glm::cross(before[1] - before[0], before[2] - before[0]);
+                glm::vec3 n1 = glm::cross(after[1] - after[0], after[2] - after[0]);
+                if (glm::dot(n0, n1) <= 0.25f * glm::length(n0) * glm::length(n1))
+                        return true;
+        }
+
+        return false;
+}
+
+/*
+ * Quadric error simplification by half-edge collapses: a vertex moves onto
+ * a neighbour rather than to a new position, so the result indexes a
+ * subset of m's vertices and can share its vertex buffer. Collapses go
+ * cheapest first, in passes that touch each neighbourhood at most once,
+ * until at most target_indices remain or the next one would move the
+ * surface further than max_error (mesh units). Wedges at one position
+ * move together; open borders are held by extra planes along them.
+ * Positions are the first three floats of each vertex. Simplifies the
+ * n_indices indices from indices; *error, if given, is the largest error
+ * accepted.
+ */
+static std::vector<uint32_t>
+mesh_simplify(const mesh& m,
+              const uint32_t *indices,
+              size_t n_indices,
+              size_t target_indices,
+              float max_error,
+              float *error = NULL)
+{
+        if (error != NULL)
+                *error = 0.0f;
+        mesh_simplifier s;
+        size_t n_vertices = mesh_vertex_count(m);
+        if ((n_vertices == 0) || (n_indices == 0))
+                return s.indices;
+        s.points.resize(n_vertices);
+        for (size_t v = 0; v < n_vertices; ++v) {
+                const float *src = &m.vertices[v * m.stride];
+                s.points[v] = glm::vec3(src[0], src[1], src[2]);
+        }
+        mesh_vertex_key key = {&s.points[0].x, 3};
+        std::unordered_map<uint32_t, uint32_t, mesh_vertex_key, mesh_vertex_key>
+                unique(n_vertices, key, key);
+        s.position.resize(n_vertices);
+        s.wedge.resize(n_vertices);
+        for (uint32_t v = 0; v < n_vertices; ++v) {
+                uint32_t p = unique.emplace(v, v).first->second;
+                s.position[v] = p;
+                s.wedge[v] = v;
+                if (p != v) {
+                        s.wedge[v] = s.wedge[p];
+                        s.wedge[p] = v;
+                }
+        }
+        s.indices.assign(indices, indices + n_indices);
+
+        // every face's plane, weighted by its area, and a plane standing
+        // on each edge without a twin, i.e. on the mesh's border
+        s.quadrics.resize(n_vertices);
+        std::unordered_set<uint64_t> edges;
+        for (size_t i = 0; i < n_indices; i += 3)
+                for (uint32_t k = 0; k < 3; ++k)
+                        edges.insert((uint64_t)s.position[indices[i + k]] << 32 |
+                                     s.position[indices[i + (k + 1) % 3]]);
+        for (size_t i = 0; i < n_indices; i += 3) {
+                uint32_t p[3] = {s.position[indices[i]],
+                                 s.position[indices[i + 1]],
+                                 s.position[indices[i + 2]]};
+                glm::vec3 n = glm::cross(s.points[p[1]] - s.points[p[0]],
+                                         s.points[p[2]] - s.points[p[0]]);
+                float area2 = glm::length(n);
+                if (area2 == 0.0f)
+                        continue;
+                n = n / area2;
+                for (uint32_t k = 0; k < 3; ++k) {
+                        mesh_quadric& q = s.quadrics[p[k]];
+                        quadric_add_plane(q, n, -glm::dot(n, s.points[p[0]]), 0.5 * area2);
+                        q.weight += 0.5 * area2;
+
+                        uint32_t a = p[k];
+                        uint32_t b = p[(k + 1) % 3];
+                        if (edges.count((uint64_t)b << 32 | a) != 0)
+                                continue;
+                        glm::vec3 e = s.points[b] - s.points[a];
+                        glm::vec3 side = glm::cross(e, n);
+                        float length = glm::length(side);
+                        if (length == 0.0f)
+                                continue;
+                        side = side / length;
+                        double w = MESH_BORDER_WEIGHT * glm::dot(e, e);
+                        float d = -glm::dot(side, s.points[a]);
+                        quadric_add_plane(s.quadrics[a], side, d, w);
+                        quadric_add_plane(s.quadrics[b], side, d, w);
+                        s.quadrics[a].weight += w;
+                        s.quadrics[b].weight += w;
+                }
+        }
+
+        float limit = max_error * max_error;
+        float reached = 0.0f;
+        std::vector<mesh_collapse> collapses;
+        std::vector<std::pair<uint32_t, uint32_t>> targets;
+        std::vector<uint32_t> remap(n_vertices);
+        std::vector<bool> locked(n_vertices);
+        while (s.indices.size() > target_indices) {
+                simplifier_adjacency(s);
+
+                collapses.clear();
+                for (size_t i = 0; i < s.indices.size(); i += 3) {
+                        for (uint32_t k = 0; k < 3; ++k) {
+                                uint32_t a = s.position[s.indices[i + k]];
+                                uint32_t b = s.position[s.indices[i + (k + 1) % 3]];
+                                mesh_quadric q = s.quadrics[a];
+                                quadric_add(q, s.quadrics[b]);
+                                collapses.push_back({a, b, quadric_error(q, s.points[b])});
+                                collapses.push_back({b, a, quadric_error(q, s.points[a])});
+                        }
+                }
+                std::sort(collapses.begin(),
+                          collapses.end(),
+                          [](const mesh_collapse& x, const mesh_collapse& y) {
+                                  return x.error < y.error;
+                          });
+
+                for (uint32_t v = 0; v < n_vertices; ++v)
+                        remap[v] = v;
+                std::fill(locked.begin(), locked.end(), false);
+                size_t n_triangles = s.indices.size() / 3;
+                size_t collapsed = 0;
+                for (const mesh_collapse& c : collapses) {
+                        if ((c.error > limit) || (3 * n_triangles <= target_indices))
+                                break;
+                        if (locked[c.from] || locked[c.to] ||
+                            !simplifier_wedge_targets(s, c, targets) ||
+                            simplifier_flips(s, c))
+                                continue;
+
+                        for (const std::pair<uint32_t, uint32_t>& t : targets)
+                                remap[t.first] = t.second;
+                        quadric_add(s.quadrics[c.to], s.quadrics[c.from]);
+                        reached = std::max(reached, c.error);
+                        ++collapsed;
+
+                        // the triangles along the edge go, and nothing
+                        // around either end moves again this pass
+                        const uint32_t ends[2] = {c.from, c.to};
+                        for (uint32_t end : ends) {
+                                for (uint32_t i = s.offsets[end]; i < s.offsets[end + 1]; ++i) {
+                                        const uint32_t *tri = &s.indices[3 * s.adjacency[i]];
+                                        uint32_t p[3] = {s.position[tri[0]],
+                                                         s.position[tri[1]],
+                                                         s.position[tri[2]]};
+                                        for (uint32_t k = 0; k < 3; ++k)
+                                                locked[p[k]] = true;
+                                        if ((end == c.from) &&
+                                            ((p[0] == c.to) || (p[1] == c.to) || (p[2] == c.to)))
+                                                --n_triangles;
+                                }
+                        }
+                }
+                if (collapsed == 0)
+                        break;
+
+                // drop what collapsed to a line or a point
+                size_t out = 0;
+                for (size_t i = 0; i < s.indices.size(); i += 3) {
+                        uint32_t tri[3] = {remap[s.indices[i]],
+                                           remap[s.indices[i + 1]],
+                                           remap[s.indices[i + 2]]};
+                        if ((s.position[tri[0]] == s.position[tri[1]]) ||
+                            (s.position[tri[1]] == s.position[tri[2]]) ||
+                            (s.position[tri[2]] == s.position[tri[0]]))
+                                continue;
+                        std::copy(tri, tri + 3, &s.indices[out]);
+                        out += 3;
+                }
+                s.indices.resize(out);
+        }
+
+        if (error != NULL)
+                *error = sqrtf(reached);
+
+        return s.indices;
+}
+
+/*
+ * Extends m's LODs to up to max_lods (at most MESH_MAX_LODS), each
+ * aiming at half the triangles of the one before. Every LOD is simplified
+ * from the full mesh, so errors don't compound. The chain ends early once
+ * the error would pass MESH_LOD_MAX_ERROR of the mesh's bounding radius or
+ * an LOD saves less than a quarter of the triangles, which is where a
+ * mesh's seams and corners stop it.
+ */
+static void
+mesh_generate_lods(mesh& m, uint32_t max_lods)
+{
+        if (m.lods.empty())
+                m.lods.push_back({0, (uint32_t)m.indices.size(), 0.0f});
+        max_lods = std::min<uint32_t>(max_lods, MESH_MAX_LODS);
+
+        float radius = 0.0f;
+        for (size_t v = 0; v < mesh_vertex_count(m); ++v) {
+                const float *p = &m.vertices[v * m.stride];
+                radius = std::max(radius, glm::length(glm::vec3(p[0], p[1], p[2])));
+        }
+
+        std::vector<uint32_t> full(m.indices.begin() + m.lods[0].first,
+                                   m.indices.begin() + m.lods[0].first + m.lods[0].count);
+        while (m.lods.size() < max_lods) {
+                size_t target = m.lods.back().count / 6 * 3;
+                if (target == 0)
+                        break;
+                float error;
+                std::vector<uint32_t> lod = mesh_simplify(m,
+                                                          full.data(),
+                                                          full.size(),
+                                                          target,
+                                                          MESH_LOD_MAX_ERROR * radius,
+                                                          &error);
+                if (4 * lod.size() > 3 * (size_t)m.lods.back().count)
+                        break;
+                m.lods.push_back({(uint32_t)m.indices.size(), (uint32_t)lod.size(), error});
+                m.indices.insert(m.indices.end(), lod.begin(), lod.end());
+        }
+}
+
+enum mesh_attr_format {
+        MESH_FLOAT,
+        // IEEE half, for texture coordinates and other small-range data
+        MESH_HALF,
+        // [-1, 1] over the attribute's bounds; see mesh_packed::scale/offset
+        MESH_SNORM16,
+};
+
+struct mesh_attr {
+        // components, and their offset into a vertex, both in floats
+        uint32_t size;
+        uint32_t offset;
+        mesh_attr_format format;
+};
+
+#define MESH_MAX_ATTRS 8
+
+/*
+ * A mesh in its GPU layout. Attribute i is bound to location i, at
+ * attr_offsets[i] bytes into each vertex_size-byte vertex. A snorm16
+ * attribute decodes as value * scale + offset per component, which the
+ * caller applies, e.g. for positions by folding mesh_dequantize_matrix
+ * into the model matrix.
+ */
+struct mesh_packed {
+        uint32_t n_attrs = 0;
+        mesh_attr attrs[MESH_MAX_ATTRS];
+        uint32_t attr_offsets[MESH_MAX_ATTRS];
+        glm::vec4 scale[MESH_MAX_ATTRS];
+        glm::vec4 offset[MESH_MAX_ATTRS];
+
+        uint32_t vertex_size = 0;
+        size_t n_vertices = 0;
+        std::vector<uint8_t> vertices;
+
+        // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+        GLenum index_type = GL_UNSIGNED_INT;
+        // every LOD's, one after the other
+        size_t n_indices = 0;
+        std::vector<uint8_t> indices;
+        // at least one, the full mesh
+        std::vector<mesh_lod> lods;
+};
+
+// float to IEEE half, rounding to nearest even; overflow saturates to inf
+static uint16_t
+float_to_half(float value)
+{
+        uint32_t f;
+        memcpy(&f, &value, sizeof(f));
+        uint32_t sign = (f >> 16) & 0x8000;
+        int32_t exponent = (int32_t)((f >> 23) & 0xff) - 127 + 15;
+        uint32_t mantissa = f & 0x7fffff;
+
+        if (((f >> 23) & 0xff) == 0xff)
+                return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+        if (exponent >= 31)
+                return sign | 0x7c00;
+        if (exponent <= 0) {
+                // subnormal half, or zero
+                if (exponent < -10)
+                        return sign;
+                mantissa |= 0x800000;
+                uint32_t shift = 14 - exponent;
+                uint32_t half = mantissa >> shift;
+                uint32_t rest = mantissa & ((1u << shift) - 1);
+                uint32_t halfway = 1u << (shift - 1);
+                if ((rest > halfway) || ((rest == halfway) && (half & 1)))
+                        ++half;
+                return sign | half;
+        }
+
+        uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+        uint32_t rest = mantissa & 0x1fff;
+        // a carry out of the mantissa correctly bumps the exponent
+        if ((rest > 0x1000) || ((rest == 0x1000) && (half & 1)))
+                ++half;
+
+        return sign | half;
+}
+
+static int16_t
+float_to_snorm16(float value)
+{
+        value = std::min(std::max(value, -1.0f), 1.0f);
+
+        return (int16_t)lrintf(value * 32767.0f);
+}
+
+/*
+ * Packs m into its GPU layout with the given attribute formats, in
+ * location order.
+ */
+static mesh_packed
+mesh_pack(const mesh& m, const mesh_attr *attrs, uint32_t n_attrs)
+{
+        mesh_packed packed;
+        packed.n_attrs = std::min<uint32_t>(n_attrs, MESH_MAX_ATTRS);
+        packed.n_vertices = mesh_vertex_count(m);
+
+        for (uint32_t a = 0; a < packed.n_attrs; ++a) {
+                const mesh_attr& attr = attrs[a];
+                packed.attrs[a] = attr;
+                packed.attr_offsets[a] = packed.vertex_size;
+                packed.scale[a] = glm::vec4(1.0f);
+                packed.offset[a] = glm::vec4(0.0f);
+
+                uint32_t component = (attr.format == MESH_FLOAT) ? 4 : 2;
+                // keep every attribute 4-byte aligned
+                packed.vertex_size += (attr.size * component + 3) & ~3u;
+
+                if (attr.format != MESH_SNORM16)
+                        continue;
+                for (uint32_t c = 0; c < attr.size; ++c) {
+                        float lo = INFINITY;
+                        float hi = -INFINITY;
+                        for (size_t v = 0; v < packed.n_vertices; ++v) {
+                                float value = m.vertices[v * m.stride + attr.offset + c];
+                                lo = std::min(lo, value);
+                                hi = std::max(hi, value);
+                        }
+                        if (packed.n_vertices == 0)
+                                lo = hi = 0.0f;
+                        packed.offset[a][c] = 0.5f * (lo + hi);
+                        packed.scale[a][c] = std::max(0.5f * (hi - lo), 1e-20f);
+                }
+        }
+
+        packed.vertices.assign(packed.n_vertices * packed.vertex_size, 0);
+        for (size_t v = 0; v < packed.n_vertices; ++v) {
+                const float *src = &m.vertices[v * m.stride];
+                uint8_t *dst = &packed.vertices[v * packed.vertex_size];
+                for (uint32_t a = 0; a < packed.n_attrs; ++a) {
+                        const mesh_attr& attr = packed.attrs[a];
+                        uint8_t *out = dst + packed.attr_offsets[a];
+                        for (uint32_t c = 0; c < attr.size; ++c) {
+                                float value = src[attr.offset + c];
+                                if (attr.format == MESH_FLOAT) {
+                                        memcpy(out + 4 * c, &value, 4);
+                                } else if (attr.format == MESH_HALF) {
+                                        uint16_t half = float_to_half(value);
+                                        memcpy(out + 2 * c, &half, 2);
+                                } else {
+                                        int16_t q = float_to_snorm16((value - packed.offset[a][c]) /
+                                                                     packed.scale[a][c]);
+                                        memcpy(out + 2 * c, &q, 2);
+                                }
+                        }
+                }
+        }
+
+        packed.n_indices = m.indices.size();
+        packed.lods = m.lods;
+        if (packed.lods.empty())
+                packed.lods.push_back({0, (uint32_t)packed.n_indices, 0.0f});
+        if (packed.n_vertices <= 65536) {
+                packed.index_type = GL_UNSIGNED_SHORT;
+                packed.indices.resize(packed.n_indices * sizeof(uint16_t));
+                uint16_t *dst = (uint16_t*)packed.indices.data();
+                for (size_t i = 0; i < packed.n_indices; ++i)
+                        dst[i] = (uint16_t)m.indices[i];
+        } else {
+                packed.index_type = GL_UNSIGNED_INT;
+                packed.indices.resize(packed.n_indices * sizeof(uint32_t));
+                memcpy(packed.indices.data(), m.indices.data(), packed.indices.size());
+        }
+
+        return packed;
+}
+
+/*
+ * The whole pipeline for a vertex stream as it comes from a file or an
+ * array: weld, simplify into up to max_lods LODs, reorder for the vertex
+ * cache and for fetch, and pack.
+ */
+static mesh_packed
+mesh_build(const float *vertices,
+           size_t n_vertices,
+           uint32_t stride,
+           const mesh_attr *attrs,
+           uint32_t n_attrs,
+           const uint32_t *indices = NULL,
+           size_t n_indices = 0,
+           uint32_t max_lods = 1)
+{
+        mesh m = mesh_weld(vertices, n_vertices, stride, indices, n_indices);
+        if (max_lods > 1)
+                mesh_generate_lods(m, max_lods);
+        mesh_optimize_vertex_cache(m);
+        mesh_optimize_vertex_fetch(m);
+
+        return mesh_pack(m, attrs, n_attrs);
+}
+
+static size_t
+mesh_packed_size(const mesh_packed& packed)
+{
+        return packed.vertices.size() + packed.indices.size();
+}
+
+/*
+ * Maps snorm16 positions (attribute attr) back to mesh space; multiply a
+ * model matrix by it on the right.
+ */
+static glm::mat4
+mesh_dequantize_matrix(const mesh_packed& packed, uint32_t attr)
+{
+        glm::mat4 m = glm::translate(glm::mat4(1.0f),
+                                     glm::vec3(packed.offset[attr].x,
+                                               packed.offset[attr].y,
+                                               packed.offset[attr].z));
+
+        return glm::scale(m, glm::vec3(packed.scale[attr].x,
+                                       packed.scale[attr].y,
+                                       packed.scale[attr].z));
+}
+
+/*
+ * Points attribute i of the bound VAO at attr_offsets[i] bytes into each
+ * vertex of the bound GL_ARRAY_BUFFER, whose vertices start at
+ * vertex_offset.
+ */
+static void
+mesh_vertex_attribs(const mesh_attr *attrs,
+                    const uint32_t *attr_offsets,
+                    uint32_t n_attrs,
+                    uint32_t vertex_size,
+                    size_t vertex_offset = 0)
+{
+        for (uint32_t a = 0; a < n_attrs; ++a) {
+                const mesh_attr& attr = attrs[a];
+                GLenum type = GL_FLOAT;
+                GLboolean normalized = GL_FALSE;
+                if (attr.format == MESH_HALF) {
+                        type = GL_HALF_FLOAT;
+                } else if (attr.format == MESH_SNORM16) {
+                        type = GL_SHORT;
+                        normalized = GL_TRUE;
+                }
+                glVertexAttribPointer(a,
+                                      attr.size,
+                                      type,
+                                      normalized,
+                                      vertex_size,
+                                      (void*)(vertex_offset + attr_offsets[a]));
+                glEnableVertexAttribArray(a);
+        }
+}
+
+/*
+ * Uploads a packed mesh into a new VAO, left bound, with its index buffer
+ * and attribute i at location i. Given an arena, vertices and indices are
+ * suballocated from it and *index_offset says where the indices start (in
+ * bytes, for the draw calls); otherwise, or if the arena is full, the mesh
+ * gets buffers of its own and the offset is 0.
+ */
+static uint32_t
+init_mesh_VAO(const mesh_packed& packed,
+              buffer_arena *arena = NULL,
+              size_t *index_offset = NULL)
+{
+        uint32_t VAO;
+        glGenVertexArrays(1, &VAO);
+        state_bind_vertex_array(VAO);
+
+        size_t vertex_offset = SIZE_MAX;
+        size_t indices_at = SIZE_MAX;
+        if (arena != NULL) {
+                size_t mark = arena->head;
+                vertex_offset = buffer_arena_upload(*arena,
+                                                    packed.vertices.data(),
+                                                    packed.vertices.size(),
+                                                    16);
+                indices_at = buffer_arena_upload(*arena,
+                                                 packed.indices.data(),
+                                                 packed.indices.size(),
+                                                 4);
+                if ((vertex_offset == SIZE_MAX) || (indices_at == SIZE_MAX))
+                        arena->head = mark;
+        }
+
+        if ((vertex_offset != SIZE_MAX) && (indices_at != SIZE_MAX)) {
+                state_bind_buffer(GL_ARRAY_BUFFER, arena->buffer);
+                state_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, arena->buffer);
+        } else {
+                vertex_offset = 0;
+                indices_at = 0;
+
+                uint32_t buffers[2];
+                glGenBuffers(2, buffers);
+                state_bind_buffer(GL_ARRAY_BUFFER, buffers[0]);
+                glBufferData(GL_ARRAY_BUFFER,
+                             packed.vertices.size(),
+                             packed.vertices.data(),
+                             GL_STATIC_DRAW);
+                state_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                             packed.indices.size(),
+                             packed.indices.data(),
+                             GL_STATIC_DRAW);
+        }
+        if (index_offset != NULL)
+                *index_offset = indices_at;
+
+        mesh_vertex_attribs(packed.attrs,
+                            packed.attr_offsets,
+                            packed.n_attrs,
+                            packed.vertex_size,
+                            vertex_offset);
+
+        return VAO;
+}
+
+#endif /* _LEARN_GL_MESH_H_ */
@@ -0,0 +1,334 @@
+#ifndef _LEARN_GL_OCCLUSION_H_
+#define _LEARN_GL_OCCLUSION_H_
+
+#include "culling.hpp"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+/*
+ * Occlusion culling against a hierarchical depth buffer (Hi-Z) built on
+ * the CPU, so it culls the same on any GL implementation, llvmpipe
+ * included, and never waits on the GPU for last frame's depth:
+ *
+ * - occlusion_draw rasterizes occluders, depth only, into a small buffer,
+ *   each shrunk by a pixel all round so it only claims pixels it covers
+ *   whole, at the farthest depth it has over them;
+ * - occlusion_build_pyramid reduces it to a mip chain, each texel holding
+ *   the farthest depth of the four under it;
+ * - occlusion_test projects a bounding box and compares its nearest depth
+ *   with the farthest depth over what it covers, read from the level where
+ *   that is at most 2x2 texels.
+ *
+ * Depths are NDC z, nearer being smaller. The shrinking assumes occluders
+ * have no notches narrower than a pixel of the buffer, which holds for
+ * anything roughly convex. Anything the test can't decide (crossing the
+ * near plane, off the buffer) counts as visible.
+ */
+
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+
+// an occluder's triangles, in its own space
+struct occluder_mesh {
+        std::vector<glm::vec3> positions;
+        std::vector<uint32_t> indices;
+};
+
+struct occlusion_buffer {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        // level 0 is what was rasterized, level i + 1 halves level i
+        std::vector<std::vector<float>> levels;
+        // since the last occlusion_clear
+        uint32_t occluders = 0;
+        uint32_t triangles = 0;
+        // occlusion_draw's transformed vertices, and the occluder alone
+        std::vector<glm::vec4> screen;
+        std::vector<float> scratch;
+};
+
+static uint32_t
+occlusion_level_width(const occlusion_buffer& buffer, uint32_t level)
+{
+        return (buffer.width + (1u << level) - 1) >> level;
+}
+
+static uint32_t
+occlusion_level_height(const occlusion_buffer& buffer, uint32_t level)
+{
+        return (buffer.height + (1u << level) - 1) >> level;
+}
+
+static void
+init_occlusion_buffer(occlusion_buffer& buffer,
+                      uint32_t width = OCCLUSION_WIDTH,
+                      uint32_t height = OCCLUSION_HEIGHT)
+{
+        buffer = occlusion_buffer();
+        buffer.width = width;
+        buffer.height = height;
+        buffer.scratch.assign((size_t)width * height, 1.0f);
+        for (uint32_t level = 0; ; ++level) {
+                uint32_t w = occlusion_level_width(buffer, level);
+                uint32_t h = occlusion_level_height(buffer, level);
+                buffer.levels.emplace_back((size_t)w * h, 1.0f);
+                if ((w == 1) && (h == 1))
+                        break;
+        }
+}
+
+static void
+occlusion_clear(occlusion_buffer& buffer)
+{
+        std::fill(buffer.levels[0].begin(), buffer.levels[0].end(), 1.0f);
+        buffer.occluders = 0;
+        buffer.triangles = 0;
+}
+
+/*
+ * Rasterizes one triangle given in buffer pixels (x, y) and NDC z into
+ * depth, a buffer-sized layer, keeping the nearest depth. Either winding.
+ */
+static void
+occlusion_triangle(const occlusion_buffer& buffer,
+                   float *depth,
+                   glm::vec3 a,
+                   glm::vec3 b,
+                   glm::vec3 c)
+{
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (area == 0.0f)
+                return;
+        if (area < 0.0f) {
+                std::swap(b, c);
+                area = -area;
+        }
+
+        int32_t x0 = std::max((int32_t)floorf(std::min(a.x, std::min(b.x, c.x))), 0);
+        int32_t y0 = std::max((int32_t)floorf(std::min(a.y, std::min(b.y, c.y))), 0);
+        int32_t x1 = std::min((int32_t)ceilf(std::max(a.x, std::max(b.x, c.x))),
+                              (int32_t)buffer.width - 1);
+        int32_t y1 = std::min((int32_t)ceilf(std::max(a.y, std::max(b.y, c.y))),
+                              (int32_t)buffer.height - 1);
+        if ((x0 > x1) || (y0 > y1))
+                return;
+
+        // z as a plane over the screen
+        float dzdx = ((b.z - a.z) * (c.y - a.y) - (c.z - a.z) * (b.y - a.y)) / area;
+        float dzdy = ((c.z - a.z) * (b.x - a.x) - (b.z - a.z) * (c.x - a.x)) / area;
+
+        // edge functions, stepped across the bounding box
+        const glm::vec3 *v[3] = {&a, &b, &c};
+        float e_dx[3];
+        float e_dy[3];
+        float e_row[3];
+        float px = x0 + 0.5f;
+        float py = y0 + 0.5f;
+        for (uint32_t k = 0; k < 3; ++k) {
+                const glm::vec3& p = *v[(k + 1) % 3];
+                const glm::vec3& q = *v[(k + 2) % 3];
+                e_dx[k] = p.y - q.y;
+                e_dy[k] = q.x - p.x;
+                e_row[k] = (px - p.x) * (p.y - q.y) + (py - p.y) * (q.x - p.x);
+        }
+        float z_row = a.z + dzdx * (px - a.x) + dzdy * (py - a.y);
+
+        for (int32_t y = y0; y <= y1; ++y) {
+                float *row = &depth[(size_t)y * buffer.width];
+                float e0 = e_row[0];
+                float e1 = e_row[1];
+                float e2 = e_row[2];
+                float z = z_row;
+                for (int32_t x = x0; x <= x1; ++x) {
+                        if ((e0 >= 0.0f) && (e1 >= 0.0f) && (e2 >= 0.0f) && (z < row[x]))
+                                row[x] = z;
+                        e0 += e_dx[0];
+                        e1 += e_dx[1];
+                        e2 += e_dx[2];
+                        z += dzdx;
+                }
+                e_row[0] += e_dy[0];
+                e_row[1] += e_dy[1];
+                e_row[2] += e_dy[2];
+                z_row += dzdy;
+        }
+}
+
+/*
+ * Draws an occluder with model-view-projection matrix mvp. Triangles
+ * reaching behind the near plane are skipped rather than clipped, which
+ * only ever lets more through. The occluder is rasterized on its own at
+ * pixel centres, then every pixel takes the farthest depth of itself and
+ * its eight neighbours, uncovered ones being as far as can be: that
+ * erodes the silhouette by the pixel that sampling at centres can claim
+ * beyond it.
+ */
+static void
+occlusion_draw(occlusion_buffer& buffer, const glm::mat4& mvp, const occluder_mesh& occluder)
+{
+        std::vector<glm::vec4>& screen = buffer.screen;
+        screen.resize(occluder.positions.size());
+        for (size_t i = 0; i < occluder.positions.size(); ++i) {
+                glm::vec4 clip = mvp * glm::vec4(occluder.positions[i], 1.0f);
+                // w of -1 marks a vertex nearer than the near plane
+                if (clip.z < -clip.w) {
+                        screen[i] = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+                        continue;
+                }
+                float inv_w = 1.0f / clip.w;
+                screen[i] = glm::vec4((clip.x * inv_w * 0.5f + 0.5f) * buffer.width,
+                                      (clip.y * inv_w * 0.5f + 0.5f) * buffer.height,
+                                      clip.z * inv_w,
+                                      1.0f);
+        }
+
+        // what the occluder can touch, with a pixel around it for the
+        // erosion to read
+        float min_x = INFINITY;
+        float min_y = INFINITY;
+        float max_x = -INFINITY;
+        float max_y = -INFINITY;
+        for (const glm::vec4& p : screen) {
+                if (p.w < 0.0f)
+                        continue;
+                min_x = std::min(min_x, p.x);
+                min_y = std::min(min_y, p.y);
+                max_x = std::max(max_x, p.x);
+                max_y = std::max(max_y, p.y);
+        }
+        ++buffer.occluders;
+        buffer.triangles += occluder.indices.size() / 3;
+        int32_t x0 = std::max((int32_t)std::max(floorf(min_x), -1.0f) - 1, 0);
+        int32_t y0 = std::max((int32_t)std::max(floorf(min_y), -1.0f) - 1, 0);
+        int32_t x1 = std::min((int32_t)std::min(ceilf(max_x), (float)buffer.width) + 1,
+                              (int32_t)buffer.width - 1);
+        int32_t y1 = std::min((int32_t)std::min(ceilf(max_y), (float)buffer.height) + 1,
+                              (int32_t)buffer.height - 1);
+        if ((x0 > x1) || (y0 > y1))
+                return;
+
+        float *scratch = buffer.scratch.data();
+        for (int32_t y = y0; y <= y1; ++y)
+                std::fill(&scratch[(size_t)y * buffer.width + x0],
+                          &scratch[(size_t)y * buffer.width + x1 + 1],
+                          1.0f);
+        for (size_t i = 0; i + 2 < occluder.indices.size(); i += 3) {
+                const glm::vec4& a = screen[occluder.indices[i]];
+                const glm::vec4& b = screen[occluder.indices[i + 1]];
+                const glm::vec4& c = screen[occluder.indices[i + 2]];
+                if ((a.w < 0.0f) || (b.w < 0.0f) || (c.w < 0.0f))
+                        continue;
+                occlusion_triangle(buffer,
+                                   scratch,
+                                   glm::vec3(a.x, a.y, a.z),
+                                   glm::vec3(b.x, b.y, b.z),
+                                   glm::vec3(c.x, c.y, c.z));
+        }
+
+        // farthest of 3x3, separably: rows in place, then columns into the
+        // buffer. Outside the box the scratch holds older occluders, so the
+        // edges only look inwards; that is right at the buffer's edge, past
+        // which the occluder may go on, and elsewhere the edges are margin.
+        for (int32_t y = y0; y <= y1; ++y) {
+                float *row = &scratch[(size_t)y * buffer.width];
+                float left = row[x0];
+                for (int32_t x = x0; x <= x1; ++x) {
+                        float centre = row[x];
+                        float right = (x < x1) ? row[x + 1] : centre;
+                        row[x] = std::max(std::max(left, centre), right);
+                        left = centre;
+                }
+        }
+        std::vector<float>& depth = buffer.levels[0];
+        for (int32_t y = y0; y <= y1; ++y) {
+                const float *up = &scratch[(size_t)std::max(y - 1, y0) * buffer.width];
+                const float *row = &scratch[(size_t)y * buffer.width];
+                const float *down = &scratch[(size_t)std::min(y + 1, y1) * buffer.width];
+                float *out = &depth[(size_t)y * buffer.width];
+                for (int32_t x = x0; x <= x1; ++x)
+                        out[x] = std::min(out[x], std::max(std::max(up[x], row[x]), down[x]));
+        }
+}
+
+// the farthest depth of every 2x2 block of each level, into the next
+static void
+occlusion_build_pyramid(occlusion_buffer& buffer)
+{
+        for (uint32_t level = 1; level < buffer.levels.size(); ++level) {
+                const std::vector<float>& src = buffer.levels[level - 1];
+                std::vector<float>& dst = buffer.levels[level];
+                uint32_t src_w = occlusion_level_width(buffer, level - 1);
+                uint32_t src_h = occlusion_level_height(buffer, level - 1);
+                uint32_t w = occlusion_level_width(buffer, level);
+                uint32_t h = occlusion_level_height(buffer, level);
+                for (uint32_t y = 0; y < h; ++y) {
+                        const float *row0 = &src[(size_t)(2 * y) * src_w];
+                        const float *row1 = &src[(size_t)std::min(2 * y + 1, src_h - 1) * src_w];
+                        for (uint32_t x = 0; x < w; ++x) {
+                                uint32_t x1 = std::min(2 * x + 1, src_w - 1);
+                                dst[(size_t)y * w + x] = std::max(std::max(row0[2 * x], row0[x1]),
+                                                                  std::max(row1[2 * x], row1[x1]));
+                        }
+                }
+        }
+}
+
+/*
+ * Whether any of box (in the space view_projection maps from) may be
+ * visible past the occluders. Needs the pyramid built.
+ */
+static bool
+occlusion_test(const occlusion_buffer& buffer, const glm::mat4& view_projection, const aabb& box)
+{
+        float min_x = INFINITY;
+        float min_y = INFINITY;
+        float max_x = -INFINITY;
+        float max_y = -INFINITY;
+        float min_z = INFINITY;
+        for (uint32_t corner = 0; corner < 8; ++corner) {
+                glm::vec4 p((corner & 1) ? box.max.x : box.min.x,
+                            (corner & 2) ? box.max.y : box.min.y,
+                            (corner & 4) ? box.max.z : box.min.z,
+                            1.0f);
+                glm::vec4 clip = view_projection * p;
+                if (clip.z < -clip.w)
+                        return true;
+                float inv_w = 1.0f / clip.w;
+                min_x = std::min(min_x, clip.x * inv_w);
+                max_x = std::max(max_x, clip.x * inv_w);
+                min_y = std::min(min_y, clip.y * inv_w);
+                max_y = std::max(max_y, clip.y * inv_w);
+                min_z = std::min(min_z, clip.z * inv_w);
+        }
+
+        // the pixels the box's screen rectangle touches
+        int32_t x0 = (int32_t)floorf((min_x * 0.5f + 0.5f) * buffer.width);
+        int32_t x1 = (int32_t)floorf((max_x * 0.5f + 0.5f) * buffer.width);
+        int32_t y0 = (int32_t)floorf((min_y * 0.5f + 0.5f) * buffer.height);
+        int32_t y1 = (int32_t)floorf((max_y * 0.5f + 0.5f) * buffer.height);
+        if ((x1 < 0) || (y1 < 0) ||
+            (x0 >= (int32_t)buffer.width) || (y0 >= (int32_t)buffer.height))
+                return true;
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        x1 = std::min(x1, (int32_t)buffer.width - 1);
+        y1 = std::min(y1, (int32_t)buffer.height - 1);
+
+        uint32_t level = 0;
+        while ((level + 1 < buffer.levels.size()) &&
+               (((x1 >> level) - (x0 >> level) > 1) || ((y1 >> level) - (y0 >> level) > 1)))
+                ++level;
+        const std::vector<float>& depth = buffer.levels[level];
+        uint32_t w = occlusion_level_width(buffer, level);
+        float farthest = -1.0f;
+        for (int32_t y = y0 >> level; y <= (y1 >> level); ++y)
+                for (int32_t x = x0 >> level; x <= (x1 >> level); ++x)
+                        farthest = std::max(farthest, depth[(size_t)y * w + x]);
+
+        return min_z <= farthest;
+}
+
+#endif /* _LEARN_GL_OCCLUSION_H_ */
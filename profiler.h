@@ -0,0 +1,481 @@
+#ifndef _LEARN_GL_PROFILER_H_
+#define _LEARN_GL_PROFILER_H_
+
+/*
+ * Frame profiler. CPU scopes are recorded into per-thread event buffers:
+ * each thread only ever appends to its own, publishing the new count with
+ * a release store, so recording takes no locks. GPU spans use
+ * GL_TIME_ELAPSED queries kept in a ring PROFILE_GPU_FRAMES frames deep;
+ * a frame's results are only read once the ring comes back around to it,
+ * and only if they are already available, so the profiler never stalls
+ * the pipeline waiting on the GPU.
+ *
+ * Frame times are always tracked, and a rolling p50/p99 over the last
+ * PROFILE_HISTORY frames is printed once a second. With LEARNGL_TRACE=<path>
+ * in the environment the scopes are recorded too and written at shutdown
+ * as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+ *
+ * Plain C like headless.h; C++ gets RAII scopes, PROFILE_SCOPE and
+ * PROFILE_GPU_SCOPE.
+ */
+
+#include <glad/glad.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROFILE_MAX_THREADS 64
+#define PROFILE_MAX_EVENTS (1 << 16)
+// frames of GPU queries in flight before their results are read
+#define PROFILE_GPU_FRAMES 4
+#define PROFILE_GPU_SPANS 16
+#define PROFILE_HISTORY 1024
+#define PROFILE_REPORT_NS 1000000000ull
+
+struct profile_event {
+        const char *name;
+        uint64_t begin_ns;
+        uint64_t end_ns;
+};
+
+struct profile_thread {
+        uint32_t tid;
+        const char *name;
+        // written only by the owning thread, read by profile_write_trace
+        uint32_t count;
+        uint32_t capacity;
+        uint32_t dropped;
+        struct profile_event *events;
+};
+
+struct profile_gpu_span {
+        const char *name;
+        uint64_t issued_ns;
+};
+
+struct profile_gpu_frame {
+        uint32_t n_spans;
+        struct profile_gpu_span spans[PROFILE_GPU_SPANS];
+        uint32_t queries[PROFILE_GPU_SPANS];
+};
+
+struct profiler_state {
+        const char *trace_path;
+        uint64_t start_ns;
+
+        uint32_t n_threads;
+        struct profile_thread *threads[PROFILE_MAX_THREADS];
+
+        // GL thread only from here on
+        struct profile_thread gpu;
+        struct profile_gpu_frame gpu_frames[PROFILE_GPU_FRAMES];
+        uint32_t gpu_frame;
+        int32_t gpu_open;
+        uint64_t gpu_cursor_ns;
+        uint32_t gpu_dropped;
+
+        uint64_t frame_ns;
+        uint64_t report_ns;
+        uint32_t n_frames;
+        float frame_ms[PROFILE_HISTORY];
+        uint32_t n_gpu_frames;
+        float gpu_ms[PROFILE_HISTORY];
+};
+
+static struct profiler_state profiler;
+static __thread struct profile_thread *profile_local;
+
+static uint64_t
+profile_now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+profile_thread_init(struct profile_thread *thread, uint32_t tid, const char *name)
+{
+        thread->tid = tid;
+        thread->name = name;
+        thread->count = 0;
+        thread->dropped = 0;
+        thread->capacity = PROFILE_MAX_EVENTS;
+        thread->events = (struct profile_event*)malloc(PROFILE_MAX_EVENTS *
+                                                       sizeof(struct profile_event));
+        if (thread->events == NULL)
+                thread->capacity = 0;
+}
+
+// the calling thread's buffer, registered on first use; NULL if not tracing
+static struct profile_thread*
+profile_thread_local(void)
+{
+        if (profiler.trace_path == NULL)
+                return NULL;
+        if (profile_local != NULL)
+                return profile_local;
+
+        uint32_t slot = __atomic_fetch_add(&profiler.n_threads, 1, __ATOMIC_RELAXED);
+        if (slot >= PROFILE_MAX_THREADS) {
+                // out of slots: record nothing for this thread
+                static struct profile_thread overflow;
+                profile_local = &overflow;
+                return profile_local;
+        }
+
+        struct profile_thread *thread =
+                (struct profile_thread*)calloc(1, sizeof(struct profile_thread));
+        profile_thread_init(thread, slot + 1, NULL);
+        __atomic_store_n(&profiler.threads[slot], thread, __ATOMIC_RELEASE);
+        profile_local = thread;
+
+        return thread;
+}
+
+// names the calling thread in the trace; name must outlive the profiler
+static void
+profile_thread_name(const char *name)
+{
+        struct profile_thread *thread = profile_thread_local();
+        if (thread != NULL)
+                thread->name = name;
+}
+
+/*
+ * Call on the GL thread once the context is current. Tracing is enabled
+ * by LEARNGL_TRACE.
+ */
+static void
+profile_init(void)
+{
+        profiler.trace_path = getenv("LEARNGL_TRACE");
+        profiler.start_ns = profile_now_ns();
+        profiler.frame_ns = profiler.start_ns;
+        profiler.report_ns = profiler.start_ns;
+        profiler.gpu_open = -1;
+
+        if (profiler.trace_path != NULL) {
+                profile_thread_init(&profiler.gpu, 0, "GPU");
+                profile_thread_name("GL thread");
+                for (uint32_t i = 0; i < PROFILE_GPU_FRAMES; ++i)
+                        glGenQueries(PROFILE_GPU_SPANS, profiler.gpu_frames[i].queries);
+        }
+}
+
+static void
+profile_record(struct profile_thread *thread,
+               const char *name,
+               uint64_t begin_ns,
+               uint64_t end_ns)
+{
+        uint32_t count = thread->count;
+        if (count >= thread->capacity) {
+                ++thread->dropped;
+                return;
+        }
+
+        struct profile_event *event = &thread->events[count];
+        event->name = name;
+        event->begin_ns = begin_ns;
+        event->end_ns = end_ns;
+        __atomic_store_n(&thread->count, count + 1, __ATOMIC_RELEASE);
+}
+
+// 0 when not tracing, so the matching profile_end records nothing
+static uint64_t
+profile_begin(void)
+{
+        if (profiler.trace_path == NULL)
+                return 0;
+
+        return profile_now_ns();
+}
+
+static void
+profile_end(const char *name, uint64_t begin_ns)
+{
+        struct profile_thread *thread = profile_thread_local();
+        if ((begin_ns == 0) || (thread == NULL))
+                return;
+
+        profile_record(thread, name, begin_ns, profile_now_ns());
+}
+
+/*
+ * GPU spans time the commands issued between begin and end on the GL
+ * thread. Timer queries can't nest, so neither can GPU spans: a span begun
+ * inside another, or past PROFILE_GPU_SPANS in a frame, is not timed and
+ * begin returns false. Only call profile_gpu_end after a true begin.
+ */
+static bool
+profile_gpu_begin(const char *name)
+{
+        struct profile_gpu_frame *frame = &profiler.gpu_frames[profiler.gpu_frame];
+        if ((profiler.trace_path == NULL) ||
+            (profiler.gpu_open >= 0) ||
+            (frame->n_spans >= PROFILE_GPU_SPANS))
+                return false;
+
+        profiler.gpu_open = frame->n_spans++;
+        frame->spans[profiler.gpu_open].name = name;
+        frame->spans[profiler.gpu_open].issued_ns = profile_now_ns();
+        glBeginQuery(GL_TIME_ELAPSED, frame->queries[profiler.gpu_open]);
+
+        return true;
+}
+
+static void
+profile_gpu_end(void)
+{
+        if (profiler.gpu_open < 0)
+                return;
+
+        glEndQuery(GL_TIME_ELAPSED);
+        profiler.gpu_open = -1;
+}
+
+/*
+ * Turns a frame's queries into GPU events. The GPU track has no clock of
+ * its own: a span is placed where it was issued, or right after the
+ * previous span if that ends later. Returns false, reading nothing, if the
+ * results are not in yet and wait is false.
+ */
+static bool
+profile_gpu_collect(struct profile_gpu_frame *frame, bool wait)
+{
+        if (frame->n_spans == 0)
+                return true;
+
+        if (!wait) {
+                uint32_t available = GL_FALSE;
+                glGetQueryObjectuiv(frame->queries[frame->n_spans - 1],
+                                    GL_QUERY_RESULT_AVAILABLE,
+                                    &available);
+                if (!available)
+                        return false;
+        }
+
+        uint64_t now = profile_now_ns();
+        uint64_t total_ns = 0;
+        for (uint32_t i = 0; i < frame->n_spans; ++i) {
+                uint64_t elapsed_ns = 0;
+                glGetQueryObjectui64v(frame->queries[i], GL_QUERY_RESULT, &elapsed_ns);
+                // some drivers return junk for the first queries; a span
+                // can't have taken longer than it's been since it was issued
+                if (elapsed_ns > now - frame->spans[i].issued_ns)
+                        continue;
+                total_ns += elapsed_ns;
+
+                uint64_t begin_ns = frame->spans[i].issued_ns;
+                if (begin_ns < profiler.gpu_cursor_ns)
+                        begin_ns = profiler.gpu_cursor_ns;
+                profiler.gpu_cursor_ns = begin_ns + elapsed_ns;
+                profile_record(&profiler.gpu,
+                               frame->spans[i].name,
+                               begin_ns,
+                               profiler.gpu_cursor_ns);
+        }
+        profiler.gpu_ms[profiler.n_gpu_frames++ % PROFILE_HISTORY] = 1e-6f * total_ns;
+
+        return true;
+}
+
+static int
+profile_compare_float(const void *a, const void *b)
+{
+        float x = *(const float*)a;
+        float y = *(const float*)b;
+
+        return (x > y) - (x < y);
+}
+
+// p50 and p99 of the last min(count, PROFILE_HISTORY) samples
+static void
+profile_percentiles(const float *samples, uint32_t count, float *p50, float *p99)
+{
+        static float sorted[PROFILE_HISTORY];
+        uint32_t n = (count < PROFILE_HISTORY) ? count : PROFILE_HISTORY;
+        *p50 = 0.0f;
+        *p99 = 0.0f;
+        if (n == 0)
+                return;
+
+        memcpy(sorted, samples, n * sizeof(float));
+        qsort(sorted, n, sizeof(float), profile_compare_float);
+        *p50 = sorted[(n - 1) / 2];
+        *p99 = sorted[(uint32_t)(0.99f * (n - 1))];
+}
+
+static void
+profile_print_summary(void)
+{
+        float p50;
+        float p99;
+        profile_percentiles(profiler.frame_ms, profiler.n_frames, &p50, &p99);
+        printf("frame p50 %.3f ms, p99 %.3f ms", p50, p99);
+        if (profiler.n_gpu_frames > 0) {
+                profile_percentiles(profiler.gpu_ms, profiler.n_gpu_frames, &p50, &p99);
+                printf(" | gpu p50 %.3f ms, p99 %.3f ms", p50, p99);
+        }
+        printf("\n");
+}
+
+/*
+ * Ends the frame on the GL thread: records its time, recycles the oldest
+ * GPU query frame and prints the rolling summary once a second.
+ */
+static void
+profile_frame(void)
+{
+        uint64_t now = profile_now_ns();
+        profiler.frame_ms[profiler.n_frames++ % PROFILE_HISTORY] =
+                1e-6f * (now - profiler.frame_ns);
+        profiler.frame_ns = now;
+
+        if (profiler.trace_path != NULL) {
+                profile_gpu_end();
+                profiler.gpu_frame = (profiler.gpu_frame + 1) % PROFILE_GPU_FRAMES;
+                struct profile_gpu_frame *oldest = &profiler.gpu_frames[profiler.gpu_frame];
+                if (!profile_gpu_collect(oldest, false))
+                        ++profiler.gpu_dropped;
+                oldest->n_spans = 0;
+        }
+
+        if (now - profiler.report_ns >= PROFILE_REPORT_NS) {
+                profiler.report_ns = now;
+                profile_print_summary();
+        }
+}
+
+static void
+profile_write_thread(FILE *file, const struct profile_thread *thread, bool *first)
+{
+        char label[32];
+        const char *name = thread->name;
+        if (name == NULL) {
+                snprintf(label, sizeof(label), "thread %u", thread->tid);
+                name = label;
+        }
+        fprintf(file,
+                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                "\"args\":{\"name\":\"%s\"}}",
+                *first ? "" : ",",
+                thread->tid,
+                name);
+        *first = false;
+
+        uint32_t count = __atomic_load_n(&thread->count, __ATOMIC_ACQUIRE);
+        for (uint32_t i = 0; i < count; ++i) {
+                const struct profile_event *event = &thread->events[i];
+                fprintf(file,
+                        ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                        "\"ts\":%.3f,\"dur\":%.3f}",
+                        event->name,
+                        thread->tid,
+                        1e-3 * (event->begin_ns - profiler.start_ns),
+                        1e-3 * (event->end_ns - event->begin_ns));
+        }
+}
+
+// writes every event recorded so far; safe while other threads record
+static bool
+profile_write_trace(const char *path)
+{
+        FILE *file = fopen(path, "w");
+        if (file == NULL) {
+                fprintf(stderr, "ERROR::PROFILER::CANNOT_WRITE %s\n", path);
+                return false;
+        }
+
+        bool first = true;
+        fprintf(file, "{\"traceEvents\":[");
+        profile_write_thread(file, &profiler.gpu, &first);
+        uint32_t n_threads = __atomic_load_n(&profiler.n_threads, __ATOMIC_RELAXED);
+        if (n_threads > PROFILE_MAX_THREADS)
+                n_threads = PROFILE_MAX_THREADS;
+        for (uint32_t i = 0; i < n_threads; ++i) {
+                struct profile_thread *thread =
+                        __atomic_load_n(&profiler.threads[i], __ATOMIC_ACQUIRE);
+                if (thread != NULL)
+                        profile_write_thread(file, thread, &first);
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(file);
+
+        return true;
+}
+
+/*
+ * Call on the GL thread before the context goes away, after any other
+ * recording threads have stopped. Waits for the GPU spans still in flight
+ * and writes the trace.
+ */
+static void
+profile_shutdown(void)
+{
+        if (profiler.trace_path == NULL)
+                return;
+
+        profile_gpu_end();
+        for (uint32_t i = 1; i <= PROFILE_GPU_FRAMES; ++i) {
+                uint32_t index = (profiler.gpu_frame + i) % PROFILE_GPU_FRAMES;
+                profile_gpu_collect(&profiler.gpu_frames[index], true);
+                profiler.gpu_frames[index].n_spans = 0;
+                glDeleteQueries(PROFILE_GPU_SPANS, profiler.gpu_frames[index].queries);
+        }
+
+        if (profile_write_trace(profiler.trace_path))
+                printf("trace written to %s (%u gpu frames not timed)\n",
+                       profiler.trace_path,
+                       profiler.gpu_dropped);
+        profile_print_summary();
+
+        uint32_t n_threads = profiler.n_threads;
+        if (n_threads > PROFILE_MAX_THREADS)
+                n_threads = PROFILE_MAX_THREADS;
+        for (uint32_t i = 0; i < n_threads; ++i) {
+                if (profiler.threads[i] != NULL) {
+                        free(profiler.threads[i]->events);
+                        free(profiler.threads[i]);
+                        profiler.threads[i] = NULL;
+                }
+        }
+        free(profiler.gpu.events);
+        profiler.gpu.events = NULL;
+        profiler.trace_path = NULL;
+}
+
+#ifdef __cplusplus
+struct profile_scope {
+        const char *name;
+        uint64_t begin_ns;
+
+        explicit profile_scope(const char *scope_name)
+                : name(scope_name), begin_ns(profile_begin()) {}
+        ~profile_scope() { profile_end(name, begin_ns); }
+};
+
+struct profile_gpu_scope {
+        bool timed;
+
+        explicit profile_gpu_scope(const char *name) : timed(profile_gpu_begin(name)) {}
+        ~profile_gpu_scope()
+        {
+                if (timed)
+                        profile_gpu_end();
+        }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) profile_scope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) \
+        profile_gpu_scope PROFILE_CONCAT(profile_gpu_scope_, __LINE__)(name)
+#endif
+
+#endif /* _LEARN_GL_PROFILER_H_ */
@@ -0,0 +1,353 @@
+#include "coordsystems_scene.hpp"
+#include "scene_file.hpp"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Offline scene converter: reads a text scene description, and the OBJ
+ * meshes it names, and writes a .lscn file (scene_file.hpp) that
+ * coordsystems --scene maps instead of generating its cubes. One
+ * directive per line, # to the end of a line is a comment:
+ *
+ *   mesh NAME builtin:cube | builtin:sphere | FILE.obj
+ *   material NAME TEXTURE1 TEXTURE2
+ *   instance MESH MATERIAL X Y Z [SPIN]
+ *   field MESH MATERIAL COUNT
+ *
+ * SPIN is in degrees per second. field places COUNT instances as
+ * coordsystems generates its cubes, spinning the same way. OBJ files are
+ * relative to the description; texture paths are stored as written and
+ * resolved relative to the output file when it is loaded. Every mesh is
+ * stored with its chain of LODs (mesh_generate_lods), which coordsystems
+ * picks from by screen-space size.
+ */
+
+// the UV sphere of builtin:sphere, unit diameter like the cube
+#define SPHERE_SEGMENTS 48
+#define SPHERE_RINGS 24
+
+static void
+usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s input.txt [output" SCENE_FILE_SUFFIX "]\n", prog);
+}
+
+// the unindexed position (3) and texture coordinate (2) stream of a mesh
+struct source_mesh {
+        std::vector<float> vertices;
+        float radius = 0.0f;
+};
+
+// corner (segment, ring) of the sphere, position then texture coordinate
+static void
+sphere_vertex(uint32_t segment, uint32_t ring, std::vector<float>& out)
+{
+        float u = (float)segment / SPHERE_SEGMENTS;
+        float v = (float)ring / SPHERE_RINGS;
+        float theta = (float)M_PI * v;
+        float phi = 2.0f * (float)M_PI * u;
+        const float vertex[5] = {0.5f * sinf(theta) * cosf(phi),
+                                 0.5f * cosf(theta),
+                                 -0.5f * sinf(theta) * sinf(phi),
+                                 u,
+                                 1.0f - v};
+        out.insert(out.end(), vertex, vertex + 5);
+}
+
+static void
+gen_sphere(source_mesh& out)
+{
+        for (uint32_t ring = 0; ring < SPHERE_RINGS; ++ring) {
+                for (uint32_t segment = 0; segment < SPHERE_SEGMENTS; ++segment) {
+                        // the rings at the poles are fans, not quads
+                        if (ring > 0) {
+                                sphere_vertex(segment, ring, out.vertices);
+                                sphere_vertex(segment + 1, ring + 1, out.vertices);
+                                sphere_vertex(segment + 1, ring, out.vertices);
+                        }
+                        if (ring + 1 < SPHERE_RINGS) {
+                                sphere_vertex(segment, ring, out.vertices);
+                                sphere_vertex(segment, ring + 1, out.vertices);
+                                sphere_vertex(segment + 1, ring + 1, out.vertices);
+                        }
+                }
+        }
+        out.radius = 0.5f;
+}
+
+// a 1-based OBJ index, negative counting back from the end, as 0-based
+static bool
+obj_index(const std::string& token, size_t count, size_t& index)
+{
+        long value = strtol(token.c_str(), NULL, 10);
+        if (value < 0)
+                value += count + 1;
+        if ((value < 1) || ((size_t)value > count))
+                return false;
+        index = value - 1;
+
+        return true;
+}
+
+/*
+ * Reads the positions, texture coordinates and faces of an OBJ file;
+ * polygons are fanned into triangles and everything else is ignored.
+ */
+static bool
+load_obj(const std::string& path, source_mesh& out)
+{
+        std::ifstream file(path);
+        if (!file) {
+                fprintf(stderr, "Failed to open mesh %s\n", path.c_str());
+                return false;
+        }
+
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec2> uvs;
+        std::string line;
+        size_t line_number = 0;
+        while (std::getline(file, line)) {
+                ++line_number;
+                std::istringstream words(line);
+                std::string kind;
+                words >> kind;
+                if (kind == "v") {
+                        glm::vec3 p(0.0f);
+                        words >> p.x >> p.y >> p.z;
+                        positions.push_back(p);
+                } else if (kind == "vt") {
+                        glm::vec2 uv(0.0f);
+                        words >> uv.x >> uv.y;
+                        uvs.push_back(uv);
+                } else if (kind == "f") {
+                        // v, v/vt, v//vn or v/vt/vn per corner
+                        std::vector<float> corners;
+                        std::string corner;
+                        while (words >> corner) {
+                                size_t slash = corner.find('/');
+                                size_t v;
+                                size_t vt = SIZE_MAX;
+                                bool ok = obj_index(corner.substr(0, slash),
+                                                    positions.size(),
+                                                    v);
+                                if (ok && (slash != std::string::npos) &&
+                                    (corner[slash + 1] != '/'))
+                                        ok = obj_index(corner.substr(slash + 1),
+                                                       uvs.size(),
+                                                       vt);
+                                if (!ok) {
+                                        fprintf(stderr,
+                                                "%s:%zu: bad face index %s\n",
+                                                path.c_str(),
+                                                line_number,
+                                                corner.c_str());
+                                        return false;
+                                }
+                                glm::vec2 uv = (vt != SIZE_MAX) ? uvs[vt] : glm::vec2(0.0f);
+                                const float vertex[5] = {positions[v].x,
+                                                         positions[v].y,
+                                                         positions[v].z,
+                                                         uv.x,
+                                                         uv.y};
+                                corners.insert(corners.end(), vertex, vertex + 5);
+                        }
+                        for (size_t c = 2; c < corners.size() / 5; ++c) {
+                                out.vertices.insert(out.vertices.end(),
+                                                    corners.data(),
+                                                    corners.data() + 5);
+                                out.vertices.insert(out.vertices.end(),
+                                                    corners.data() + 5 * (c - 1),
+                                                    corners.data() + 5 * (c + 1));
+                        }
+                }
+        }
+
+        for (const glm::vec3& p : positions)
+                out.radius = std::max(out.radius, glm::length(p));
+
+        return true;
+}
+
+struct convert_state {
+        // directory the description is in, for OBJ paths
+        std::string dir;
+        std::unordered_map<std::string, uint32_t> meshes;
+        std::unordered_map<std::string, uint32_t> materials;
+        scene_source scene;
+};
+
+static bool
+add_mesh(convert_state& state, const std::string& name, const std::string& source)
+{
+        source_mesh m;
+        if (source == "builtin:cube") {
+                m.vertices.assign(cube_vertices, cube_vertices + CUBE_VERTEX_COUNT * 5);
+                m.radius = CUBE_RADIUS;
+        } else if (source == "builtin:sphere") {
+                gen_sphere(m);
+        } else if (!load_obj((source[0] == '/') ? source : state.dir + source, m)) {
+                return false;
+        }
+
+        const mesh_attr attrs[] = {
+                {3, 0, MESH_FLOAT},
+                {2, 3, MESH_HALF},
+        };
+        state.meshes[name] = state.scene.meshes.size();
+        state.scene.meshes.push_back(mesh_build(m.vertices.data(),
+                                                m.vertices.size() / 5,
+                                                5,
+                                                attrs,
+                                                2,
+                                                NULL,
+                                                0,
+                                                MESH_MAX_LODS));
+        state.scene.radii.push_back(m.radius);
+
+        return true;
+}
+
+// looks up the mesh and material names of an instance or field directive
+static bool
+lookup_instance(const convert_state& state,
+                const std::string& mesh,
+                const std::string& material,
+                scene_instance& instance)
+{
+        auto m = state.meshes.find(mesh);
+        auto t = state.materials.find(material);
+        if ((m == state.meshes.end()) || (t == state.materials.end()))
+                return false;
+        instance.mesh = m->second;
+        instance.material = t->second;
+
+        return true;
+}
+
+static bool
+convert_line(convert_state& state, const std::string& line)
+{
+        std::istringstream words(line.substr(0, line.find('#')));
+        std::string kind;
+        if (!(words >> kind))
+                return true;
+
+        if (kind == "mesh") {
+                std::string name;
+                std::string source;
+                return (words >> name >> source) && add_mesh(state, name, source);
+        }
+        if (kind == "material") {
+                std::string name;
+                std::string texture1;
+                std::string texture2;
+                if (!(words >> name >> texture1 >> texture2))
+                        return false;
+                state.materials[name] = state.scene.materials.size();
+                state.scene.materials.emplace_back(texture1, texture2);
+                return true;
+        }
+
+        std::string mesh;
+        std::string material;
+        scene_instance instance;
+        if (!(words >> mesh >> material) ||
+            !lookup_instance(state, mesh, material, instance))
+                return false;
+        if (kind == "instance") {
+                float spin = 0.0f;
+                if (!(words >> instance.position.x >> instance.position.y >> instance.position.z))
+                        return false;
+                words >> spin;
+                instance.spin = glm::radians(spin);
+                state.scene.instances.push_back(instance);
+                return true;
+        }
+        if (kind == "field") {
+                size_t count;
+                if (!(words >> count))
+                        return false;
+                std::vector<glm::vec3> positions =
+                        gen_cube_positions(cube_fixed_positions,
+                                           sizeof(cube_fixed_positions)/sizeof(cube_fixed_positions[0]),
+                                           count);
+                for (size_t i = 0; i < count; ++i) {
+                        instance.position = positions[i];
+                        instance.spin = glm::radians(20.0f * i);
+                        state.scene.instances.push_back(instance);
+                }
+                return true;
+        }
+
+        return false;
+}
+
+int main(int argc, char **argv)
+{
+        if ((argc < 2) || (argc > 3)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        std::string input = argv[1];
+        std::string output = (argc == 3) ?
+                             std::string(argv[2]) :
+                             input.substr(0, input.rfind('.')) + SCENE_FILE_SUFFIX;
+
+        std::ifstream file(input);
+        if (!file) {
+                fprintf(stderr, "Failed to open %s\n", input.c_str());
+                return EXIT_FAILURE;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        convert_state state;
+        size_t slash = input.rfind('/');
+        if (slash != std::string::npos)
+                state.dir = input.substr(0, slash + 1);
+        std::string line;
+        size_t line_number = 0;
+        while (std::getline(file, line)) {
+                ++line_number;
+                if (!convert_line(state, line)) {
+                        fprintf(stderr,
+                                "%s:%zu: can't convert: %s\n",
+                                input.c_str(),
+                                line_number,
+                                line.c_str());
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (!write_scene_file(output.c_str(), state.scene)) {
+                fprintf(stderr, "Failed to write %s\n", output.c_str());
+                return EXIT_FAILURE;
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+        for (const auto& mesh : state.meshes) {
+                const mesh_packed& packed = state.scene.meshes[mesh.second];
+                printf("%s:", mesh.first.c_str());
+                for (const mesh_lod& lod : packed.lods)
+                        printf(" %u", lod.count / 3);
+                printf(" triangles\n");
+        }
+        printf("%s -> %s (%zu meshes, %zu materials, %zu instances) in %.2f ms\n",
+               input.c_str(),
+               output.c_str(),
+               state.scene.meshes.size(),
+               state.scene.materials.size(),
+               state.scene.instances.size(),
+               ms);
+
+        return EXIT_SUCCESS;
+}
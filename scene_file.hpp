@@ -0,0 +1,653 @@
+#ifndef _LEARN_GL_SCENE_FILE_H_
+#define _LEARN_GL_SCENE_FILE_H_
+
+#include "learngl.hpp"
+#include "culling.hpp"
+#include "mesh.hpp"
+#include <glm/glm.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Binary scene container (".lscn"), written offline by scene_convert.cpp.
+ * Everything a scene needs at run time is stored in the layout it is used
+ * in, so opening one is an mmap and a look at the header:
+ *
+ * - one vertex and one index buffer shared by all meshes, uploaded with a
+ *   glBufferData each straight from the mapping; the mesh table gives each
+ *   mesh's index range and base vertex, and its LODs in the LOD table, as
+ *   further index ranges over the same vertices;
+ * - per-instance position, spin (radians per second), mesh and material,
+ *   one array each, in BVH order, which the transform and cull kernels
+ *   read in place;
+ * - the BVH itself, nodes and padded SoA bounds as culling.hpp builds them;
+ * - materials as pairs of texture paths, relative to the scene file.
+ *
+ * Layout: scene_file_header, whose section table gives the offset and size
+ * of every section. Sections start on SCENE_FILE_ALIGN boundaries, so the
+ * SoA arrays can be loaded four (or sixteen) at a time. Numbers are in the
+ * host's byte order.
+ */
+
+#define SCENE_FILE_MAGIC "LSCN"
+#define SCENE_FILE_VERSION 2
+#define SCENE_FILE_ALIGN 64
+#define SCENE_FILE_SUFFIX ".lscn"
+
+enum scene_section_id {
+        SCENE_VERTICES,
+        SCENE_INDICES,
+        SCENE_MESHES,
+        SCENE_MATERIALS,
+        // NUL-terminated texture paths, which materials point into
+        SCENE_STRINGS,
+        SCENE_PX,
+        SCENE_PY,
+        SCENE_PZ,
+        SCENE_SPIN,
+        SCENE_MESH_INDEX,
+        SCENE_MATERIAL_INDEX,
+        SCENE_BVH_NODES,
+        // n_instances + 3 floats each, as bvh::min_x and friends
+        SCENE_BOUNDS_MIN_X,
+        SCENE_BOUNDS_MIN_Y,
+        SCENE_BOUNDS_MIN_Z,
+        SCENE_BOUNDS_MAX_X,
+        SCENE_BOUNDS_MAX_Y,
+        SCENE_BOUNDS_MAX_Z,
+        SCENE_LODS,
+        SCENE_SECTION_COUNT
+};
+
+struct scene_file_section {
+        uint64_t offset;
+        uint64_t size;
+};
+
+struct scene_file_attr {
+        uint32_t size;
+        // a mesh_attr_format; positions are never snorm16, see write_scene_file
+        uint32_t format;
+        // bytes into a vertex
+        uint32_t offset;
+};
+
+struct scene_file_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t n_instances;
+        uint32_t n_meshes;
+        uint32_t n_lods;
+        uint32_t n_materials;
+        uint32_t n_nodes;
+        uint32_t n_vertices;
+        uint32_t n_indices;
+        // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, for every mesh
+        uint32_t index_type;
+        uint32_t vertex_size;
+        uint32_t n_attrs;
+        scene_file_attr attrs[MESH_MAX_ATTRS];
+        scene_file_section sections[SCENE_SECTION_COUNT];
+};
+
+struct scene_mesh {
+        // in indices, into the shared index buffer; the full mesh, LOD 0
+        uint32_t first_index;
+        uint32_t n_indices;
+        int32_t base_vertex;
+        uint32_t n_vertices;
+        // bounding sphere about the mesh origin, whatever its rotation
+        float radius;
+        // into the LOD table, finest first; there is always one
+        uint32_t first_lod;
+        uint32_t n_lods;
+        uint32_t pad;
+};
+
+// a mesh_lod, with its range in the shared index buffer
+struct scene_lod {
+        uint32_t first_index;
+        uint32_t n_indices;
+        float error;
+};
+
+struct scene_material {
+        // offsets into SCENE_STRINGS
+        uint32_t textures[2];
+};
+
+struct scene_file {
+        void *map = NULL;
+        size_t map_size = 0;
+        const scene_file_header *header = NULL;
+        // what texture paths are relative to, with a trailing '/' if not empty
+        std::string dir;
+};
+
+static void
+close_scene_file(scene_file& scene)
+{
+        if (scene.map != NULL)
+                munmap(scene.map, scene.map_size);
+        scene = scene_file();
+}
+
+template <typename T>
+static const T*
+scene_section_data(const scene_file& scene, scene_section_id section)
+{
+        return (const T*)((const uint8_t*)scene.map + scene.header->sections[section].offset);
+}
+
+static uint32_t
+scene_index_size(uint32_t index_type)
+{
+        return (index_type == GL_UNSIGNED_SHORT) ? 2 : 4;
+}
+
+// the size every section must have, given the header's counts
+static uint64_t
+scene_section_expected_size(const scene_file_header& header, uint32_t section)
+{
+        uint64_t n = header.n_instances;
+        switch (section) {
+        case SCENE_VERTICES:
+                return (uint64_t)header.n_vertices * header.vertex_size;
+        case SCENE_INDICES:
+                return (uint64_t)header.n_indices * scene_index_size(header.index_type);
+        case SCENE_MESHES:
+                return (uint64_t)header.n_meshes * sizeof(scene_mesh);
+        case SCENE_LODS:
+                return (uint64_t)header.n_lods * sizeof(scene_lod);
+        case SCENE_MATERIALS:
+                return (uint64_t)header.n_materials * sizeof(scene_material);
+        case SCENE_STRINGS:
+                return UINT64_MAX;
+        case SCENE_BVH_NODES:
+                return (uint64_t)header.n_nodes * sizeof(bvh_node);
+        case SCENE_BOUNDS_MIN_X:
+        case SCENE_BOUNDS_MIN_Y:
+        case SCENE_BOUNDS_MIN_Z:
+        case SCENE_BOUNDS_MAX_X:
+        case SCENE_BOUNDS_MAX_Y:
+        case SCENE_BOUNDS_MAX_Z:
+                return (n + 3) * sizeof(float);
+        default:
+                return n * sizeof(uint32_t);
+        }
+}
+
+/*
+ * Checks what the per-instance sections and the BVH refer to, which
+ * touches every page of them; open_scene_file only does it if asked.
+ */
+static bool
+scene_file_check_records(const scene_file& scene)
+{
+        const scene_file_header& header = *scene.header;
+        const uint32_t *mesh_index = scene_section_data<uint32_t>(scene, SCENE_MESH_INDEX);
+        const uint32_t *material_index = scene_section_data<uint32_t>(scene,
+                                                                      SCENE_MATERIAL_INDEX);
+        for (uint32_t i = 0; i < header.n_instances; ++i)
+                if ((mesh_index[i] >= header.n_meshes) ||
+                    (material_index[i] >= header.n_materials))
+                        return false;
+
+        const bvh_node *nodes = scene_section_data<bvh_node>(scene, SCENE_BVH_NODES);
+        for (uint32_t i = 0; i < header.n_nodes; ++i) {
+                const bvh_node& node = nodes[i];
+                if (node.n_children > BVH_WIDTH)
+                        return false;
+                for (uint32_t c = 0; c < node.n_children; ++c) {
+                        // children come after their parent, so walks terminate
+                        if ((node.child[c] != -1) &&
+                            ((node.child[c] <= (int32_t)i) ||
+                             ((uint32_t)node.child[c] >= header.n_nodes)))
+                                return false;
+                        if ((node.begin[c] > node.end[c]) ||
+                            (node.end[c] > header.n_instances))
+                                return false;
+                }
+        }
+
+        return true;
+}
+
+/*
+ * Maps a scene file and checks its header, section table and the small
+ * mesh and material tables against the file size. The bulk sections are
+ * left unread; the kernel pages them in as the upload and the first frame
+ * touch them, so opening costs the same for any number of instances.
+ * check_records also validates every instance and BVH node, for files
+ * that did not come from write_scene_file. Returns false, leaving scene
+ * empty, if the file is missing or invalid.
+ */
+static bool
+open_scene_file(const char *path, scene_file& scene, bool check_records = false)
+{
+        scene = scene_file();
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return false;
+
+        struct stat st;
+        if ((fstat(fd, &st) != 0) ||
+            ((size_t)st.st_size < sizeof(scene_file_header))) {
+                close(fd);
+                return false;
+        }
+
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+                return false;
+
+        scene.map = map;
+        scene.map_size = st.st_size;
+        scene.header = (const scene_file_header*)map;
+        const char *slash = strrchr(path, '/');
+        if (slash != NULL)
+                scene.dir.assign(path, slash + 1 - path);
+
+        const scene_file_header& header = *scene.header;
+        bool valid = (memcmp(header.magic, SCENE_FILE_MAGIC, 4) == 0) &&
+                     (header.version == SCENE_FILE_VERSION) &&
+                     (header.n_meshes > 0) &&
+                     (header.n_attrs > 0) &&
+                     (header.n_attrs <= MESH_MAX_ATTRS) &&
+                     ((header.index_type == GL_UNSIGNED_SHORT) ||
+                      (header.index_type == GL_UNSIGNED_INT));
+        for (uint32_t i = 0; valid && (i < header.n_attrs); ++i)
+                valid = (header.attrs[i].size >= 1) &&
+                        (header.attrs[i].size <= 4) &&
+                        (header.attrs[i].format <= MESH_SNORM16) &&
+                        (header.attrs[i].offset < header.vertex_size);
+        for (uint32_t i = 0; valid && (i < SCENE_SECTION_COUNT); ++i) {
+                const scene_file_section& section = header.sections[i];
+                uint64_t expected = scene_section_expected_size(header, i);
+                valid = (section.offset % SCENE_FILE_ALIGN == 0) &&
+                        (section.offset >= sizeof(header)) &&
+                        (section.offset <= scene.map_size) &&
+                        (section.size <= scene.map_size - section.offset) &&
+                        ((expected == UINT64_MAX) || (section.size == expected));
+        }
+
+        // the tables are a few entries per mesh and material, check them all
+        const scene_mesh *meshes = valid ?
+                                   scene_section_data<scene_mesh>(scene, SCENE_MESHES) :
+                                   NULL;
+        for (uint32_t i = 0; valid && (i < header.n_meshes); ++i)
+                valid = ((uint64_t)meshes[i].first_index + meshes[i].n_indices <=
+                         header.n_indices) &&
+                        (meshes[i].base_vertex >= 0) &&
+                        ((uint64_t)meshes[i].base_vertex + meshes[i].n_vertices <=
+                         header.n_vertices) &&
+                        (meshes[i].n_lods > 0) &&
+                        ((uint64_t)meshes[i].first_lod + meshes[i].n_lods <= header.n_lods);
+        const scene_lod *lods = valid ? scene_section_data<scene_lod>(scene, SCENE_LODS) : NULL;
+        for (uint32_t i = 0; valid && (i < header.n_lods); ++i)
+                valid = (uint64_t)lods[i].first_index + lods[i].n_indices <= header.n_indices;
+        if (valid && (header.n_materials > 0)) {
+                const scene_file_section& strings = header.sections[SCENE_STRINGS];
+                const char *text = scene_section_data<char>(scene, SCENE_STRINGS);
+                valid = (strings.size > 0) && (text[strings.size - 1] == '\0');
+                const scene_material *materials =
+                        scene_section_data<scene_material>(scene, SCENE_MATERIALS);
+                for (uint32_t i = 0; valid && (i < header.n_materials); ++i)
+                        valid = (materials[i].textures[0] < strings.size) &&
+                                (materials[i].textures[1] < strings.size);
+        }
+        if (valid && check_records)
+                valid = scene_file_check_records(scene);
+
+        if (!valid) {
+                fprintf(stderr, "ERROR::SCENE_FILE::INVALID_FILE %s\n", path);
+                close_scene_file(scene);
+                return false;
+        }
+
+        return true;
+}
+
+static bvh_view
+scene_bvh(const scene_file& scene)
+{
+        bvh_view tree;
+        tree.nodes = scene_section_data<bvh_node>(scene, SCENE_BVH_NODES);
+        tree.n_nodes = scene.header->n_nodes;
+        tree.min_x = scene_section_data<float>(scene, SCENE_BOUNDS_MIN_X);
+        tree.min_y = scene_section_data<float>(scene, SCENE_BOUNDS_MIN_Y);
+        tree.min_z = scene_section_data<float>(scene, SCENE_BOUNDS_MIN_Z);
+        tree.max_x = scene_section_data<float>(scene, SCENE_BOUNDS_MAX_X);
+        tree.max_y = scene_section_data<float>(scene, SCENE_BOUNDS_MAX_Y);
+        tree.max_z = scene_section_data<float>(scene, SCENE_BOUNDS_MAX_Z);
+
+        return tree;
+}
+
+// texture t of material, as a path usable from the working directory
+static std::string
+scene_texture_path(const scene_file& scene, uint32_t material, uint32_t t)
+{
+        const scene_material *materials = scene_section_data<scene_material>(scene,
+                                                                             SCENE_MATERIALS);
+        const char *path = scene_section_data<char>(scene, SCENE_STRINGS) +
+                           materials[material].textures[t];
+        if (path[0] == '/')
+                return path;
+
+        return scene.dir + path;
+}
+
+/*
+ * Uploads the shared vertex and index buffers into buffers[0] and [1],
+ * each with one glBufferData from the mapping, and returns a new VAO,
+ * left bound, with attribute i at location i.
+ */
+static uint32_t
+init_scene_VAO(const scene_file& scene, uint32_t buffers[2])
+{
+        const scene_file_header& header = *scene.header;
+        uint32_t VAO;
+        glGenVertexArrays(1, &VAO);
+        state_bind_vertex_array(VAO);
+
+        glGenBuffers(2, buffers);
+        state_bind_buffer(GL_ARRAY_BUFFER, buffers[0]);
+        glBufferData(GL_ARRAY_BUFFER,
+                     header.sections[SCENE_VERTICES].size,
+                     scene_section_data<uint8_t>(scene, SCENE_VERTICES),
+                     GL_STATIC_DRAW);
+        state_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                     header.sections[SCENE_INDICES].size,
+                     scene_section_data<uint8_t>(scene, SCENE_INDICES),
+                     GL_STATIC_DRAW);
+
+        mesh_attr attrs[MESH_MAX_ATTRS];
+        uint32_t attr_offsets[MESH_MAX_ATTRS];
+        for (uint32_t a = 0; a < header.n_attrs; ++a) {
+                attrs[a].size = header.attrs[a].size;
+                attrs[a].offset = 0;
+                attrs[a].format = (mesh_attr_format)header.attrs[a].format;
+                attr_offsets[a] = header.attrs[a].offset;
+        }
+        mesh_vertex_attribs(attrs, attr_offsets, header.n_attrs, header.vertex_size);
+
+        return VAO;
+}
+
+/*
+ * A scene as the converter assembles it. Meshes must share one vertex
+ * format; instances may come in any order.
+ */
+struct scene_instance {
+        glm::vec3 position;
+        // radians per second
+        float spin;
+        uint32_t mesh;
+        uint32_t material;
+};
+
+struct scene_source {
+        std::vector<mesh_packed> meshes;
+        // bounding sphere of each mesh about its origin
+        std::vector<float> radii;
+        // texture paths, relative to the scene file
+        std::vector<std::pair<std::string, std::string>> materials;
+        std::vector<scene_instance> instances;
+};
+
+/*
+ * Appends size bytes to file at the next SCENE_FILE_ALIGN boundary and
+ * records where they went in header's section table; false if the write
+ * failed.
+ */
+static bool
+scene_write_section(FILE *file,
+                    scene_file_header& header,
+                    scene_section_id section,
+                    const void *data,
+                    size_t size)
+{
+        const uint8_t padding[SCENE_FILE_ALIGN] = {};
+        long pos = ftell(file);
+        if (pos < 0)
+                return false;
+        long aligned = (pos + SCENE_FILE_ALIGN - 1) & ~(long)(SCENE_FILE_ALIGN - 1);
+        header.sections[section].offset = aligned;
+        header.sections[section].size = size;
+
+        return (fwrite(padding, 1, aligned - pos, file) == (size_t)(aligned - pos)) &&
+               (fwrite(data, 1, size, file) == size);
+}
+
+static bool
+scene_source_error(const char *what)
+{
+        fprintf(stderr, "ERROR::SCENE_FILE::%s\n", what);
+        return false;
+}
+
+/*
+ * Merges the meshes into shared buffers, builds the BVH over the
+ * instances' bounding boxes and writes the instances in its order.
+ */
+static bool
+write_scene_file(const char *path, const scene_source& source)
+{
+        if (source.meshes.empty() || (source.radii.size() != source.meshes.size()))
+                return scene_source_error("NO_MESHES");
+        if (source.instances.size() > UINT32_MAX - 3)
+                return scene_source_error("TOO_MANY_INSTANCES");
+
+        scene_file_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SCENE_FILE_MAGIC, 4);
+        header.version = SCENE_FILE_VERSION;
+
+        // snorm16 needs a dequantization matrix per mesh, which the
+        // instance data has no room for
+        const mesh_packed& first = source.meshes[0];
+        header.n_attrs = first.n_attrs;
+        header.vertex_size = first.vertex_size;
+        for (uint32_t a = 0; a < first.n_attrs; ++a) {
+                if (first.attrs[a].format == MESH_SNORM16)
+                        return scene_source_error("SNORM16_ATTRIBUTE");
+                header.attrs[a].size = first.attrs[a].size;
+                header.attrs[a].format = first.attrs[a].format;
+                header.attrs[a].offset = first.attr_offsets[a];
+        }
+
+        // indices are relative to each mesh's base vertex, so 16 bits do
+        // as long as every mesh fits
+        header.index_type = GL_UNSIGNED_SHORT;
+        for (const mesh_packed& packed : source.meshes) {
+                bool same = (packed.n_attrs == first.n_attrs) &&
+                            (packed.vertex_size == first.vertex_size);
+                for (uint32_t a = 0; same && (a < first.n_attrs); ++a)
+                        same = (packed.attrs[a].size == first.attrs[a].size) &&
+                               (packed.attrs[a].format == first.attrs[a].format) &&
+                               (packed.attr_offsets[a] == first.attr_offsets[a]);
+                if (!same)
+                        return scene_source_error("MIXED_VERTEX_FORMATS");
+                if (packed.index_type == GL_UNSIGNED_INT)
+                        header.index_type = GL_UNSIGNED_INT;
+        }
+
+        std::vector<uint8_t> vertices;
+        std::vector<uint8_t> indices;
+        std::vector<scene_mesh> meshes(source.meshes.size());
+        std::vector<scene_lod> lods;
+        uint32_t index_size = scene_index_size(header.index_type);
+        for (size_t m = 0; m < source.meshes.size(); ++m) {
+                const mesh_packed& packed = source.meshes[m];
+                scene_mesh& record = meshes[m];
+                memset(&record, 0, sizeof(record));
+                uint32_t first_index = indices.size() / index_size;
+                record.first_index = first_index + packed.lods[0].first;
+                record.n_indices = packed.lods[0].count;
+                record.base_vertex = vertices.size() / header.vertex_size;
+                record.n_vertices = packed.n_vertices;
+                record.radius = source.radii[m];
+                record.first_lod = lods.size();
+                record.n_lods = packed.lods.size();
+                for (const mesh_lod& lod : packed.lods)
+                        lods.push_back({first_index + lod.first, lod.count, lod.error});
+
+                vertices.insert(vertices.end(), packed.vertices.begin(), packed.vertices.end());
+                if (packed.index_type == header.index_type) {
+                        indices.insert(indices.end(), packed.indices.begin(), packed.indices.end());
+                } else {
+                        // widen a 16-bit mesh to the scene's 32 bits
+                        const uint16_t *src = (const uint16_t*)packed.indices.data();
+                        for (size_t i = 0; i < packed.n_indices; ++i) {
+                                uint32_t index = src[i];
+                                const uint8_t *bytes = (const uint8_t*)&index;
+                                indices.insert(indices.end(), bytes, bytes + 4);
+                        }
+                }
+        }
+        header.n_meshes = meshes.size();
+        header.n_lods = lods.size();
+        header.n_vertices = vertices.size() / header.vertex_size;
+        header.n_indices = indices.size() / index_size;
+
+        std::string strings;
+        std::unordered_map<std::string, uint32_t> string_offsets;
+        std::vector<scene_material> materials(source.materials.size());
+        for (size_t m = 0; m < source.materials.size(); ++m) {
+                const std::string *paths[2] = {&source.materials[m].first,
+                                               &source.materials[m].second};
+                for (uint32_t t = 0; t < 2; ++t) {
+                        auto it = string_offsets.find(*paths[t]);
+                        if (it == string_offsets.end()) {
+                                it = string_offsets.emplace(*paths[t], strings.size()).first;
+                                strings.append(*paths[t]);
+                                strings.push_back('\0');
+                        }
+                        materials[m].textures[t] = it->second;
+                }
+        }
+        header.n_materials = materials.size();
+
+        size_t n = source.instances.size();
+        std::vector<aabb> bounds(n);
+        for (size_t i = 0; i < n; ++i) {
+                const scene_instance& instance = source.instances[i];
+                if ((instance.mesh >= meshes.size()) ||
+                    (instance.material >= materials.size()))
+                        return scene_source_error("INSTANCE_OUT_OF_RANGE");
+                float radius = source.radii[instance.mesh];
+                bounds[i].min = instance.position - glm::vec3(radius);
+                bounds[i].max = instance.position + glm::vec3(radius);
+        }
+        bvh tree;
+        bvh_build(tree, bounds.data(), n);
+        header.n_instances = n;
+        header.n_nodes = tree.nodes.size();
+
+        std::vector<float> px(n), py(n), pz(n), spin(n);
+        std::vector<uint32_t> mesh_index(n), material_index(n);
+        for (size_t j = 0; j < n; ++j) {
+                const scene_instance& instance = source.instances[tree.order[j]];
+                px[j] = instance.position.x;
+                py[j] = instance.position.y;
+                pz[j] = instance.position.z;
+                spin[j] = instance.spin;
+                mesh_index[j] = instance.mesh;
+                material_index[j] = instance.material;
+        }
+
+        FILE *file = fopen(path, "wb");
+        if (file == NULL)
+                return false;
+
+        // the header goes in last, once the section table is filled in
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_VERTICES,
+                                       vertices.data(),
+                                       vertices.size());
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_INDICES,
+                                       indices.data(),
+                                       indices.size());
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_MESHES,
+                                       meshes.data(),
+                                       meshes.size() * sizeof(scene_mesh));
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_LODS,
+                                       lods.data(),
+                                       lods.size() * sizeof(scene_lod));
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_MATERIALS,
+                                       materials.data(),
+                                       materials.size() * sizeof(scene_material));
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_STRINGS,
+                                       strings.data(),
+                                       strings.size());
+        ok = ok && scene_write_section(file, header, SCENE_PX, px.data(), n * sizeof(float));
+        ok = ok && scene_write_section(file, header, SCENE_PY, py.data(), n * sizeof(float));
+        ok = ok && scene_write_section(file, header, SCENE_PZ, pz.data(), n * sizeof(float));
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_SPIN,
+                                       spin.data(),
+                                       n * sizeof(float));
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_MESH_INDEX,
+                                       mesh_index.data(),
+                                       n * sizeof(uint32_t));
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_MATERIAL_INDEX,
+                                       material_index.data(),
+                                       n * sizeof(uint32_t));
+        ok = ok && scene_write_section(file,
+                                       header,
+                                       SCENE_BVH_NODES,
+                                       tree.nodes.data(),
+                                       tree.nodes.size() * sizeof(bvh_node));
+        const std::vector<float> *bounds_arrays[6] = {
+                &tree.min_x, &tree.min_y, &tree.min_z,
+                &tree.max_x, &tree.max_y, &tree.max_z,
+        };
+        for (uint32_t i = 0; i < 6; ++i)
+                ok = ok && scene_write_section(file,
+                                               header,
+                                               (scene_section_id)(SCENE_BOUNDS_MIN_X + i),
+                                               bounds_arrays[i]->data(),
+                                               bounds_arrays[i]->size() * sizeof(float));
+
+        ok = ok &&
+             (fseek(file, 0, SEEK_SET) == 0) &&
+             (fwrite(&header, sizeof(header), 1, file) == 1);
+        ok = (fclose(file) == 0) && ok;
+        if (!ok) {
+                // no partial scene is left for a later load to trip on
+                remove(path);
+                return scene_source_error("WRITE_FAILED");
+        }
+
+        return true;
+}
+
+#endif /* _LEARN_GL_SCENE_FILE_H_ */
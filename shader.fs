@@ -3,11 +3,19 @@ out vec4 FragColor;
 
 in vec2 TexCoord;
 
+#ifdef TEXTURE_ARRAYS
+flat in uint Material;
+uniform sampler2DArray texture1;
+uniform sampler2DArray texture2;
+#define SAMPLE(tex, uv) texture(tex, vec3(uv, float(Material)))
+#else
 uniform sampler2D texture1;
 uniform sampler2D texture2;
+#define SAMPLE(tex, uv) texture(tex, uv)
+#endif
 uniform float alpha;
 
 void main()
 {
-        FragColor = mix(texture(texture1, TexCoord), texture(texture2, vec2(2.0*(1.0 - TexCoord.x), 2.0*TexCoord.y)), alpha);
+        FragColor = mix(SAMPLE(texture1, TexCoord), SAMPLE(texture2, vec2(2.0*(1.0 - TexCoord.x), 2.0*TexCoord.y)), alpha);
 }
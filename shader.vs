@@ -1,15 +1,26 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 aTexCoord;
+#ifdef TEXTURE_ARRAYS
+// texture array layer, a constant attribute here
+layout (location = 6) in uint aMaterial;
+flat out uint Material;
+#endif
 
 out vec2 TexCoord;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout (std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
 
 void main()
 {
     gl_Position = projection * view * model * vec4(aPos, 1.0);
     TexCoord = aTexCoord;
+#ifdef TEXTURE_ARRAYS
+    Material = aMaterial;
+#endif
 }
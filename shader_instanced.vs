@@ -0,0 +1,26 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aTexCoord;
+layout (location = 2) in mat4 aModel;
+#ifdef TEXTURE_ARRAYS
+// texture array layer, per instance
+layout (location = 6) in uint aMaterial;
+flat out uint Material;
+#endif
+
+out vec2 TexCoord;
+
+layout (std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+
+void main()
+{
+    gl_Position = projection * view * aModel * vec4(aPos, 1.0);
+    TexCoord = aTexCoord;
+#ifdef TEXTURE_ARRAYS
+    Material = aMaterial;
+#endif
+}
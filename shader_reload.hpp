@@ -0,0 +1,242 @@
+#ifndef _LEARN_GL_SHADER_RELOAD_H_
+#define _LEARN_GL_SHADER_RELOAD_H_
+
+#include "learngl.hpp"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/*
+ * Shader hot-reload. A watcher thread waits on inotify for writes to the
+ * shader files and bumps a generation counter; the GL thread notices the
+ * bump in reload_program_poll, kicks off a recompile and relink, and keeps
+ * rendering with the old program until the new one has linked. With
+ * GL_KHR_parallel_shader_compile the driver compiles in the background and
+ * completion is polled, so the render loop never waits on the compiler.
+ * A program that fails to compile or link is dropped and the old one kept.
+ */
+
+struct watched_file {
+        int32_t wd;
+        std::string name;
+};
+
+struct shader_watcher {
+        int32_t fd = -1;
+        std::vector<watched_file> files;
+        std::thread thread;
+        std::atomic<bool> quit{false};
+        std::atomic<uint32_t> generation{0};
+};
+
+static void
+shader_watcher_thread(shader_watcher *watcher)
+{
+        alignas(struct inotify_event) char buf[4096];
+        while (!watcher->quit.load(std::memory_order_relaxed)) {
+                struct pollfd pfd = {watcher->fd, POLLIN, 0};
+                if (poll(&pfd, 1, 100) <= 0)
+                        continue;
+
+                ssize_t len = read(watcher->fd, buf, sizeof(buf));
+                bool changed = false;
+                for (ssize_t pos = 0; pos < len; ) {
+                        const struct inotify_event *event =
+                                (const struct inotify_event*)(buf + pos);
+                        pos += sizeof(struct inotify_event) + event->len;
+                        if (event->len == 0)
+                                continue;
+
+                        for (const watched_file& file : watcher->files)
+                                if ((file.wd == event->wd) &&
+                                    (file.name == event->name))
+                                        changed = true;
+                }
+                if (changed)
+                        watcher->generation.fetch_add(1, std::memory_order_release);
+        }
+}
+
+/*
+ * Watches the given shader files. Their directories are watched rather than
+ * the files themselves, since editors often save by writing a new file and
+ * renaming it over the old one. Call before shader_watcher_start.
+ */
+static bool
+shader_watcher_add(shader_watcher& watcher, const char *path)
+{
+        if (watcher.fd < 0) {
+                watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+                if (watcher.fd < 0)
+                        return false;
+        }
+
+        std::string full(path);
+        size_t slash = full.rfind('/');
+        std::string dir = (slash == std::string::npos) ? "." : full.substr(0, slash);
+        std::string name = (slash == std::string::npos) ? full : full.substr(slash + 1);
+
+        int32_t wd = inotify_add_watch(watcher.fd,
+                                       dir.c_str(),
+                                       IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd < 0) {
+                fprintf(stderr, "ERROR::SHADER_RELOAD::CANNOT_WATCH %s\n", path);
+                return false;
+        }
+        watcher.files.push_back({wd, name});
+
+        return true;
+}
+
+static void
+shader_watcher_start(shader_watcher& watcher)
+{
+        if (watcher.fd >= 0)
+                watcher.thread = std::thread(shader_watcher_thread, &watcher);
+
+        // let the driver use as many compiler threads as it likes
+        if (GLAD_GL_KHR_parallel_shader_compile)
+                glMaxShaderCompilerThreadsKHR(0xffffffffu);
+}
+
+static void
+shader_watcher_stop(shader_watcher& watcher)
+{
+        watcher.quit = true;
+        if (watcher.thread.joinable())
+                watcher.thread.join();
+        if (watcher.fd >= 0)
+                close(watcher.fd);
+        watcher.fd = -1;
+}
+
+struct reload_program {
+        shader_program program;
+        std::string vs_path;
+        std::string fs_path;
+        std::string defines;
+
+        // watcher generation the current (or pending) program was built from
+        uint32_t generation = 0;
+
+        // program being compiled/linked, 0 if none
+        uint32_t pending = 0;
+        uint32_t pending_vertex = 0;
+        uint32_t pending_fragment = 0;
+        std::string pending_cache_path;
+};
+
+/*
+ * Loads the initial program synchronously (through the binary cache) and
+ * registers its shader files with the watcher.
+ */
+static void
+reload_program_init(reload_program& reload,
+                    shader_watcher& watcher,
+                    const char *vs_path,
+                    const char *fs_path,
+                    const char *defines = "")
+{
+        reload.vs_path = vs_path;
+        reload.fs_path = fs_path;
+        reload.defines = defines;
+        reload.generation = watcher.generation.load(std::memory_order_acquire);
+        reload.program = create_program_cached(vs_path, fs_path, defines);
+
+        shader_watcher_add(watcher, vs_path);
+        shader_watcher_add(watcher, fs_path);
+}
+
+/*
+ * Issues the compile and link of the edited sources without waiting on
+ * either; with parallel shader compile both return immediately.
+ */
+static void
+reload_program_begin(reload_program& reload)
+{
+        const char *defines = reload.defines.c_str();
+        std::string vs_code = insert_defines(read_shader_source(reload.vs_path.c_str()),
+                                             defines);
+        std::string fs_code = insert_defines(read_shader_source(reload.fs_path.c_str()),
+                                             defines);
+
+        reload.pending_vertex = glCreateShader(GL_VERTEX_SHADER);
+        const char *code = vs_code.c_str();
+        glShaderSource(reload.pending_vertex, 1, &code, NULL);
+        glCompileShader(reload.pending_vertex);
+
+        reload.pending_fragment = glCreateShader(GL_FRAGMENT_SHADER);
+        code = fs_code.c_str();
+        glShaderSource(reload.pending_fragment, 1, &code, NULL);
+        glCompileShader(reload.pending_fragment);
+
+        reload.pending = glCreateProgram();
+        reload.pending_cache_path.clear();
+        if (program_binaries_supported()) {
+                reload.pending_cache_path = shader_cache_path(vs_code, fs_code, defines);
+                glProgramParameteri(reload.pending,
+                                    GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                                    GL_TRUE);
+        }
+        glAttachShader(reload.pending, reload.pending_vertex);
+        glAttachShader(reload.pending, reload.pending_fragment);
+        glLinkProgram(reload.pending);
+}
+
+/*
+ * Call once per frame on the GL thread. Returns true on the frame the new
+ * program replaces the old one; uniform handles and any uniform values set
+ * on the old program must then be set up again for reload.program.
+ */
+static bool
+reload_program_poll(reload_program& reload, const shader_watcher& watcher)
+{
+        if (reload.pending == 0) {
+                uint32_t generation = watcher.generation.load(std::memory_order_acquire);
+                if (generation == reload.generation)
+                        return false;
+                reload.generation = generation;
+                reload_program_begin(reload);
+        }
+
+        if (GLAD_GL_KHR_parallel_shader_compile) {
+                int32_t done = GL_FALSE;
+                glGetProgramiv(reload.pending, GL_COMPLETION_STATUS_KHR, &done);
+                if (!done)
+                        return false;
+        }
+
+        checkCompileErrors(reload.pending_vertex, reload.vs_path);
+        checkCompileErrors(reload.pending_fragment, reload.fs_path);
+        checkCompileErrors(reload.pending, "PROGRAM");
+        glDeleteShader(reload.pending_vertex);
+        glDeleteShader(reload.pending_fragment);
+
+        int32_t success;
+        glGetProgramiv(reload.pending, GL_LINK_STATUS, &success);
+        uint32_t program = reload.pending;
+        reload.pending = 0;
+        if (!success) {
+                fprintf(stderr,
+                        "ERROR::SHADER_RELOAD::KEEPING_OLD_PROGRAM %s %s\n",
+                        reload.vs_path.c_str(),
+                        reload.fs_path.c_str());
+                state_delete_program(program);
+                return false;
+        }
+
+        if (!reload.pending_cache_path.empty())
+                store_program_binary(reload.pending_cache_path, program);
+
+        state_delete_program(reload.program.id);
+        reload.program.id = program;
+        init_program_uniforms(reload.program);
+
+        return true;
+}
+
+#endif /* _LEARN_GL_SHADER_RELOAD_H_ */
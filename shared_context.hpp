@@ -0,0 +1,384 @@
+#ifndef _LEARN_GL_SHARED_CONTEXT_H_
+#define _LEARN_GL_SHARED_CONTEXT_H_
+
+#include "learngl.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/*
+ * More contexts in the share group of the one init_gl made, each driven by
+ * a render thread of its own, so one process can feed several windows
+ * (preview, output, thumbnails). Textures, buffers, programs and sync
+ * objects belong to the share group and are made once, in any of the
+ * contexts; container objects (VAOs, framebuffers) do not, so each context
+ * makes its own.
+ *
+ * - create_shared_context, on the main thread, makes a context sharing
+ *   with init_gl's: a window of its own, or headless an EGL context whose
+ *   framebuffer its thread makes.
+ * - shared_context_start runs a function on a new thread with the context
+ *   current. It should return once ctx.quit is set, which
+ *   shared_context_stop sets before joining.
+ * - shared_context_swap presents, from that thread.
+ * - A shared_ring hands frames one context renders to the others, through
+ *   a few textures. Each carries a fence for its writing and one for each
+ *   reader's reading, and every wait on them is a glWaitSync on the
+ *   waiting context's command stream: no glFinish, and neither side blocks
+ *   on the other's GPU work.
+ *
+ * The GL entry points are loaded once, by init_gl; every context of a
+ * share group is on the same driver, so they hold for all of them. The
+ * state cache (gl_state.h) is per thread. The profiler's GPU scopes are
+ * for init_gl's context only.
+ */
+
+#define SHARED_MAX_READERS 8
+// the newest frame, one being written, and one for a reader still on an
+// older frame
+#define SHARED_RING_SIZE 3
+
+struct shared_context {
+        // windowed, or headless
+        GLFWwindow *window = NULL;
+        EGLContext context = EGL_NO_CONTEXT;
+        uint32_t width = 0;
+        uint32_t height = 0;
+
+        // context's thread only: headless, its framebuffer and the frame
+        // the next swap waits for, as headless_swap does
+        uint32_t FBO = 0;
+        uint32_t color_RBO = 0;
+        uint32_t depth_RBO = 0;
+        GLsync frame_fence = NULL;
+
+        std::thread thread;
+        std::atomic<bool> quit{false};
+        std::atomic<uint64_t> frames{0};
+};
+
+/*
+ * Main thread, after init_gl: a width x height context sharing objects with
+ * init_gl's. Returns false on failure.
+ */
+static bool
+create_shared_context(shared_context& ctx, uint32_t width, uint32_t height, const char *title)
+{
+        ctx.width = width;
+        ctx.height = height;
+        if (headless.context != EGL_NO_CONTEXT) {
+                ctx.context = headless_create_context(headless.context);
+                if (ctx.context == EGL_NO_CONTEXT) {
+                        fprintf(stderr, "ERROR::HEADLESS::EGL_CONTEXT_FAILED\n");
+                        return false;
+                }
+                return true;
+        }
+
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        ctx.window = glfwCreateWindow(width, height, title, NULL, glfwGetCurrentContext());
+        if (ctx.window == NULL) {
+                fprintf(stderr, "%s\n", "Failed to create shared GLFW window.");
+                return false;
+        }
+
+        return true;
+}
+
+// the framebuffer standing in for the context's window: 0 unless headless
+static uint32_t
+shared_context_framebuffer(const shared_context& ctx)
+{
+        return ctx.FBO;
+}
+
+static void
+shared_context_thread(shared_context *ctx,
+                      void (*run)(shared_context& ctx, void *data),
+                      void *data)
+{
+        profile_thread_name("shared context");
+        if (ctx->window != NULL) {
+                glfwMakeContextCurrent(ctx->window);
+        } else {
+                eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx->context);
+                ctx->FBO = headless_create_framebuffer(ctx->width,
+                                                       ctx->height,
+                                                       &ctx->color_RBO,
+                                                       &ctx->depth_RBO);
+        }
+        gl_state_init();
+
+        if ((ctx->window != NULL) || (ctx->FBO != 0))
+                run(*ctx, data);
+
+        if (ctx->frame_fence != NULL)
+                glDeleteSync(ctx->frame_fence);
+        ctx->frame_fence = NULL;
+        if (ctx->FBO != 0) {
+                glDeleteFramebuffers(1, &ctx->FBO);
+                glDeleteRenderbuffers(1, &ctx->color_RBO);
+                glDeleteRenderbuffers(1, &ctx->depth_RBO);
+                ctx->FBO = 0;
+        }
+        if (ctx->window != NULL)
+                glfwMakeContextCurrent(NULL);
+        else
+                eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+/*
+ * Runs run(ctx, data) on a new thread with ctx current there. ctx must not
+ * be current anywhere else meanwhile.
+ */
+static void
+shared_context_start(shared_context& ctx,
+                     void (*run)(shared_context& ctx, void *data),
+                     void *data = NULL)
+{
+        ctx.quit.store(false, std::memory_order_relaxed);
+        ctx.thread = std::thread(shared_context_thread, &ctx, run, data);
+}
+
+static void
+shared_context_stop(shared_context& ctx)
+{
+        ctx.quit.store(true, std::memory_order_relaxed);
+        if (ctx.thread.joinable())
+                ctx.thread.join();
+}
+
+// context's thread: presents, keeping at most one frame queued headless
+static void
+shared_context_swap(shared_context& ctx)
+{
+        if (ctx.window != NULL) {
+                glfwSwapBuffers(ctx.window);
+        } else {
+                if (ctx.frame_fence != NULL) {
+                        glClientWaitSync(ctx.frame_fence,
+                                         GL_SYNC_FLUSH_COMMANDS_BIT,
+                                         UINT64_MAX);
+                        glDeleteSync(ctx.frame_fence);
+                }
+                ctx.frame_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                glFlush();
+        }
+        gl_state_frame();
+        ctx.frames.fetch_add(1, std::memory_order_relaxed);
+}
+
+// main thread: stops the context's thread, then the context
+static void
+destroy_shared_context(shared_context& ctx)
+{
+        shared_context_stop(ctx);
+        if (ctx.window != NULL)
+                glfwDestroyWindow(ctx.window);
+        if (ctx.context != EGL_NO_CONTEXT)
+                eglDestroyContext(headless.display, ctx.context);
+        ctx.window = NULL;
+        ctx.context = EGL_NO_CONTEXT;
+}
+
+/*
+ * Frames from one context (the writer) to any others (readers 0 to
+ * SHARED_MAX_READERS - 1), by texture. Readers always take the newest
+ * frame; the writer never overwrites a texture a reader holds, and drops
+ * the frame if every other texture is held.
+ */
+struct shared_ring {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t textures[SHARED_RING_SIZE] = {};
+        // writer's, over each texture
+        uint32_t FBOs[SHARED_RING_SIZE] = {};
+
+        std::mutex mutex;
+        std::condition_variable published;
+        // written by the writer, and read by each reader; the writer takes
+        // them out when it reuses the texture
+        GLsync written[SHARED_RING_SIZE] = {};
+        GLsync read[SHARED_MAX_READERS][SHARED_RING_SIZE] = {};
+        // readers between shared_ring_acquire and shared_ring_release
+        uint32_t holders[SHARED_RING_SIZE] = {};
+        int32_t latest = -1;
+        uint64_t serial = 0;
+        uint64_t dropped = 0;
+};
+
+// writer's thread: textures of width x height
+static void
+init_shared_ring(shared_ring& ring, uint32_t width, uint32_t height)
+{
+        ring.width = width;
+        ring.height = height;
+        glGenTextures(SHARED_RING_SIZE, ring.textures);
+        glGenFramebuffers(SHARED_RING_SIZE, ring.FBOs);
+        for (uint32_t i = 0; i < SHARED_RING_SIZE; ++i) {
+                state_bind_texture(0, GL_TEXTURE_2D, ring.textures[i]);
+                glTexImage2D(GL_TEXTURE_2D,
+                             0,
+                             GL_RGBA8,
+                             width,
+                             height,
+                             0,
+                             GL_RGBA,
+                             GL_UNSIGNED_BYTE,
+                             NULL);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+                glBindFramebuffer(GL_FRAMEBUFFER, ring.FBOs[i]);
+                glFramebufferTexture2D(GL_FRAMEBUFFER,
+                                       GL_COLOR_ATTACHMENT0,
+                                       GL_TEXTURE_2D,
+                                       ring.textures[i],
+                                       0);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, screen_framebuffer());
+}
+
+/*
+ * Writer's thread: scales the color of framebuffer's width x height into a
+ * free texture and makes it the newest frame, leaving framebuffer bound.
+ * Returns false if the frame was dropped.
+ */
+static bool
+shared_ring_publish(shared_ring& ring, uint32_t framebuffer, uint32_t width, uint32_t height)
+{
+        int32_t slot = -1;
+        GLsync reads[SHARED_MAX_READERS];
+        uint32_t n_reads = 0;
+        GLsync written = NULL;
+        {
+                std::lock_guard<std::mutex> lock(ring.mutex);
+                // only the newest is ever acquired, so no reader can take
+                // any other from here on
+                for (int32_t i = 1; i <= SHARED_RING_SIZE; ++i) {
+                        int32_t candidate = (ring.latest + i) % SHARED_RING_SIZE;
+                        if ((candidate != ring.latest) && (ring.holders[candidate] == 0)) {
+                                slot = candidate;
+                                break;
+                        }
+                }
+                if (slot < 0) {
+                        ++ring.dropped;
+                        return false;
+                }
+                for (uint32_t r = 0; r < SHARED_MAX_READERS; ++r) {
+                        if (ring.read[r][slot] != NULL)
+                                reads[n_reads++] = ring.read[r][slot];
+                        ring.read[r][slot] = NULL;
+                }
+                written = ring.written[slot];
+                ring.written[slot] = NULL;
+        }
+
+        // the blit waits for the readers' draws from the texture, on the GPU
+        for (uint32_t i = 0; i < n_reads; ++i) {
+                glWaitSync(reads[i], 0, GL_TIMEOUT_IGNORED);
+                glDeleteSync(reads[i]);
+        }
+        if (written != NULL)
+                glDeleteSync(written);
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ring.FBOs[slot]);
+        glBlitFramebuffer(0,
+                          0,
+                          width,
+                          height,
+                          0,
+                          0,
+                          ring.width,
+                          ring.height,
+                          GL_COLOR_BUFFER_BIT,
+                          GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        written = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        // a fence only signals, and other contexts' waits only end, once
+        // it has been flushed
+        glFlush();
+
+        {
+                std::lock_guard<std::mutex> lock(ring.mutex);
+                ring.written[slot] = written;
+                ring.latest = slot;
+                ++ring.serial;
+        }
+        ring.published.notify_all();
+
+        return true;
+}
+
+/*
+ * Reader's thread: waits up to timeout_ms for a frame newer than *serial,
+ * and returns its texture's index, or -1. The context's later commands
+ * wait for the writing to finish. Hand it back with shared_ring_release.
+ */
+static int32_t
+shared_ring_acquire(shared_ring& ring, uint64_t *serial, uint32_t timeout_ms)
+{
+        int32_t slot;
+        GLsync written;
+        {
+                std::unique_lock<std::mutex> lock(ring.mutex);
+                ring.published.wait_for(lock,
+                                        std::chrono::milliseconds(timeout_ms),
+                                        [&]() { return ring.serial != *serial; });
+                if ((ring.latest < 0) || (ring.serial == *serial))
+                        return -1;
+                slot = ring.latest;
+                *serial = ring.serial;
+                written = ring.written[slot];
+                ++ring.holders[slot];
+        }
+        glWaitSync(written, 0, GL_TIMEOUT_IGNORED);
+
+        return slot;
+}
+
+// reader's thread, once the commands reading texture slot are issued
+static void
+shared_ring_release(shared_ring& ring, uint32_t reader, int32_t slot)
+{
+        GLsync read = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+
+        GLsync previous;
+        {
+                std::lock_guard<std::mutex> lock(ring.mutex);
+                // an earlier read of the same texture, if the writer hasn't
+                // taken it: this one finishing implies it
+                previous = ring.read[reader][slot];
+                ring.read[reader][slot] = read;
+                --ring.holders[slot];
+        }
+        if (previous != NULL)
+                glDeleteSync(previous);
+}
+
+// writer's thread, once every reader has stopped
+static void
+destroy_shared_ring(shared_ring& ring)
+{
+        for (uint32_t i = 0; i < SHARED_RING_SIZE; ++i) {
+                if (ring.written[i] != NULL)
+                        glDeleteSync(ring.written[i]);
+                for (uint32_t r = 0; r < SHARED_MAX_READERS; ++r)
+                        if (ring.read[r][i] != NULL)
+                                glDeleteSync(ring.read[r][i]);
+        }
+        state_delete_textures(SHARED_RING_SIZE, ring.textures);
+        glDeleteFramebuffers(SHARED_RING_SIZE, ring.FBOs);
+        glBindFramebuffer(GL_FRAMEBUFFER, screen_framebuffer());
+}
+
+#endif /* _LEARN_GL_SHARED_CONTEXT_H_ */
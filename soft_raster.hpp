@@ -0,0 +1,1435 @@
+#ifndef _LEARN_GL_SOFT_RASTER_H_
+#define _LEARN_GL_SOFT_RASTER_H_
+
+#include "jobs.hpp"
+#include "texture_cache.hpp"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <immintrin.h>
+
+/*
+ * Software rendering backend for hosts without a GPU, behind the same small
+ * API as learngl.hpp: soft_init, soft_init_VAO, soft_init_vert_attr,
+ * soft_create_program, uniforms, textures and plain or indexed draws.
+ *
+ * Draws only transform, clip and set up their triangles, and sort them into
+ * SOFT_TILE_SIZE square tiles. soft_finish (or a readback) then rasterizes
+ * the tiles in parallel on the job system, each tile walking its triangles
+ * in submission order, so the image doesn't depend on the thread count.
+ * Coverage is tested four pixels at a time with SSE integer edge functions
+ * on vertices snapped to 1/SOFT_SUBPIXELS pixel with a top-left fill rule,
+ * and depth is a float buffer tested with GL_LESS.
+ *
+ * There is no shader compiler. soft_create_program recognises the two
+ * shader pairs of this repository by the inputs and uniforms they declare
+ * and runs a built-in kernel for each:
+ *
+ * - SOFT_SHADE_TEXTURE_MIX (shader.vs, shader.fs): projection * view *
+ *   model * position, then mix(texture1(uv), texture2(2(1 - u), 2v), alpha);
+ * - SOFT_SHADE_VERTEX_COLOUR (anki/shader.vert, anki/shader.frag): the
+ *   position as is, then host_texture(uv) * colour.
+ *
+ * Textures repeat, and filter as GL_LINEAR when magnified and
+ * GL_LINEAR_MIPMAP_LINEAR over a box-filtered mip chain when minified, the
+ * way bench_render sets its textures up, four pixels at a time in 16-bit
+ * fixed point; with AVX2 the texel fetches are gathers. The framebuffer is
+ * RGBA8, bottom row first, as glReadPixels returns it.
+ *
+ * Objects must outlive the soft_finish after the draws that use them.
+ */
+
+#define SOFT_TILE_SIZE 64
+#define SOFT_SUBPIXEL_BITS 4
+#define SOFT_SUBPIXELS (1 << SOFT_SUBPIXEL_BITS)
+// x and y are clipped to this many times the viewport, in NDC, rather
+// than to the viewport; the rest is cut by the tile bounds
+#define SOFT_GUARD_BAND 1.25f
+// keeps edge functions, two products of guard band sized fixed-point
+// spans, within int32
+#define SOFT_MAX_PIXELS (2560u * 1024u)
+#define SOFT_MAX_ATTRS 4
+// texture coordinate, then vertex colour
+#define SOFT_MAX_VARYINGS 5
+#define SOFT_TEXTURE_UNITS 2
+
+enum soft_shading {
+        SOFT_SHADE_TEXTURE_MIX,
+        SOFT_SHADE_VERTEX_COLOUR,
+};
+
+enum soft_uniform_location {
+        SOFT_UNIFORM_MODEL,
+        SOFT_UNIFORM_VIEW,
+        SOFT_UNIFORM_PROJECTION,
+        SOFT_UNIFORM_ALPHA,
+        SOFT_UNIFORM_TEXTURE1,
+        SOFT_UNIFORM_TEXTURE2,
+};
+
+// like uniform<T> (learngl.hpp), a soft_uniform_location or -1
+template <typename T>
+struct soft_uniform {
+        int32_t location = -1;
+};
+
+struct soft_program {
+        soft_shading shading = SOFT_SHADE_TEXTURE_MIX;
+        glm::mat4 model = glm::mat4(1.0f);
+        glm::mat4 view = glm::mat4(1.0f);
+        glm::mat4 projection = glm::mat4(1.0f);
+        float alpha = 0.0f;
+        // texture units of texture1 (or host_texture) and texture2
+        int32_t samplers[2] = {0, 0};
+};
+
+// a float attribute, in floats as init_vert_attr takes it; size 0 if unused
+struct soft_attr {
+        int32_t size = 0;
+        size_t stride = 0;
+        size_t offset = 0;
+};
+
+struct soft_vertex_array {
+        std::vector<float> vertices;
+        std::vector<uint32_t> indices;
+        soft_attr attrs[SOFT_MAX_ATTRS];
+};
+
+/*
+ * An RGBA8 level as texel pairs: entry (x, y) holds texels x and x + 1
+ * (wrapped) of row y with their channels interleaved, r0 r1 g0 g1 ..., so
+ * a bilinear footprint is two 8-byte loads, each filtered across by one
+ * _mm_maddubs_epi16, at twice the memory of the texels. Entries are stored
+ * in 4x4 blocks, two cache lines, so that the footprints of neighbouring
+ * pixels share lines whichever way the texture runs across the screen;
+ * entry (x, y) is pairs[first + soft_texel_index(level, x, y)], first
+ * putting block 0 on a line boundary.
+ */
+struct soft_level {
+        int32_t width;
+        int32_t height;
+        int32_t blocks_x;
+        // both sides are powers of two, so wrapping is a mask
+        bool pow2;
+        size_t first;
+        std::vector<uint64_t> pairs;
+};
+
+// levels largest first
+struct soft_texture {
+        std::vector<soft_level> levels;
+};
+
+// a shaded vertex, in clip space
+struct soft_vertex {
+        glm::vec4 position;
+        float varyings[SOFT_MAX_VARYINGS];
+};
+
+// what a draw's triangles are shaded with
+struct soft_draw_state {
+        soft_shading shading;
+        float alpha;
+        uint32_t textures[2];
+        bool depth_test;
+};
+
+/*
+ * A set-up triangle, counterclockwise. Edge e starts at (ex, ey) and runs
+ * (edx, edy), in fixed point; a pixel is covered when every edge function
+ * plus its bias (-1 unless the edge is top or left) is >= 0. Planes hold
+ * depth, 1/w and each varying / w as value at (ox, oy) and d/dx, d/dy, in
+ * pixels.
+ */
+struct soft_triangle {
+        int32_t ex[3];
+        int32_t ey[3];
+        int32_t edx[3];
+        int32_t edy[3];
+        int32_t bias[3];
+        // covered pixels lie in [min_x, max_x] x [min_y, max_y]
+        int32_t min_x;
+        int32_t min_y;
+        int32_t max_x;
+        int32_t max_y;
+        float ox;
+        float oy;
+        float planes[2 + SOFT_MAX_VARYINGS][3];
+        uint32_t state;
+};
+
+struct soft_context {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        // the buffers cover whole tiles, so a 4-pixel block never leaves one
+        uint32_t stride = 0;
+        uint32_t tiles_x = 0;
+        uint32_t tiles_y = 0;
+        std::vector<uint32_t> colour;
+        std::vector<float> depth;
+        job_system *jobs = NULL;
+
+        // objects by id; id 0 is none
+        std::vector<soft_vertex_array> vertex_arrays;
+        std::vector<soft_program> programs;
+        std::vector<soft_texture> textures;
+        uint32_t vertex_array = 0;
+        uint32_t program = 0;
+        uint32_t units[SOFT_TEXTURE_UNITS] = {};
+        bool depth_test = false;
+
+        // queued since the last soft_finish
+        bool clear = false;
+        uint32_t clear_colour = 0;
+        std::vector<soft_draw_state> states;
+        std::vector<soft_triangle> triangles;
+        std::vector<std::vector<uint32_t>> bins;
+        // a draw's shaded vertices
+        std::vector<soft_vertex> vertices;
+
+        // since soft_init
+        uint64_t triangles_submitted = 0;
+        uint64_t triangles_binned = 0;
+};
+
+static soft_context soft;
+
+/*
+ * Sets up a width x height framebuffer rasterized on jobs, which must
+ * outlive the context; the counterpart of init_gl.
+ */
+static bool
+soft_init(uint32_t width, uint32_t height, job_system& jobs)
+{
+        if ((width == 0) || (height == 0) || ((size_t)width * height > SOFT_MAX_PIXELS)) {
+                fprintf(stderr, "ERROR::SOFT::BAD_FRAMEBUFFER_SIZE %ux%u\n", width, height);
+                return false;
+        }
+
+        soft = soft_context();
+        soft.width = width;
+        soft.height = height;
+        soft.tiles_x = (width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+        soft.tiles_y = (height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+        soft.stride = soft.tiles_x * SOFT_TILE_SIZE;
+        size_t pixels = (size_t)soft.stride * soft.tiles_y * SOFT_TILE_SIZE;
+        soft.colour.assign(pixels, 0);
+        soft.depth.assign(pixels, 1.0f);
+        soft.jobs = &jobs;
+        soft.vertex_arrays.resize(1);
+        soft.programs.resize(1);
+        soft.textures.resize(1);
+        soft.bins.resize(soft.tiles_x * soft.tiles_y);
+
+        return true;
+}
+
+static void
+soft_terminate(void)
+{
+        soft = soft_context();
+}
+
+/*
+ * Copies vertices (and indices, if any) into a new vertex array and binds
+ * it, like init_VAO; sizes are in bytes.
+ */
+static uint32_t
+soft_init_VAO(const float *vertices,
+              size_t verts_sz,
+              const uint32_t *indices = NULL,
+              size_t indices_sz = 0)
+{
+        soft_vertex_array vao;
+        vao.vertices.assign(vertices, vertices + verts_sz / sizeof(float));
+        if (indices != NULL)
+                vao.indices.assign(indices, indices + indices_sz / sizeof(uint32_t));
+        soft.vertex_arrays.push_back(std::move(vao));
+        soft.vertex_array = soft.vertex_arrays.size() - 1;
+
+        return soft.vertex_array;
+}
+
+static void
+soft_bind_vertex_array(uint32_t vao)
+{
+        soft.vertex_array = vao;
+}
+
+// float attribute index of the bound vertex array, like init_vert_attr
+static void
+soft_init_vert_attr(uint32_t index, int32_t size, size_t stride, size_t offset)
+{
+        if ((soft.vertex_array == 0) || (index >= SOFT_MAX_ATTRS))
+                return;
+        soft_attr& attr = soft.vertex_arrays[soft.vertex_array].attrs[index];
+        attr.size = std::min(size, 4);
+        attr.stride = stride;
+        attr.offset = offset;
+}
+
+static void
+soft_delete_vertex_array(uint32_t vao)
+{
+        if (vao < soft.vertex_arrays.size())
+                soft.vertex_arrays[vao] = soft_vertex_array();
+        if (soft.vertex_array == vao)
+                soft.vertex_array = 0;
+}
+
+/*
+ * Picks the built-in kernel for a vertex and fragment shader pair (see the
+ * top of this file) from what the sources declare. Returns 0, and says so,
+ * for anything else.
+ */
+static uint32_t
+soft_create_program(const char *vs_path, const char *fs_path)
+{
+        std::string vs = read_shader_source(vs_path);
+        std::string fs = read_shader_source(fs_path);
+
+        soft_program program;
+        if ((vs.find("aTexCoord") != std::string::npos) &&
+            (fs.find("texture2") != std::string::npos) &&
+            (fs.find("alpha") != std::string::npos)) {
+                program.shading = SOFT_SHADE_TEXTURE_MIX;
+        } else if ((vs.find("a_colour") != std::string::npos) &&
+                   (fs.find("host_texture") != std::string::npos)) {
+                program.shading = SOFT_SHADE_VERTEX_COLOUR;
+        } else {
+                fprintf(stderr, "ERROR::SOFT::UNSUPPORTED_PROGRAM %s %s\n", vs_path, fs_path);
+                return 0;
+        }
+        soft.programs.push_back(program);
+
+        return soft.programs.size() - 1;
+}
+
+static void
+soft_use_program(uint32_t program)
+{
+        soft.program = program;
+}
+
+static void
+soft_delete_program(uint32_t program)
+{
+        if (soft.program == program)
+                soft.program = 0;
+}
+
+// the uniforms each kernel has, by their GLSL names
+template <typename T>
+static soft_uniform<T>
+soft_get_uniform(uint32_t program, const char *name)
+{
+        soft_uniform<T> handle;
+        if ((program == 0) || (program >= soft.programs.size()))
+                return handle;
+
+        static const char *const mix_names[] = {
+                "model", "view", "projection", "alpha", "texture1", "texture2",
+        };
+        if (soft.programs[program].shading == SOFT_SHADE_TEXTURE_MIX) {
+                for (int32_t i = 0; i < 6; ++i)
+                        if (strcmp(name, mix_names[i]) == 0)
+                                handle.location = i;
+        } else if (strcmp(name, "host_texture") == 0) {
+                handle.location = SOFT_UNIFORM_TEXTURE1;
+        }
+
+        return handle;
+}
+
+// sets a uniform of the program in use, as glUniform* does
+static void
+soft_set_uniform(soft_uniform<glm::mat4> handle, const glm::mat4& value)
+{
+        if (soft.program == 0)
+                return;
+        soft_program& program = soft.programs[soft.program];
+        if (handle.location == SOFT_UNIFORM_MODEL)
+                program.model = value;
+        else if (handle.location == SOFT_UNIFORM_VIEW)
+                program.view = value;
+        else if (handle.location == SOFT_UNIFORM_PROJECTION)
+                program.projection = value;
+}
+
+static void
+soft_set_uniform(soft_uniform<float> handle, float value)
+{
+        if ((soft.program != 0) && (handle.location == SOFT_UNIFORM_ALPHA))
+                soft.programs[soft.program].alpha = value;
+}
+
+static void
+soft_set_uniform(soft_uniform<int32_t> handle, int32_t value)
+{
+        if ((soft.program == 0) ||
+            (handle.location < SOFT_UNIFORM_TEXTURE1) ||
+            (handle.location > SOFT_UNIFORM_TEXTURE2))
+                return;
+        soft.programs[soft.program].samplers[handle.location - SOFT_UNIFORM_TEXTURE1] = value;
+}
+
+static size_t
+soft_texel_index(const soft_level& level, int32_t x, int32_t y)
+{
+        return (size_t)(((y >> 2) * level.blocks_x + (x >> 2)) * 16 + ((y & 3) << 2) + (x & 3));
+}
+
+// the pairs of image, which must be RGBA, in blocks
+static soft_level
+soft_block_level(const cook_image& image)
+{
+        soft_level level;
+        level.width = image.width;
+        level.height = image.height;
+        level.blocks_x = (image.width + 3) / 4;
+        level.pow2 = ((image.width & (image.width - 1)) == 0) &&
+                     ((image.height & (image.height - 1)) == 0);
+        size_t blocks = (size_t)level.blocks_x * ((image.height + 3) / 4);
+        level.pairs.resize(16 * blocks + 7);
+        level.first = (64 - ((uintptr_t)level.pairs.data() & 63)) % 64 / 8;
+        for (uint32_t y = 0; y < image.height; ++y) {
+                const uint8_t *row = &image.pixels[(size_t)y * image.width * 4];
+                for (uint32_t x = 0; x < image.width; ++x) {
+                        uint8_t *pair = (uint8_t*)&level.pairs[level.first + soft_texel_index(level, x, y)];
+                        uint32_t x1 = (x + 1 == image.width) ? 0 : x + 1;
+                        for (uint32_t c = 0; c < 4; ++c) {
+                                pair[2 * c] = row[x * 4 + c];
+                                pair[2 * c + 1] = row[x1 * 4 + c];
+                        }
+                }
+        }
+
+        return level;
+}
+
+// a texture with image's pixels and a full mip chain, as glGenerateMipmap
+static uint32_t
+soft_texture_image(const cook_image& image)
+{
+        soft_texture texture;
+        cook_image level = expand_to_rgba(image);
+        texture.levels.push_back(soft_block_level(level));
+        while ((level.width > 1) || (level.height > 1)) {
+                level = downsample_image(level);
+                texture.levels.push_back(soft_block_level(level));
+        }
+        soft.textures.push_back(std::move(texture));
+
+        return soft.textures.size() - 1;
+}
+
+// 0 if the image can't be read
+static uint32_t
+soft_load_texture(const char *path)
+{
+        int32_t width;
+        int32_t height;
+        int32_t channels;
+        uint8_t *data = stbi_load(path, &width, &height, &channels, 4);
+        if (data == NULL) {
+                fprintf(stderr, "ERROR::SOFT::CANNOT_LOAD_TEXTURE %s\n", path);
+                return 0;
+        }
+
+        cook_image image;
+        image.width = width;
+        image.height = height;
+        image.channels = 4;
+        image.pixels.assign(data, data + (size_t)width * height * 4);
+        stbi_image_free(data);
+
+        return soft_texture_image(image);
+}
+
+static void
+soft_bind_texture(uint32_t unit, uint32_t texture)
+{
+        if (unit < SOFT_TEXTURE_UNITS)
+                soft.units[unit] = texture;
+}
+
+static void
+soft_delete_texture(uint32_t texture)
+{
+        if (texture < soft.textures.size())
+                soft.textures[texture] = soft_texture();
+        for (uint32_t& unit : soft.units)
+                if (unit == texture)
+                        unit = 0;
+}
+
+static void
+soft_depth_test(bool enable)
+{
+        soft.depth_test = enable;
+}
+
+static uint32_t
+soft_pack_colour(const float c[4])
+{
+        uint32_t packed = 0;
+        for (uint32_t i = 0; i < 4; ++i) {
+                float v = std::min(std::max(c[i], 0.0f), 1.0f);
+                packed |= (uint32_t)(v * 255.0f + 0.5f) << (8 * i);
+        }
+
+        return packed;
+}
+
+/*
+ * Vertex stage: fetches each attribute (missing components default to
+ * 0, 0, 0, 1 as in GL) and runs the program's vertex kernel.
+ */
+static void
+soft_shade_vertices(const soft_program& program,
+                    const soft_vertex_array& vao,
+                    uint32_t first,
+                    uint32_t count,
+                    soft_vertex *out)
+{
+        glm::mat4 mvp = program.projection * program.view * program.model;
+        for (uint32_t i = 0; i < count; ++i) {
+                float attrs[SOFT_MAX_ATTRS][4];
+                for (uint32_t a = 0; a < SOFT_MAX_ATTRS; ++a) {
+                        const soft_attr& attr = vao.attrs[a];
+                        const float defaults[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+                        memcpy(attrs[a], defaults, sizeof(defaults));
+                        if (attr.size == 0)
+                                continue;
+                        const float *src = &vao.vertices[0] +
+                                           (first + i) * attr.stride +
+                                           attr.offset;
+                        for (int32_t c = 0; c < attr.size; ++c)
+                                attrs[a][c] = src[c];
+                }
+
+                soft_vertex& v = out[i];
+                glm::vec4 position(attrs[0][0], attrs[0][1], attrs[0][2], 1.0f);
+                if (program.shading == SOFT_SHADE_TEXTURE_MIX) {
+                        v.position = mvp * position;
+                        v.varyings[0] = attrs[1][0];
+                        v.varyings[1] = attrs[1][1];
+                } else {
+                        v.position = position;
+                        v.varyings[0] = attrs[2][0];
+                        v.varyings[1] = attrs[2][1];
+                        for (uint32_t c = 0; c < 3; ++c)
+                                v.varyings[2 + c] = attrs[1][c];
+                }
+        }
+}
+
+// vertices of a vertex array every enabled attribute can be read for
+static size_t
+soft_vertex_count(const soft_vertex_array& vao)
+{
+        size_t count = SIZE_MAX;
+        for (const soft_attr& attr : vao.attrs) {
+                if (attr.size == 0)
+                        continue;
+                size_t end = attr.offset + attr.size;
+                if (end > vao.vertices.size())
+                        return 0;
+                size_t n = (attr.stride == 0) ?
+                           SIZE_MAX :
+                           (vao.vertices.size() - end) / attr.stride + 1;
+                count = std::min(count, n);
+        }
+
+        return count;
+}
+
+/*
+ * Triangle setup: perspective divide and viewport transform, snapping,
+ * orientation, bounds, edges and attribute planes. Zero-area triangles
+ * and those covering no pixel centre are dropped; the rest are binned to
+ * every tile their bounds touch.
+ */
+static void
+soft_setup_triangle(const soft_vertex *const v[3], uint32_t n_varyings, uint32_t state)
+{
+        int32_t fx[3];
+        int32_t fy[3];
+        float z[3];
+        float inv_w[3];
+        for (uint32_t i = 0; i < 3; ++i) {
+                const glm::vec4& p = v[i]->position;
+                inv_w[i] = 1.0f / p.w;
+                float sx = (p.x * inv_w[i] * 0.5f + 0.5f) * soft.width;
+                float sy = (p.y * inv_w[i] * 0.5f + 0.5f) * soft.height;
+                fx[i] = (int32_t)lrintf(sx * SOFT_SUBPIXELS);
+                fy[i] = (int32_t)lrintf(sy * SOFT_SUBPIXELS);
+                z[i] = p.z * inv_w[i] * 0.5f + 0.5f;
+        }
+
+        int64_t area = (int64_t)(fx[1] - fx[0]) * (fy[2] - fy[0]) -
+                       (int64_t)(fx[2] - fx[0]) * (fy[1] - fy[0]);
+        if (area == 0)
+                return;
+        uint32_t order[3] = {0, 1, 2};
+        if (area < 0)
+                std::swap(order[1], order[2]);
+
+        // pixels whose centres (x + 1/2, y + 1/2) can be covered
+        const int32_t half = SOFT_SUBPIXELS / 2;
+        soft_triangle tri;
+        tri.min_x = (std::min({fx[0], fx[1], fx[2]}) - half + SOFT_SUBPIXELS - 1) >> SOFT_SUBPIXEL_BITS;
+        tri.min_y = (std::min({fy[0], fy[1], fy[2]}) - half + SOFT_SUBPIXELS - 1) >> SOFT_SUBPIXEL_BITS;
+        tri.max_x = (std::max({fx[0], fx[1], fx[2]}) - half) >> SOFT_SUBPIXEL_BITS;
+        tri.max_y = (std::max({fy[0], fy[1], fy[2]}) - half) >> SOFT_SUBPIXEL_BITS;
+        tri.min_x = std::max(tri.min_x, 0);
+        tri.min_y = std::max(tri.min_y, 0);
+        tri.max_x = std::min(tri.max_x, (int32_t)soft.width - 1);
+        tri.max_y = std::min(tri.max_y, (int32_t)soft.height - 1);
+        if ((tri.min_x > tri.max_x) || (tri.min_y > tri.max_y))
+                return;
+
+        for (uint32_t e = 0; e < 3; ++e) {
+                uint32_t a = order[e];
+                uint32_t b = order[(e + 1) % 3];
+                tri.ex[e] = fx[a];
+                tri.ey[e] = fy[a];
+                tri.edx[e] = fx[b] - fx[a];
+                tri.edy[e] = fy[b] - fy[a];
+                // y points up: left edges run down, top edges run left
+                bool top_left = (tri.edy[e] < 0) || ((tri.edy[e] == 0) && (tri.edx[e] < 0));
+                tri.bias[e] = top_left ? 0 : -1;
+        }
+
+        // planes f(x, y) = f0 + a (x - ox) + b (y - oy), from the snapped
+        // positions so they agree with coverage
+        const float scale = 1.0f / SOFT_SUBPIXELS;
+        tri.ox = fx[0] * scale;
+        tri.oy = fy[0] * scale;
+        float x1 = (fx[1] - fx[0]) * scale;
+        float y1 = (fy[1] - fy[0]) * scale;
+        float x2 = (fx[2] - fx[0]) * scale;
+        float y2 = (fy[2] - fy[0]) * scale;
+        float inv_area = 1.0f / ((float)area * scale * scale);
+        auto plane = [&](float *out, float f0, float f1, float f2) {
+                float d1 = f1 - f0;
+                float d2 = f2 - f0;
+                out[0] = f0;
+                out[1] = (d1 * y2 - d2 * y1) * inv_area;
+                out[2] = (d2 * x1 - d1 * x2) * inv_area;
+        };
+        plane(tri.planes[0], z[0], z[1], z[2]);
+        plane(tri.planes[1], inv_w[0], inv_w[1], inv_w[2]);
+        for (uint32_t k = 0; k < n_varyings; ++k)
+                plane(tri.planes[2 + k],
+                      v[0]->varyings[k] * inv_w[0],
+                      v[1]->varyings[k] * inv_w[1],
+                      v[2]->varyings[k] * inv_w[2]);
+        tri.state = state;
+
+        uint32_t id = soft.triangles.size();
+        soft.triangles.push_back(tri);
+        ++soft.triangles_binned;
+        for (int32_t ty = tri.min_y / SOFT_TILE_SIZE; ty <= tri.max_y / SOFT_TILE_SIZE; ++ty)
+                for (int32_t tx = tri.min_x / SOFT_TILE_SIZE; tx <= tri.max_x / SOFT_TILE_SIZE; ++tx)
+                        soft.bins[ty * soft.tiles_x + tx].push_back(id);
+}
+
+// clip planes as dot(plane, position) >= 0: near, far, then the guard band
+static const glm::vec4 soft_clip_planes[6] = {
+        glm::vec4(0.0f, 0.0f, 1.0f, 1.0f),
+        glm::vec4(0.0f, 0.0f, -1.0f, 1.0f),
+        glm::vec4(1.0f, 0.0f, 0.0f, SOFT_GUARD_BAND),
+        glm::vec4(-1.0f, 0.0f, 0.0f, SOFT_GUARD_BAND),
+        glm::vec4(0.0f, 1.0f, 0.0f, SOFT_GUARD_BAND),
+        glm::vec4(0.0f, -1.0f, 0.0f, SOFT_GUARD_BAND),
+};
+
+// the soft_clip_planes p is outside of, as bits
+static uint32_t
+soft_outcode(const glm::vec4& p)
+{
+        float band = SOFT_GUARD_BAND * p.w;
+
+        return ((p.z < -p.w) ? 1u : 0u) |
+               ((p.z > p.w) ? 2u : 0u) |
+               ((p.x < -band) ? 4u : 0u) |
+               ((p.x > band) ? 8u : 0u) |
+               ((p.y < -band) ? 16u : 0u) |
+               ((p.y > band) ? 32u : 0u);
+}
+
+/*
+ * Clips a triangle against the planes its vertices are outside of
+ * (Sutherland-Hodgman) and sets up the fan of what is left.
+ */
+static void
+soft_submit_triangle(const soft_vertex& a,
+                     const soft_vertex& b,
+                     const soft_vertex& c,
+                     uint32_t n_varyings,
+                     uint32_t state)
+{
+        ++soft.triangles_submitted;
+        uint32_t codes[3] = {soft_outcode(a.position),
+                             soft_outcode(b.position),
+                             soft_outcode(c.position)};
+        if ((codes[0] & codes[1] & codes[2]) != 0)
+                return;
+        const soft_vertex *v[3] = {&a, &b, &c};
+        uint32_t clip = codes[0] | codes[1] | codes[2];
+        if (clip == 0) {
+                soft_setup_triangle(v, n_varyings, state);
+                return;
+        }
+
+        // every plane adds at most one vertex
+        soft_vertex polygons[2][3 + 6];
+        uint32_t n = 3;
+        for (uint32_t i = 0; i < 3; ++i)
+                polygons[0][i] = *v[i];
+        uint32_t in = 0;
+        for (uint32_t p = 0; (p < 6) && (n >= 3); ++p) {
+                if ((clip & (1u << p)) == 0)
+                        continue;
+                const soft_vertex *src = polygons[in];
+                soft_vertex *dst = polygons[in ^ 1];
+                uint32_t m = 0;
+                for (uint32_t i = 0; i < n; ++i) {
+                        const soft_vertex& s = src[i];
+                        const soft_vertex& e = src[(i + 1) % n];
+                        float ds = glm::dot(soft_clip_planes[p], s.position);
+                        float de = glm::dot(soft_clip_planes[p], e.position);
+                        if (ds >= 0.0f)
+                                dst[m++] = s;
+                        if ((ds >= 0.0f) != (de >= 0.0f)) {
+                                float t = ds / (ds - de);
+                                soft_vertex& out = dst[m++];
+                                out.position = s.position + (e.position - s.position) * t;
+                                for (uint32_t k = 0; k < n_varyings; ++k)
+                                        out.varyings[k] = s.varyings[k] +
+                                                          (e.varyings[k] - s.varyings[k]) * t;
+                        }
+                }
+                n = m;
+                in ^= 1;
+        }
+
+        for (uint32_t i = 2; i < n; ++i) {
+                const soft_vertex *fan[3] = {&polygons[in][0],
+                                             &polygons[in][i - 1],
+                                             &polygons[in][i]};
+                soft_setup_triangle(fan, n_varyings, state);
+        }
+}
+
+static bool
+soft_same_state(const soft_draw_state& a, const soft_draw_state& b)
+{
+        return (a.shading == b.shading) &&
+               (a.alpha == b.alpha) &&
+               (a.textures[0] == b.textures[0]) &&
+               (a.textures[1] == b.textures[1]) &&
+               (a.depth_test == b.depth_test);
+}
+
+/*
+ * Runs the vertex stage over the vertices count elements (indices when
+ * given, else first, first + 1, ...) refer to, then clips, sets up and
+ * bins their triangles with the current program, textures and depth test.
+ */
+static void
+soft_draw(const uint32_t *indices, uint32_t first, uint32_t count)
+{
+        PROFILE_SCOPE("soft draw");
+        if ((soft.program == 0) || (soft.vertex_array == 0) || (count < 3))
+                return;
+        const soft_program& program = soft.programs[soft.program];
+        const soft_vertex_array& vao = soft.vertex_arrays[soft.vertex_array];
+
+        uint32_t lo = first;
+        uint32_t hi = first + count - 1;
+        if (indices != NULL) {
+                lo = *std::min_element(indices, indices + count);
+                hi = *std::max_element(indices, indices + count);
+        }
+        if (hi >= soft_vertex_count(vao)) {
+                fprintf(stderr, "ERROR::SOFT::VERTEX_OUT_OF_RANGE %u\n", hi);
+                return;
+        }
+        soft.vertices.resize(hi - lo + 1);
+        soft_shade_vertices(program, vao, lo, hi - lo + 1, soft.vertices.data());
+
+        soft_draw_state state;
+        state.shading = program.shading;
+        state.alpha = program.alpha;
+        for (uint32_t i = 0; i < 2; ++i) {
+                uint32_t unit = program.samplers[i];
+                state.textures[i] = (unit < SOFT_TEXTURE_UNITS) ? soft.units[unit] : 0;
+        }
+        state.depth_test = soft.depth_test;
+        if (soft.states.empty() || !soft_same_state(soft.states.back(), state))
+                soft.states.push_back(state);
+        uint32_t state_id = soft.states.size() - 1;
+
+        uint32_t n_varyings = (program.shading == SOFT_SHADE_TEXTURE_MIX) ? 2 : 5;
+        const soft_vertex *v = soft.vertices.data();
+        for (uint32_t i = 0; i + 3 <= count; i += 3) {
+                uint32_t a = (indices != NULL) ? indices[i] : first + i;
+                uint32_t b = (indices != NULL) ? indices[i + 1] : first + i + 1;
+                uint32_t c = (indices != NULL) ? indices[i + 2] : first + i + 2;
+                soft_submit_triangle(v[a - lo], v[b - lo], v[c - lo], n_varyings, state_id);
+        }
+}
+
+// GL_TRIANGLES from vertices first .. first + count - 1 of the bound array
+static void
+soft_draw_arrays(uint32_t first, uint32_t count)
+{
+        soft_draw(NULL, first, count);
+}
+
+// GL_TRIANGLES from count indices of the bound array, from first_index on
+static void
+soft_draw_elements(uint32_t count, uint32_t first_index = 0)
+{
+        if (soft.vertex_array == 0)
+                return;
+        const std::vector<uint32_t>& indices = soft.vertex_arrays[soft.vertex_array].indices;
+        if ((size_t)first_index + count > indices.size()) {
+                fprintf(stderr, "ERROR::SOFT::INDEX_OUT_OF_RANGE %u\n", first_index + count);
+                return;
+        }
+        soft_draw(indices.data() + first_index, 0, count);
+}
+
+// i modulo n, for n a power of two or not
+static int32_t
+soft_wrap(int32_t i, int32_t n)
+{
+        if ((n & (n - 1)) == 0)
+                return i & (n - 1);
+        i %= n;
+
+        return (i < 0) ? i + n : i;
+}
+
+// log2(x) for x > 0 in each lane, to within 0.005: the exponent plus a
+// quadratic fit of the mantissa, plenty for a level of detail
+static __m128
+soft_log2(__m128 x)
+{
+        __m128i bits = _mm_castps_si128(x);
+        __m128 exponent = _mm_cvtepi32_ps(
+                _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xff)),
+                              _mm_set1_epi32(127)));
+        __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                                                 _mm_set1_epi32(0x3f800000)));
+        __m128 fit = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-0.34484843f), m), _mm_set1_ps(2.02466578f));
+        fit = _mm_sub_ps(_mm_mul_ps(fit, m), _mm_set1_ps(1.67487759f));
+
+        return _mm_add_ps(exponent, fit);
+}
+
+// a fraction 0..1 as a _mm_mulhrs_epi16 factor; x - floor(x) can round
+// up to 1
+static __m128i
+soft_weight(float t)
+{
+        return _mm_set1_epi16((int16_t)std::min(t * 32767.0f + 0.5f, 32767.0f));
+}
+
+// a fraction 0..1 as the _mm_maddubs_epi16 factors of a texel pair, 1 - t
+// and t in 7 bits
+static __m128i
+soft_pair_weight(float t)
+{
+        int32_t w = (int32_t)(t * 127.0f + 0.5f);
+
+        return _mm_set1_epi16((int16_t)((w << 8) | (127 - w)));
+}
+
+// a + (b - a) t, per 16-bit lane
+static __m128i
+soft_lerp(__m128i a, __m128i b, __m128i t)
+{
+        return _mm_add_epi16(a, _mm_mulhrs_epi16(_mm_sub_epi16(b, a), t));
+}
+
+/*
+ * The pairs at entries a and b of level, in the low and high halves: for
+ * a bilinear footprint, a in row y0 and b in row y1.
+ */
+static __m128i
+soft_pairs(const soft_level& level, size_t a, size_t b)
+{
+        const uint64_t *pairs = level.pairs.data() + level.first;
+        __m128d both = _mm_castsi128_pd(_mm_loadl_epi64((const __m128i*)(pairs + a)));
+
+        return _mm_castpd_si128(_mm_loadh_pd(both, (const double*)(pairs + b)));
+}
+
+/*
+ * GL_LINEAR with GL_REPEAT: RGBA, scaled by 127, in the low four 16-bit
+ * lanes. Texel pairs are filtered across with 7-bit weights, as llvmpipe
+ * does with 8, then the two rows with 15-bit ones.
+ */
+static __m128i
+soft_sample_level(const soft_level& level, float u, float v)
+{
+        float x = u * level.width - 0.5f;
+        float y = v * level.height - 0.5f;
+        // repeats far from 0 are brought back before converting to int
+        if (!(fabsf(x) < 16777216.0f) || !(fabsf(y) < 16777216.0f)) {
+                x = fmodf(x, (float)level.width);
+                y = fmodf(y, (float)level.height);
+                if (!(fabsf(x) < 16777216.0f) || !(fabsf(y) < 16777216.0f))
+                        x = y = 0.0f;
+        }
+        float fx = floorf(x);
+        float fy = floorf(y);
+        int32_t x0 = soft_wrap((int32_t)fx, level.width);
+        int32_t y0 = soft_wrap((int32_t)fy, level.height);
+        int32_t y1 = (y0 + 1 == level.height) ? 0 : y0 + 1;
+        __m128i rows = _mm_maddubs_epi16(soft_pairs(level,
+                                                    soft_texel_index(level, x0, y0),
+                                                    soft_texel_index(level, x0, y1)),
+                                         soft_pair_weight(x - fx));
+
+        return soft_lerp(rows, _mm_srli_si128(rows, 8), soft_weight(y - fy));
+}
+
+// 1.0 in a channel of a filtered texel
+#define SOFT_TEXEL_ONE (255 * 127)
+
+/*
+ * Filtered RGBA of four pixels as 16-bit lanes, scaled as
+ * soft_sample_level leaves them: one AVX2 register, or with SSE pixels 0
+ * and 1 in lo and 2 and 3 in hi.
+ */
+#if defined(__AVX2__)
+typedef __m256i soft_pixels;
+#else
+struct soft_pixels {
+        __m128i lo;
+        __m128i hi;
+};
+#endif
+
+static soft_pixels
+soft_pixels_of(__m128i lo, __m128i hi)
+{
+#if defined(__AVX2__)
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+#else
+        return soft_pixels{lo, hi};
+#endif
+}
+
+static soft_pixels
+soft_lerp4(soft_pixels a, soft_pixels b, soft_pixels t)
+{
+#if defined(__AVX2__)
+        return _mm256_add_epi16(a, _mm256_mulhrs_epi16(_mm256_sub_epi16(b, a), t));
+#else
+        return soft_pixels{soft_lerp(a.lo, b.lo, t.lo), soft_lerp(a.hi, b.hi, t.hi)};
+#endif
+}
+
+// a times _mm_mulhrs_epi16 factors b
+static soft_pixels
+soft_scale4(soft_pixels a, soft_pixels b)
+{
+#if defined(__AVX2__)
+        return _mm256_mulhrs_epi16(a, b);
+#else
+        return soft_pixels{_mm_mulhrs_epi16(a.lo, b.lo), _mm_mulhrs_epi16(a.hi, b.hi)};
+#endif
+}
+
+// the low 16 bits of each lane of w over its pixel's four channels
+static soft_pixels
+soft_spread(__m128i w)
+{
+#if defined(__AVX2__)
+        return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(w),
+                                   _mm256_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5,
+                                                    8, 9, 8, 9, 8, 9, 8, 9, 12, 13, 12, 13, 12, 13, 12, 13));
+#else
+        return soft_pixels{_mm_shuffle_epi8(w, _mm_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 4, 5, 4, 5, 4, 5, 4, 5)),
+                           _mm_shuffle_epi8(w, _mm_setr_epi8(8, 9, 8, 9, 8, 9, 8, 9, 12, 13, 12, 13, 12, 13, 12, 13))};
+#endif
+}
+
+// soft_weight of each lane
+static soft_pixels
+soft_weights(__m128 t)
+{
+        return soft_spread(_mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(t, _mm_set1_ps(32767.0f)),
+                                                                  _mm_set1_ps(0.5f)),
+                                                       _mm_set1_ps(32767.0f))));
+}
+
+// soft_pair_weight of each lane
+static soft_pixels
+soft_pair_weights(__m128 t)
+{
+        __m128i w = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(t, _mm_set1_ps(127.0f)), _mm_set1_ps(0.5f)));
+
+        return soft_spread(_mm_or_si128(_mm_slli_epi32(w, 8), _mm_sub_epi32(_mm_set1_epi32(127), w)));
+}
+
+// the four pixels as RGBA8, rounding the scale away
+static __m128i
+soft_pack4(soft_pixels p)
+{
+        // x / 127 as (x * 258 + 2^14) >> 15, exact at the ends
+#if defined(__AVX2__)
+        p = _mm256_mulhrs_epi16(p, _mm256_set1_epi16(258));
+
+        return _mm_packus_epi16(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+#else
+        const __m128i scale = _mm_set1_epi16(258);
+
+        return _mm_packus_epi16(_mm_mulhrs_epi16(p.lo, scale), _mm_mulhrs_epi16(p.hi, scale));
+#endif
+}
+
+/*
+ * soft_sample_level for four pixels at once, with the same arithmetic. The
+ * level must be pow2 and the coordinates of the lanes that matter within
+ * 2^24 texels; the other lanes still read inside the level.
+ */
+static soft_pixels
+soft_sample_level4(const soft_level& level, __m128 u, __m128 v)
+{
+        __m128 x = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(level.width)), _mm_set1_ps(0.5f));
+        __m128 y = _mm_sub_ps(_mm_mul_ps(v, _mm_set1_ps(level.height)), _mm_set1_ps(0.5f));
+        __m128 fx = _mm_floor_ps(x);
+        __m128 fy = _mm_floor_ps(y);
+        const __m128i wrap_y = _mm_set1_epi32(level.height - 1);
+        __m128i x0 = _mm_and_si128(_mm_cvttps_epi32(fx), _mm_set1_epi32(level.width - 1));
+        __m128i y0 = _mm_and_si128(_mm_cvttps_epi32(fy), wrap_y);
+        __m128i y1 = _mm_and_si128(_mm_add_epi32(y0, _mm_set1_epi32(1)), wrap_y);
+        // soft_texel_index of each lane in rows y0 and y1
+        const __m128i three = _mm_set1_epi32(3);
+        __m128i column = _mm_or_si128(_mm_slli_epi32(_mm_srai_epi32(x0, 2), 4), _mm_and_si128(x0, three));
+        auto row = [&](__m128i y) {
+                __m128i blocks = _mm_mullo_epi32(_mm_srai_epi32(y, 2), _mm_set1_epi32(level.blocks_x));
+                return _mm_add_epi32(column, _mm_or_si128(_mm_slli_epi32(blocks, 4),
+                                                          _mm_slli_epi32(_mm_and_si128(y, three), 2)));
+        };
+        __m128i top = row(y0);
+        __m128i bottom = row(y1);
+        soft_pixels wx = soft_pair_weights(_mm_sub_ps(x, fx));
+        soft_pixels wy = soft_weights(_mm_sub_ps(y, fy));
+
+        // each pixel's rows y0 and y1 filtered across, then together
+#if defined(__AVX2__)
+        const long long *pairs = (const long long*)(level.pairs.data() + level.first);
+        __m256i upper = _mm256_maddubs_epi16(_mm256_i32gather_epi64(pairs, top, 8), wx);
+        __m256i lower = _mm256_maddubs_epi16(_mm256_i32gather_epi64(pairs, bottom, 8), wx);
+
+        return soft_lerp4(upper, lower, wy);
+#else
+        auto rows = [&](__m128i index, int32_t a, int32_t b, __m128i w) {
+                int32_t lanes[4];
+                _mm_storeu_si128((__m128i*)lanes, index);
+                return _mm_maddubs_epi16(soft_pairs(level, lanes[a], lanes[b]), w);
+        };
+        return soft_pixels{soft_lerp(rows(top, 0, 1, wx.lo), rows(bottom, 0, 1, wx.lo), wy.lo),
+                           soft_lerp(rows(top, 2, 3, wx.hi), rows(bottom, 2, 3, wx.hi), wy.hi)};
+#endif
+}
+
+/*
+ * Samples texture at (u, v) at level of detail lod, scaled as
+ * soft_sample_level: bilinear in the base level when magnified, else
+ * blended between the two nearest levels. An incomplete (deleted or
+ * unbound) texture reads as (0, 0, 0, 1).
+ */
+static __m128i
+soft_sample(const soft_texture *texture, float u, float v, float lod)
+{
+        if ((texture == NULL) || texture->levels.empty())
+                return _mm_setr_epi16(0, 0, 0, SOFT_TEXEL_ONE, 0, 0, 0, 0);
+
+        const std::vector<soft_level>& levels = texture->levels;
+        if (!(lod > 0.0f) || (levels.size() == 1))
+                return soft_sample_level(levels[0], u, v);
+
+        lod = std::min(lod, (float)(levels.size() - 1));
+        uint32_t level = (uint32_t)lod;
+        float t = lod - level;
+        __m128i colour = soft_sample_level(levels[level], u, v);
+        if ((t > 0.0f) && (level + 1 < levels.size()))
+                colour = soft_lerp(colour, soft_sample_level(levels[level + 1], u, v), soft_weight(t));
+
+        return colour;
+}
+
+/*
+ * soft_sample for the pixels of mask in four lanes. Lanes that share a
+ * level, the usual case, are filtered together; otherwise each pixel goes
+ * through soft_sample. Either way the results are the same.
+ */
+static inline soft_pixels
+soft_sample4(const soft_texture *texture, __m128 u, __m128 v, __m128 lod, int32_t mask)
+{
+        if ((texture == NULL) || texture->levels.empty()) {
+                __m128i none = _mm_setr_epi16(0, 0, 0, SOFT_TEXEL_ONE, 0, 0, 0, SOFT_TEXEL_ONE);
+                return soft_pixels_of(none, none);
+        }
+
+        const std::vector<soft_level>& levels = texture->levels;
+        // the level, and the blend towards the next, of each lane: level 0
+        // unblended when magnified, for a NaN lod and with a single level
+        __m128 clamped = _mm_and_ps(_mm_min_ps(lod, _mm_set1_ps(levels.size() - 1)),
+                                    _mm_cmpgt_ps(lod, _mm_setzero_ps()));
+        __m128i lane_levels = _mm_cvttps_epi32(clamped);
+        __m128 ts = _mm_sub_ps(clamped, _mm_cvtepi32_ps(lane_levels));
+        int32_t first[4];
+        _mm_storeu_si128((__m128i*)first, lane_levels);
+        int32_t level = first[__builtin_ctz(mask)];
+        __m128i same = _mm_cmpeq_epi32(lane_levels, _mm_set1_epi32(level));
+        bool shared = (_mm_movemask_ps(_mm_castsi128_ps(same)) & mask) == mask;
+        bool blend = (_mm_movemask_ps(_mm_cmpgt_ps(ts, _mm_setzero_ps())) & mask) != 0;
+
+        __m128 x = _mm_mul_ps(u, _mm_set1_ps(levels[0].width));
+        __m128 y = _mm_mul_ps(v, _mm_set1_ps(levels[0].height));
+        const __m128 limit = _mm_set1_ps(16777216.0f);
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        __m128 near = _mm_and_ps(_mm_cmplt_ps(_mm_andnot_ps(sign, x), limit),
+                                 _mm_cmplt_ps(_mm_andnot_ps(sign, y), limit));
+        bool vector = shared &&
+                      levels[level].pow2 &&
+                      (!blend || levels[level + 1].pow2) &&
+                      ((_mm_movemask_ps(near) & mask) == mask);
+        if (!vector) {
+                float us[4];
+                float vs[4];
+                float lods[4];
+                _mm_storeu_ps(us, u);
+                _mm_storeu_ps(vs, v);
+                _mm_storeu_ps(lods, lod);
+                __m128i texels[4] = {};
+                for (int32_t m = mask; m != 0; m &= m - 1) {
+                        int32_t i = __builtin_ctz(m);
+                        texels[i] = soft_sample(texture, us[i], vs[i], lods[i]);
+                }
+                return soft_pixels_of(_mm_unpacklo_epi64(texels[0], texels[1]),
+                                      _mm_unpacklo_epi64(texels[2], texels[3]));
+        }
+
+        soft_pixels colour = soft_sample_level4(levels[level], u, v);
+        if (blend)
+                colour = soft_lerp4(colour, soft_sample_level4(levels[level + 1], u, v), soft_weights(ts));
+
+        return colour;
+}
+
+/*
+ * Level of detail of texture in each lane, from the screen-space
+ * derivatives of its coordinates (squared, in texture units), as GL does
+ * per quad.
+ */
+static inline __m128
+soft_lod(const soft_texture *texture, __m128 dudx2, __m128 dvdx2, __m128 dudy2, __m128 dvdy2)
+{
+        if ((texture == NULL) || texture->levels.empty())
+                return _mm_setzero_ps();
+
+        float w = texture->levels[0].width;
+        float h = texture->levels[0].height;
+        __m128 w2 = _mm_set1_ps(w * w);
+        __m128 h2 = _mm_set1_ps(h * h);
+        __m128 rx = _mm_add_ps(_mm_mul_ps(dudx2, w2), _mm_mul_ps(dvdx2, h2));
+        __m128 ry = _mm_add_ps(_mm_mul_ps(dudy2, w2), _mm_mul_ps(dvdy2, h2));
+
+        return _mm_mul_ps(_mm_set1_ps(0.5f), soft_log2(_mm_max_ps(rx, ry)));
+}
+
+/*
+ * Fragment kernels for the pixels of mask in a block of four starting
+ * (fx, fy) pixels from the triangle's origin, all four lanes at once.
+ */
+static void
+soft_shade_block(const soft_triangle& tri,
+                 const soft_draw_state& state,
+                 const soft_texture *const textures[2],
+                 float fx,
+                 float fy,
+                 int32_t mask,
+                 uint32_t *out)
+{
+        const float (*p)[3] = tri.planes;
+        const __m128 x = _mm_add_ps(_mm_set1_ps(fx), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+        auto eval = [&](const float *plane) {
+                return _mm_add_ps(_mm_set1_ps(plane[0] + plane[2] * fy),
+                                  _mm_mul_ps(_mm_set1_ps(plane[1]), x));
+        };
+        __m128 w = _mm_div_ps(_mm_set1_ps(1.0f), eval(p[1]));
+        __m128 u = _mm_mul_ps(eval(p[2]), w);
+        __m128 v = _mm_mul_ps(eval(p[3]), w);
+        // d(U / W)/dx = (dU/dx - u dW/dx) / W, with U = u / w and W = 1 / w
+        auto derivative = [&](__m128 f, float df, float dw) {
+                __m128 d = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(df), _mm_mul_ps(f, _mm_set1_ps(dw))), w);
+                return _mm_mul_ps(d, d);
+        };
+        __m128 dudx2 = derivative(u, p[2][1], p[1][1]);
+        __m128 dudy2 = derivative(u, p[2][2], p[1][2]);
+        __m128 dvdx2 = derivative(v, p[3][1], p[1][1]);
+        __m128 dvdy2 = derivative(v, p[3][2], p[1][2]);
+
+        soft_pixels colour = soft_sample4(textures[0],
+                                          u,
+                                          v,
+                                          soft_lod(textures[0], dudx2, dvdx2, dudy2, dvdy2),
+                                          mask);
+
+        if (state.shading == SOFT_SHADE_TEXTURE_MIX) {
+                // texture2 is read at twice the rate
+                const __m128 two = _mm_set1_ps(2.0f);
+                const __m128 four = _mm_set1_ps(4.0f);
+                __m128 lod = soft_lod(textures[1],
+                                      _mm_mul_ps(dudx2, four),
+                                      _mm_mul_ps(dvdx2, four),
+                                      _mm_mul_ps(dudy2, four),
+                                      _mm_mul_ps(dvdy2, four));
+                soft_pixels second = soft_sample4(textures[1],
+                                                  _mm_mul_ps(two, _mm_sub_ps(_mm_set1_ps(1.0f), u)),
+                                                  _mm_mul_ps(two, v),
+                                                  lod,
+                                                  mask);
+                const __m128i alpha = soft_weight(std::min(std::max(state.alpha, 0.0f), 1.0f));
+                colour = soft_lerp4(colour, second, soft_pixels_of(alpha, alpha));
+        } else {
+                // colours as _mm_mulhrs_epi16 factors, alpha 1
+                __m128i rgb[3];
+                for (uint32_t c = 0; c < 3; ++c) {
+                        __m128 colour = _mm_min_ps(_mm_max_ps(_mm_mul_ps(eval(p[4 + c]), w),
+                                                              _mm_setzero_ps()),
+                                                   _mm_set1_ps(1.0f));
+                        rgb[c] = _mm_cvtps_epi32(_mm_mul_ps(colour, _mm_set1_ps(32767.0f)));
+                }
+                // RGBA per pixel as 16-bit lanes, pixels 0 and 1, then 2 and 3
+                __m128i rg = _mm_packs_epi32(rgb[0], rgb[1]);
+                __m128i ba = _mm_packs_epi32(rgb[2], _mm_set1_epi32(32767));
+                __m128i rb = _mm_unpacklo_epi16(rg, ba);
+                __m128i ga = _mm_unpackhi_epi16(rg, ba);
+                __m128i rgba01 = _mm_unpacklo_epi16(rb, ga);
+                __m128i rgba23 = _mm_unpackhi_epi16(rb, ga);
+                colour = soft_scale4(colour, soft_pixels_of(rgba01, rgba23));
+        }
+
+        const __m128i lanes = _mm_cmpgt_epi32(_mm_and_si128(_mm_set1_epi32(mask),
+                                                            _mm_setr_epi32(1, 2, 4, 8)),
+                                              _mm_setzero_si128());
+        __m128i pixels = soft_pack4(colour);
+        __m128i old = _mm_loadu_si128((const __m128i*)out);
+        _mm_storeu_si128((__m128i*)out, _mm_blendv_epi8(old, pixels, lanes));
+}
+
+// no triangle, in a tile's visibility buffer
+#define SOFT_NO_TRIANGLE UINT32_MAX
+
+/*
+ * Rasterizes triangle id inside the tile [x0, x1) x [y0, y1), four pixels
+ * at a time: SSE edge functions give coverage, interpolated depth is
+ * tested and written for the block, and the pixels that pass record id in
+ * the tile's visibility buffer.
+ */
+static void
+soft_raster_triangle(const soft_triangle& tri,
+                     uint32_t id,
+                     bool depth_test,
+                     int32_t x0,
+                     int32_t y0,
+                     int32_t x1,
+                     int32_t y1,
+                     uint32_t *visible)
+{
+        // blocks start on multiples of 4, so never straddle a tile edge
+        int32_t bx0 = std::max(tri.min_x, x0) & ~3;
+        int32_t bx1 = std::min(tri.max_x, x1 - 1);
+        int32_t by0 = std::max(tri.min_y, y0);
+        int32_t by1 = std::min(tri.max_y, y1 - 1);
+        if ((bx0 > bx1) || (by0 > by1))
+                return;
+
+        __m128i lanes[3];
+        __m128i steps[3];
+        for (uint32_t e = 0; e < 3; ++e) {
+                int32_t s = -tri.edy[e] * SOFT_SUBPIXELS;
+                lanes[e] = _mm_setr_epi32(0, s, 2 * s, 3 * s);
+                steps[e] = _mm_set1_epi32(4 * s);
+        }
+        const float *zp = tri.planes[0];
+        const __m128 z_lanes = _mm_setr_ps(0.0f, zp[1], 2.0f * zp[1], 3.0f * zp[1]);
+        const __m128 z_step = _mm_set1_ps(4.0f * zp[1]);
+        const __m128i minus_one = _mm_set1_epi32(-1);
+        const __m128 ids = _mm_castsi128_ps(_mm_set1_epi32(id));
+
+        for (int32_t y = by0; y <= by1; ++y) {
+                int32_t px = (bx0 << SOFT_SUBPIXEL_BITS) + SOFT_SUBPIXELS / 2;
+                int32_t py = (y << SOFT_SUBPIXEL_BITS) + SOFT_SUBPIXELS / 2;
+                __m128i e[3];
+                for (uint32_t k = 0; k < 3; ++k) {
+                        int64_t value = (int64_t)tri.edx[k] * (py - tri.ey[k]) -
+                                        (int64_t)tri.edy[k] * (px - tri.ex[k]);
+                        e[k] = _mm_add_epi32(_mm_set1_epi32((int32_t)value + tri.bias[k]),
+                                             lanes[k]);
+                }
+                float fy = y + 0.5f - tri.oy;
+                float fx = bx0 + 0.5f - tri.ox;
+                __m128 z = _mm_add_ps(_mm_set1_ps(zp[0] + zp[1] * fx + zp[2] * fy), z_lanes);
+
+                float *depth = &soft.depth[(size_t)y * soft.stride];
+                uint32_t *row = &visible[(y - y0) * SOFT_TILE_SIZE];
+                for (int32_t x = bx0; x <= bx1; x += 4) {
+                        __m128i outside = _mm_or_si128(_mm_or_si128(e[0], e[1]), e[2]);
+                        __m128 pass = _mm_castsi128_ps(_mm_cmpgt_epi32(outside, minus_one));
+                        if (_mm_movemask_ps(pass) != 0) {
+                                if (depth_test) {
+                                        __m128 d = _mm_loadu_ps(depth + x);
+                                        pass = _mm_and_ps(pass, _mm_cmplt_ps(z, d));
+                                        _mm_storeu_ps(depth + x, _mm_blendv_ps(d, z, pass));
+                                }
+                                float *block = (float*)(row + x - x0);
+                                _mm_storeu_ps(block, _mm_blendv_ps(_mm_loadu_ps(block), ids, pass));
+                        }
+                        for (uint32_t k = 0; k < 3; ++k)
+                                e[k] = _mm_add_epi32(e[k], steps[k]);
+                        z = _mm_add_ps(z, z_step);
+                }
+        }
+}
+
+/*
+ * Clears the tile if asked, rasterizes its triangles in order into a
+ * visibility buffer, then shades what is left visible: as the fragments
+ * are opaque, only the last to pass at a pixel matters, and each pixel is
+ * shaded once however much was drawn over it. The colour clear is done
+ * block by block in the shading pass, so each line is written from cache.
+ */
+static void
+soft_raster_tile(uint32_t tile, const std::vector<const soft_texture*>& textures)
+{
+        int32_t x0 = (tile % soft.tiles_x) * SOFT_TILE_SIZE;
+        int32_t y0 = (tile / soft.tiles_x) * SOFT_TILE_SIZE;
+        int32_t x1 = std::min(x0 + SOFT_TILE_SIZE, (int32_t)soft.width);
+        int32_t y1 = std::min(y0 + SOFT_TILE_SIZE, (int32_t)soft.height);
+        if (soft.clear) {
+                for (int32_t y = y0; y < y1; ++y) {
+                        if (soft.bins[tile].empty())
+                                std::fill_n(&soft.colour[(size_t)y * soft.stride + x0],
+                                            x1 - x0,
+                                            soft.clear_colour);
+                        std::fill_n(&soft.depth[(size_t)y * soft.stride + x0], x1 - x0, 1.0f);
+                }
+        }
+        if (soft.bins[tile].empty())
+                return;
+
+        uint32_t visible[SOFT_TILE_SIZE * SOFT_TILE_SIZE];
+        std::fill_n(visible, SOFT_TILE_SIZE * SOFT_TILE_SIZE, SOFT_NO_TRIANGLE);
+        for (uint32_t id : soft.bins[tile])
+                soft_raster_triangle(soft.triangles[id],
+                                     id,
+                                     soft.states[soft.triangles[id].state].depth_test,
+                                     x0,
+                                     y0,
+                                     x1,
+                                     y1,
+                                     visible);
+
+        const __m128i none = _mm_set1_epi32(SOFT_NO_TRIANGLE);
+        const __m128i clear_colour = _mm_set1_epi32(soft.clear_colour);
+        for (int32_t y = y0; y < y1; ++y) {
+                uint32_t *colour = &soft.colour[(size_t)y * soft.stride];
+                for (int32_t x = x0; x < x1; x += 4) {
+                        if (soft.clear)
+                                _mm_storeu_si128((__m128i*)(colour + x), clear_colour);
+                        __m128i ids = _mm_loadu_si128((const __m128i*)&visible[(y - y0) * SOFT_TILE_SIZE + x - x0]);
+                        int32_t mask = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(ids, none))) & 0xf;
+                        // a block's pixels shaded together per triangle
+                        while (mask != 0) {
+                                int32_t first = __builtin_ctz(mask);
+                                uint32_t id = visible[(y - y0) * SOFT_TILE_SIZE + x - x0 + first];
+                                __m128i same = _mm_cmpeq_epi32(ids, _mm_set1_epi32(id));
+                                int32_t lanes = _mm_movemask_ps(_mm_castsi128_ps(same)) & mask;
+                                mask &= ~lanes;
+
+                                const soft_triangle& tri = soft.triangles[id];
+                                soft_shade_block(tri,
+                                                 soft.states[tri.state],
+                                                 &textures[2 * tri.state],
+                                                 x + 0.5f - tri.ox,
+                                                 y + 0.5f - tri.oy,
+                                                 lanes,
+                                                 colour + x);
+                        }
+                }
+        }
+}
+
+/*
+ * Rasterizes everything queued since the last call, one job per tile, and
+ * returns once the framebuffer is complete; the counterpart of glFinish.
+ */
+static void
+soft_finish(void)
+{
+        if (!soft.clear && soft.triangles.empty())
+                return;
+
+        PROFILE_SCOPE("soft raster");
+        std::vector<const soft_texture*> textures(2 * soft.states.size());
+        for (size_t i = 0; i < soft.states.size(); ++i)
+                for (uint32_t t = 0; t < 2; ++t)
+                        if (soft.states[i].textures[t] < soft.textures.size())
+                                textures[2 * i + t] = &soft.textures[soft.states[i].textures[t]];
+        parallel_for(*soft.jobs, 0, soft.bins.size(), 1, [&](size_t begin, size_t end) {
+                for (size_t tile = begin; tile < end; ++tile)
+                        soft_raster_tile(tile, textures);
+        });
+
+        soft.clear = false;
+        soft.states.clear();
+        soft.triangles.clear();
+        for (std::vector<uint32_t>& bin : soft.bins)
+                bin.clear();
+}
+
+// clears colour and depth (to 1) before anything drawn after
+static void
+soft_clear(float r, float g, float b, float a)
+{
+        // what is queued is covered anyway, so the clear replaces it
+        soft.states.clear();
+        soft.triangles.clear();
+        for (std::vector<uint32_t>& bin : soft.bins)
+                bin.clear();
+
+        const float colour[4] = {r, g, b, a};
+        soft.clear = true;
+        soft.clear_colour = soft_pack_colour(colour);
+}
+
+// the whole framebuffer as RGBA8 rows, bottom row first
+static void
+soft_read_pixels(uint8_t *rgba)
+{
+        soft_finish();
+        for (uint32_t y = 0; y < soft.height; ++y)
+                memcpy(rgba + (size_t)y * soft.width * 4,
+                       &soft.colour[(size_t)y * soft.stride],
+                       soft.width * 4);
+}
+
+#endif /* _LEARN_GL_SOFT_RASTER_H_ */
@@ -0,0 +1,161 @@
+#ifndef _LEARN_GL_TEXTURE_ARRAY_H_
+#define _LEARN_GL_TEXTURE_ARRAY_H_
+
+#include "texture_cache.hpp"
+#include <vector>
+#include <cstdint>
+
+/*
+ * Texture arrays for material sets. Instead of a texture object per
+ * material, which has to be bound for every draw that uses it, all
+ * materials' images go into the layers of one GL_TEXTURE_2D_ARRAY and
+ * the shader picks the layer from a per-instance index (TEXTURE_ARRAY_DEFINES
+ * turns that on in the scene shaders). A whole material set then draws
+ * under a single bind, so the draw queue can batch across materials.
+ *
+ * Arrays rather than an atlas: each layer wraps and mips on its own, so
+ * GL_REPEAT texture coordinates (shader.fs tiles texture2) keep working
+ * and there is no bleeding between neighbours to pad against. The price
+ * is that layers share one size; images of other sizes are resampled.
+ *
+ * Layers are packed at run time with texture_array_add, or offline with
+ * cook_texture --array into a cooked file load_texture_array maps.
+ */
+
+#define TEXTURE_ARRAY_DEFINES "#define TEXTURE_ARRAYS 1\n"
+
+struct texture_array {
+        uint32_t texture = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t levels = 0;
+        uint32_t max_layers = 0;
+        uint32_t layers = 0;
+};
+
+// full mip chain of a width x height image, down to 1x1
+static uint32_t
+mip_level_count(uint32_t width, uint32_t height)
+{
+        uint32_t levels = 1;
+        while ((width > 1) || (height > 1)) {
+                width = std::max(1u, width / 2);
+                height = std::max(1u, height / 2);
+                ++levels;
+        }
+
+        return levels;
+}
+
+static void
+texture_array_parameters(uint32_t levels)
+{
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+}
+
+/*
+ * Allocates an RGBA8 array of max_layers width x height layers with full
+ * mip chains, all undefined until added. Leaves it bound to unit 0.
+ */
+static void
+init_texture_array(texture_array& array, uint32_t width, uint32_t height, uint32_t max_layers)
+{
+        array = texture_array();
+        array.width = width;
+        array.height = height;
+        array.levels = mip_level_count(width, height);
+        array.max_layers = max_layers;
+
+        glGenTextures(1, &array.texture);
+        state_bind_texture(0, GL_TEXTURE_2D_ARRAY, array.texture);
+        for (uint32_t level = 0; level < array.levels; ++level)
+                glTexImage3D(GL_TEXTURE_2D_ARRAY,
+                             level,
+                             GL_RGBA8,
+                             std::max(1u, width >> level),
+                             std::max(1u, height >> level),
+                             max_layers,
+                             0,
+                             GL_RGBA,
+                             GL_UNSIGNED_BYTE,
+                             NULL);
+        texture_array_parameters(array.levels);
+}
+
+/*
+ * Packs image (3 or 4 channels, any size) into the next layer, resampled
+ * to the array's size, with its mip chain built by the same box filter
+ * as the cooker. Returns the layer, or UINT32_MAX if the array is full.
+ */
+static uint32_t
+texture_array_add(texture_array& array, const cook_image& image)
+{
+        if (array.layers == array.max_layers)
+                return UINT32_MAX;
+        uint32_t layer = array.layers++;
+
+        cook_image level_image = expand_to_rgba(resize_image(image, array.width, array.height));
+        state_bind_texture(0, GL_TEXTURE_2D_ARRAY, array.texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (uint32_t level = 0; level < array.levels; ++level) {
+                if (level > 0)
+                        level_image = downsample_image(level_image);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY,
+                                level,
+                                0,
+                                0,
+                                layer,
+                                level_image.width,
+                                level_image.height,
+                                1,
+                                GL_RGBA,
+                                GL_UNSIGNED_BYTE,
+                                level_image.pixels.data());
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        return layer;
+}
+
+/*
+ * Loads an array cooked by cook_texture --array (or a plain cooked
+ * texture, as a one-layer array) straight from the mapping. The array is
+ * full: max_layers is the cooked layer count. Returns false if the file
+ * is missing or invalid.
+ */
+static bool
+load_texture_array(const char *path, texture_array& array)
+{
+        cooked_texture cooked;
+        if (!open_cooked_texture(path, cooked))
+                return false;
+
+        const cooked_texture_header *header = cooked.header;
+        array = texture_array();
+        array.width = header->width;
+        array.height = header->height;
+        array.levels = header->levels;
+        array.max_layers = header->layers;
+        array.layers = header->layers;
+
+        glGenTextures(1, &array.texture);
+        state_bind_texture(0, GL_TEXTURE_2D_ARRAY, array.texture);
+        upload_cooked_texture(cooked, true);
+        texture_array_parameters(array.levels);
+        close_cooked_texture(cooked);
+
+        return true;
+}
+
+static void
+destroy_texture_array(texture_array& array)
+{
+        state_delete_textures(1, &array.texture);
+        array = texture_array();
+}
+
+#endif /* _LEARN_GL_TEXTURE_ARRAY_H_ */
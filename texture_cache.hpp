@@ -0,0 +1,591 @@
+#ifndef _LEARN_GL_TEXTURE_CACHE_H_
+#define _LEARN_GL_TEXTURE_CACHE_H_
+
+#include "learngl.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Cooked texture container (".ltex"). The file holds a texture's whole mip
+ * chain already in the layout glTexImage2D/glCompressedTexImage2D expect:
+ * tightly packed RGB8/RGBA8 rows, or BC1/BC3 (DXT1/DXT5) blocks. At run time
+ * it is mmap'd and every level is uploaded straight from the mapping, so
+ * there is no decode, no mipmap generation and no intermediate copy.
+ *
+ * Layout: cooked_texture_header, then levels x cooked_texture_level, then
+ * the level data, each level starting on a COOKED_TEXTURE_ALIGN boundary.
+ * A texture array (layers > 1, see texture_array.hpp) stores each level's
+ * layers back to back, as glTexImage3D takes them.
+ */
+
+#define COOKED_TEXTURE_MAGIC "LTEX"
+// 2 added layers; version 1 files are rejected and the originals decoded
+#define COOKED_TEXTURE_VERSION 2
+#define COOKED_TEXTURE_ALIGN 16
+#define COOKED_TEXTURE_SUFFIX ".ltex"
+// bounds a reader accepts, well past what GL can allocate
+#define COOKED_TEXTURE_MAX_SIZE 16384
+#define COOKED_TEXTURE_MAX_LAYERS 2048
+
+struct cooked_texture_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t internal_format;
+        // upload format and type; 0 for compressed textures
+        uint32_t format;
+        uint32_t type;
+        uint32_t width;
+        uint32_t height;
+        uint32_t levels;
+        uint32_t layers;
+};
+
+struct cooked_texture_level {
+        uint64_t offset;
+        uint64_t size;
+        uint32_t width;
+        uint32_t height;
+};
+
+struct cooked_texture {
+        void *map = NULL;
+        size_t map_size = 0;
+        const cooked_texture_header *header = NULL;
+        const cooked_texture_level *levels = NULL;
+};
+
+static bool
+is_compressed_format(uint32_t internal_format)
+{
+        return (internal_format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT) ||
+               (internal_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT);
+}
+
+/*
+ * Size in bytes of one width x height level of every layer, as the cooker
+ * writes it; 0 if the header's formats are not a combination it produces.
+ */
+static uint64_t
+cooked_level_size(const cooked_texture_header& header, uint32_t width, uint32_t height)
+{
+        uint64_t texels = (uint64_t)width * height * header.layers;
+        uint64_t blocks = (uint64_t)((width + 3) / 4) * ((height + 3) / 4) * header.layers;
+        switch (header.internal_format) {
+        case GL_RGB8:
+                return ((header.format == GL_RGB) && (header.type == GL_UNSIGNED_BYTE)) ?
+                       3 * texels :
+                       0;
+        case GL_RGBA8:
+                return ((header.format == GL_RGBA) && (header.type == GL_UNSIGNED_BYTE)) ?
+                       4 * texels :
+                       0;
+        case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+                return ((header.format == 0) && (header.type == 0)) ? 8 * blocks : 0;
+        case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+                return ((header.format == 0) && (header.type == 0)) ? 16 * blocks : 0;
+        default:
+                return 0;
+        }
+}
+
+static void
+close_cooked_texture(cooked_texture& cooked)
+{
+        if (cooked.map != NULL)
+                munmap(cooked.map, cooked.map_size);
+        cooked = cooked_texture();
+}
+
+/*
+ * Maps a cooked texture and checks it against what the cooker writes: known
+ * formats, a halving mip chain and levels of exactly the size their
+ * dimensions need, each inside the file. Pages are prefaulted (MAP_POPULATE)
+ * so the GL thread doesn't take the faults during upload. Returns false,
+ * leaving cooked empty, if the file is missing or invalid.
+ */
+static bool
+open_cooked_texture(const char *path, cooked_texture& cooked)
+{
+        cooked = cooked_texture();
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return false;
+
+        struct stat st;
+        if ((fstat(fd, &st) != 0) ||
+            ((size_t)st.st_size < sizeof(cooked_texture_header))) {
+                close(fd);
+                return false;
+        }
+
+        void *map = mmap(NULL,
+                         st.st_size,
+                         PROT_READ,
+                         MAP_PRIVATE | MAP_POPULATE,
+                         fd,
+                         0);
+        close(fd);
+        if (map == MAP_FAILED)
+                return false;
+
+        cooked.map = map;
+        cooked.map_size = st.st_size;
+        cooked.header = (const cooked_texture_header*)map;
+        cooked.levels = (const cooked_texture_level*)(cooked.header + 1);
+
+        const cooked_texture_header *header = cooked.header;
+        size_t tables_end = sizeof(*header) +
+                            (size_t)header->levels * sizeof(cooked_texture_level);
+        bool valid = (memcmp(header->magic, COOKED_TEXTURE_MAGIC, 4) == 0) &&
+                     (header->version == COOKED_TEXTURE_VERSION) &&
+                     (header->levels > 0) &&
+                     (header->levels <= 32) &&
+                     (header->layers > 0) &&
+                     (header->layers <= COOKED_TEXTURE_MAX_LAYERS) &&
+                     (header->width > 0) &&
+                     (header->width <= COOKED_TEXTURE_MAX_SIZE) &&
+                     (header->height > 0) &&
+                     (header->height <= COOKED_TEXTURE_MAX_SIZE) &&
+                     (tables_end <= cooked.map_size);
+        for (uint32_t i = 0; valid && (i < header->levels); ++i) {
+                const cooked_texture_level& level = cooked.levels[i];
+                valid = (level.width == std::max(1u, header->width >> i)) &&
+                        (level.height == std::max(1u, header->height >> i)) &&
+                        // the chain ends at its first 1x1 level
+                        ((i + 1 == header->levels) || (level.width > 1) || (level.height > 1)) &&
+                        (level.size == cooked_level_size(*header, level.width, level.height)) &&
+                        (level.size > 0) &&
+                        (level.offset >= tables_end) &&
+                        // no offset + size, which a huge offset could wrap
+                        (level.offset <= cooked.map_size) &&
+                        (level.size <= cooked.map_size - level.offset);
+        }
+        if (!valid) {
+                fprintf(stderr, "ERROR::TEXTURE_CACHE::INVALID_FILE %s\n", path);
+                close_cooked_texture(cooked);
+                return false;
+        }
+
+        return true;
+}
+
+/*
+ * Uploads every level of a mapped cooked texture into the texture bound to
+ * GL_TEXTURE_2D on the active unit, or to GL_TEXTURE_2D_ARRAY for one with
+ * layers or if as_array.
+ */
+static void
+upload_cooked_texture(const cooked_texture& cooked, bool as_array = false)
+{
+        const cooked_texture_header *header = cooked.header;
+        const uint8_t *base = (const uint8_t*)cooked.map;
+        bool compressed = is_compressed_format(header->internal_format);
+        GLenum target = (as_array || (header->layers > 1)) ?
+                        GL_TEXTURE_2D_ARRAY :
+                        GL_TEXTURE_2D;
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (uint32_t i = 0; i < header->levels; ++i) {
+                const cooked_texture_level& level = cooked.levels[i];
+                if ((target == GL_TEXTURE_2D_ARRAY) && compressed)
+                        glCompressedTexImage3D(target,
+                                               i,
+                                               header->internal_format,
+                                               level.width,
+                                               level.height,
+                                               header->layers,
+                                               0,
+                                               level.size,
+                                               base + level.offset);
+                else if (target == GL_TEXTURE_2D_ARRAY)
+                        glTexImage3D(target,
+                                     i,
+                                     header->internal_format,
+                                     level.width,
+                                     level.height,
+                                     header->layers,
+                                     0,
+                                     header->format,
+                                     header->type,
+                                     base + level.offset);
+                else if (compressed)
+                        glCompressedTexImage2D(GL_TEXTURE_2D,
+                                               i,
+                                               header->internal_format,
+                                               level.width,
+                                               level.height,
+                                               0,
+                                               level.size,
+                                               base + level.offset);
+                else
+                        glTexImage2D(GL_TEXTURE_2D,
+                                     i,
+                                     header->internal_format,
+                                     level.width,
+                                     level.height,
+                                     0,
+                                     header->format,
+                                     header->type,
+                                     base + level.offset);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, header->levels - 1);
+}
+
+/*
+ * Offline side: mip generation, the DXT encoder and the writer, used by
+ * cook_texture.cpp.
+ */
+
+struct cook_image {
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;
+        std::vector<uint8_t> pixels;
+};
+
+/*
+ * Halves an image with a 2x2 box filter, the same filter glGenerateMipmap
+ * uses; odd edges reuse their last row/column.
+ */
+static cook_image
+downsample_image(const cook_image& src)
+{
+        cook_image dst;
+        dst.width = std::max(1u, src.width / 2);
+        dst.height = std::max(1u, src.height / 2);
+        dst.channels = src.channels;
+        dst.pixels.resize((size_t)dst.width * dst.height * dst.channels);
+
+        for (uint32_t y = 0; y < dst.height; ++y) {
+                uint32_t y0 = std::min(2 * y, src.height - 1);
+                uint32_t y1 = std::min(2 * y + 1, src.height - 1);
+                for (uint32_t x = 0; x < dst.width; ++x) {
+                        uint32_t x0 = std::min(2 * x, src.width - 1);
+                        uint32_t x1 = std::min(2 * x + 1, src.width - 1);
+                        for (uint32_t c = 0; c < dst.channels; ++c) {
+                                uint32_t sum =
+                                        src.pixels[(y0 * src.width + x0) * src.channels + c] +
+                                        src.pixels[(y0 * src.width + x1) * src.channels + c] +
+                                        src.pixels[(y1 * src.width + x0) * src.channels + c] +
+                                        src.pixels[(y1 * src.width + x1) * src.channels + c];
+                                dst.pixels[(y * dst.width + x) * dst.channels + c] =
+                                        (sum + 2) / 4;
+                        }
+                }
+        }
+
+        return dst;
+}
+
+/*
+ * Bilinear resize to width x height, for packing images of mixed sizes
+ * into the layers of one texture array. Shrinking by more than half skips
+ * texels, so large reductions go through downsample_image first.
+ */
+static cook_image
+resize_image(const cook_image& image, uint32_t width, uint32_t height)
+{
+        cook_image src = image;
+        while ((src.width >= 2 * width) && (src.height >= 2 * height))
+                src = downsample_image(src);
+        if ((src.width == width) && (src.height == height))
+                return src;
+
+        cook_image dst;
+        dst.width = width;
+        dst.height = height;
+        dst.channels = src.channels;
+        dst.pixels.resize((size_t)width * height * dst.channels);
+        for (uint32_t y = 0; y < height; ++y) {
+                float sy = std::max((y + 0.5f) * src.height / height - 0.5f, 0.0f);
+                uint32_t y0 = std::min((uint32_t)sy, src.height - 1);
+                uint32_t y1 = std::min(y0 + 1, src.height - 1);
+                float fy = sy - y0;
+                for (uint32_t x = 0; x < width; ++x) {
+                        float sx = std::max((x + 0.5f) * src.width / width - 0.5f, 0.0f);
+                        uint32_t x0 = std::min((uint32_t)sx, src.width - 1);
+                        uint32_t x1 = std::min(x0 + 1, src.width - 1);
+                        float fx = sx - x0;
+                        for (uint32_t c = 0; c < dst.channels; ++c) {
+                                auto at = [&](uint32_t px, uint32_t py) {
+                                        return (float)src.pixels[(py * src.width + px) *
+                                                                 src.channels + c];
+                                };
+                                float top = at(x0, y0) + fx * (at(x1, y0) - at(x0, y0));
+                                float bottom = at(x0, y1) + fx * (at(x1, y1) - at(x0, y1));
+                                dst.pixels[(y * width + x) * dst.channels + c] =
+                                        (uint8_t)(top + fy * (bottom - top) + 0.5f);
+                        }
+                }
+        }
+
+        return dst;
+}
+
+// RGB to RGBA (opaque); RGBA is returned as is
+static cook_image
+expand_to_rgba(const cook_image& image)
+{
+        if (image.channels == 4)
+                return image;
+
+        cook_image rgba;
+        rgba.width = image.width;
+        rgba.height = image.height;
+        rgba.channels = 4;
+        rgba.pixels.resize((size_t)image.width * image.height * 4);
+        for (size_t i = 0; i < (size_t)image.width * image.height; ++i) {
+                memcpy(&rgba.pixels[4 * i], &image.pixels[3 * i], 3);
+                rgba.pixels[4 * i + 3] = 255;
+        }
+
+        return rgba;
+}
+
+static uint16_t
+pack_565(const uint8_t *rgb)
+{
+        return ((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3);
+}
+
+static void
+unpack_565(uint16_t c, int32_t *rgb)
+{
+        rgb[0] = ((c >> 11) & 31) * 255 / 31;
+        rgb[1] = ((c >> 5) & 63) * 255 / 63;
+        rgb[2] = (c & 31) * 255 / 31;
+}
+
+/*
+ * Encodes one 4x4 block of RGBA texels as a BC1 colour block, picking the
+ * endpoints from the inset bounding box of the block's colours.
+ */
+static void
+encode_bc1_block(const uint8_t block[16][4], uint8_t *out)
+{
+        uint8_t lo[3] = {255, 255, 255};
+        uint8_t hi[3] = {0, 0, 0};
+        for (uint32_t i = 0; i < 16; ++i) {
+                for (uint32_t c = 0; c < 3; ++c) {
+                        lo[c] = std::min(lo[c], block[i][c]);
+                        hi[c] = std::max(hi[c], block[i][c]);
+                }
+        }
+        for (uint32_t c = 0; c < 3; ++c) {
+                uint8_t inset = (hi[c] - lo[c]) / 16;
+                lo[c] += inset;
+                hi[c] -= inset;
+        }
+
+        uint16_t c0 = pack_565(hi);
+        uint16_t c1 = pack_565(lo);
+        uint32_t indices = 0;
+        if (c0 < c1)
+                std::swap(c0, c1);
+        if (c0 != c1) {
+                // c0 > c1 selects the opaque four colour palette
+                int32_t palette[4][3];
+                unpack_565(c0, palette[0]);
+                unpack_565(c1, palette[1]);
+                for (uint32_t c = 0; c < 3; ++c) {
+                        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+                }
+
+                for (uint32_t i = 0; i < 16; ++i) {
+                        uint32_t best = 0;
+                        int32_t best_dist = INT32_MAX;
+                        for (uint32_t p = 0; p < 4; ++p) {
+                                int32_t dist = 0;
+                                for (uint32_t c = 0; c < 3; ++c) {
+                                        int32_t d = block[i][c] - palette[p][c];
+                                        dist += d * d;
+                                }
+                                if (dist < best_dist) {
+                                        best_dist = dist;
+                                        best = p;
+                                }
+                        }
+                        indices |= best << (2 * i);
+                }
+        }
+
+        out[0] = c0 & 0xff;
+        out[1] = c0 >> 8;
+        out[2] = c1 & 0xff;
+        out[3] = c1 >> 8;
+        memcpy(out + 4, &indices, 4);
+}
+
+/*
+ * Encodes the alpha of one 4x4 block as a BC3 alpha block using the eight
+ * value interpolated palette.
+ */
+static void
+encode_bc3_alpha_block(const uint8_t block[16][4], uint8_t *out)
+{
+        uint8_t a0 = 0;
+        uint8_t a1 = 255;
+        for (uint32_t i = 0; i < 16; ++i) {
+                a0 = std::max(a0, block[i][3]);
+                a1 = std::min(a1, block[i][3]);
+        }
+
+        uint64_t indices = 0;
+        if (a0 != a1) {
+                int32_t palette[8];
+                palette[0] = a0;
+                palette[1] = a1;
+                for (uint32_t p = 1; p < 7; ++p)
+                        palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+
+                for (uint32_t i = 0; i < 16; ++i) {
+                        uint64_t best = 0;
+                        int32_t best_dist = INT32_MAX;
+                        for (uint32_t p = 0; p < 8; ++p) {
+                                int32_t dist = std::abs(block[i][3] - palette[p]);
+                                if (dist < best_dist) {
+                                        best_dist = dist;
+                                        best = p;
+                                }
+                        }
+                        indices |= best << (3 * i);
+                }
+        }
+
+        out[0] = a0;
+        out[1] = a1;
+        for (uint32_t i = 0; i < 6; ++i)
+                out[2 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+/*
+ * Compresses an image to BC1 (3 channels) or BC3 (4 channels). Blocks that
+ * overhang the image edge repeat its last row/column.
+ */
+static std::vector<uint8_t>
+encode_dxt(const cook_image& image)
+{
+        uint32_t block_size = (image.channels == 4) ? 16 : 8;
+        uint32_t blocks_x = (image.width + 3) / 4;
+        uint32_t blocks_y = (image.height + 3) / 4;
+        std::vector<uint8_t> out((size_t)blocks_x * blocks_y * block_size);
+
+        uint8_t *dst = out.data();
+        for (uint32_t by = 0; by < blocks_y; ++by) {
+                for (uint32_t bx = 0; bx < blocks_x; ++bx) {
+                        uint8_t block[16][4];
+                        for (uint32_t i = 0; i < 16; ++i) {
+                                uint32_t x = std::min(bx * 4 + i % 4, image.width - 1);
+                                uint32_t y = std::min(by * 4 + i / 4, image.height - 1);
+                                const uint8_t *src =
+                                        &image.pixels[(y * image.width + x) * image.channels];
+                                block[i][0] = src[0];
+                                block[i][1] = src[1];
+                                block[i][2] = src[2];
+                                block[i][3] = (image.channels == 4) ? src[3] : 255;
+                        }
+
+                        if (image.channels == 4) {
+                                encode_bc3_alpha_block(block, dst);
+                                dst += 8;
+                        }
+                        encode_bc1_block(block, dst);
+                        dst += 8;
+                }
+        }
+
+        return out;
+}
+
+/*
+ * Writes images and their full mip chains to path, DXT compressed if
+ * requested: one image is a 2D texture, more are the layers of an array.
+ * The images must all have the same size and 3 or 4 channels.
+ */
+static bool
+write_cooked_texture(const char *path, const std::vector<cook_image>& images, bool compress)
+{
+        std::vector<std::vector<uint8_t>> data;
+        std::vector<cooked_texture_level> levels;
+
+        const cook_image& image = images[0];
+        std::vector<cook_image> level_images = images;
+        for (;;) {
+                cooked_texture_level level;
+                level.width = level_images[0].width;
+                level.height = level_images[0].height;
+                data.emplace_back();
+                for (const cook_image& layer : level_images) {
+                        std::vector<uint8_t> layer_data = compress ?
+                                                          encode_dxt(layer) :
+                                                          layer.pixels;
+                        data.back().insert(data.back().end(),
+                                           layer_data.begin(),
+                                           layer_data.end());
+                }
+                level.size = data.back().size();
+                levels.push_back(level);
+
+                if ((level.width == 1) && (level.height == 1))
+                        break;
+                for (cook_image& layer : level_images)
+                        layer = downsample_image(layer);
+        }
+
+        cooked_texture_header header;
+        memcpy(header.magic, COOKED_TEXTURE_MAGIC, 4);
+        header.version = COOKED_TEXTURE_VERSION;
+        header.width = image.width;
+        header.height = image.height;
+        header.levels = levels.size();
+        header.layers = images.size();
+        if (compress) {
+                header.internal_format = (image.channels == 4) ?
+                                         GL_COMPRESSED_RGBA_S3TC_DXT5_EXT :
+                                         GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+                header.format = 0;
+                header.type = 0;
+        } else {
+                header.internal_format = (image.channels == 4) ? GL_RGBA8 : GL_RGB8;
+                header.format = (image.channels == 4) ? GL_RGBA : GL_RGB;
+                header.type = GL_UNSIGNED_BYTE;
+        }
+
+        uint64_t offset = sizeof(header) + levels.size() * sizeof(cooked_texture_level);
+        for (cooked_texture_level& level : levels) {
+                offset = (offset + COOKED_TEXTURE_ALIGN - 1) & ~(uint64_t)(COOKED_TEXTURE_ALIGN - 1);
+                level.offset = offset;
+                offset += level.size;
+        }
+
+        FILE *file = fopen(path, "wb");
+        if (file == NULL)
+                return false;
+
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(levels.data(), sizeof(cooked_texture_level), levels.size(), file);
+        const uint8_t padding[COOKED_TEXTURE_ALIGN] = {};
+        for (size_t i = 0; i < levels.size(); ++i) {
+                long pos = ftell(file);
+                fwrite(padding, 1, levels[i].offset - pos, file);
+                fwrite(data[i].data(), 1, data[i].size(), file);
+        }
+
+        return fclose(file) == 0;
+}
+
+static bool
+write_cooked_texture(const char *path, const cook_image& image, bool compress)
+{
+        return write_cooked_texture(path, std::vector<cook_image>(1, image), compress);
+}
+
+#endif /* _LEARN_GL_TEXTURE_CACHE_H_ */
@@ -0,0 +1,339 @@
+#ifndef _LEARN_GL_TEXTURE_LOADER_H_
+#define _LEARN_GL_TEXTURE_LOADER_H_
+
+#include "learngl.hpp"
+#include "lockfree.hpp"
+#include "texture_cache.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Asynchronous texture loading. texture_loader_request hands back a texture
+ * name straight away, holding a 1x1 placeholder, and queues the file for a
+ * pool of decode threads. Decoded images come back over a lock-free queue
+ * and texture_loader_pump uploads them on the GL thread, through a small
+ * ring of pixel unpack buffers, until its per-frame time budget runs out.
+ * Each PBO keeps its storage between uploads and is fenced after its
+ * glTexImage2D, so it is only written again once the driver has read it.
+ *
+ * If a cooked copy (path + COOKED_TEXTURE_SUFFIX, see cook_texture.cpp)
+ * exists, the decode thread maps it instead and the GL thread uploads its
+ * prebuilt mip chain directly from the mapping.
+ */
+
+#define TEXTURE_LOADER_PBOS 3
+
+struct texture_request : mpsc_node {
+        std::string path;
+        uint32_t texture;
+        int32_t width;
+        int32_t height;
+        int32_t channels;
+        uint8_t *pixels;
+        cooked_texture cooked;
+};
+
+struct texture_loader {
+        std::vector<std::thread> workers;
+
+        // requests waiting for a decode thread
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<texture_request*> pending;
+        bool quit = false;
+        // set before the workers start, read-only afterwards
+        bool s3tc = false;
+
+        // decoded images waiting for the GL thread
+        mpsc_queue decoded;
+
+        // GL thread only
+        uint32_t in_flight = 0;
+        uint32_t PBOs[TEXTURE_LOADER_PBOS];
+        size_t PBO_sizes[TEXTURE_LOADER_PBOS] = {};
+        GLsync PBO_fences[TEXTURE_LOADER_PBOS] = {};
+        uint32_t next_PBO = 0;
+        // uploads that had to wait for the driver to release their PBO
+        uint32_t stalls = 0;
+};
+
+static void
+texture_loader_worker(texture_loader *loader)
+{
+        profile_thread_name("texture decode");
+        for (;;) {
+                texture_request *request;
+                {
+                        std::unique_lock<std::mutex> lock(loader->mutex);
+                        loader->wake.wait(lock, [loader] {
+                                return loader->quit || !loader->pending.empty();
+                        });
+                        if (loader->quit)
+                                return;
+
+                        request = loader->pending.front();
+                        loader->pending.pop_front();
+                }
+
+                PROFILE_SCOPE("decode");
+                std::string cooked_path = request->path + COOKED_TEXTURE_SUFFIX;
+                if (open_cooked_texture(cooked_path.c_str(), request->cooked)) {
+                        uint32_t format = request->cooked.header->internal_format;
+                        // arrays are loaded by texture_array.hpp, not here
+                        if ((is_compressed_format(format) && !loader->s3tc) ||
+                            (request->cooked.header->layers != 1))
+                                close_cooked_texture(request->cooked);
+                }
+                if (request->cooked.map == NULL)
+                        request->pixels = stbi_load(request->path.c_str(),
+                                                    &request->width,
+                                                    &request->height,
+                                                    &request->channels,
+                                                    0);
+                mpsc_push(loader->decoded, request);
+        }
+}
+
+/*
+ * Starts n_threads decode threads (one per core when 0). Must be called on
+ * the GL thread, since it also creates the upload PBOs.
+ */
+static void
+texture_loader_start(texture_loader& loader, uint32_t n_threads = 0)
+{
+        if (n_threads == 0)
+                n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        glGenBuffers(TEXTURE_LOADER_PBOS, loader.PBOs);
+        loader.s3tc = GLAD_GL_EXT_texture_compression_s3tc != 0;
+
+        for (uint32_t i = 0; i < n_threads; ++i)
+                loader.workers.emplace_back(texture_loader_worker, &loader);
+}
+
+/*
+ * Returns a texture that can be bound immediately. It samples as a single
+ * grey texel until texture_loader_pump uploads the decoded file into it.
+ */
+static uint32_t
+texture_loader_request(texture_loader& loader, const char *path)
+{
+        uint32_t texture;
+        glGenTextures(1, &texture);
+        state_bind_texture(0, GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        const uint8_t placeholder[4] = {128, 128, 128, 255};
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,
+                     GL_RGBA,
+                     1,
+                     1,
+                     0,
+                     GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     placeholder);
+
+        texture_request *request = new texture_request;
+        request->path = path;
+        request->texture = texture;
+        request->pixels = NULL;
+        {
+                std::lock_guard<std::mutex> lock(loader.mutex);
+                loader.pending.push_back(request);
+        }
+        loader.wake.notify_one();
+        ++loader.in_flight;
+
+        return texture;
+}
+
+static GLenum
+channels_to_format(int32_t channels)
+{
+        switch (channels) {
+        case 1:
+                return GL_RED;
+        case 2:
+                return GL_RG;
+        case 3:
+                return GL_RGB;
+        default:
+                return GL_RGBA;
+        }
+}
+
+/*
+ * Waits, if it must, for the driver to finish reading the PBO in slot, so
+ * it can be written without synchronisation.
+ */
+static void
+texture_loader_wait_PBO(texture_loader& loader, uint32_t slot)
+{
+        GLsync fence = loader.PBO_fences[slot];
+        if (fence == NULL)
+                return;
+
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if ((status == GL_TIMEOUT_EXPIRED) || (status == GL_WAIT_FAILED)) {
+                ++loader.stalls;
+                while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) ==
+                       GL_TIMEOUT_EXPIRED)
+                        ;
+        }
+        glDeleteSync(fence);
+        loader.PBO_fences[slot] = NULL;
+}
+
+/*
+ * Copies a decoded image into the next PBO of the ring and sources the
+ * texture upload from it, so the driver can pull the pixels asynchronously
+ * instead of copying them inside glTexImage2D. The PBO's storage is only
+ * reallocated when the image outgrows it. Leaves request->texture bound to
+ * GL_TEXTURE_2D on the active texture unit; on a failed map the texture
+ * keeps its placeholder.
+ */
+static void
+upload_texture_request(texture_loader& loader, const texture_request *request)
+{
+        size_t size = (size_t)request->width * request->height * request->channels;
+
+        uint32_t slot = loader.next_PBO;
+        loader.next_PBO = (loader.next_PBO + 1) % TEXTURE_LOADER_PBOS;
+        texture_loader_wait_PBO(loader, slot);
+
+        state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, loader.PBOs[slot]);
+        if (loader.PBO_sizes[slot] < size) {
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+                loader.PBO_sizes[slot] = size;
+        }
+
+        // the fence above already covers the previous upload from this PBO
+        void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+                                     0,
+                                     size,
+                                     GL_MAP_WRITE_BIT |
+                                     GL_MAP_INVALIDATE_RANGE_BIT |
+                                     GL_MAP_UNSYNCHRONIZED_BIT);
+        state_bind_texture(0, GL_TEXTURE_2D, request->texture);
+        if (dst == NULL) {
+                fprintf(stderr, "Failed to map upload buffer for %s\n", request->path.c_str());
+                state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return;
+        }
+        memcpy(dst, request->pixels, size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        GLenum format = channels_to_format(request->channels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,
+                     format,
+                     request->width,
+                     request->height,
+                     0,
+                     format,
+                     GL_UNSIGNED_BYTE,
+                     (void*)0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        loader.PBO_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+/*
+ * Uploads decoded images until budget_ms has elapsed; call once per frame
+ * on the GL thread. The budget is checked between images, so a single large
+ * image may overrun it. Returns the number of textures completed.
+ */
+static uint32_t
+texture_loader_pump(texture_loader& loader, double budget_ms)
+{
+        using clock = std::chrono::steady_clock;
+        clock::time_point start = clock::now();
+
+        uint32_t completed = 0;
+        while (std::chrono::duration<double, std::milli>(clock::now() - start).count() <
+               budget_ms) {
+                mpsc_node *node = mpsc_pop(loader.decoded);
+                if (node == nullptr)
+                        break;
+
+                texture_request *request = static_cast<texture_request*>(node);
+                if (request->cooked.map != NULL) {
+                        state_bind_texture(0, GL_TEXTURE_2D, request->texture);
+                        upload_cooked_texture(request->cooked);
+                        close_cooked_texture(request->cooked);
+                } else if (request->pixels != NULL) {
+                        upload_texture_request(loader, request);
+                } else {
+                        fprintf(stderr,
+                                "Failed to load texture %s\n",
+                                request->path.c_str());
+                }
+
+                stbi_image_free(request->pixels);
+                delete request;
+                --loader.in_flight;
+                ++completed;
+        }
+
+        return completed;
+}
+
+static bool
+texture_loader_idle(const texture_loader& loader)
+{
+        return loader.in_flight == 0;
+}
+
+/*
+ * Stops the decode threads and drops any work not yet uploaded. Call on the
+ * GL thread before the context goes away.
+ */
+static void
+texture_loader_stop(texture_loader& loader)
+{
+        {
+                std::lock_guard<std::mutex> lock(loader.mutex);
+                loader.quit = true;
+        }
+        loader.wake.notify_all();
+        for (std::thread& worker : loader.workers)
+                worker.join();
+        loader.workers.clear();
+
+        for (texture_request *request : loader.pending)
+                delete request;
+        loader.pending.clear();
+
+        for (mpsc_node *node = mpsc_pop(loader.decoded);
+             node != nullptr;
+             node = mpsc_pop(loader.decoded)) {
+                texture_request *request = static_cast<texture_request*>(node);
+                close_cooked_texture(request->cooked);
+                stbi_image_free(request->pixels);
+                delete request;
+        }
+        loader.in_flight = 0;
+
+        for (GLsync& fence : loader.PBO_fences) {
+                if (fence != NULL)
+                        glDeleteSync(fence);
+                fence = NULL;
+        }
+        state_delete_buffers(TEXTURE_LOADER_PBOS, loader.PBOs);
+}
+
+#endif /* _LEARN_GL_TEXTURE_LOADER_H_ */
@@ -0,0 +1,422 @@
+#ifndef _LEARN_GL_TRANSFORM_H_
+#define _LEARN_GL_TRANSFORM_H_
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Batch model matrix builder. Inputs are structure-of-arrays (translation,
+ * rotation as unit quaternions or as angle about an axis, optional scale)
+ * and the output is one packed column-major glm::mat4 per object, either
+ * the model matrix or, given a view-projection matrix, the full MVP.
+ *
+ * The kernel is written once over a small SIMD wrapper (f32x1 scalar,
+ * f32x4 SSE2, f32x8 AVX2+FMA) so every width computes the same thing. The
+ * wide kernels are compiled in when the compiler targets them (-msse2 is
+ * the x86-64 baseline, -mavx2 -mfma or -march=native for AVX2).
+ */
+
+struct transform_batch {
+        size_t count = 0;
+
+        // translation
+        const float *px = NULL;
+        const float *py = NULL;
+        const float *pz = NULL;
+
+        // rotation as unit quaternions; used when qx is not NULL...
+        const float *qx = NULL;
+        const float *qy = NULL;
+        const float *qz = NULL;
+        const float *qw = NULL;
+
+        // ...otherwise angle[i] * angle_scale radians about the unit axis
+        // (ax, ay, az)[i], or about shared_axis when ax is NULL; the product
+        // is taken and reduced in double, so any angle_scale (a clock) works
+        const float *angle = NULL;
+        double angle_scale = 1.0;
+        const float *ax = NULL;
+        const float *ay = NULL;
+        const float *az = NULL;
+        glm::vec3 shared_axis = glm::vec3(0.0f, 0.0f, 1.0f);
+
+        // per-axis scale; NULL means 1
+        const float *sx = NULL;
+        const float *sy = NULL;
+        const float *sz = NULL;
+};
+
+enum transform_kernel {
+        TRANSFORM_SCALAR,
+        TRANSFORM_SSE,
+        TRANSFORM_AVX2,
+        TRANSFORM_BEST,
+};
+
+struct f32x1 {
+        static constexpr size_t width = 1;
+        float v;
+
+        static f32x1 set1(float x) { return {x}; }
+        static f32x1 load(const float *p) { return {*p}; }
+        friend f32x1 operator+(f32x1 a, f32x1 b) { return {a.v + b.v}; }
+        friend f32x1 operator-(f32x1 a, f32x1 b) { return {a.v - b.v}; }
+        friend f32x1 operator*(f32x1 a, f32x1 b) { return {a.v * b.v}; }
+        friend f32x1 fmadd(f32x1 a, f32x1 b, f32x1 c) { return {a.v * b.v + c.v}; }
+        friend f32x1 abs(f32x1 a) { return {std::fabs(a.v)}; }
+        // floor of a non-negative value
+        friend f32x1 floor_pos(f32x1 a) { return {std::floor(a.v)}; }
+        friend f32x1 copysign(f32x1 a, f32x1 b) { return {std::copysign(a.v, b.v)}; }
+
+        // e[c * 4 + r] holds element (column c, row r) of each lane's matrix
+        static void
+        store_matrices(const f32x1 *e, float *out)
+        {
+                for (size_t i = 0; i < 16; ++i)
+                        out[i] = e[i].v;
+        }
+};
+
+#if defined(__SSE2__)
+struct f32x4 {
+        static constexpr size_t width = 4;
+        __m128 v;
+
+        static f32x4 set1(float x) { return {_mm_set1_ps(x)}; }
+        static f32x4 load(const float *p) { return {_mm_loadu_ps(p)}; }
+        friend f32x4 operator+(f32x4 a, f32x4 b) { return {_mm_add_ps(a.v, b.v)}; }
+        friend f32x4 operator-(f32x4 a, f32x4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+        friend f32x4 operator*(f32x4 a, f32x4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+        friend f32x4 fmadd(f32x4 a, f32x4 b, f32x4 c) { return {_mm_add_ps(_mm_mul_ps(a.v, b.v), c.v)}; }
+        friend f32x4
+        abs(f32x4 a)
+        {
+                return {_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)};
+        }
+        friend f32x4
+        floor_pos(f32x4 a)
+        {
+                // truncation is floor for the non-negative inputs used here
+                return {_mm_cvtepi32_ps(_mm_cvttps_epi32(a.v))};
+        }
+        friend f32x4
+        copysign(f32x4 a, f32x4 b)
+        {
+                __m128 sign = _mm_set1_ps(-0.0f);
+                return {_mm_or_ps(_mm_andnot_ps(sign, a.v), _mm_and_ps(sign, b.v))};
+        }
+
+        static void
+        store_matrices(const f32x4 *e, float *out)
+        {
+                for (size_t c = 0; c < 4; ++c) {
+                        __m128 r0 = e[c * 4 + 0].v;
+                        __m128 r1 = e[c * 4 + 1].v;
+                        __m128 r2 = e[c * 4 + 2].v;
+                        __m128 r3 = e[c * 4 + 3].v;
+                        // lanes are objects; after the transpose r<k> is
+                        // column c of object k
+                        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                        _mm_storeu_ps(out + 0 * 16 + c * 4, r0);
+                        _mm_storeu_ps(out + 1 * 16 + c * 4, r1);
+                        _mm_storeu_ps(out + 2 * 16 + c * 4, r2);
+                        _mm_storeu_ps(out + 3 * 16 + c * 4, r3);
+                }
+        }
+};
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+struct f32x8 {
+        static constexpr size_t width = 8;
+        __m256 v;
+
+        static f32x8 set1(float x) { return {_mm256_set1_ps(x)}; }
+        static f32x8 load(const float *p) { return {_mm256_loadu_ps(p)}; }
+        friend f32x8 operator+(f32x8 a, f32x8 b) { return {_mm256_add_ps(a.v, b.v)}; }
+        friend f32x8 operator-(f32x8 a, f32x8 b) { return {_mm256_sub_ps(a.v, b.v)}; }
+        friend f32x8 operator*(f32x8 a, f32x8 b) { return {_mm256_mul_ps(a.v, b.v)}; }
+        friend f32x8 fmadd(f32x8 a, f32x8 b, f32x8 c) { return {_mm256_fmadd_ps(a.v, b.v, c.v)}; }
+        friend f32x8
+        abs(f32x8 a)
+        {
+                return {_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)};
+        }
+        friend f32x8
+        floor_pos(f32x8 a)
+        {
+                return {_mm256_floor_ps(a.v)};
+        }
+        friend f32x8
+        copysign(f32x8 a, f32x8 b)
+        {
+                __m256 sign = _mm256_set1_ps(-0.0f);
+                return {_mm256_or_ps(_mm256_andnot_ps(sign, a.v), _mm256_and_ps(sign, b.v))};
+        }
+
+        static void
+        store_matrices(const f32x8 *e, float *out)
+        {
+                for (size_t c = 0; c < 4; ++c) {
+                        __m256 t0 = _mm256_unpacklo_ps(e[c * 4 + 0].v, e[c * 4 + 1].v);
+                        __m256 t1 = _mm256_unpackhi_ps(e[c * 4 + 0].v, e[c * 4 + 1].v);
+                        __m256 t2 = _mm256_unpacklo_ps(e[c * 4 + 2].v, e[c * 4 + 3].v);
+                        __m256 t3 = _mm256_unpackhi_ps(e[c * 4 + 2].v, e[c * 4 + 3].v);
+                        // each 128-bit half of u<k> is column c of object k
+                        // (low half) and object k + 4 (high half)
+                        __m256 u0 = _mm256_shuffle_ps(t0, t2, 0x44);
+                        __m256 u1 = _mm256_shuffle_ps(t0, t2, 0xee);
+                        __m256 u2 = _mm256_shuffle_ps(t1, t3, 0x44);
+                        __m256 u3 = _mm256_shuffle_ps(t1, t3, 0xee);
+                        _mm_storeu_ps(out + 0 * 16 + c * 4, _mm256_castps256_ps128(u0));
+                        _mm_storeu_ps(out + 1 * 16 + c * 4, _mm256_castps256_ps128(u1));
+                        _mm_storeu_ps(out + 2 * 16 + c * 4, _mm256_castps256_ps128(u2));
+                        _mm_storeu_ps(out + 3 * 16 + c * 4, _mm256_castps256_ps128(u3));
+                        _mm_storeu_ps(out + 4 * 16 + c * 4, _mm256_extractf128_ps(u0, 1));
+                        _mm_storeu_ps(out + 5 * 16 + c * 4, _mm256_extractf128_ps(u1, 1));
+                        _mm_storeu_ps(out + 6 * 16 + c * 4, _mm256_extractf128_ps(u2, 1));
+                        _mm_storeu_ps(out + 7 * 16 + c * 4, _mm256_extractf128_ps(u3, 1));
+                }
+        }
+};
+#endif
+
+/*
+ * sin and cos of x together, Cephes-style: reduce to an octant, evaluate
+ * the minimax polynomials on [-pi/4, pi/4], then swap and fix the signs by
+ * octant. Everything is arithmetic (no masks) so it maps onto any width.
+ * Accurate to a few ulp for |x| up to ~1e5.
+ */
+template <typename V>
+static inline void
+sincos_batch(V x, V& s, V& c)
+{
+        V ax = abs(x);
+        V j = floor_pos(ax * V::set1(1.27323954473516f));   // 4 / pi
+        // round up to even; j / 2 mod 4 is then the quadrant
+        j = j + (j - V::set1(2.0f) * floor_pos(j * V::set1(0.5f)));
+        V y = fmadd(j, V::set1(-0.78515625f), ax);
+        y = fmadd(j, V::set1(-2.4187564849853515625e-4f), y);
+        y = fmadd(j, V::set1(-3.77489497744594108e-8f), y);
+        V q = j - V::set1(8.0f) * floor_pos(j * V::set1(0.125f));  // 0, 2, 4 or 6
+
+        V z = y * y;
+        V ps = fmadd(z, V::set1(-1.9515295891e-4f), V::set1(8.3321608736e-3f));
+        ps = fmadd(ps, z, V::set1(-1.6666654611e-1f));
+        ps = fmadd(ps * z, y, y);
+        V pc = fmadd(z, V::set1(2.443315711809948e-5f), V::set1(-1.388731625493765e-3f));
+        pc = fmadd(pc, z, V::set1(4.166664568298827e-2f));
+        pc = fmadd(pc * z, z, fmadd(z, V::set1(-0.5f), V::set1(1.0f)));
+
+        // quadrants 1 and 3 swap the polynomials
+        V swap = q * V::set1(0.5f) - V::set1(2.0f) * floor_pos(q * V::set1(0.25f));
+        V sin_y = fmadd(swap, pc - ps, ps);
+        V cos_y = fmadd(swap, ps - pc, pc);
+
+        // sin is negative in quadrants 2 and 3, cos in quadrants 1 and 2
+        V sin_neg = floor_pos(q * V::set1(0.25f));
+        V q2 = q + V::set1(2.0f);
+        V cos_neg = floor_pos((q2 - V::set1(8.0f) * floor_pos(q2 * V::set1(0.125f))) *
+                              V::set1(0.25f));
+        // sin is odd, so the sign of x flips it once more
+        s = sin_y * (V::set1(1.0f) - V::set1(2.0f) * sin_neg) * copysign(V::set1(1.0f), x);
+        c = cos_y * (V::set1(1.0f) - V::set1(2.0f) * cos_neg);
+}
+
+// x modulo 2 pi, in [-pi, pi]
+static inline double
+reduce_angle(double x)
+{
+        const double two_pi = 6.283185307179586476925;
+        return x - two_pi * std::floor(x * (1.0 / two_pi) + 0.5);
+}
+
+/*
+ * Builds the matrices of objects [begin, end), V::width at a time; the
+ * range must be a multiple of V::width.
+ */
+template <typename V>
+static void
+transform_batch_range(const transform_batch& batch,
+                      const float *view_proj,
+                      float *out,
+                      size_t begin,
+                      size_t end)
+{
+        const V one = V::set1(1.0f);
+        const V two = V::set1(2.0f);
+
+        for (size_t i = begin; i < end; i += V::width) {
+                V qx, qy, qz, qw;
+                if (batch.qx != NULL) {
+                        qx = V::load(batch.qx + i);
+                        qy = V::load(batch.qy + i);
+                        qz = V::load(batch.qz + i);
+                        qw = V::load(batch.qw + i);
+                } else {
+                        // sincos_batch is only accurate for small arguments
+                        float half[V::width];
+                        for (size_t k = 0; k < V::width; ++k)
+                                half[k] = 0.5 * reduce_angle((double)batch.angle[i + k] *
+                                                             batch.angle_scale);
+                        V s;
+                        sincos_batch(V::load(half), s, qw);
+                        if (batch.ax != NULL) {
+                                qx = V::load(batch.ax + i) * s;
+                                qy = V::load(batch.ay + i) * s;
+                                qz = V::load(batch.az + i) * s;
+                        } else {
+                                qx = V::set1(batch.shared_axis.x) * s;
+                                qy = V::set1(batch.shared_axis.y) * s;
+                                qz = V::set1(batch.shared_axis.z) * s;
+                        }
+                }
+
+                V xx = qx * qx, yy = qy * qy, zz = qz * qz;
+                V xy = qx * qy, xz = qx * qz, yz = qy * qz;
+                V wx = qw * qx, wy = qw * qy, wz = qw * qz;
+
+                // model = T * R * S, column-major
+                V m[16];
+                m[0] = one - two * (yy + zz);
+                m[1] = two * (xy + wz);
+                m[2] = two * (xz - wy);
+                m[3] = V::set1(0.0f);
+                m[4] = two * (xy - wz);
+                m[5] = one - two * (xx + zz);
+                m[6] = two * (yz + wx);
+                m[7] = V::set1(0.0f);
+                m[8] = two * (xz + wy);
+                m[9] = two * (yz - wx);
+                m[10] = one - two * (xx + yy);
+                m[11] = V::set1(0.0f);
+                m[12] = V::load(batch.px + i);
+                m[13] = V::load(batch.py + i);
+                m[14] = V::load(batch.pz + i);
+                m[15] = one;
+
+                if (batch.sx != NULL) {
+                        const float *scale[3] = {batch.sx, batch.sy, batch.sz};
+                        for (size_t c = 0; c < 3; ++c) {
+                                V s = V::load(scale[c] + i);
+                                m[c * 4 + 0] = m[c * 4 + 0] * s;
+                                m[c * 4 + 1] = m[c * 4 + 1] * s;
+                                m[c * 4 + 2] = m[c * 4 + 2] * s;
+                        }
+                }
+
+                if (view_proj == NULL) {
+                        V::store_matrices(m, out + i * 16);
+                        continue;
+                }
+
+                V mvp[16];
+                for (size_t c = 0; c < 4; ++c) {
+                        for (size_t r = 0; r < 4; ++r) {
+                                V sum = m[c * 4 + 0] * V::set1(view_proj[0 * 4 + r]);
+                                sum = fmadd(m[c * 4 + 1], V::set1(view_proj[1 * 4 + r]), sum);
+                                sum = fmadd(m[c * 4 + 2], V::set1(view_proj[2 * 4 + r]), sum);
+                                sum = fmadd(m[c * 4 + 3], V::set1(view_proj[3 * 4 + r]), sum);
+                                mvp[c * 4 + r] = sum;
+                        }
+                }
+                V::store_matrices(mvp, out + i * 16);
+        }
+}
+
+static transform_kernel
+transform_best_kernel(void)
+{
+#if defined(__AVX2__) && defined(__FMA__)
+        return TRANSFORM_AVX2;
+#elif defined(__SSE2__)
+        return TRANSFORM_SSE;
+#else
+        return TRANSFORM_SCALAR;
+#endif
+}
+
+static const char*
+transform_kernel_name(transform_kernel kernel)
+{
+        switch (kernel) {
+        case TRANSFORM_SCALAR:
+                return "scalar";
+        case TRANSFORM_SSE:
+                return "sse";
+        case TRANSFORM_AVX2:
+                return "avx2";
+        default:
+                return transform_kernel_name(transform_best_kernel());
+        }
+}
+
+/*
+ * Writes one matrix per object of [begin, end) to out[begin..end), premultiplied by
+ * view_proj if it isn't NULL. Kernels not compiled in fall back to the
+ * widest one that is.
+ */
+static void
+transform_batch_build(const transform_batch& batch,
+                      const glm::mat4 *view_proj,
+                      glm::mat4 *out,
+                      size_t begin,
+                      size_t end,
+                      transform_kernel kernel = TRANSFORM_BEST)
+{
+        const float *vp = (view_proj != NULL) ? &(*view_proj)[0][0] : NULL;
+        float *dst = &out[0][0][0];
+        if (kernel == TRANSFORM_BEST)
+                kernel = transform_best_kernel();
+
+        size_t simd_end = begin;
+#if defined(__AVX2__) && defined(__FMA__)
+        if (kernel == TRANSFORM_AVX2) {
+                simd_end = begin + (end - begin) / 8 * 8;
+                transform_batch_range<f32x8>(batch, vp, dst, begin, simd_end);
+        }
+#endif
+#if defined(__SSE2__)
+        if ((kernel == TRANSFORM_SSE) || (kernel == TRANSFORM_AVX2)) {
+                size_t sse_end = simd_end + (end - simd_end) / 4 * 4;
+                transform_batch_range<f32x4>(batch, vp, dst, simd_end, sse_end);
+                simd_end = sse_end;
+        }
+#endif
+        transform_batch_range<f32x1>(batch, vp, dst, simd_end, end);
+}
+
+static void
+transform_batch_build(const transform_batch& batch,
+                      const glm::mat4 *view_proj,
+                      glm::mat4 *out,
+                      transform_kernel kernel = TRANSFORM_BEST)
+{
+        transform_batch_build(batch, view_proj, out, 0, batch.count, kernel);
+}
+
+// the objects [begin, end) of batch as a batch of their own
+static transform_batch
+transform_batch_slice(const transform_batch& batch, size_t begin, size_t end)
+{
+        transform_batch slice = batch;
+        slice.count = end - begin;
+        const float **arrays[] = {
+                &slice.px, &slice.py, &slice.pz,
+                &slice.qx, &slice.qy, &slice.qz, &slice.qw,
+                &slice.angle, &slice.ax, &slice.ay, &slice.az,
+                &slice.sx, &slice.sy, &slice.sz,
+        };
+        for (const float **array : arrays)
+                if (*array != NULL)
+                        *array += begin;
+
+        return slice;
+}
+
+#endif /* _LEARN_GL_TRANSFORM_H_ */